@@ -0,0 +1,193 @@
+/*
+* @file     cam_ioctl.h
+* @author   Trong Phuoc
+* @brief    Private controls and ioctls of the camera driver, shared by the driver
+*           and the applications in user space
+*/
+#ifndef CAM_IOCTL_H
+#define CAM_IOCTL_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/*******************************************************************************
+ *  CONTROLS
+ ******************************************************************************/
+/* A new frame replaces the completed frames not dequeued yet (boolean, per file) */
+#define CAM_CID_LATEST_FRAME    (V4L2_CID_PRIVATE_BASE + 0)
+/* Only every Nth frame of the camera is delivered, the others are dropped while
+ * their payloads arrive (integer 1 to CAM_MAX_DECIMATION, per file) */
+#define CAM_CID_DECIMATION      (V4L2_CID_PRIVATE_BASE + 1)
+#define CAM_MAX_DECIMATION      60
+/* What becomes of a frame that lost payloads on the bus or carried the error bit
+ * of the camera (integer CAM_ERROR_*, per file, the policy of the streaming handle applies) */
+#define CAM_CID_ERROR_FRAMES    (V4L2_CID_PRIVATE_BASE + 2)
+#define CAM_ERROR_DELIVER       0   /**< completed with V4L2_BUF_FLAG_ERROR set */
+#define CAM_ERROR_DROP          1   /**< the buffer takes the next frame, the sequence keeps the gap */
+
+/*******************************************************************************
+ *  SHARED CONSUMERS
+ ******************************************************************************/
+/*
+ * A file handle subscribed with VIDIOC_CAM_SUBSCRIBE gets every frame the stream
+ * of another handle completes, read-only and without copy (VIDIOC_CAM_DQSHARED
+ * and a PROT_READ mapping) or through read(). A frame goes back to the camera
+ * once the streaming handle and every consumer released it. A consumer that
+ * lags drops frames following its policy instead of stalling the others.
+ */
+#define CAM_MAX_CONSUMERS       8
+#define CAM_SHARE_DROP_OLDEST   0   /**< drop the oldest frame not taken yet */
+#define CAM_SHARE_DROP_NEWEST   1   /**< drop the incoming frame */
+#define CAM_SHARE_LATEST        2   /**< keep only the newest frame, as CAM_CID_LATEST_FRAME */
+
+/*******************************************************************************
+ *  METADATA
+ ******************************************************************************/
+/*
+ * The camera node also has a V4L2_BUF_TYPE_META_CAPTURE queue (kernel 4.12 and
+ * later) in the CAM_META_FMT format. Each of its buffers holds one struct
+ * cam_meta, the payload header of the first payload of a frame, and carries the
+ * sequence of the video buffer of that frame. A record is dropped when no
+ * metadata buffer is queued, the video frame is completed anyway.
+ */
+#define CAM_META_FMT            v4l2_fourcc('C', 'M', 'E', 'T')
+#define CAM_META_PTS            (1 << 0)    /**< pts is valid */
+#define CAM_META_SCR            (1 << 1)    /**< scr_stc and scr_sof are valid */
+#define CAM_META_ERROR          (1 << 2)    /**< a payload of the frame had the error bit set */
+#define CAM_META_EXT_SIZE       28
+
+/*******************************************************************************
+ *  BATCHED BUFFER EXCHANGE
+ ******************************************************************************/
+/*
+ * VIDIOC_CAM_BATCH queues the buffers listed in queue[] again, then dequeues up
+ * to ndone completed buffers, oldest first, in one system call instead of a
+ * VIDIOC_QBUF and a VIDIOC_DQBUF per frame. Only the streaming handle of the
+ * mmap method can use it. With CAM_BATCH_WAIT and a blocking file the call
+ * sleeps until at least one buffer is completed, otherwise ndone may come back
+ * 0. A buffer completed with an error is returned with V4L2_BUF_FLAG_ERROR set.
+ */
+#define CAM_MAX_BATCH           32
+#define CAM_BATCH_WAIT          (1 << 0)    /**< sleep until a buffer is completed */
+
+/*******************************************************************************
+ *  COMPLETION RING
+ ******************************************************************************/
+/*
+ * VIDIOC_CAM_RING gives the streaming handle of the mmap method one page shared
+ * with the driver, mapped at the offset it returns. While the ring is on, the
+ * driver writes every completed buffer to done[] and then advances done_head,
+ * instead of keeping it for VIDIOC_DQBUF. The application gives a buffer back
+ * by writing its index to free[] and then advancing free_head; the driver takes
+ * it when it needs a buffer to fill. A process that spins on done_head gets its
+ * frames without a system call. The counters run freely, an entry is at
+ * counter % CAM_RING_ENTRIES. A buffer is in one ring at a time at most, so
+ * neither can overflow. poll() reports POLLIN while done_tail, which the
+ * application advances, is behind done_head. Buffers are queued the first time
+ * with VIDIOC_QBUF; VIDIOC_DQBUF, VIDIOC_CAM_BATCH and read() fail while the
+ * ring is on. STREAMOFF empties both rings and sets the counters to 0.
+ */
+#define CAM_RING_ENTRIES        32
+
+/*******************************************************************************
+ *  TYPEDEF
+ ******************************************************************************/
+struct cam_stats
+{
+    __u32 frames;       /**< frames completed by the camera since stream on */
+    __u32 replaced;     /**< completed frames recycled by a newer frame */
+    __u32 consumers;    /**< subscribed shared consumers */
+    __u32 dropped;      /**< frames dropped for the calling consumer */
+    __u32 urbs;         /**< URBs decoded since stream on */
+    __u32 batches;      /**< batches the URBs were decoded in */
+    __u32 irq_us;       /**< time spent in the URB completion handler */
+    __u32 decode_us;    /**< time spent decoding the batches out of interrupt context */
+    __u32 lost;         /**< frames the camera sent while no buffer was queued */
+    __u32 errors;       /**< frames completed with V4L2_BUF_FLAG_ERROR */
+    __u32 decimated;    /**< frames dropped by CAM_CID_DECIMATION of the streaming handle */
+    __u32 urb_errors;   /**< URBs completed with an error, decoded as lost and resubmitted */
+    __u32 packet_errors; /**< isochronous packets completed with an error */
+    __u32 error_drops;  /**< frames with errors dropped by CAM_ERROR_DROP */
+    __u32 urb_retries;  /**< URBs submitted again later because their resubmission failed */
+    __u32 reserved[1];
+};
+
+/* 64 bytes, one cache line */
+struct cam_meta
+{
+    __u64 timestamp;    /**< CLOCK_MONOTONIC time of the first payload (ns) */
+    __u32 sequence;     /**< sequence of the video buffer holding the frame */
+    __u32 pts;          /**< presentation time stamp, in camera clock ticks */
+    __u32 scr_stc;      /**< source clock of the SCR */
+    __u16 scr_sof;      /**< 11 bit USB frame number of the SCR */
+    __u16 usb_frame;    /**< USB frame number of the host when the payload was decoded */
+    __u32 payloads;     /**< payloads the frame was transferred in */
+    __u32 bytes;        /**< payload data of the frame, header excluded */
+    __u8 flags;         /**< CAM_META_* */
+    __u8 header_info;   /**< bmHeaderInfo of the first payload */
+    __u8 ext_length;    /**< header bytes after the standard fields */
+    __u8 reserved;
+    __u8 ext[CAM_META_EXT_SIZE]; /**< first bytes of the extended header */
+};
+
+struct cam_batch_buffer
+{
+    __u32 index;        /**< buffer of VIDIOC_REQBUFS */
+    __u32 bytesused;
+    __u32 flags;        /**< V4L2_BUF_FLAG_* */
+    __u32 sequence;
+    __u64 timestamp;    /**< CLOCK_MONOTONIC time of the frame (ns) */
+};
+
+struct cam_batch
+{
+    __u32 nqueue;       /**< in: buffers of queue[] to queue, out: buffers queued */
+    __u32 ndone;        /**< in: room in done[], out: buffers dequeued */
+    __u32 flags;        /**< CAM_BATCH_* */
+    __u32 reserved;
+    __u32 queue[CAM_MAX_BATCH];
+    struct cam_batch_buffer done[CAM_MAX_BATCH];
+};
+
+/* the driver writes the first cache line, the application the second */
+struct cam_ring
+{
+    __u32 done_head;    /**< buffers written to done[] */
+    __u32 free_tail;    /**< entries of free[] taken back by the driver */
+    __u32 reserved0[14];
+    __u32 done_tail;    /**< entries of done[] the application consumed */
+    __u32 free_head;    /**< buffers written to free[] */
+    __u32 reserved1[14];
+    struct cam_batch_buffer done[CAM_RING_ENTRIES];
+    __u32 free[CAM_RING_ENTRIES];
+};
+
+struct cam_ring_setup
+{
+    __u32 enable;       /**< in: 1 maps the ring in, 0 turns it off */
+    __u32 offset;       /**< out: mmap offset of the ring */
+    __u32 size;         /**< out: bytes to map */
+    __u32 reserved[5];
+};
+
+struct cam_subscribe
+{
+    __u32 policy;       /**< CAM_SHARE_* applied when the consumer lags */
+    __u32 depth;        /**< frames pending or held at most, 0 selects the default */
+    __u32 reserved[6];
+};
+
+/*******************************************************************************
+ *  IOCTLS
+ ******************************************************************************/
+#define VIDIOC_CAM_G_STATS      _IOR('V', BASE_VIDIOC_PRIVATE + 0, struct cam_stats)
+#define VIDIOC_CAM_SUBSCRIBE    _IOWR('V', BASE_VIDIOC_PRIVATE + 1, struct cam_subscribe)
+#define VIDIOC_CAM_UNSUBSCRIBE  _IO('V', BASE_VIDIOC_PRIVATE + 2)
+#define VIDIOC_CAM_DQSHARED     _IOWR('V', BASE_VIDIOC_PRIVATE + 3, struct v4l2_buffer)
+#define VIDIOC_CAM_QSHARED      _IOW('V', BASE_VIDIOC_PRIVATE + 4, struct v4l2_buffer)
+#define VIDIOC_CAM_BATCH        _IOWR('V', BASE_VIDIOC_PRIVATE + 5, struct cam_batch)
+#define VIDIOC_CAM_RING         _IOWR('V', BASE_VIDIOC_PRIVATE + 6, struct cam_ring_setup)
+
+#endif /* CAM_IOCTL_H */
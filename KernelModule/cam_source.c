@@ -4,12 +4,15 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/usb.h>
+#include <linux/usb/video.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/hardirq.h>
 #include <linux/bug.h>
 #include <linux/poll.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
 //#include<linux/usb/storage.h>
 #include <media/v4l2-dev.h>
 #include <media/v4l2-device.h> // used v4l2 registration
@@ -25,10 +28,25 @@
 #include <asm/uaccess.h>
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
 #include <asm-generic/ioctl.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+#include <linux/pfn_t.h>
+#endif
 #include <media/videobuf-vmalloc.h>
 #include <linux/vmalloc.h>
+#include <asm/unaligned.h>
+#include "cam_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "cam_trace.h"
 /*******************************************************************************
  *  DEFINE
  ******************************************************************************/
@@ -39,10 +57,52 @@
 #define MAX_BUFFER      32
 #define MAX_BUFFER_SIZE 10
 #define QUEUE_STREAMING (1 << 0)
+#define QUEUE_READ_IO   (1 << 1)
 #define DEVICE_NAME     "UVCCamera"
 #define STATUS_OK        0
 #define NULL_POINTER    -1
 #define INVALID_VALUE   -1
+
+#define CAM_READ_BUFFERS    4       /**< frames in the internal ring used by read() */
+#define CAM_URBS            5       /**< isochronous URBs kept in flight */
+#define CAM_URB_PACKETS     32      /**< packets per isochronous URB */
+#define CAM_BATCH_URBS      (CAM_URBS - 2) /**< completed URBs decoded without waiting, two stay in flight */
+#define CAM_CTRL_TIMEOUT    5000    /**< timeout of UVC control requests (ms) */
+#define CAM_URB_RETRY_MS    10      /**< delay before an URB whose resubmission failed is submitted again */
+#define CAM_MAX_FORMATS     4
+#define CAM_MAX_FRAMES      16
+#define CAM_SHARE_DEPTH     2       /**< default frames pending or held per shared consumer */
+#define CAM_SHARE_RESERVED  2       /**< buffers shared consumers can never pin */
+#define CAM_ALLOC_VMALLOC   0       /**< one vmalloc_32 area mapped page by page */
+#define CAM_ALLOC_CONTIG    1       /**< physically contiguous chunks mapped with huge pages */
+#define CAM_VID_LIMIT       (16 * 1024 * 1024)  /**< memory of a buffer pool at most */
+#define CAM_META_OFFSET     0x40000000  /**< mmap offset of the metadata buffers, past any video pool */
+#define CAM_RING_OFFSET     0x48000000  /**< mmap offset of the completion ring, past the metadata buffers */
+#define CAM_FS_RATE         1500000     /**< bytes/s of a full speed bus */
+#define CAM_HS_RATE         60000000    /**< bytes/s of a high speed bus */
+#define CAM_SS_RATE         500000000   /**< bytes/s of a SuperSpeed bus, after 8b/10b */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+// the v4l2 core of older kernels rejects the metadata buffer type before the driver sees it
+#define V4L2_BUF_TYPE_META_CAPTURE  13
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+// strlcpy is deprecated and gone in 6.8, strscpy only exists since 4.3
+#define strscpy(dest, src, count)   strlcpy(dest, src, count)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
+// VFL_TYPE_GRABBER was renamed in 5.7 and dropped afterwards
+#define VFL_TYPE_VIDEO  VFL_TYPE_GRABBER
+#endif
+// largest order the page allocator hands out: MAX_ORDER became inclusive in 6.4
+// and was renamed to MAX_PAGE_ORDER in 6.8
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define CAM_MAX_PAGE_ORDER  MAX_PAGE_ORDER
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define CAM_MAX_PAGE_ORDER  MAX_ORDER
+#else
+#define CAM_MAX_PAGE_ORDER  (MAX_ORDER - 1)
+#endif
 /*******************************************************************************
  *  TYPEDEF
  ******************************************************************************/
@@ -53,6 +113,8 @@ typedef enum uvc_buffer_state
     UVC_BUF_STATE_READY = 2,    /**< Buffer is ready */
     UVC_BUF_STATE_DONE = 3,     /**< Buffer is done */
     UVC_BUF_STATE_ERROR = 4,    /**< Buffer is error */
+    UVC_BUF_STATE_ACTIVE = 5,   /**< Buffer is being filled by the camera */
+    UVC_BUF_STATE_OUTPUT = 6,   /**< Buffer is being filled by the output side of a loopback node */
 } uvc_buffer_state;
 
 // define memory type
@@ -67,9 +129,43 @@ typedef struct CamDevBuff_T
 
     struct cam_fmt *fmt;
     uvc_buffer_state buffState;
+    void *mem;                      /**< kernel address of the frame data */
+    struct UVC_cam_queue_T *queue;  /**< queue the buffer belongs to */
+    atomic_t pipeRefs;              /**< read cursor and pipe buffers holding the frame */
+    unsigned int shareRefs;         /**< shared consumers holding the frame, under irqlock */
+    struct page **pages;            /**< pages of the frame in a contiguous pool */
 
 } CamDevBuff_T;
 
+// metadata buffers of a camera node, one record per frame
+typedef struct CamMetaQueue_T
+{
+    void *mem;                      /**< one page per buffer, vmalloc_user */
+    unsigned int count;
+    struct v4l2_buffer buf[MAX_BUFFER];
+    uvc_buffer_state state[MAX_BUFFER];
+    unsigned int queued[MAX_BUFFER]; /**< buffers waiting for a record, oldest first */
+    unsigned int qhead;
+    unsigned int nqueued;
+    unsigned int done[MAX_BUFFER];  /**< buffers holding a record, oldest first */
+    unsigned int dhead;
+    unsigned int ndone;
+    unsigned int vmaCount;          /**< mappings of the buffers */
+    struct file *owner;             /**< file handle which allocated the buffers */
+    int streaming;
+    __u32 dropped;                  /**< records lost because no buffer was queued */
+} CamMetaQueue_T;
+
+// completion ring shared with the streaming handle
+typedef struct CamRing_T
+{
+    struct cam_ring *shared;        /**< one page, vmalloc_user, user space writes it too */
+    struct file *owner;             /**< file handle which turned the ring on */
+    __u32 doneHead;                 /**< the counters of the driver, the shared copies */
+    __u32 freeTail;                 /**< are written by user space and never read back */
+    unsigned int vmaCount;          /**< mappings of the ring */
+} CamRing_T;
+
 typedef struct UVC_cam_queue_T
 {
     enum v4l2_buf_type buff_type;
@@ -79,24 +175,157 @@ typedef struct UVC_cam_queue_T
 
     unsigned int buff_size;
     unsigned int buff_used;
+    unsigned int allocMode;         /**< CAM_ALLOC_* backing the current pool */
+    int node;                       /**< NUMA node of the next pool, NUMA_NO_NODE for any */
+    int poolNode;                   /**< node the current pool was allocated for */
+    unsigned int cached;            /**< buffers of a pool released by REQBUFS(0), kept for reuse */
 
     CamDevBuff_T buffer[MAX_BUFFER];
     struct mutex mutex;
     
+    spinlock_t irqlock;             /**< protects both lists and the buffer states */
+    struct list_head irqqueue;      /**< buffers waiting to be filled by the camera */
+    struct list_head mainqueue;     /**< filled buffers waiting for DQBUF or read() */
+    wait_queue_head_t wait;         /**< woken each time a buffer is completed or queued */
+    struct file *owner;             /**< file handle which allocated the buffers */
+
+    struct mutex readMutex;         /**< serializes read() callers */
+    CamDevBuff_T *readBuff;         /**< frame currently consumed by read() or splice() */
+    unsigned int readPos;           /**< bytes of readBuff already copied out */
+
+    int latestFrame;                /**< latest frame mode of the owner handle */
+    unsigned int decimation;        /**< CAM_CID_DECIMATION of the owner handle */
+    unsigned int errorFrames;       /**< CAM_CID_ERROR_FRAMES of the owner handle */
+    struct cam_stats stats;
+    u64 irqNs;                      /**< time spent in the URB completion handler */
+    u64 decodeNs;                   /**< time spent decoding batches in the workqueue */
+    int deferWake;                  /**< a batch is decoded, wake the readers once at its end */
+    unsigned int wakePending;       /**< frames completed by the batch being decoded */
+    struct file *writer;            /**< file handle feeding a loopback node */
+    struct list_head consumers;     /**< shared consumers, under irqlock */
+    unsigned int nconsumers;
+    unsigned int sharePinned;       /**< buffers referenced by shared consumers */
+    CamMetaQueue_T meta;            /**< per frame metadata, rings under irqlock */
+    CamRing_T ring;                 /**< completion ring of the owner, under irqlock */
+    struct kref ref;                /**< the camera and the pipe buffers holding frame pages */
+
 } UVC_cam_queue_T;
 
+// file handle subscribed to the frames of the stream
+typedef struct CamConsumer_T
+{
+    struct list_head list;          /**< entry in the consumers of the queue */
+    __u32 policy;                   /**< CAM_SHARE_* applied when the consumer lags */
+    unsigned int depth;             /**< frames pending or held at most */
+    CamDevBuff_T *pending[MAX_BUFFER]; /**< completed frames not taken yet, oldest first */
+    unsigned int head;
+    unsigned int npending;
+    __u32 held;                     /**< frames taken with VIDIOC_CAM_DQSHARED, one bit per index */
+    CamDevBuff_T *readBuff;         /**< frame currently consumed by read() */
+    unsigned int readPos;
+    __u32 dropped;                  /**< frames this consumer missed */
+    unsigned int decimation;        /**< only frames whose sequence is a multiple are shared */
+} CamConsumer_T;
+
+// frame size advertised by a VS_FRAME_* descriptor
+typedef struct CamFrameDesc_T
+{
+    __u8 index;
+    __u16 width;
+    __u16 height;
+    __u32 maxBufferSize;
+    __u32 interval;                 /**< default frame interval (100 ns units) */
+} CamFrameDesc_T;
+
+// format advertised by a VS_FORMAT_* descriptor
+typedef struct CamFormatDesc_T
+{
+    __u8 index;
+    __u32 pixelformat;
+    unsigned int nframes;
+    CamFrameDesc_T frame[CAM_MAX_FRAMES];
+} CamFormatDesc_T;
+
+// UVC video probe and commit control (UVC 1.1, UVC 1.0 uses the first 26 bytes)
+typedef struct CamStreamCtrl_T
+{
+    __le16 bmHint;
+    __u8 bFormatIndex;
+    __u8 bFrameIndex;
+    __le32 dwFrameInterval;
+    __le16 wKeyFrameRate;
+    __le16 wPFrameRate;
+    __le16 wCompQuality;
+    __le16 wCompWindowSize;
+    __le16 wDelay;
+    __le32 dwMaxVideoFrameSize;
+    __le32 dwMaxPayloadTransferSize;
+    __le32 dwClockFrequency;
+    __u8 bmFramingInfo;
+    __u8 bPreferedVersion;
+    __u8 bMinVersion;
+    __u8 bMaxVersion;
+} __packed CamStreamCtrl_T;
 
 // declare video device structure
 typedef struct CameraDev_T
 {
     struct v4l2_device *V4L2Dev;
     struct video_device *VDev;
+    struct v4l2_device v4l2Device;  /**< V4L2Dev of a camera, each camera registers its own */
     struct mutex mutex;
-    struct videobuf_queue *vb_vidq;
     //CamDevBuff_T *CamBuff;
     UVC_cam_queue_T *queue;
     enum v4l2_buf_type type;
 
+    struct usb_device *udev;
+    struct usb_interface *intf;
+    struct v4l2_format format;      /**< format negotiated with VIDIOC_S_FMT */
+    CamFormatDesc_T formats[CAM_MAX_FORMATS];
+    unsigned int nformats;
+    CamFormatDesc_T *curFormat;
+    CamFrameDesc_T *curFrame;
+    struct v4l2_rect crop;          /**< part of the frame copied into the buffers */
+    int cropped;                    /**< crop is smaller than the frame of the camera */
+
+    CamStreamCtrl_T ctrl;           /**< last committed streaming parameters */
+    unsigned int ctrlSize;
+    struct urb *urb[CAM_URBS];
+    char *urbBuffer[CAM_URBS];
+    dma_addr_t urbDma[CAM_URBS];
+    unsigned int urbSize;
+    CamDevBuff_T *curBuff;          /**< buffer the transfer path is filling */
+    int lastFid;
+    struct cam_meta frameMeta;      /**< metadata of the frame being filled */
+    int metaValid;                  /**< frameMeta holds the first payload of the frame */
+    __u32 frameSeq;                 /**< sequence of the frame the camera is sending */
+    int frameLost;                  /**< payloads of the frame were dropped, no buffer was queued */
+    int frameDone;                  /**< the frame was completed on end of frame, its FID still runs */
+    int frameError;                 /**< the frame lost a packet or a payload was corrupted */
+    int frameSkip;                  /**< the frame is dropped by the decimation of the owner */
+    unsigned int frameOffset;       /**< bytes of the full frame received, when cropped */
+    int resync;                     /**< payloads were lost since the last one decoded */
+    unsigned int faultUrbs;         /**< URBs and packets seen by the fault injection */
+    unsigned int faultPackets;
+
+    struct workqueue_struct *workqueue; /**< decodes the completed URBs in batches */
+    struct work_struct batchWork;
+    struct hrtimer batchTimer;      /**< bounds the time a completed URB waits for its batch */
+    spinlock_t urbLock;             /**< protects the completed URBs */
+    struct urb *urbDone[CAM_URBS];  /**< completed URBs not decoded yet, oldest first */
+    unsigned int urbDoneHead;
+    unsigned int urbDoneCount;
+    ktime_t batchStart;             /**< completion of the oldest URB of the batch */
+    struct delayed_work retryWork;  /**< submits the URBs whose resubmission failed */
+    unsigned long urbRetry;         /**< URBs waiting for retryWork, one bit per URB */
+    struct cpumask cpus;            /**< completion_cpus, empty for the CPU of the interrupt */
+    int numaNode;                   /**< buffer_node, -1 follows the completion CPU */
+    int workCpu;                    /**< CPU of the cpus set the next stream decodes on, -1 none */
+    int streamCpu;                  /**< CPU the running stream decodes on, -1 the interrupted one */
+    int streamKept;                 /**< stopped with the URBs and the alternate setting kept */
+    int gone;                       /**< the camera was unplugged, no USB request is made anymore */
+    unsigned long busBandwidth;     /**< bytes/s the stream reserved on its bus, 0 none */
+
 } CameraDev_T;
 
 typedef enum cam_handle_state
@@ -109,17 +338,64 @@ typedef struct CamManage
 {
     CameraDev_T *camDev;
     cam_handle_state camState;
+    int latestFrame;                /**< CAM_CID_LATEST_FRAME of this handle */
+    unsigned int decimation;        /**< CAM_CID_DECIMATION of this handle */
+    unsigned int errorFrames;       /**< CAM_CID_ERROR_FRAMES of this handle */
+    CamConsumer_T *consumer;        /**< set while the handle is a shared consumer */
 
 } CamManage;
 
-struct v4l2_format *fmt;
-struct video_device *CameraDev;
-struct usb_device *device;
-struct list_head temp1;
-struct list_head mainqueue;
+// periodic bandwidth the streams reserved on one USB bus
+typedef struct CamBus_T
+{
+    struct list_head list;
+    struct usb_bus *bus;
+    unsigned long reserved;         /**< bytes/s reserved by the streams of the bus */
+    unsigned int streams;           /**< streams holding a reservation */
+} CamBus_T;
+
 unsigned int mem_size = 0;
-unsigned int buf_size = 0;
-unsigned int buf_count = 0;
+
+static bool latest_frame;
+module_param(latest_frame, bool, 0644);
+MODULE_PARM_DESC(latest_frame, "Default latest frame mode of new file handles");
+
+static bool loopback;
+module_param(loopback, bool, 0444);
+MODULE_PARM_DESC(loopback, "Register a loopback node fed by its output queue, no camera needed");
+static struct video_device *LoopbackDev;
+
+static unsigned int batch_us;
+module_param(batch_us, uint, 0644);
+MODULE_PARM_DESC(batch_us, "Maximum time (us) a completed URB waits to be decoded with the next ones, 0 decodes at once");
+
+static bool keep_stream = true;
+module_param(keep_stream, bool, 0644);
+MODULE_PARM_DESC(keep_stream, "Keep the URBs, the bandwidth and the buffers across STREAMOFF/STREAMON while the format is unchanged");
+
+static unsigned int alloc_mode = CAM_ALLOC_VMALLOC;
+module_param(alloc_mode, uint, 0644);
+MODULE_PARM_DESC(alloc_mode, "Buffer backing: 0 vmalloc, 1 physically contiguous chunks mapped with huge pages");
+
+static unsigned int error_frames = CAM_ERROR_DELIVER;
+module_param(error_frames, uint, 0644);
+MODULE_PARM_DESC(error_frames, "Default CAM_CID_ERROR_FRAMES of new file handles: 0 deliver flagged, 1 drop");
+
+// fault injection, the transfer path treats the chosen URBs and packets as failed
+static unsigned int fault_urbs;
+module_param(fault_urbs, uint, 0644);
+MODULE_PARM_DESC(fault_urbs, "Fail one completed URB out of N (fault injection), 0 disables");
+
+static unsigned int fault_packets;
+module_param(fault_packets, uint, 0644);
+MODULE_PARM_DESC(fault_packets, "Fail one isochronous packet out of N (fault injection), 0 disables");
+
+static unsigned int bus_budget = 80;
+module_param(bus_budget, uint, 0644);
+MODULE_PARM_DESC(bus_budget, "Percent of the rate of a USB bus the streams of the cameras on it may reserve");
+
+static LIST_HEAD(CamBusList);
+static DEFINE_MUTEX(CamBusLock);       /**< protects CamBusList and the busBandwidth of the cameras */
 
 //ssize_t BufferOffset[MAX_BUFFER_SIZE];
 /*
@@ -141,148 +417,4124 @@ static const struct vm_operations_struct my_vm_ops = {
     .open       = my_vm_open,
     .close      = my_vm_close,
 };
-/************************************************************************************
-                                DEVICE FILE OPERATIONS
- ************************************************************************************/
 
-//  declare struct v4l2_file_operations
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+/*
+ * A contiguous pool is mapped on demand: a fault on a PMD aligned address of
+ * a mapping which starts on a PMD boundary inserts the whole chunk as one huge
+ * page, anything else falls back to 4 KiB pages.
+ */
+static vm_fault_t my_vm_fault(struct vm_fault *vmf)
+{
+    CamDevBuff_T *buffer = vmf->vma->vm_private_data;
+    unsigned long index = (vmf->address - vmf->vma->vm_start) >> PAGE_SHIFT;
+
+    return vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(buffer->pages[index]));
+}
+
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t my_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+#else
+static vm_fault_t my_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+#endif
+{
+    struct vm_area_struct *vma = vmf->vma;
+    CamDevBuff_T *buffer = vma->vm_private_data;
+    unsigned long address = vmf->address & PMD_MASK;
+    pfn_t pfn;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+    if (order != PMD_SHIFT - PAGE_SHIFT)
+#else
+    if (pe_size != PE_SIZE_PMD)
+#endif
+    {
+        return VM_FAULT_FALLBACK;
+    }
+    // a chunk covers a whole PMD unless the page allocator tops out below it
+    if (CAM_MAX_PAGE_ORDER < PMD_SHIFT - PAGE_SHIFT ||
+        (vma->vm_start & ~PMD_MASK) != 0 || address + PMD_SIZE > vma->vm_end)
+    {
+        return VM_FAULT_FALLBACK;
+    }
+    pfn = __pfn_to_pfn_t(page_to_pfn(buffer->pages[(address - vma->vm_start) >> PAGE_SHIFT]), PFN_DEV);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+    return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+    return vmf_insert_pfn_pmd(vma, vmf->address, vmf->pmd, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#endif
 
+static const struct vm_operations_struct my_vm_contig_ops = {
+    .open       = my_vm_open,
+    .close      = my_vm_close,
+    .fault      = my_vm_fault,
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    .huge_fault = my_vm_huge_fault,
+#endif
+};
+#endif
 /************************************************************************************
- * @func    int openCameraDevice(struct file *)
- * 
- * @brief   when application in user space use system call open(), this function will
- *          interact with device file in kernel space
- * @param   struct file*    - a pointer point to the device file is used by application
- * @return  STATUS_OK       - open device file success
- * @return  NULL_POINTER    - Allocate memory for device is failed
- * 
+                                BUFFER QUEUE
  ************************************************************************************/
-int openCameraDevice(struct file *);
 
 /************************************************************************************
- * @func    int releaseCameraDevice(struct file *)
+ * @func    static void CamDevQueueInit(UVC_cam_queue_T *queue)
+ *
+ * @brief   initialize locks, lists and wait queue of a buffer queue
+ *
+ ************************************************************************************/
+static void CamDevQueueInit(UVC_cam_queue_T *queue)
+{
+    mutex_init(&queue->mutex);
+    mutex_init(&queue->readMutex);
+    spin_lock_init(&queue->irqlock);
+    INIT_LIST_HEAD(&queue->irqqueue);
+    INIT_LIST_HEAD(&queue->mainqueue);
+    INIT_LIST_HEAD(&queue->consumers);
+    init_waitqueue_head(&queue->wait);
+    queue->buff_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    queue->node = NUMA_NO_NODE;
+    kref_init(&queue->ref);
+}
 
- * 
- * @brief   when application in user space use system call close(), the driver will 
- *          handle this function
- * @param   struct file*    - a pointer point to the device file is used by application
- * 
+/************************************************************************************
+ * @func    static void CamDevInitBuffer(UVC_cam_queue_T *queue, unsigned int i,
+ *                                       void *mem, unsigned int size)
+ *
+ * @brief   describe buffer i of a new or reused pool, its data starts at mem in the
+ *          kernel and at offset i * size in the mmap space of the node
+ *
  ************************************************************************************/
-int releaseCameraDevice(struct file *);
-ssize_t getFrame(struct file *, char __user *, size_t, loff_t *);
+static void CamDevInitBuffer(UVC_cam_queue_T *queue, unsigned int i, void *mem, unsigned int size)
+{
+    struct page **pages = queue->buffer[i].pages;
+
+    memset(&queue->buffer[i], 0, sizeof(queue->buffer[i]));
+    queue->buffer[i].pages = pages;
+    queue->buffer[i].buf.index = i;
+    queue->buffer[i].buf.m.offset = i * size;
+    queue->buffer[i].buf.length = size;
+    queue->buffer[i].buf.type = queue->buff_type;
+    queue->buffer[i].buf.field = V4L2_FIELD_NONE;
+    queue->buffer[i].buf.memory = V4L2_MEMORY_MMAP;
+    queue->buffer[i].buf.flags = 0; // V4L2_BUF_FLAG_QUEUED
+    queue->buffer[i].buffState = UVC_BUF_STATE_IDLE;
+    queue->buffer[i].mem = mem;
+    queue->buffer[i].queue = queue;
+    atomic_set(&queue->buffer[i].pipeRefs, 0);
+    INIT_LIST_HEAD(&queue->buffer[i].stream);
+}
 
-int openCameraDevice(struct file *fileDesc)
+/************************************************************************************
+ * @func    static unsigned int CamDevContigOrder(void)
+ *
+ * @brief   order of the chunks of a contiguous pool, one chunk fills a PMD so that
+ *          user space can map it with a single huge page
+ *
+ ************************************************************************************/
+static unsigned int CamDevContigOrder(void)
 {
-    printk(KERN_INFO "Camera device is opened \n");
-    struct CamManage *CamHandle;
-    struct CameraDev_T *Stream;
+    return min_t(unsigned int, PMD_SHIFT - PAGE_SHIFT, CAM_MAX_PAGE_ORDER);
+}
 
-    // Allocate memory for CamManage
-    CamHandle = (CamManage *)kzalloc(sizeof(CamManage), GFP_KERNEL);
-    // get driver data from file structure fileDesc
-    Stream = video_drvdata(fileDesc);
-    Stream->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+/************************************************************************************
+ * @func    static void CamDevFreeContig(CamDevBuff_T *buff)
+ *
+ * @brief   release the pages of a buffer of a contiguous pool
+ *
+ ************************************************************************************/
+static void CamDevFreeContig(CamDevBuff_T *buff)
+{
+    unsigned int i;
 
-    Stream->queue = (UVC_cam_queue_T *)kmalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
-    if (Stream->queue == NULL)
+    if (buff->mem != NULL)
+    {
+        vunmap(buff->mem);
+    }
+    for (i = 0; i < buff->buf.length >> PAGE_SHIFT && buff->pages[i] != NULL; i++)
     {
-        printk(KERN_INFO "Stream is null, cannot allocate memory \n");
-        return NULL_POINTER;
+        __free_page(buff->pages[i]);
     }
+    kfree(buff->pages);
+    buff->pages = NULL;
+    buff->mem = NULL;
+}
 
-    mutex_init(&Stream->queue->mutex);
-    INIT_LIST_HEAD(&mainqueue);
-    Stream->queue->buff_type = Stream->type;
+/************************************************************************************
+ * @func    static int CamDevAllocContig(UVC_cam_queue_T *queue, unsigned int count,
+ *                                       unsigned int size)
+ *
+ * @brief   allocate every buffer as naturally aligned chunks of CamDevContigOrder()
+ *          pages. The chunks are split into single pages, so splice() can reference
+ *          them one by one, and mapped together into the kernel with vmap().
+ * @return  count
+ * @return  -ENOMEM       - not enough contiguous memory
+ *
+ ************************************************************************************/
+static int CamDevAllocContig(UVC_cam_queue_T *queue, unsigned int count, unsigned int size)
+{
+    unsigned int order = CamDevContigOrder();
+    unsigned int npages = size >> PAGE_SHIFT;
+    struct page **pages, *page;
+    unsigned int i, j, k;
+    void *mem;
 
-    CamHandle->camDev = Stream;
-    CamHandle->camState = 0;
-    fileDesc->private_data = CamHandle;
+    for (i = 0; i < count; i++)
+    {
+        pages = kcalloc(npages, sizeof(*pages), GFP_KERNEL);
+        if (pages == NULL)
+        {
+            goto fail;
+        }
+        queue->buffer[i].pages = pages;
+        queue->buffer[i].buf.length = size;
+        queue->buffer[i].mem = NULL;
+        for (j = 0; j < npages; j += 1U << order)
+        {
+            page = alloc_pages_node(READ_ONCE(queue->node), GFP_KERNEL | __GFP_NOWARN, order);
+            if (page == NULL)
+            {
+                CamDevFreeContig(&queue->buffer[i]);
+                goto fail;
+            }
+            split_page(page, order);
+            for (k = 0; k < 1U << order; k++)
+            {
+                pages[j + k] = page + k;
+            }
+        }
+        mem = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+        if (mem == NULL)
+        {
+            CamDevFreeContig(&queue->buffer[i]);
+            goto fail;
+        }
+        CamDevInitBuffer(queue, i, mem, size);
+        queue->buffer[i].pages = pages;
+    }
+    return count;
 
-    return 0;
+fail:
+    while (i-- > 0)
+    {
+        CamDevFreeContig(&queue->buffer[i]);
+    }
+    return -ENOMEM;
 }
-int releaseCameraDevice(struct file *fileDesc)
+
+/************************************************************************************
+ * @func    static int CamDevFreeBuffers(UVC_cam_queue_T *queue)
+ *
+ * @brief   release the buffer pool of the queue, or the pool kept for reuse
+ * @return  STATUS_OK     - buffers released
+ * @return  -EBUSY        - a buffer is still mapped in user space or held by a pipe
+ *
+ ************************************************************************************/
+static int CamDevFreeBuffers(UVC_cam_queue_T *queue)
 {
-    printk(KERN_INFO "Camera device is closed \n");
-    return 0;
+    unsigned int count = queue->count != 0 ? queue->count : queue->cached;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (queue->buffer[i].vmaCount != 0 || atomic_read(&queue->buffer[i].pipeRefs) != 0)
+        {
+            return -EBUSY;
+        }
+    }
+    if (queue->allocMode == CAM_ALLOC_CONTIG)
+    {
+        for (i = 0; i < count; i++)
+        {
+            CamDevFreeContig(&queue->buffer[i]);
+        }
+    }
+    vfree(queue->mem);
+    queue->mem = NULL;
+    queue->count = 0;
+    queue->cached = 0;
+    queue->buff_size = 0;
+    return STATUS_OK;
 }
 
-static ssize_t my_read(struct file *fp,char __user *buff,size_t len,loff_t *off)
+/************************************************************************************
+ * @func    static int CamDevCacheBuffers(UVC_cam_queue_T *queue)
+ *
+ * @brief   release the buffers for user space but keep their memory, the next
+ *          VIDIOC_REQBUFS of the same size takes them back without allocating
+ * @return  STATUS_OK     - buffers released
+ * @return  -EBUSY        - a buffer is still mapped in user space or held by a pipe
+ *
+ ************************************************************************************/
+static int CamDevCacheBuffers(UVC_cam_queue_T *queue)
 {
-      
-    CamManage *vfh=fp->private_data;
-    printk(KERN_INFO "Erfolg : Now in reading module....");
-    return videobuf_read_stream(vfh->camDev->vb_vidq, buff, len, off, 1,fp->f_flags & O_NONBLOCK);
-    //printk(KERN_INFO "Erfolg : Addresses : %p,%p,%d",fp,buff,len);
-       
-    return 0;
-}
+    unsigned int i;
 
-/***********************************************************************************
- *                              IOCTL FUNCTIONS
- ***********************************************************************************/
+    if (!keep_stream)
+    {
+        return CamDevFreeBuffers(queue);
+    }
+    for (i = 0; i < queue->count; i++)
+    {
+        if (queue->buffer[i].vmaCount != 0 || atomic_read(&queue->buffer[i].pipeRefs) != 0)
+        {
+            return -EBUSY;
+        }
+    }
+    if (queue->count != 0)
+    {
+        queue->cached = queue->count;
+        queue->count = 0;
+    }
+    return STATUS_OK;
+}
 
 /************************************************************************************
- * @func    int CameraDeviceQueryCaps(struct file *file, void *fh, 
- *                               struct v4l2_capability *v4l2_cap);
- * 
- * @brief   when application in user space use ioctl call VIDIOC_QUERYCAP, driver will
- *          fill all field of struct v4l2_capability to show informations of device  
- * @param   struct file*  - a pointer point to the device file is used by application
- * @param   fh
- * @param   v4l2_cap      - a pointer to struct v4l2_capability, driver will get this 
- *                        pointer from user space
- * @return  STATUS_OK     - the driver filled rest of field of struct v4l2_capability
- * 
+ * @func    static int CamDevReuseBuffers(UVC_cam_queue_T *queue, unsigned int count,
+ *                                        unsigned int size)
+ *
+ * @brief   take back the pool kept by CamDevCacheBuffers when a new one would have
+ *          the same number and size of buffers, backing and node
+ * @return  STATUS_OK     - the pool is reused, its buffers are idle
+ * @return  -ENOENT       - no matching pool, a new one has to be allocated
+ *
  ************************************************************************************/
-int CameraDeviceQueryCaps(struct file *file, void *fh, struct v4l2_capability *v4l2_cap);
+static int CamDevReuseBuffers(UVC_cam_queue_T *queue, unsigned int count, unsigned int size)
+{
+    unsigned int i;
 
-/************************************************************************************
- * @func    int CameraDeviceEnumInput(struct file *file, void *fh
- *                                      ,struct v4l2_input *inp);
+    if (queue->cached == 0 || queue->allocMode != alloc_mode || queue->poolNode != READ_ONCE(queue->node))
+    {
+        return -ENOENT;
+    }
+    if (queue->allocMode == CAM_ALLOC_CONTIG)
+    {
+        size = ALIGN(size, PAGE_SIZE << CamDevContigOrder());
+    }
+    else
+    {
+        size = PAGE_ALIGN(size);
+    }
+    while (count > 0 && size * count > CAM_VID_LIMIT)
+    {
+        count--;
+    }
+    if (queue->buff_size != size || queue->cached != count)
+    {
+        return -ENOENT;
+    }
 
- * 
- * @brief   handle the ioctl VIDIOC_ENUM_INPUT with the value of index field of struct
- *          v4l2_input
- * @param   struct file*  - a pointer point to the device file is used by application
- * @param   fh
- * @param   inp           - a pointer to struct v4l2,driver will get this pointer from  
- *                          application in user space
- * @return  STATUS_OK     - the driver filled rest of field of struct v4l2_input
- * @return  EINVAL        - the index field of struct v4l2_input is invalid
- * 
- ************************************************************************************/
-int CameraDeviceEnumInput(struct file *file, void *fh, struct v4l2_input *inp);
+    for (i = 0; i < count; i++)
+    {
+        CamDevInitBuffer(queue, i, queue->buffer[i].mem, size);
+    }
+    queue->count = count;
+    queue->cached = 0;
+    return STATUS_OK;
+}
 
 /************************************************************************************
- * @func    int CameraDeviceSetInput(struct file *file, void *fh, unsigned int i);
- * 
- * @brief   handle the ioctl VIDIOC_S_INPUT with the value of index
- * @param   struct file*  - a pointer point to the device file is used by application
- * @param   fh
- * @param   i             - index of camera device input
- * @return  STATUS_OK     
- * @return  EINVAL        - the index field of struct v4l2_input is invalid
- * 
+ * @func    static int CamDevAllocBuffers(UVC_cam_queue_T *queue, unsigned int count,
+ *                                        unsigned int size)
+ *
+ * @brief   allocate the buffer pool of the queue with the backing selected by the
+ *          alloc_mode parameter, on the node selected by buffer_node. The number
+ *          of buffers is reduced to stay below the memory limit of the driver. A
+ *          contiguous pool rounds every buffer up to a whole chunk and falls back
+ *          to vmalloc when memory is fragmented.
+ * @return  the number of allocated buffers
+ * @return  -ENOMEM       - allocate memory failed
+ * @return  -EBUSY        - a buffer of the previous pool is still mapped or in a pipe
+ *
  ************************************************************************************/
-int CameraDeviceSetInput(struct file *file, void *fh, unsigned int i);
+static int CamDevAllocBuffers(UVC_cam_queue_T *queue, unsigned int count, unsigned int size)
+{
+    unsigned int contigSize = ALIGN(size, PAGE_SIZE << CamDevContigOrder());
+    unsigned int i;
+    void *mem1;
+    int ret;
 
-/************************************************************************************
- * @func    int CameraDeviceEnumFormat(struct file *file, void *fh, 
- *                                      struct v4l2_fmtdesc *format);
- * 
- * @brief   handle the ioctl VIDIOC_ENUM_FMT 
+    if (count > MAX_BUFFER)
+    {
+        count = MAX_BUFFER;
+    }
+    if (CamDevReuseBuffers(queue, count, size) == STATUS_OK)
+    {
+        return queue->count;
+    }
+    // pipes still hold pages of the previous pool, its buffers can not be reused yet
+    ret = CamDevFreeBuffers(queue);
+    if (ret < 0)
+    {
+        return ret;
+    }
 
- * @param   struct file*  - a pointer point to the device file is used by application
- * @param   fh
- * @param   format        - a pointer to struct v4l2_fmtdesc
- * @return  STATUS_OK     - format have appropriate index and format type
+    if (alloc_mode == CAM_ALLOC_CONTIG)
+    {
+        i = count;
+        while (i > 0 && contigSize * i > CAM_VID_LIMIT)
+        {
+            i--;
+        }
+        if (i > 0 && CamDevAllocContig(queue, i, contigSize) == i)
+        {
+            queue->allocMode = CAM_ALLOC_CONTIG;
+            queue->poolNode = READ_ONCE(queue->node);
+            queue->count = i;
+            queue->buff_size = contigSize;
+            return i;
+        }
+        printk(KERN_INFO "REQUEST BUFF: no contiguous memory, using vmalloc \n");
+    }
+
+    size = PAGE_ALIGN(size);
+    while (count > 0 && size * count > CAM_VID_LIMIT)
+    {
+        (count)--;
+    }
+    if (count == 0)
+    {
+        return -ENOMEM;
+    }
+
+    // the frames are filled by the CPU, a pool bound to a node does not need DMA32 memory
+    if (READ_ONCE(queue->node) == NUMA_NO_NODE)
+    {
+        mem1 = (void*)vmalloc_32(count*size);
+    }
+    else
+    {
+        mem1 = vmalloc_node(count * size, READ_ONCE(queue->node));
+    }
+    if (mem1 == NULL)
+    {
+        printk(KERN_INFO "REQUEST BUFF: Allocate memory failed \n");
+        return -ENOMEM;
+    }
+
+    queue->mem = mem1;
+    for (i = 0; i < count; i++)
+    {
+        CamDevInitBuffer(queue, i, mem1 + i * size, size);
+    }
+
+    queue->allocMode = CAM_ALLOC_VMALLOC;
+    queue->poolNode = READ_ONCE(queue->node);
+    queue->count = count;
+    queue->buff_size = size;
+    return count;
+}
+
+/************************************************************************************
+ * @func    static void CamDevSharePut(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   drop the reference of a shared consumer on a frame, the last reference
+ *          gives back a frame the streaming handle already released. Called with
+ *          irqlock held.
+ *
  ************************************************************************************/
-int CameraDeviceEnumFormat(struct file *file, void *fh, struct v4l2_fmtdesc *format);
+static void CamDevSharePut(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    if (--buff->shareRefs != 0)
+    {
+        return;
+    }
+    queue->sharePinned--;
+    if (buff->buffState != UVC_BUF_STATE_READY || atomic_read(&buff->pipeRefs) != 0)
+    {
+        return;
+    }
+    buff->buffState = UVC_BUF_STATE_QUEUED;
+    buff->buf.bytesused = 0;
+    buff->buf.flags &= ~V4L2_BUF_FLAG_ERROR;
+    list_add_tail(&buff->stream, &queue->irqqueue);
+}
 
-int CameraDeviceSetFormat(struct file *file, void *fh, struct v4l2_format *format);
 /************************************************************************************
- * @func    int CameraDeviceGetFormat(struct file *file, void *fh, 
- *                                    struct v4l2_format *format);
+ * @func    static CamDevBuff_T *CamDevShareShift(CamConsumer_T *cons)
+ *
+ * @brief   remove the oldest pending frame of a consumer. Called with irqlock held.
+ *
+ ************************************************************************************/
+static CamDevBuff_T *CamDevShareShift(CamConsumer_T *cons)
+{
+    CamDevBuff_T *buff;
+
+    if (cons->npending == 0)
+    {
+        return NULL;
+    }
+    buff = cons->pending[cons->head];
+    cons->head = (cons->head + 1) % MAX_BUFFER;
+    cons->npending--;
+    return buff;
+}
+
+/************************************************************************************
+ * @func    static void CamDevShareFrame(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   hand a completed frame to every shared consumer. The frames a consumer
+ *          holds count against its depth, a consumer at its depth drops a frame
+ *          following its policy. Consumers never pin the last CAM_SHARE_RESERVED
+ *          buffers, the camera and the streaming handle keep going whatever the
+ *          consumers do. Called with irqlock held.
+ *
+ ************************************************************************************/
+static void CamDevShareFrame(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    CamConsumer_T *cons;
+    unsigned int held, limit;
+    int starved = queue->sharePinned + CAM_SHARE_RESERVED >= queue->count;
+
+    list_for_each_entry(cons, &queue->consumers, list)
+    {
+        // a decimated consumer skips the frame, it did not miss it
+        if (buff->buf.sequence % cons->decimation != 0)
+        {
+            continue;
+        }
+        if (starved)
+        {
+            cons->dropped++;
+            continue;
+        }
+        held = hweight32(cons->held) + (cons->readBuff != NULL);
+        limit = held < cons->depth ? cons->depth - held : 0;
+        if (cons->policy == CAM_SHARE_LATEST && limit > 1)
+        {
+            limit = 1;
+        }
+        if (cons->npending >= limit && (cons->policy == CAM_SHARE_DROP_NEWEST || limit == 0))
+        {
+            cons->dropped++;
+            continue;
+        }
+        while (cons->npending >= limit)
+        {
+            CamDevSharePut(queue, CamDevShareShift(cons));
+            cons->dropped++;
+        }
+        cons->pending[(cons->head + cons->npending) % MAX_BUFFER] = buff;
+        cons->npending++;
+        if (buff->shareRefs++ == 0)
+        {
+            queue->sharePinned++;
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevShareFlush(UVC_cam_queue_T *queue)
+ *
+ * @brief   forget the frames of every shared consumer, the stream is stopped.
+ *          Called with irqlock held.
+ *
+ ************************************************************************************/
+static void CamDevShareFlush(UVC_cam_queue_T *queue)
+{
+    CamConsumer_T *cons;
+
+    queue->sharePinned = 0;
+    list_for_each_entry(cons, &queue->consumers, list)
+    {
+        cons->head = 0;
+        cons->npending = 0;
+        cons->held = 0;
+        cons->readBuff = NULL;
+        cons->readPos = 0;
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevStampBuffer(struct v4l2_buffer *vbuf, u64 ns)
+ *
+ * @brief   set the time stamp of a buffer, in CLOCK_MONOTONIC nanoseconds
+ *
+ ************************************************************************************/
+static void CamDevStampBuffer(struct v4l2_buffer *vbuf, u64 ns)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    v4l2_buffer_set_timestamp(vbuf, ns);
+#else
+    vbuf->timestamp = ns_to_timeval(ns);
+#endif
+}
+
+/************************************************************************************
+ * @func    static void CamDevQueueLocked(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   CamDevQueueBuffer with the irqlock held, without the wake up
+ *
+ ************************************************************************************/
+static void CamDevQueueLocked(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    if (buff->shareRefs != 0)
+    {
+        // consumers still read the frame, the last of them queues it
+        buff->buffState = UVC_BUF_STATE_READY;
+        return;
+    }
+    buff->buffState = UVC_BUF_STATE_QUEUED;
+    buff->buf.bytesused = 0;
+    buff->buf.flags &= ~V4L2_BUF_FLAG_ERROR;
+    list_add_tail(&buff->stream, &queue->irqqueue);
+}
+
+/************************************************************************************
+ * @func    static void CamDevQueueBuffer(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   hand a buffer to the transfer path so that the camera can fill it, or to
+ *          the last shared consumer still reading it
+ *
+ ************************************************************************************/
+static void CamDevQueueBuffer(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    CamDevQueueLocked(queue, buff);
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+
+    // the output side of a loopback node waits for buffers to fill
+    wake_up_interruptible(&queue->wait);
+}
+
+/************************************************************************************
+ * @func    static u64 CamDevBufferNs(const struct v4l2_buffer *vbuf)
+ *
+ * @brief   get the time stamp CamDevStampBuffer set, in nanoseconds
+ *
+ ************************************************************************************/
+static u64 CamDevBufferNs(const struct v4l2_buffer *vbuf)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    return v4l2_buffer_get_timestamp(vbuf);
+#else
+    return timeval_to_ns(&vbuf->timestamp);
+#endif
+}
+
+/************************************************************************************
+ * @func    static void CamDevTakeBuffer(CamDevBuff_T *buff)
+ *
+ * @brief   give a completed buffer to user space, a frame completed with errors is
+ *          handed out with V4L2_BUF_FLAG_ERROR
+ *
+ ************************************************************************************/
+static void CamDevTakeBuffer(CamDevBuff_T *buff)
+{
+    // failing the call would lose the buffer for user space
+    if (buff->buffState == UVC_BUF_STATE_ERROR)
+    {
+        buff->buf.flags |= V4L2_BUF_FLAG_ERROR;
+    }
+    buff->buffState = UVC_BUF_STATE_IDLE;
+}
+
+/************************************************************************************
+ * @func    static void CamDevTakeEntry(CamDevBuff_T *buff, struct cam_batch_buffer *entry)
+ *
+ * @brief   give a completed buffer to user space and describe it in entry
+ *
+ ************************************************************************************/
+static void CamDevTakeEntry(CamDevBuff_T *buff, struct cam_batch_buffer *entry)
+{
+    CamDevTakeBuffer(buff);
+    entry->index = buff->buf.index;
+    entry->bytesused = buff->buf.bytesused;
+    entry->flags = buff->buf.flags;
+    entry->sequence = buff->buf.sequence;
+    entry->timestamp = CamDevBufferNs(&buff->buf);
+}
+
+/************************************************************************************
+ * @func    static int CamDevRingActive(UVC_cam_queue_T *queue)
+ *
+ * @brief   check whether the completed buffers go to the completion ring
+ *
+ ************************************************************************************/
+static int CamDevRingActive(UVC_cam_queue_T *queue)
+{
+    return queue->ring.shared != NULL && queue->ring.owner == queue->owner;
+}
+
+/************************************************************************************
+ * @func    static void CamDevRingPublish(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   write a completed buffer to done[] of the ring, the entry is visible
+ *          before the head moves. Called with the irqlock held.
+ *
+ ************************************************************************************/
+static void CamDevRingPublish(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    CamRing_T *ring = &queue->ring;
+
+    CamDevTakeEntry(buff, &ring->shared->done[ring->doneHead % CAM_RING_ENTRIES]);
+    ring->doneHead++;
+    smp_store_release(&ring->shared->done_head, ring->doneHead);
+}
+
+/************************************************************************************
+ * @func    static void CamDevRingRefill(UVC_cam_queue_T *queue)
+ *
+ * @brief   queue the buffers user space wrote to free[] of the ring. The indexes
+ *          come from user space, a buffer which is not idle is skipped. Called
+ *          with the irqlock held.
+ *
+ ************************************************************************************/
+static void CamDevRingRefill(UVC_cam_queue_T *queue)
+{
+    CamRing_T *ring = &queue->ring;
+    __u32 head = smp_load_acquire(&ring->shared->free_head);
+    unsigned int n = 0;
+    __u32 i;
+
+    if (head == ring->freeTail)
+    {
+        return;
+    }
+    // a head far ahead is caught up with one ring per call
+    while (ring->freeTail != head && n++ < CAM_RING_ENTRIES)
+    {
+        i = READ_ONCE(ring->shared->free[ring->freeTail % CAM_RING_ENTRIES]);
+        ring->freeTail++;
+        if (i < queue->count && queue->buffer[i].buffState == UVC_BUF_STATE_IDLE)
+        {
+            CamDevQueueLocked(queue, &queue->buffer[i]);
+        }
+    }
+    WRITE_ONCE(ring->shared->free_tail, ring->freeTail);
+}
+
+/************************************************************************************
+ * @func    static CamDevBuff_T *CamDevNextBuffer(UVC_cam_queue_T *queue)
+ *
+ * @brief   take the next queued buffer to fill, called from the transfer path
+ * @return  NULL when user space did not queue any buffer
+ *
+ ************************************************************************************/
+static CamDevBuff_T *CamDevNextBuffer(UVC_cam_queue_T *queue)
+{
+    CamDevBuff_T *buff = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (CamDevRingActive(queue))
+    {
+        CamDevRingRefill(queue);
+    }
+    if (!list_empty(&queue->irqqueue))
+    {
+        buff = list_first_entry(&queue->irqqueue, CamDevBuff_T, stream);
+        list_del_init(&buff->stream);
+        buff->buffState = UVC_BUF_STATE_ACTIVE;
+        buff->buf.bytesused = 0;
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return buff;
+}
+
+/************************************************************************************
+ * @func    static void CamDevBufferDone(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   move a filled buffer to the main queue, hand it to the shared consumers
+ *          and wake up the waiting readers, once per batch while a batch of URBs
+ *          is decoded.
+ *          In latest frame mode the completed buffers nobody dequeued yet go back
+ *          to the camera, so the main queue only holds the newest frame.
+ *
+ ************************************************************************************/
+static void CamDevBufferDone(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    CamDevBuff_T *old, *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (queue->latestFrame)
+    {
+        list_for_each_entry_safe(old, tmp, &queue->mainqueue, stream)
+        {
+            queue->stats.replaced++;
+            if (old->shareRefs != 0)
+            {
+                old->buffState = UVC_BUF_STATE_READY;
+                list_del_init(&old->stream);
+                continue;
+            }
+            old->buffState = UVC_BUF_STATE_QUEUED;
+            old->buf.bytesused = 0;
+            old->buf.flags &= ~V4L2_BUF_FLAG_ERROR;
+            list_move_tail(&old->stream, &queue->irqqueue);
+        }
+    }
+    queue->stats.frames++;
+    buff->buffState = UVC_BUF_STATE_DONE;
+    CamDevShareFrame(queue, buff);
+    if (CamDevRingActive(queue))
+    {
+        // user space owns the frame once it is in the ring
+        CamDevRingPublish(queue, buff);
+    }
+    else
+    {
+        list_add_tail(&buff->stream, &queue->mainqueue);
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+
+    if (queue->deferWake)
+    {
+        queue->wakePending++;
+        return;
+    }
+    wake_up_interruptible(&queue->wait);
+}
+
+/************************************************************************************
+ * @func    static int CamDevQueueHasDone(UVC_cam_queue_T *queue)
+ *
+ * @brief   check whether a completed buffer can be dequeued
+ *
+ ************************************************************************************/
+static int CamDevQueueHasDone(UVC_cam_queue_T *queue)
+{
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    ret = !list_empty(&queue->mainqueue);
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevTakeDone(UVC_cam_queue_T *queue, int nonblocking,
+ *                                    CamDevBuff_T **buff)
+ *
+ * @brief   remove the oldest completed buffer from the main queue, wait for one if
+ *          the queue is empty and the caller can block
+ * @return  STATUS_OK     - *buff points to the completed buffer
+ * @return  -EAGAIN       - no buffer is completed and the caller cannot block
+ * @return  -EINVAL       - the queue is not streaming
+ *
+ ************************************************************************************/
+static int CamDevTakeDone(UVC_cam_queue_T *queue, int nonblocking, CamDevBuff_T **buff)
+{
+    unsigned long flags;
+    int ret;
+
+    for (;;)
+    {
+        if (!(queue->flag & QUEUE_STREAMING))
+        {
+            return -EINVAL;
+        }
+
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (!list_empty(&queue->mainqueue))
+        {
+            *buff = list_first_entry(&queue->mainqueue, CamDevBuff_T, stream);
+            list_del_init(&(*buff)->stream);
+            spin_unlock_irqrestore(&queue->irqlock, flags);
+            return STATUS_OK;
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+
+        if (nonblocking)
+        {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(queue->wait, CamDevQueueHasDone(queue) ||
+                                       !(queue->flag & QUEUE_STREAMING));
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevBatchTake(struct cam_batch *batch, CamDevBuff_T *buff)
+ *
+ * @brief   hand a dequeued buffer back to user space in the next done[] entry
+ *
+ ************************************************************************************/
+static void CamDevBatchTake(struct cam_batch *batch, CamDevBuff_T *buff)
+{
+    CamDevTakeEntry(buff, &batch->done[batch->ndone++]);
+}
+
+/************************************************************************************
+ * @func    static int CamDevBatch(struct file *file, UVC_cam_queue_T *queue,
+ *                                 struct cam_batch *batch)
+ *
+ * @brief   handle VIDIOC_CAM_BATCH: queue the listed buffers under one lock, then
+ *          take the completed ones, only the first of them may be waited for
+ * @return  STATUS_OK     - batch->nqueue buffers queued, batch->ndone dequeued. A
+ *                          wait interrupted by a signal or by STREAMOFF after
+ *                          buffers were queued returns them with ndone 0, so the
+ *                          call is not restarted with buffers already queued
+ * @return  -EINVAL       - not the streaming handle, or an index is invalid,
+ *                          repeated or not dequeued, nothing is queued then
+ *
+ ************************************************************************************/
+static int CamDevBatch(struct file *file, UVC_cam_queue_T *queue, struct cam_batch *batch)
+{
+    DECLARE_BITMAP(seen, MAX_BUFFER);
+    CamDevBuff_T *buff;
+    unsigned long flags;
+    unsigned int i, nqueue = batch->nqueue, room = batch->ndone;
+    int ret;
+
+    batch->nqueue = 0;
+    batch->ndone = 0;
+    if (nqueue > CAM_MAX_BATCH || room > CAM_MAX_BATCH)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&queue->mutex);
+    if (queue->owner != file || (queue->flag & QUEUE_READ_IO) || queue->count == 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    if (CamDevRingActive(queue))
+    {
+        mutex_unlock(&queue->mutex);
+        return -EBUSY;
+    }
+    // all or nothing, a buffer listed twice would be linked twice
+    bitmap_zero(seen, MAX_BUFFER);
+    for (i = 0; i < nqueue; i++)
+    {
+        if (batch->queue[i] >= queue->count || __test_and_set_bit(batch->queue[i], seen) ||
+            queue->buffer[batch->queue[i]].buffState != UVC_BUF_STATE_IDLE)
+        {
+            printk(KERN_INFO "BATCH: invalid buffer %u \n", batch->queue[i]);
+            mutex_unlock(&queue->mutex);
+            return -EINVAL;
+        }
+    }
+    if (nqueue != 0)
+    {
+        spin_lock_irqsave(&queue->irqlock, flags);
+        for (i = 0; i < nqueue; i++)
+        {
+            CamDevQueueLocked(queue, &queue->buffer[batch->queue[i]]);
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        wake_up_interruptible(&queue->wait);
+    }
+    batch->nqueue = nqueue;
+    mutex_unlock(&queue->mutex);
+
+    if (room == 0)
+    {
+        return STATUS_OK;
+    }
+    if ((batch->flags & CAM_BATCH_WAIT) && !(file->f_flags & O_NONBLOCK))
+    {
+        ret = CamDevTakeDone(queue, 0, &buff);
+        if (ret < 0)
+        {
+            // the error would not copy nqueue back to user space
+            return nqueue != 0 ? STATUS_OK : ret;
+        }
+        CamDevBatchTake(batch, buff);
+    }
+    spin_lock_irqsave(&queue->irqlock, flags);
+    while (batch->ndone < room && !list_empty(&queue->mainqueue))
+    {
+        buff = list_first_entry(&queue->mainqueue, CamDevBuff_T, stream);
+        list_del_init(&buff->stream);
+        CamDevBatchTake(batch, buff);
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static void CamDevRingFree(UVC_cam_queue_T *queue)
+ *
+ * @brief   turn the completion ring off, the completed buffers go to the main
+ *          queue again. Called with queue->mutex held and the stream stopped.
+ *
+ ************************************************************************************/
+static void CamDevRingFree(UVC_cam_queue_T *queue)
+{
+    struct cam_ring *shared;
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    shared = queue->ring.shared;
+    queue->ring.shared = NULL;
+    queue->ring.owner = NULL;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    // a mapping still holds the page, user space does not fault
+    vfree(shared);
+}
+
+/************************************************************************************
+ * @func    static int CamDevRingSetup(struct file *file, UVC_cam_queue_T *queue,
+ *                                     struct cam_ring_setup *setup)
+ *
+ * @brief   handle VIDIOC_CAM_RING: allocate the completion ring of the streaming
+ *          handle, or free it. The stream must be stopped.
+ * @return  STATUS_OK     - setup->offset and setup->size locate the ring
+ * @return  -EINVAL       - not the handle which requested the mmap buffers
+ * @return  -EBUSY        - streaming, the ring is mapped, or it belongs to another
+ *                          handle
+ *
+ ************************************************************************************/
+static int CamDevRingSetup(struct file *file, UVC_cam_queue_T *queue, struct cam_ring_setup *setup)
+{
+    CamRing_T *ring = &queue->ring;
+    struct cam_ring *shared;
+    unsigned long flags;
+
+    mutex_lock(&queue->mutex);
+    if (!setup->enable)
+    {
+        if (ring->owner != file || (queue->flag & QUEUE_STREAMING) || ring->vmaCount != 0)
+        {
+            mutex_unlock(&queue->mutex);
+            return ring->owner != file ? -EINVAL : -EBUSY;
+        }
+        CamDevRingFree(queue);
+        mutex_unlock(&queue->mutex);
+        return STATUS_OK;
+    }
+    if (queue->owner != file || (queue->flag & QUEUE_READ_IO) || queue->count == 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    if ((ring->shared != NULL && ring->owner != file) || (queue->flag & QUEUE_STREAMING))
+    {
+        mutex_unlock(&queue->mutex);
+        return -EBUSY;
+    }
+    if (ring->shared == NULL)
+    {
+        shared = vmalloc_user(PAGE_ALIGN(sizeof(struct cam_ring)));
+        if (shared == NULL)
+        {
+            mutex_unlock(&queue->mutex);
+            return -ENOMEM;
+        }
+        spin_lock_irqsave(&queue->irqlock, flags);
+        ring->shared = shared;
+        ring->owner = file;
+        ring->doneHead = 0;
+        ring->freeTail = 0;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+    }
+    setup->offset = CAM_RING_OFFSET;
+    setup->size = PAGE_ALIGN(sizeof(struct cam_ring));
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevRingHasDone(UVC_cam_queue_T *queue, struct file *file)
+ *
+ * @brief   check whether the ring of file holds a buffer user space did not
+ *          consume, going by the done_tail it advances
+ *
+ ************************************************************************************/
+static int CamDevRingHasDone(UVC_cam_queue_T *queue, struct file *file)
+{
+    unsigned long flags;
+    int ret = 0;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (queue->ring.shared != NULL && queue->ring.owner == file)
+    {
+        ret = READ_ONCE(queue->ring.shared->done_tail) != queue->ring.doneHead;
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return ret;
+}
+
+static void CamDevRingVmOpen(struct vm_area_struct *vma)
+{
+    UVC_cam_queue_T *queue = vma->vm_private_data;
+    queue->ring.vmaCount++;
+}
+
+static void CamDevRingVmClose(struct vm_area_struct *vma)
+{
+    UVC_cam_queue_T *queue = vma->vm_private_data;
+    queue->ring.vmaCount--;
+}
+
+static const struct vm_operations_struct cam_ring_vm_ops =
+{
+    .open = CamDevRingVmOpen,
+    .close = CamDevRingVmClose,
+};
+
+/************************************************************************************
+ * @func    static int CamDevRingMap(struct file *file, UVC_cam_queue_T *queue,
+ *                                   struct vm_area_struct *vma)
+ *
+ * @brief   map the completion ring, only the handle which turned it on maps it
+ *
+ ************************************************************************************/
+static int CamDevRingMap(struct file *file, UVC_cam_queue_T *queue, struct vm_area_struct *vma)
+{
+    int ret;
+
+    mutex_lock(&queue->mutex);
+    if (queue->ring.owner != file || vma->vm_pgoff != (CAM_RING_OFFSET >> PAGE_SHIFT) ||
+        vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(struct cam_ring)))
+    {
+        printk(KERN_INFO "Mapper: no completion ring at offset %lu \n", vma->vm_pgoff << PAGE_SHIFT);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    ret = remap_vmalloc_range(vma, queue->ring.shared, 0);
+    if (ret == 0)
+    {
+        vma->vm_ops = &cam_ring_vm_ops;
+        vma->vm_private_data = queue;
+        CamDevRingVmOpen(vma);
+    }
+    mutex_unlock(&queue->mutex);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static void CamDevQueueFlush(UVC_cam_queue_T *queue)
+ *
+ * @brief   take back every buffer from the transfer path and user space, called
+ *          once the transfer path is stopped
+ *
+ ************************************************************************************/
+static void CamDevQueueFlush(UVC_cam_queue_T *queue)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    INIT_LIST_HEAD(&queue->irqqueue);
+    INIT_LIST_HEAD(&queue->mainqueue);
+    for (i = 0; i < queue->count; i++)
+    {
+        INIT_LIST_HEAD(&queue->buffer[i].stream);
+        queue->buffer[i].buffState = UVC_BUF_STATE_IDLE;
+        queue->buffer[i].shareRefs = 0;
+    }
+    CamDevShareFlush(queue);
+    // every buffer is idle, user space starts the rings over with QBUF
+    if (queue->ring.shared != NULL)
+    {
+        queue->ring.doneHead = 0;
+        queue->ring.freeTail = 0;
+        memset(queue->ring.shared, 0, sizeof(*queue->ring.shared));
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+
+    // pipes may still hold pages of the frame, only the cursor reference goes away
+    if (queue->readBuff != NULL)
+    {
+        atomic_dec(&queue->readBuff->pipeRefs);
+    }
+    queue->readBuff = NULL;
+    queue->readPos = 0;
+    wake_up_interruptible(&queue->wait);
+}
+
+/************************************************************************************
+ * @func    static void CamDevPutFrame(CamDevBuff_T *buff)
+ *
+ * @brief   drop a reference of the read cursor or of a pipe buffer on a frame, the
+ *          last reference gives the frame back to the camera
+ *
+ ************************************************************************************/
+static void CamDevPutFrame(CamDevBuff_T *buff)
+{
+    UVC_cam_queue_T *queue = buff->queue;
+    unsigned long flags;
+
+    if (!atomic_dec_and_test(&buff->pipeRefs))
+    {
+        return;
+    }
+
+    // a flushed frame stays idle, the stream it belongs to is stopped
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (buff->buffState == UVC_BUF_STATE_READY && buff->shareRefs == 0)
+    {
+        CamDevQueueLocked(queue, buff);
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    wake_up_interruptible(&queue->wait);
+}
+
+/************************************************************************************
+ * @func    static int CamDevReadCursor(UVC_cam_queue_T *queue, int nonblocking,
+ *                                      CamDevBuff_T **buff)
+ *
+ * @brief   get the frame consumed by read() and splice(), take the oldest completed
+ *          frame when the previous one is fully consumed. Called with readMutex held.
+ * @return  STATUS_OK     - *buff points to the frame, readPos is the read position
+ * @return  -EAGAIN       - no frame is completed and the caller cannot block
+ *
+ ************************************************************************************/
+static int CamDevReadCursor(UVC_cam_queue_T *queue, int nonblocking, CamDevBuff_T **buff)
+{
+    int ret;
+
+    if (queue->readBuff == NULL)
+    {
+        ret = CamDevTakeDone(queue, nonblocking, buff);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        (*buff)->buffState = UVC_BUF_STATE_READY;
+        atomic_set(&(*buff)->pipeRefs, 1);
+        queue->readBuff = *buff;
+        queue->readPos = 0;
+    }
+    *buff = queue->readBuff;
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static void CamDevReadAdvance(UVC_cam_queue_T *queue, unsigned int count)
+ *
+ * @brief   move the read position forward, release the cursor reference once the
+ *          whole frame is consumed. Called with readMutex held.
+ *
+ ************************************************************************************/
+static void CamDevReadAdvance(UVC_cam_queue_T *queue, unsigned int count)
+{
+    CamDevBuff_T *buff = queue->readBuff;
+
+    queue->readPos += count;
+    if (queue->readPos >= buff->buf.bytesused)
+    {
+        queue->readBuff = NULL;
+        queue->readPos = 0;
+        CamDevPutFrame(buff);
+    }
+}
+
+/************************************************************************************
+                                SHARED CONSUMERS
+ ************************************************************************************/
+
+/*
+ * The handle which allocated the buffers streams as before. Other handles
+ * subscribe as consumers: every completed frame is referenced once per consumer
+ * and only goes back to the camera when the streaming handle and all consumers
+ * released it. A consumer never holds more than its depth of frames, a lagging
+ * one drops frames on its own and the others keep their rate.
+ */
+
+/************************************************************************************
+ * @func    static int CamDevSubscribe(struct file *file, UVC_cam_queue_T *queue,
+ *                                     struct cam_subscribe *sub)
+ *
+ * @brief   make the file handle a shared consumer, or change its policy
+ * @return  STATUS_OK     - sub->depth holds the depth in use
+ * @return  -EINVAL       - unknown policy
+ * @return  -EBUSY        - the handle streams or feeds the node itself, or there
+ *                          are CAM_MAX_CONSUMERS consumers already
+ *
+ ************************************************************************************/
+static int CamDevSubscribe(struct file *file, UVC_cam_queue_T *queue, struct cam_subscribe *sub)
+{
+    CamManage *Cam = file->private_data;
+    CamConsumer_T *cons = Cam->consumer;
+    unsigned long flags;
+
+    if (sub->policy > CAM_SHARE_LATEST)
+    {
+        return -EINVAL;
+    }
+    if (sub->depth == 0)
+    {
+        sub->depth = CAM_SHARE_DEPTH;
+    }
+    // the streaming handle needs buffers of its own
+    sub->depth = min_t(__u32, sub->depth, MAX_BUFFER / 2);
+
+    mutex_lock(&queue->mutex);
+    if (queue->owner == file || queue->writer == file ||
+        (cons == NULL && queue->nconsumers >= CAM_MAX_CONSUMERS))
+    {
+        mutex_unlock(&queue->mutex);
+        return -EBUSY;
+    }
+    if (cons == NULL)
+    {
+        cons = kzalloc(sizeof(CamConsumer_T), GFP_KERNEL);
+        if (cons == NULL)
+        {
+            mutex_unlock(&queue->mutex);
+            return -ENOMEM;
+        }
+        Cam->consumer = cons;
+        spin_lock_irqsave(&queue->irqlock, flags);
+        cons->policy = sub->policy;
+        cons->depth = sub->depth;
+        cons->decimation = Cam->decimation;
+        list_add_tail(&cons->list, &queue->consumers);
+        queue->nconsumers++;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+    }
+    else
+    {
+        spin_lock_irqsave(&queue->irqlock, flags);
+        cons->policy = sub->policy;
+        cons->depth = sub->depth;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+    }
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static void CamDevUnsubscribe(CamManage *Cam, UVC_cam_queue_T *queue)
+ *
+ * @brief   release every frame of a shared consumer and remove it. Called with
+ *          queue->mutex held.
+ *
+ ************************************************************************************/
+static void CamDevUnsubscribe(CamManage *Cam, UVC_cam_queue_T *queue)
+{
+    CamConsumer_T *cons = Cam->consumer;
+    CamDevBuff_T *buff;
+    unsigned long flags;
+    unsigned int i;
+
+    if (cons == NULL)
+    {
+        return;
+    }
+    spin_lock_irqsave(&queue->irqlock, flags);
+    while ((buff = CamDevShareShift(cons)) != NULL)
+    {
+        CamDevSharePut(queue, buff);
+    }
+    for (i = 0; i < queue->count; i++)
+    {
+        if (cons->held & (1U << i))
+        {
+            CamDevSharePut(queue, &queue->buffer[i]);
+        }
+    }
+    if (cons->readBuff != NULL)
+    {
+        CamDevSharePut(queue, cons->readBuff);
+    }
+    list_del(&cons->list);
+    queue->nconsumers--;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+
+    wake_up_interruptible(&queue->wait);
+    kfree(cons);
+    Cam->consumer = NULL;
+}
+
+/************************************************************************************
+ * @func    static int CamDevShareHasFrame(UVC_cam_queue_T *queue, CamConsumer_T *cons)
+ *
+ * @brief   check whether a frame is pending for the consumer
+ *
+ ************************************************************************************/
+static int CamDevShareHasFrame(UVC_cam_queue_T *queue, CamConsumer_T *cons)
+{
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    ret = cons->npending != 0 || cons->readBuff != NULL;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevShareTake(CameraDev_T *cam, CamConsumer_T *cons,
+ *                                     int nonblocking, int forRead, CamDevBuff_T **buff)
+ *
+ * @brief   get the oldest pending frame of a consumer, wait for one if none is
+ *          pending and the caller can block. A frame taken for read() becomes the
+ *          read cursor of the consumer (kept until fully read), any other is held
+ *          until VIDIOC_CAM_QSHARED. Returns with queue->mutex held on success, so
+ *          the buffers can not be freed under the caller.
+ * @return  STATUS_OK     - *buff points to the frame
+ * @return  -EAGAIN       - no frame is pending and the caller cannot block
+ * @return  -EPIPE        - no frame is pending and the stream is stopped
+ * @return  -ENODEV       - no frame is pending and the camera was unplugged
+ *
+ ************************************************************************************/
+static int CamDevShareTake(CameraDev_T *cam, CamConsumer_T *cons, int nonblocking,
+                           int forRead, CamDevBuff_T **buff)
+{
+    UVC_cam_queue_T *queue = cam->queue;
+    unsigned long flags;
+    int ret;
+
+    for (;;)
+    {
+        if (mutex_lock_interruptible(&queue->mutex))
+        {
+            return -ERESTARTSYS;
+        }
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (forRead && cons->readBuff != NULL)
+        {
+            *buff = cons->readBuff;
+        }
+        else
+        {
+            *buff = CamDevShareShift(cons);
+            if (*buff != NULL && forRead)
+            {
+                cons->readBuff = *buff;
+                cons->readPos = 0;
+            }
+            else if (*buff != NULL)
+            {
+                cons->held |= 1U << (*buff)->buf.index;
+            }
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        if (*buff != NULL)
+        {
+            return STATUS_OK;
+        }
+        mutex_unlock(&queue->mutex);
+
+        // pending frames are handed out first, then a stopped stream ends the wait
+        if (READ_ONCE(cam->gone))
+        {
+            return -ENODEV;
+        }
+        if (!(queue->flag & QUEUE_STREAMING))
+        {
+            return -EPIPE;
+        }
+        if (nonblocking)
+        {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(queue->wait, CamDevShareHasFrame(queue, cons) ||
+                                       !(queue->flag & QUEUE_STREAMING));
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static ssize_t CamDevShareRead(struct file *fp, CamConsumer_T *cons,
+ *                                         char __user *buff, size_t len)
+ *
+ * @brief   read() of a shared consumer, same partial read rules as the read ring.
+ *          The copy runs under queue->mutex, the streaming handle only waits for it
+ *          in its ioctls, never in the transfer path.
+ *
+ ************************************************************************************/
+static ssize_t CamDevShareRead(struct file *fp, CamConsumer_T *cons, char __user *buff, size_t len)
+{
+    CameraDev_T *cam = ((CamManage *)fp->private_data)->camDev;
+    UVC_cam_queue_T *queue = cam->queue;
+    CamDevBuff_T *frame;
+    unsigned long flags;
+    size_t count;
+    int ret;
+
+    ret = CamDevShareTake(cam, cons, fp->f_flags & O_NONBLOCK, 1, &frame);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    count = min_t(size_t, len, frame->buf.bytesused - cons->readPos);
+    if (copy_to_user(buff, frame->mem + cons->readPos, count))
+    {
+        mutex_unlock(&queue->mutex);
+        return -EFAULT;
+    }
+    cons->readPos += count;
+    if (cons->readPos >= frame->buf.bytesused)
+    {
+        spin_lock_irqsave(&queue->irqlock, flags);
+        cons->readBuff = NULL;
+        cons->readPos = 0;
+        CamDevSharePut(queue, frame);
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        wake_up_interruptible(&queue->wait);
+    }
+    mutex_unlock(&queue->mutex);
+    return count;
+}
+
+/************************************************************************************
+ * @func    static int CamDevShareDequeue(struct file *fp, CamConsumer_T *cons,
+ *                                        struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_CAM_DQSHARED, hold the oldest pending frame until VIDIOC_CAM_QSHARED.
+ *          The buffer is mapped read-only with the offset given in vbuf.
+ *
+ ************************************************************************************/
+static int CamDevShareDequeue(struct file *fp, CamConsumer_T *cons, struct v4l2_buffer *vbuf)
+{
+    CameraDev_T *cam = ((CamManage *)fp->private_data)->camDev;
+    UVC_cam_queue_T *queue = cam->queue;
+    CamDevBuff_T *frame;
+    int ret;
+
+    ret = CamDevShareTake(cam, cons, fp->f_flags & O_NONBLOCK, 0, &frame);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    *vbuf = frame->buf;
+    vbuf->flags |= V4L2_BUF_FLAG_DONE;
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevShareQueue(struct file *fp, CamConsumer_T *cons,
+ *                                      struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_CAM_QSHARED, release a frame held by the consumer
+ * @return  -EINVAL       - the consumer does not hold the buffer, or the stream
+ *                          stopped since it was dequeued
+ *
+ ************************************************************************************/
+static int CamDevShareQueue(struct file *fp, CamConsumer_T *cons, struct v4l2_buffer *vbuf)
+{
+    UVC_cam_queue_T *queue = ((CamManage *)fp->private_data)->camDev->queue;
+    unsigned long flags;
+    int ret = -EINVAL;
+
+    mutex_lock(&queue->mutex);
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (vbuf->index < queue->count && (cons->held & (1U << vbuf->index)))
+    {
+        cons->held &= ~(1U << vbuf->index);
+        CamDevSharePut(queue, &queue->buffer[vbuf->index]);
+        ret = STATUS_OK;
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    mutex_unlock(&queue->mutex);
+    wake_up_interruptible(&queue->wait);
+    return ret;
+}
+
+/************************************************************************************
+                                LOOPBACK OUTPUT
+ ************************************************************************************/
+
+/*
+ * A loopback node has no camera. Its output queue takes the empty buffers the
+ * capture side queued, user space fills them (through mmap or write()) and
+ * queuing them on the output side completes them for the capture side. Both
+ * sides share the buffer pool, a frame is never copied inside the driver.
+ */
+
+/************************************************************************************
+ * @func    static int CamDevIsLoopback(CameraDev_T *cam)
+ *
+ * @brief   check whether the node is fed by its output queue instead of a camera
+ *
+ ************************************************************************************/
+static int CamDevIsLoopback(CameraDev_T *cam)
+{
+    return cam->udev == NULL;
+}
+
+/************************************************************************************
+ * @func    static int CamDevQueueHasEmpty(UVC_cam_queue_T *queue)
+ *
+ * @brief   check whether the capture side queued a buffer the output side can fill
+ *
+ ************************************************************************************/
+static int CamDevQueueHasEmpty(UVC_cam_queue_T *queue)
+{
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    ret = !list_empty(&queue->irqqueue);
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevOutputClaim(struct file *file, UVC_cam_queue_T *queue)
+ *
+ * @brief   make the file handle the writer of the loopback node
+ * @return  STATUS_OK     - the handle is the writer
+ * @return  -EBUSY        - another handle feeds the node
+ *
+ ************************************************************************************/
+static int CamDevOutputClaim(struct file *file, UVC_cam_queue_T *queue)
+{
+    int ret = STATUS_OK;
+
+    mutex_lock(&queue->mutex);
+    if (queue->writer == NULL)
+    {
+        queue->writer = file;
+    }
+    else if (queue->writer != file)
+    {
+        ret = -EBUSY;
+    }
+    mutex_unlock(&queue->mutex);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevOutputTake(UVC_cam_queue_T *queue, int nonblocking,
+ *                                      CamDevBuff_T **buff)
+ *
+ * @brief   take the oldest empty buffer for the output side, wait for the capture
+ *          side to queue one if none is available and the caller can block
+ * @return  STATUS_OK     - *buff is owned by the output side
+ * @return  -EAGAIN       - no empty buffer and the caller cannot block
+ *
+ ************************************************************************************/
+static int CamDevOutputTake(UVC_cam_queue_T *queue, int nonblocking, CamDevBuff_T **buff)
+{
+    unsigned long flags;
+    int ret;
+
+    for (;;)
+    {
+        // a flush of the capture side runs under the same mutex
+        mutex_lock(&queue->mutex);
+        *buff = CamDevNextBuffer(queue);
+        if (*buff != NULL)
+        {
+            spin_lock_irqsave(&queue->irqlock, flags);
+            (*buff)->buffState = UVC_BUF_STATE_OUTPUT;
+            spin_unlock_irqrestore(&queue->irqlock, flags);
+            mutex_unlock(&queue->mutex);
+            return STATUS_OK;
+        }
+        mutex_unlock(&queue->mutex);
+        if (nonblocking)
+        {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(queue->wait, CamDevQueueHasEmpty(queue));
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevOutputRelease(UVC_cam_queue_T *queue)
+ *
+ * @brief   give the buffers held by the output side back to the capture side.
+ *          Called with queue->mutex held.
+ *
+ ************************************************************************************/
+static void CamDevOutputRelease(UVC_cam_queue_T *queue)
+{
+    unsigned int i;
+
+    for (i = 0; i < queue->count; i++)
+    {
+        if (queue->buffer[i].buffState == UVC_BUF_STATE_OUTPUT)
+        {
+            CamDevQueueBuffer(queue, &queue->buffer[i]);
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static int CamDevOutputRequest(struct file *file, UVC_cam_queue_T *queue,
+ *                                         struct v4l2_requestbuffers *req)
+ *
+ * @brief   VIDIOC_REQBUFS on the output queue, the output side does not allocate
+ *          anything and reports the buffers of the capture side. A count of 0
+ *          gives the node up for another writer.
+ * @return  STATUS_OK     - req->count holds the number of shared buffers
+ * @return  -EBUSY        - another handle feeds the node or the capture side did
+ *                          not allocate its buffers yet
+ *
+ ************************************************************************************/
+static int CamDevOutputRequest(struct file *file, UVC_cam_queue_T *queue, struct v4l2_requestbuffers *req)
+{
+    int ret;
+
+    ret = CamDevOutputClaim(file, queue);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    mutex_lock(&queue->mutex);
+    if (req->count == 0)
+    {
+        CamDevOutputRelease(queue);
+        queue->writer = NULL;
+    }
+    else if (queue->count == 0)
+    {
+        printk(KERN_INFO "REQUEST BUFF: no capture buffers to fill \n");
+        ret = -EBUSY;
+    }
+    else
+    {
+        req->count = queue->count;
+    }
+    mutex_unlock(&queue->mutex);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevOutputQueue(UVC_cam_queue_T *queue, struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_QBUF on the output queue, the frame user space wrote into the
+ *          mapped buffer is completed for the capture side as it is
+ * @return  STATUS_OK
+ * @return  -EINVAL       - the output side does not hold the buffer or bytesused is
+ *                          larger than the buffer
+ *
+ ************************************************************************************/
+static int CamDevOutputQueue(UVC_cam_queue_T *queue, struct v4l2_buffer *vbuf)
+{
+    CamDevBuff_T *buff;
+
+    mutex_lock(&queue->mutex);
+    if (vbuf->memory != V4L2_MEMORY_MMAP || vbuf->index >= queue->count)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    buff = &queue->buffer[vbuf->index];
+    if (buff->buffState != UVC_BUF_STATE_OUTPUT || vbuf->bytesused > buff->buf.length)
+    {
+        printk(KERN_INFO "QUEUE: output buffer %d is not dequeued \n", vbuf->index);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    buff->buf.bytesused = vbuf->bytesused;
+    buff->buf.timestamp = vbuf->timestamp;
+    buff->buf.sequence = queue->stats.frames;
+    CamDevBufferDone(queue, buff);
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static void CamDevLoopbackFormats(CameraDev_T *cam)
+ *
+ * @brief   advertise the formats a replayed stream can have, there are no camera
+ *          descriptors to parse
+ *
+ ************************************************************************************/
+static void CamDevLoopbackFormats(CameraDev_T *cam)
+{
+    static const __u16 sizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+    static const __u32 fourcc[] = {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG};
+    CamFormatDesc_T *format;
+    unsigned int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(fourcc); i++)
+    {
+        format = &cam->formats[cam->nformats++];
+        format->index = i + 1;
+        format->pixelformat = fourcc[i];
+        format->nframes = ARRAY_SIZE(sizes);
+        for (j = 0; j < ARRAY_SIZE(sizes); j++)
+        {
+            format->frame[j].index = j + 1;
+            format->frame[j].width = sizes[j][0];
+            format->frame[j].height = sizes[j][1];
+            // a compressed frame never gets larger than the raw one
+            format->frame[j].maxBufferSize = sizes[j][0] * sizes[j][1] * 2;
+            format->frame[j].interval = 333333;
+        }
+    }
+}
+
+/************************************************************************************
+                                FRAME METADATA
+ ************************************************************************************/
+
+/*
+ * The metadata queue of a camera node holds one page per buffer, the record of
+ * a frame sits at the start of its page so that every buffer is mapped on its
+ * own. The rings and the buffer states are protected by the irqlock of the
+ * video queue, the records are completed by the same worker as the frames.
+ */
+
+/************************************************************************************
+ * @func    static void CamDevMetaDone(UVC_cam_queue_T *queue, const struct cam_meta *rec)
+ *
+ * @brief   copy the record of a completed frame into the oldest queued metadata
+ *          buffer, the record is dropped when no buffer is queued
+ *
+ ************************************************************************************/
+static void CamDevMetaDone(UVC_cam_queue_T *queue, const struct cam_meta *rec)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (!meta->streaming)
+    {
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return;
+    }
+    if (meta->nqueued == 0)
+    {
+        meta->dropped++;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return;
+    }
+    i = meta->queued[meta->qhead];
+    meta->qhead = (meta->qhead + 1) % MAX_BUFFER;
+    meta->nqueued--;
+    memcpy(meta->mem + i * PAGE_SIZE, rec, sizeof(*rec));
+    meta->buf[i].bytesused = sizeof(*rec);
+    meta->buf[i].sequence = rec->sequence;
+    meta->buf[i].flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    CamDevStampBuffer(&meta->buf[i], rec->timestamp);
+    meta->state[i] = UVC_BUF_STATE_DONE;
+    meta->done[(meta->dhead + meta->ndone) % MAX_BUFFER] = i;
+    meta->ndone++;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+
+    // the frame of the record was completed by the same batch, which wakes up once
+    if (!queue->deferWake)
+    {
+        wake_up_interruptible(&queue->wait);
+    }
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaHasDone(UVC_cam_queue_T *queue)
+ *
+ * @brief   check whether a metadata buffer can be dequeued
+ *
+ ************************************************************************************/
+static int CamDevMetaHasDone(UVC_cam_queue_T *queue)
+{
+    unsigned long flags;
+    int ret;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    ret = queue->meta.ndone != 0;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static void CamDevMetaFlush(UVC_cam_queue_T *queue)
+ *
+ * @brief   stop the metadata queue and give every buffer back to user space.
+ *          Called with queue->mutex held.
+ *
+ ************************************************************************************/
+static void CamDevMetaFlush(UVC_cam_queue_T *queue)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    meta->streaming = 0;
+    meta->qhead = 0;
+    meta->nqueued = 0;
+    meta->dhead = 0;
+    meta->ndone = 0;
+    for (i = 0; i < meta->count; i++)
+    {
+        meta->state[i] = UVC_BUF_STATE_IDLE;
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    wake_up_interruptible(&queue->wait);
+}
+
+/************************************************************************************
+ * @func    static void CamDevMetaFree(UVC_cam_queue_T *queue)
+ *
+ * @brief   stop the metadata queue and free its buffers. Called with queue->mutex
+ *          held.
+ *
+ ************************************************************************************/
+static void CamDevMetaFree(UVC_cam_queue_T *queue)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+
+    CamDevMetaFlush(queue);
+    vfree(meta->mem);
+    meta->mem = NULL;
+    meta->count = 0;
+    meta->owner = NULL;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaRequest(struct file *file, CameraDev_T *cam,
+ *                                       struct v4l2_requestbuffers *req)
+ *
+ * @brief   VIDIOC_REQBUFS on the metadata queue, a count of 0 frees the buffers and
+ *          gives the queue up for another handle
+ * @return  STATUS_OK     - req->count holds the number of buffers
+ * @return  -EBUSY        - another handle owns the queue, or it is streaming or mapped
+ *
+ ************************************************************************************/
+static int CamDevMetaRequest(struct file *file, CameraDev_T *cam, struct v4l2_requestbuffers *req)
+{
+    UVC_cam_queue_T *queue = cam->queue;
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned int i;
+
+    // a loopback node has no payload headers
+    if (CamDevIsLoopback(cam) || req->memory != V4L2_MEMORY_MMAP)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&queue->mutex);
+    if ((meta->owner != NULL && meta->owner != file) || meta->streaming || meta->vmaCount != 0)
+    {
+        printk(KERN_INFO "REQUEST BUFF: metadata buffers are busy \n");
+        mutex_unlock(&queue->mutex);
+        return -EBUSY;
+    }
+    CamDevMetaFree(queue);
+    if (req->count == 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return STATUS_OK;
+    }
+
+    req->count = min_t(unsigned int, req->count, MAX_BUFFER);
+    meta->mem = vmalloc_user(req->count * PAGE_SIZE);
+    if (meta->mem == NULL)
+    {
+        mutex_unlock(&queue->mutex);
+        return -ENOMEM;
+    }
+    for (i = 0; i < req->count; i++)
+    {
+        memset(&meta->buf[i], 0, sizeof(meta->buf[i]));
+        meta->buf[i].index = i;
+        meta->buf[i].type = V4L2_BUF_TYPE_META_CAPTURE;
+        meta->buf[i].memory = V4L2_MEMORY_MMAP;
+        meta->buf[i].length = sizeof(struct cam_meta);
+        meta->buf[i].m.offset = CAM_META_OFFSET + i * PAGE_SIZE;
+        meta->state[i] = UVC_BUF_STATE_IDLE;
+    }
+    meta->count = req->count;
+    meta->owner = file;
+    meta->dropped = 0;
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaQuery(struct file *file, UVC_cam_queue_T *queue,
+ *                                     struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_QUERYBUF on the metadata queue
+ *
+ ************************************************************************************/
+static int CamDevMetaQuery(struct file *file, UVC_cam_queue_T *queue, struct v4l2_buffer *vbuf)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned int i = vbuf->index;
+
+    mutex_lock(&queue->mutex);
+    if (meta->owner != file || i >= meta->count)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    *vbuf = meta->buf[i];
+    if (meta->state[i] == UVC_BUF_STATE_DONE)
+    {
+        vbuf->flags |= V4L2_BUF_FLAG_DONE;
+    }
+    else if (meta->state[i] == UVC_BUF_STATE_QUEUED)
+    {
+        vbuf->flags |= V4L2_BUF_FLAG_QUEUED;
+    }
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaQueue(struct file *file, UVC_cam_queue_T *queue,
+ *                                     struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_QBUF on the metadata queue, the buffer takes the record of the
+ *          next completed frame
+ *
+ ************************************************************************************/
+static int CamDevMetaQueue(struct file *file, UVC_cam_queue_T *queue, struct v4l2_buffer *vbuf)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned int i = vbuf->index;
+    unsigned long flags;
+    int ret = -EINVAL;
+
+    mutex_lock(&queue->mutex);
+    if (meta->owner != file || i >= meta->count || vbuf->memory != V4L2_MEMORY_MMAP)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    spin_lock_irqsave(&queue->irqlock, flags);
+    if (meta->state[i] == UVC_BUF_STATE_IDLE)
+    {
+        meta->state[i] = UVC_BUF_STATE_QUEUED;
+        meta->queued[(meta->qhead + meta->nqueued) % MAX_BUFFER] = i;
+        meta->nqueued++;
+        ret = STATUS_OK;
+    }
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    mutex_unlock(&queue->mutex);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaDequeue(struct file *file, UVC_cam_queue_T *queue,
+ *                                       struct v4l2_buffer *vbuf)
+ *
+ * @brief   VIDIOC_DQBUF on the metadata queue, wait for a record if none is
+ *          completed and the caller can block
+ * @return  STATUS_OK     - *vbuf describes the oldest record
+ * @return  -EAGAIN       - no record and the caller cannot block
+ * @return  -EINVAL       - the queue is not streaming
+ *
+ ************************************************************************************/
+static int CamDevMetaDequeue(struct file *file, UVC_cam_queue_T *queue, struct v4l2_buffer *vbuf)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned long flags;
+    unsigned int i;
+    int ret;
+
+    for (;;)
+    {
+        // the owner and the metadata pool only change under queue->mutex
+        if (mutex_lock_interruptible(&queue->mutex))
+        {
+            return -ERESTARTSYS;
+        }
+        if (meta->owner != file)
+        {
+            mutex_unlock(&queue->mutex);
+            return -EINVAL;
+        }
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (meta->ndone != 0)
+        {
+            break;
+        }
+        if (!meta->streaming)
+        {
+            spin_unlock_irqrestore(&queue->irqlock, flags);
+            mutex_unlock(&queue->mutex);
+            return -EINVAL;
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        mutex_unlock(&queue->mutex);
+        if (file->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(queue->wait, CamDevMetaHasDone(queue) || !meta->streaming);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    i = meta->done[meta->dhead];
+    meta->dhead = (meta->dhead + 1) % MAX_BUFFER;
+    meta->ndone--;
+    meta->state[i] = UVC_BUF_STATE_IDLE;
+    *vbuf = meta->buf[i];
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaStream(struct file *file, UVC_cam_queue_T *queue, int on)
+ *
+ * @brief   VIDIOC_STREAMON and VIDIOC_STREAMOFF on the metadata queue, the records
+ *          follow the video stream whenever it runs
+ *
+ ************************************************************************************/
+static int CamDevMetaStream(struct file *file, UVC_cam_queue_T *queue, int on)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned long flags;
+
+    mutex_lock(&queue->mutex);
+    if (meta->owner != file || meta->count == 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    if (on)
+    {
+        spin_lock_irqsave(&queue->irqlock, flags);
+        meta->streaming = 1;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+    }
+    else
+    {
+        CamDevMetaFlush(queue);
+    }
+    mutex_unlock(&queue->mutex);
+    return STATUS_OK;
+}
+
+static void CamDevMetaVmOpen(struct vm_area_struct *vma)
+{
+    UVC_cam_queue_T *queue = vma->vm_private_data;
+    queue->meta.vmaCount++;
+}
+
+static void CamDevMetaVmClose(struct vm_area_struct *vma)
+{
+    UVC_cam_queue_T *queue = vma->vm_private_data;
+    queue->meta.vmaCount--;
+}
+
+static const struct vm_operations_struct cam_meta_vm_ops =
+{
+    .open = CamDevMetaVmOpen,
+    .close = CamDevMetaVmClose,
+};
+
+/************************************************************************************
+ * @func    static int CamDevMetaMap(struct file *file, UVC_cam_queue_T *queue,
+ *                                   struct vm_area_struct *vma)
+ *
+ * @brief   map the page of a metadata buffer, only the owner of the queue maps it
+ *
+ ************************************************************************************/
+static int CamDevMetaMap(struct file *file, UVC_cam_queue_T *queue, struct vm_area_struct *vma)
+{
+    CamMetaQueue_T *meta = &queue->meta;
+    unsigned long i = vma->vm_pgoff - (CAM_META_OFFSET >> PAGE_SHIFT);
+    int ret;
+
+    mutex_lock(&queue->mutex);
+    if (meta->owner != file || i >= meta->count || vma->vm_end - vma->vm_start > PAGE_SIZE)
+    {
+        printk(KERN_INFO "Mapper: no metadata buffer at offset %lu \n", vma->vm_pgoff << PAGE_SHIFT);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+    ret = remap_vmalloc_range(vma, meta->mem, i);
+    if (ret == 0)
+    {
+        vma->vm_ops = &cam_meta_vm_ops;
+        vma->vm_private_data = queue;
+        CamDevMetaVmOpen(vma);
+    }
+    mutex_unlock(&queue->mutex);
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+/************************************************************************************
+ * @func    static int CamDevMetaEnumFormat(struct file *file, void *fh,
+ *                                          struct v4l2_fmtdesc *format)
+ *
+ * @brief   VIDIOC_ENUM_FMT on the metadata queue, the records have one format
+ *
+ ************************************************************************************/
+static int CamDevMetaEnumFormat(struct file *file, void *fh, struct v4l2_fmtdesc *format)
+{
+    CamManage *Cam = file->private_data;
+
+    if (format->index != 0 || CamDevIsLoopback(Cam->camDev))
+    {
+        return -EINVAL;
+    }
+    format->flags = 0;
+    format->pixelformat = CAM_META_FMT;
+    strscpy(format->description, "Camera frame metadata", sizeof(format->description));
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevMetaFormat(struct file *file, void *fh,
+ *                                      struct v4l2_format *format)
+ *
+ * @brief   VIDIOC_G_FMT, VIDIOC_S_FMT and VIDIOC_TRY_FMT on the metadata queue, the
+ *          format is fixed
+ *
+ ************************************************************************************/
+static int CamDevMetaFormat(struct file *file, void *fh, struct v4l2_format *format)
+{
+    CamManage *Cam = file->private_data;
+
+    if (CamDevIsLoopback(Cam->camDev))
+    {
+        return -EINVAL;
+    }
+    memset(&format->fmt.meta, 0, sizeof(format->fmt.meta));
+    format->fmt.meta.dataformat = CAM_META_FMT;
+    format->fmt.meta.buffersize = sizeof(struct cam_meta);
+    return STATUS_OK;
+}
+#endif
+
+/************************************************************************************
+                                VIDEO TRANSFER
+ ************************************************************************************/
+
+/************************************************************************************
+ * @func    static void CamDevParseFormats(CameraDev_T *cam)
+ *
+ * @brief   collect the formats and frame sizes advertised by the class specific
+ *          descriptors of the video streaming interface
+ *
+ ************************************************************************************/
+static void CamDevParseFormats(CameraDev_T *cam)
+{
+    const unsigned char *desc = cam->intf->altsetting[0].extra;
+    int left = cam->intf->altsetting[0].extralen;
+    CamFormatDesc_T *format = NULL;
+    CamFrameDesc_T *frame;
+
+    while (left >= 3 && desc[0] >= 3 && desc[0] <= left)
+    {
+        if (desc[1] != USB_DT_CS_INTERFACE)
+        {
+            goto next;
+        }
+        switch (desc[2])
+        {
+        case UVC_VS_FORMAT_UNCOMPRESSED:
+        case UVC_VS_FORMAT_MJPEG:
+        {
+            // a VS_FORMAT_MJPEG descriptor is 11 bytes, a VS_FORMAT_UNCOMPRESSED one 27
+            if (cam->nformats >= CAM_MAX_FORMATS || desc[0] < (desc[2] == UVC_VS_FORMAT_MJPEG ? 11 : 27))
+            {
+                format = NULL;
+                break;
+            }
+            format = &cam->formats[cam->nformats++];
+            format->index = desc[3];
+            format->nframes = 0;
+            if (desc[2] == UVC_VS_FORMAT_MJPEG)
+            {
+                format->pixelformat = V4L2_PIX_FMT_MJPEG;
+            }
+            else if (!memcmp(&desc[5], "YUY2", 4))
+            {
+                format->pixelformat = V4L2_PIX_FMT_YUYV;
+            }
+            else
+            {
+                format->pixelformat = v4l2_fourcc(desc[5], desc[6], desc[7], desc[8]);
+            }
+            break;
+        }
+        case UVC_VS_FRAME_UNCOMPRESSED:
+        case UVC_VS_FRAME_MJPEG:
+        {
+            if (format == NULL || format->nframes >= CAM_MAX_FRAMES || desc[0] < 26)
+            {
+                break;
+            }
+            frame = &format->frame[format->nframes++];
+            frame->index = desc[3];
+            frame->width = get_unaligned_le16(&desc[5]);
+            frame->height = get_unaligned_le16(&desc[7]);
+            frame->maxBufferSize = get_unaligned_le32(&desc[17]);
+            frame->interval = get_unaligned_le32(&desc[21]);
+            break;
+        }
+        }
+next:
+        left -= desc[0];
+        desc += desc[0];
+    }
+    printk(KERN_INFO "Camera advertises %u formats \n", cam->nformats);
+}
+
+/************************************************************************************
+ * @func    static int CamDevSelectFormat(CameraDev_T *cam, struct v4l2_pix_format *pix)
+ *
+ * @brief   pick the advertised format and frame size closest to the request and
+ *          update the request with the values the camera will deliver
+ * @return  STATUS_OK     - pix is updated
+ * @return  -EINVAL       - the camera did not advertise any format
+ *
+ ************************************************************************************/
+static int CamDevSelectFormat(CameraDev_T *cam, struct v4l2_pix_format *pix)
+{
+    CamFormatDesc_T *format = NULL;
+    CamFrameDesc_T *frame = NULL;
+    unsigned int i, diff, best = UINT_MAX;
+
+    for (i = 0; i < cam->nformats; i++)
+    {
+        if (cam->formats[i].pixelformat == pix->pixelformat)
+        {
+            format = &cam->formats[i];
+            break;
+        }
+    }
+    if (format == NULL && cam->nformats > 0)
+    {
+        format = &cam->formats[0];
+    }
+    if (format == NULL || format->nframes == 0)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < format->nframes; i++)
+    {
+        diff = abs((int)format->frame[i].width - (int)pix->width) +
+               abs((int)format->frame[i].height - (int)pix->height);
+        if (diff < best)
+        {
+            best = diff;
+            frame = &format->frame[i];
+        }
+    }
+
+    pix->pixelformat = format->pixelformat;
+    pix->width = frame->width;
+    pix->height = frame->height;
+    pix->field = V4L2_FIELD_NONE;
+    if (format->pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        pix->bytesperline = 0;
+        pix->sizeimage = frame->maxBufferSize;
+        pix->colorspace = V4L2_COLORSPACE_JPEG;
+    }
+    else
+    {
+        pix->bytesperline = frame->width * 2;
+        pix->sizeimage = pix->bytesperline * frame->height;
+        pix->colorspace = V4L2_COLORSPACE_SRGB;
+    }
+
+    cam->curFormat = format;
+    cam->curFrame = frame;
+    // a new format starts uncropped
+    cam->crop.left = 0;
+    cam->crop.top = 0;
+    cam->crop.width = frame->width;
+    cam->crop.height = frame->height;
+    cam->cropped = 0;
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevStreamCtrl(CameraDev_T *cam, __u8 request, __u8 cs,
+ *                                      CamStreamCtrl_T *ctrl, unsigned int size)
+ *
+ * @brief   send a SET_CUR or GET_CUR request for the probe or commit control
+ * @return  number of transferred bytes, negative error code on failure
+ *
+ ************************************************************************************/
+static int CamDevStreamCtrl(CameraDev_T *cam, __u8 request, __u8 cs,
+                            CamStreamCtrl_T *ctrl, unsigned int size)
+{
+    __u8 ifnum;
+    unsigned int pipe;
+    __u8 type = USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    void *data;
+    int ret;
+
+    // the interface is freed with an unplugged camera
+    if (cam->gone)
+    {
+        return -ENODEV;
+    }
+    ifnum = cam->intf->cur_altsetting->desc.bInterfaceNumber;
+    data = kmalloc(sizeof(CamStreamCtrl_T), GFP_KERNEL);
+    if (data == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    if (request & USB_DIR_IN)
+    {
+        pipe = usb_rcvctrlpipe(cam->udev, 0);
+        type |= USB_DIR_IN;
+    }
+    else
+    {
+        pipe = usb_sndctrlpipe(cam->udev, 0);
+        memcpy(data, ctrl, size);
+    }
+
+    ret = usb_control_msg(cam->udev, pipe, request, type, cs << 8, ifnum,
+                          data, size, CAM_CTRL_TIMEOUT);
+    if (ret > 0 && (request & USB_DIR_IN))
+    {
+        memcpy(ctrl, data, ret);
+    }
+    kfree(data);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static int CamDevCommit(CameraDev_T *cam)
+ *
+ * @brief   negotiate the selected format and frame size with the camera through
+ *          the probe and commit controls
+ * @return  STATUS_OK     - streaming parameters committed
+ *
+ ************************************************************************************/
+static int CamDevCommit(CameraDev_T *cam)
+{
+    CamStreamCtrl_T *ctrl = &cam->ctrl;
+    int ret;
+
+    if (cam->curFormat == NULL || cam->curFrame == NULL)
+    {
+        return -EINVAL;
+    }
+
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->bmHint = cpu_to_le16(1);  // keep dwFrameInterval
+    ctrl->bFormatIndex = cam->curFormat->index;
+    ctrl->bFrameIndex = cam->curFrame->index;
+    ctrl->dwFrameInterval = cpu_to_le32(cam->curFrame->interval);
+
+    // UVC 1.0 cameras answer with a 26 bytes long control
+    ret = CamDevStreamCtrl(cam, UVC_SET_CUR, UVC_VS_PROBE_CONTROL, ctrl, sizeof(*ctrl));
+    if (ret < 0)
+    {
+        ret = CamDevStreamCtrl(cam, UVC_SET_CUR, UVC_VS_PROBE_CONTROL, ctrl, 26);
+    }
+    if (ret < 0)
+    {
+        printk(KERN_INFO "COMMIT: set probe control failed %d \n", ret);
+        return ret;
+    }
+    cam->ctrlSize = ret;
+
+    ret = CamDevStreamCtrl(cam, UVC_GET_CUR, UVC_VS_PROBE_CONTROL, ctrl, cam->ctrlSize);
+    if (ret < 0)
+    {
+        printk(KERN_INFO "COMMIT: get probe control failed %d \n", ret);
+        return ret;
+    }
+
+    ret = CamDevStreamCtrl(cam, UVC_SET_CUR, UVC_VS_COMMIT_CONTROL, ctrl, cam->ctrlSize);
+    if (ret < 0)
+    {
+        printk(KERN_INFO "COMMIT: set commit control failed %d \n", ret);
+        return ret;
+    }
+
+    printk(KERN_INFO "COMMIT: frame size %u, payload size %u \n",
+           le32_to_cpu(ctrl->dwMaxVideoFrameSize), le32_to_cpu(ctrl->dwMaxPayloadTransferSize));
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static void CamDevMetaPayload(CameraDev_T *cam, const __u8 *data,
+ *                                        unsigned int len)
+ *
+ * @brief   account a payload of the frame being filled in its metadata, the header
+ *          fields are taken from the first payload
+ *
+ ************************************************************************************/
+static void CamDevMetaPayload(CameraDev_T *cam, const __u8 *data, unsigned int len)
+{
+    struct cam_meta *meta = &cam->frameMeta;
+    unsigned int hlen = data[0];
+    unsigned int pos = 2;
+
+    if (!cam->metaValid)
+    {
+        memset(meta, 0, sizeof(*meta));
+        meta->timestamp = ktime_to_ns(ktime_get());
+        meta->usb_frame = usb_get_current_frame_number(cam->udev);
+        meta->header_info = data[1];
+        if ((data[1] & UVC_STREAM_PTS) && hlen >= pos + 4)
+        {
+            meta->pts = get_unaligned_le32(data + pos);
+            meta->flags |= CAM_META_PTS;
+            pos += 4;
+        }
+        if ((data[1] & UVC_STREAM_SCR) && hlen >= pos + 6)
+        {
+            meta->scr_stc = get_unaligned_le32(data + pos);
+            meta->scr_sof = get_unaligned_le16(data + pos + 4) & 0x7ff;
+            meta->flags |= CAM_META_SCR;
+            pos += 6;
+        }
+        if (hlen > pos)
+        {
+            meta->ext_length = hlen - pos;
+            memcpy(meta->ext, data + pos, min_t(unsigned int, hlen - pos, CAM_META_EXT_SIZE));
+        }
+        cam->metaValid = 1;
+    }
+    meta->payloads++;
+    meta->bytes += len - hlen;
+}
+
+/************************************************************************************
+ * @func    static void CamDevFrameDrop(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+ *
+ * @brief   give the buffer of a dropped frame back to the transfer path, first in
+ *          line, so it takes the next frame
+ *
+ ************************************************************************************/
+static void CamDevFrameDrop(UVC_cam_queue_T *queue, CamDevBuff_T *buff)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->irqlock, flags);
+    queue->stats.error_drops++;
+    buff->buffState = UVC_BUF_STATE_QUEUED;
+    buff->buf.bytesused = 0;
+    buff->buf.flags &= ~V4L2_BUF_FLAG_ERROR;
+    list_add(&buff->stream, &queue->irqqueue);
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+}
+
+/************************************************************************************
+ * @func    static void CamDevFrameDone(CameraDev_T *cam, CamDevBuff_T *buff)
+ *
+ * @brief   complete the frame being filled and its metadata record, both carry
+ *          the same sequence. A frame with errors is dropped instead when the
+ *          owner asked for CAM_ERROR_DROP.
+ *
+ ************************************************************************************/
+static void CamDevFrameDone(CameraDev_T *cam, CamDevBuff_T *buff)
+{
+    UVC_cam_queue_T *queue = cam->queue;
+
+    // an uncompressed frame shorter than the image lost payloads on the way
+    if (cam->curFormat != NULL && cam->curFormat->pixelformat != V4L2_PIX_FMT_MJPEG &&
+        buff->buf.bytesused < cam->format.fmt.pix.sizeimage)
+    {
+        cam->frameError = 1;
+    }
+    if (cam->frameError && queue->errorFrames == CAM_ERROR_DROP)
+    {
+        CamDevFrameDrop(queue, buff);
+        cam->metaValid = 0;
+        cam->frameError = 0;
+        return;
+    }
+    buff->buf.sequence = cam->frameSeq;
+    buff->buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    CamDevStampBuffer(&buff->buf, cam->frameMeta.timestamp);
+    cam->frameMeta.sequence = cam->frameSeq;
+    if (cam->frameError)
+    {
+        buff->buf.flags |= V4L2_BUF_FLAG_ERROR;
+        cam->frameMeta.flags |= CAM_META_ERROR;
+        queue->stats.errors++;
+    }
+    CamDevBufferDone(queue, buff);
+    if (cam->metaValid)
+    {
+        CamDevMetaDone(queue, &cam->frameMeta);
+    }
+    cam->metaValid = 0;
+    cam->frameError = 0;
+}
+
+/************************************************************************************
+ * @func    static void CamDevCropCopy(CameraDev_T *cam, CamDevBuff_T *buff,
+ *                                     const __u8 *src, unsigned int len)
+ *
+ * @brief   copy the part of a YUYV payload inside the crop rectangle, the payload
+ *          continues the frame at cam->frameOffset. The rows above and below the
+ *          rectangle and the columns around it never reach the buffer.
+ *
+ ************************************************************************************/
+static void CamDevCropCopy(CameraDev_T *cam, CamDevBuff_T *buff, const __u8 *src, unsigned int len)
+{
+    unsigned int stride = cam->curFrame->width * 2;
+    unsigned int size = stride * cam->curFrame->height;
+    unsigned int first = cam->crop.left * 2;
+    unsigned int last = first + cam->crop.width * 2;
+    unsigned int row, col, chunk, from, to;
+
+    if (cam->frameOffset >= size || len > size - cam->frameOffset)
+    {
+        cam->frameError = 1;
+        len = cam->frameOffset >= size ? 0 : size - cam->frameOffset;
+    }
+    while (len > 0)
+    {
+        row = cam->frameOffset / stride;
+        col = cam->frameOffset % stride;
+        chunk = min(len, stride - col);
+        if (row >= cam->crop.top + cam->crop.height)
+        {
+            // nothing below the rectangle is kept
+            cam->frameOffset += len;
+            return;
+        }
+        if (row >= cam->crop.top)
+        {
+            from = max(col, first);
+            to = min(col + chunk, last);
+            if (from < to)
+            {
+                memcpy(buff->mem + (row - cam->crop.top) * (last - first) + from - first,
+                       src + from - col, to - from);
+                buff->buf.bytesused += to - from;
+            }
+        }
+        src += chunk;
+        len -= chunk;
+        cam->frameOffset += chunk;
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevPayloadLost(CameraDev_T *cam)
+ *
+ * @brief   a packet or a whole URB failed: the frame in progress misses data, and
+ *          the next payload decoded is checked for a frame boundary lost with it
+ *
+ ************************************************************************************/
+static void CamDevPayloadLost(CameraDev_T *cam)
+{
+    cam->frameError = 1;
+    cam->resync = 1;
+}
+
+/************************************************************************************
+ * @func    static int CamDevPtsChanged(CameraDev_T *cam, const __u8 *data,
+ *                                      unsigned int hlen)
+ *
+ * @brief   check whether a payload carries another PTS than the frame in progress,
+ *          every payload of a frame has the same one
+ *
+ ************************************************************************************/
+static int CamDevPtsChanged(CameraDev_T *cam, const __u8 *data, unsigned int hlen)
+{
+    return cam->metaValid && (cam->frameMeta.flags & CAM_META_PTS) && (data[1] & UVC_STREAM_PTS) &&
+           hlen >= 6 && get_unaligned_le32(data + 2) != cam->frameMeta.pts;
+}
+
+/************************************************************************************
+ * @func    static void CamDevDecodePayload(CameraDev_T *cam, const __u8 *data,
+ *                                          unsigned int len)
+ *
+ * @brief   strip the UVC payload header and append the payload data to the buffer
+ *          being filled, a buffer is completed on end of frame or when the frame
+ *          id toggles
+ *
+ ************************************************************************************/
+static void CamDevDecodePayload(CameraDev_T *cam, const __u8 *data, unsigned int len)
+{
+    UVC_cam_queue_T *queue = cam->queue;
+    CamDevBuff_T *buff = cam->curBuff;
+    unsigned int hlen, plen;
+    int fid, resync;
+
+    if (len < 2 || data[0] < 2 || data[0] > len)
+    {
+        // empty packets are normal, a payload with a broken header is not
+        if (len >= 2)
+        {
+            CamDevPayloadLost(cam);
+        }
+        return;
+    }
+    hlen = data[0];
+    fid = data[1] & UVC_STREAM_FID;
+    resync = cam->resync;
+    cam->resync = 0;
+
+    // wait for the first frame boundary after stream start
+    if (cam->lastFid < 0)
+    {
+        cam->lastFid = fid;
+        return;
+    }
+
+    // a toggled frame id marks the first payload of a new frame. After lost
+    // payloads two toggles may be gone with them, a new PTS is a new frame too
+    if (fid != cam->lastFid || (resync && CamDevPtsChanged(cam, data, hlen)))
+    {
+        cam->lastFid = fid;
+        if (buff != NULL && buff->buf.bytesused > 0)
+        {
+            CamDevFrameDone(cam, buff);
+            buff = NULL;
+        }
+        if (cam->frameLost)
+        {
+            queue->stats.lost++;
+        }
+        // the sequence counts every frame of the camera, a lost one leaves a gap
+        cam->frameSeq++;
+        cam->frameLost = 0;
+        cam->frameDone = 0;
+        // the payloads lost just before may have been the first ones of this frame
+        cam->frameError = resync;
+        cam->frameOffset = 0;
+        cam->metaValid = 0;
+        // a decimated frame never takes a buffer, its payloads are dropped as they come
+        cam->frameSkip = queue->decimation > 1 && cam->frameSeq % queue->decimation != 0;
+        if (cam->frameSkip)
+        {
+            queue->stats.decimated++;
+        }
+        else if (buff == NULL)
+        {
+            buff = CamDevNextBuffer(queue);
+        }
+        cam->curBuff = buff;
+    }
+    if (data[1] & UVC_STREAM_ERR)
+    {
+        cam->frameError = 1;
+    }
+    if (cam->frameSkip)
+    {
+        return;
+    }
+    if (buff == NULL)
+    {
+        // cameras send header only payloads after end of frame until the FID toggles
+        if (len > hlen && !cam->frameDone)
+        {
+            cam->frameLost = 1;
+        }
+        return;
+    }
+    CamDevMetaPayload(cam, data, len);
+
+    if (cam->cropped)
+    {
+        CamDevCropCopy(cam, buff, data + hlen, len - hlen);
+    }
+    else
+    {
+        plen = min(len - hlen, buff->buf.length - buff->buf.bytesused);
+        if (plen < len - hlen)
+        {
+            cam->frameError = 1;
+        }
+        memcpy(buff->mem + buff->buf.bytesused, data + hlen, plen);
+        buff->buf.bytesused += plen;
+    }
+
+    if ((data[1] & UVC_STREAM_EOF) && buff->buf.bytesused > 0)
+    {
+        CamDevFrameDone(cam, buff);
+        cam->curBuff = NULL;
+        cam->frameDone = 1;
+        cam->frameOffset = 0;
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevUrbSubmit(CameraDev_T *cam, struct urb *urb)
+ *
+ * @brief   resubmit a decoded URB. When the host controller refuses it, the URB is
+ *          submitted again from retryWork instead of leaving the stream one URB
+ *          short for good
+ *
+ ************************************************************************************/
+static void CamDevUrbSubmit(CameraDev_T *cam, struct urb *urb)
+{
+    unsigned int i;
+    int ret;
+
+    ret = usb_submit_urb(urb, GFP_ATOMIC);
+    // a poisoned URB is being stopped, a gone device stops the stream
+    if (ret == 0 || ret == -EPERM || ret == -ENODEV || ret == -ESHUTDOWN)
+    {
+        return;
+    }
+    printk_ratelimited(KERN_INFO "URB: resubmit failed %d, retrying \n", ret);
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        if (cam->urb[i] == urb)
+        {
+            set_bit(i, &cam->urbRetry);
+            queue_delayed_work(cam->workqueue, &cam->retryWork, msecs_to_jiffies(CAM_URB_RETRY_MS));
+            return;
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevRetryWork(struct work_struct *work)
+ *
+ * @brief   submit the URBs CamDevUrbSubmit could not resubmit, until the host
+ *          controller takes them or the stream stops
+ *
+ ************************************************************************************/
+static void CamDevRetryWork(struct work_struct *work)
+{
+    CameraDev_T *cam = container_of(to_delayed_work(work), CameraDev_T, retryWork);
+    unsigned long flags;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        if (!test_and_clear_bit(i, &cam->urbRetry))
+        {
+            continue;
+        }
+        ret = usb_submit_urb(cam->urb[i], GFP_KERNEL);
+        if (ret == 0)
+        {
+            spin_lock_irqsave(&cam->queue->irqlock, flags);
+            cam->queue->stats.urb_retries++;
+            spin_unlock_irqrestore(&cam->queue->irqlock, flags);
+        }
+        else if (ret != -EPERM && ret != -ENODEV && ret != -ESHUTDOWN)
+        {
+            set_bit(i, &cam->urbRetry);
+            queue_delayed_work(cam->workqueue, &cam->retryWork, msecs_to_jiffies(CAM_URB_RETRY_MS));
+        }
+    }
+}
+
+/************************************************************************************
+ * @func    static void CamDevUrbProcess(CameraDev_T *cam, struct urb *urb)
+ *
+ * @brief   decode every packet of a completed URB and resubmit it. A failed URB or
+ *          packet marks the frame in progress, the stream goes on and the decoder
+ *          resynchronizes on the next frame boundary
+ *
+ ************************************************************************************/
+static void CamDevUrbProcess(CameraDev_T *cam, struct urb *urb)
+{
+    UVC_cam_queue_T *queue = cam->queue;
+    int status = urb->status;
+    unsigned long flags;
+    unsigned int i;
+
+    if (fault_urbs != 0 && ++cam->faultUrbs % fault_urbs == 0)
+    {
+        status = -EPROTO;
+    }
+    // -EXDEV only says some packets failed, the packets tell which
+    if (status < 0 && status != -EXDEV)
+    {
+        // the packet descriptors of a failed URB can not be trusted
+        spin_lock_irqsave(&queue->irqlock, flags);
+        queue->stats.urb_errors++;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        CamDevPayloadLost(cam);
+        CamDevUrbSubmit(cam, urb);
+        return;
+    }
+    for (i = 0; i < urb->number_of_packets; i++)
+    {
+        status = urb->iso_frame_desc[i].status;
+        if (fault_packets != 0 && ++cam->faultPackets % fault_packets == 0)
+        {
+            status = -EOVERFLOW;
+        }
+        // the payload of a failed packet is missing from the frame
+        if (status < 0)
+        {
+            spin_lock_irqsave(&queue->irqlock, flags);
+            queue->stats.packet_errors++;
+            spin_unlock_irqrestore(&queue->irqlock, flags);
+            CamDevPayloadLost(cam);
+            continue;
+        }
+        CamDevDecodePayload(cam, urb->transfer_buffer + urb->iso_frame_desc[i].offset,
+                            urb->iso_frame_desc[i].actual_length);
+    }
+    CamDevUrbSubmit(cam, urb);
+}
+
+/************************************************************************************
+ * @func    static void CamDevBatchKick(CameraDev_T *cam)
+ *
+ * @brief   schedule the decoding of the completed URBs, on the completion CPU of
+ *          the device when completion_cpus is set
+ *
+ ************************************************************************************/
+static void CamDevBatchKick(CameraDev_T *cam)
+{
+    if (cam->streamCpu < 0)
+    {
+        queue_work(cam->workqueue, &cam->batchWork);
+        return;
+    }
+    queue_work_on(cam->streamCpu, cam->workqueue, &cam->batchWork);
+}
+
+/************************************************************************************
+ * @func    static enum hrtimer_restart CamDevBatchTimer(struct hrtimer *timer)
+ *
+ * @brief   the oldest completed URB waited batch_us, decode the batch as it is
+ *
+ ************************************************************************************/
+static enum hrtimer_restart CamDevBatchTimer(struct hrtimer *timer)
+{
+    CamDevBatchKick(container_of(timer, CameraDev_T, batchTimer));
+    return HRTIMER_NORESTART;
+}
+
+/************************************************************************************
+ * @func    static void CamDevBatchWork(struct work_struct *work)
+ *
+ * @brief   decode the completed URBs in completion order and resubmit them. The
+ *          readers are woken once for all the frames the batch completed. A work
+ *          item never runs concurrently with itself, so the payloads are decoded
+ *          in order whatever CPU queued it.
+ *
+ ************************************************************************************/
+static void CamDevBatchWork(struct work_struct *work)
+{
+    CameraDev_T *cam = container_of(work, CameraDev_T, batchWork);
+    UVC_cam_queue_T *queue = cam->queue;
+    struct urb *urbs[CAM_URBS];
+    ktime_t start = ktime_get();
+    ktime_t first;
+    unsigned long flags;
+    unsigned int i, count, frames;
+    u64 ns;
+
+    spin_lock_irqsave(&cam->urbLock, flags);
+    count = cam->urbDoneCount;
+    for (i = 0; i < count; i++)
+    {
+        urbs[i] = cam->urbDone[(cam->urbDoneHead + i) % CAM_URBS];
+    }
+    cam->urbDoneHead = (cam->urbDoneHead + count) % CAM_URBS;
+    cam->urbDoneCount = 0;
+    first = cam->batchStart;
+    spin_unlock_irqrestore(&cam->urbLock, flags);
+    if (count == 0)
+    {
+        // the timer fired after the batch was already decoded
+        return;
+    }
+
+    queue->deferWake = 1;
+    queue->wakePending = 0;
+    for (i = 0; i < count; i++)
+    {
+        CamDevUrbProcess(cam, urbs[i]);
+    }
+    queue->deferWake = 0;
+    frames = queue->wakePending;
+    if (frames > 0)
+    {
+        wake_up_interruptible(&queue->wait);
+    }
+
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    spin_lock_irqsave(&queue->irqlock, flags);
+    queue->stats.batches++;
+    queue->stats.urbs += count;
+    queue->decodeNs += ns;
+    spin_unlock_irqrestore(&queue->irqlock, flags);
+    trace_cam_batch(count, frames, ktime_to_ns(ktime_sub(start, first)), ns);
+}
+
+/************************************************************************************
+ * @func    static void CamDevUrbComplete(struct urb *urb)
+ *
+ * @brief   completion handler of the isochronous URBs, runs with interrupts
+ *          disabled so it only appends the URB to the batch. The batch is decoded
+ *          at once, when CAM_BATCH_URBS URBs are waiting or after batch_us.
+ *
+ ************************************************************************************/
+static void CamDevUrbComplete(struct urb *urb)
+{
+    CameraDev_T *cam = urb->context;
+    ktime_t start = ktime_get();
+    unsigned long flags;
+    unsigned int pending;
+    u64 ns;
+
+    switch (urb->status)
+    {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+    case -ENODEV:
+        return;
+    default:
+        // transient bus errors (-EPROTO, -EILSEQ, babble -EOVERFLOW): decoded as lost and resubmitted
+        printk_ratelimited(KERN_INFO "URB: completion status %d \n", urb->status);
+        break;
+    }
+
+    spin_lock_irqsave(&cam->urbLock, flags);
+    if (cam->urbDoneCount == 0)
+    {
+        cam->batchStart = start;
+    }
+    cam->urbDone[(cam->urbDoneHead + cam->urbDoneCount) % CAM_URBS] = urb;
+    pending = ++cam->urbDoneCount;
+    spin_unlock_irqrestore(&cam->urbLock, flags);
+
+    if (batch_us == 0 || pending >= CAM_BATCH_URBS)
+    {
+        CamDevBatchKick(cam);
+    }
+    else if (pending == 1)
+    {
+        hrtimer_start(&cam->batchTimer, ns_to_ktime((u64)batch_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+    }
+
+    // only the completion handler writes irqNs
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    cam->queue->irqNs += ns;
+    trace_cam_urb_complete(urb->number_of_packets, pending, ns);
+}
+
+/************************************************************************************
+ * @func    static void CamDevFreeUrbs(CameraDev_T *cam)
+ *
+ * @brief   release the URBs and their transfer buffers
+ *
+ ************************************************************************************/
+static void CamDevFreeUrbs(CameraDev_T *cam)
+{
+    unsigned int i;
+
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        if (cam->urb[i] == NULL)
+        {
+            continue;
+        }
+        usb_free_coherent(cam->udev, cam->urbSize, cam->urbBuffer[i], cam->urbDma[i]);
+        usb_free_urb(cam->urb[i]);
+        cam->urb[i] = NULL;
+        cam->urbBuffer[i] = NULL;
+    }
+}
+
+/************************************************************************************
+ * @func    static int CamDevInitUrbs(CameraDev_T *cam, struct usb_host_endpoint *ep,
+ *                                    unsigned int psize)
+ *
+ * @brief   allocate the isochronous URBs for the selected endpoint
+ * @return  STATUS_OK     - URBs allocated
+ * @return  -ENOMEM       - allocate memory failed
+ *
+ ************************************************************************************/
+static int CamDevInitUrbs(CameraDev_T *cam, struct usb_host_endpoint *ep, unsigned int psize)
+{
+    struct urb *urb;
+    unsigned int i, j;
+
+    cam->urbSize = psize * CAM_URB_PACKETS;
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        urb = usb_alloc_urb(CAM_URB_PACKETS, GFP_KERNEL);
+        if (urb == NULL)
+        {
+            CamDevFreeUrbs(cam);
+            return -ENOMEM;
+        }
+        cam->urbBuffer[i] = usb_alloc_coherent(cam->udev, cam->urbSize, GFP_KERNEL, &cam->urbDma[i]);
+        if (cam->urbBuffer[i] == NULL)
+        {
+            usb_free_urb(urb);
+            CamDevFreeUrbs(cam);
+            return -ENOMEM;
+        }
+
+        urb->dev = cam->udev;
+        urb->context = cam;
+        urb->pipe = usb_rcvisocpipe(cam->udev, ep->desc.bEndpointAddress);
+        urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+        urb->interval = ep->desc.bInterval;
+        urb->transfer_buffer = cam->urbBuffer[i];
+        urb->transfer_dma = cam->urbDma[i];
+        urb->transfer_buffer_length = cam->urbSize;
+        urb->complete = CamDevUrbComplete;
+        urb->number_of_packets = CAM_URB_PACKETS;
+        for (j = 0; j < CAM_URB_PACKETS; j++)
+        {
+            urb->iso_frame_desc[j].offset = j * psize;
+            urb->iso_frame_desc[j].length = psize;
+        }
+        cam->urb[i] = urb;
+    }
+    return STATUS_OK;
+}
+
+/************************************************************************************
+                                BUS BANDWIDTH
+ ************************************************************************************/
+/*
+ * The cameras on one USB bus share its periodic bandwidth. A stream takes the
+ * smallest alternate setting whose packets carry the payload size committed by
+ * the camera, not the largest one, and reserves the bandwidth of that setting
+ * on its bus from STREAMON until the interface goes back to zero bandwidth. A
+ * stream which does not fit in bus_budget percent of the bus fails STREAMON
+ * with -ENOSPC, before the URBs are submitted. Only the cameras of this driver
+ * are accounted; the host controller still refuses what the other devices of
+ * the bus leave no room for.
+ */
+
+/************************************************************************************
+ * @func    static unsigned long CamDevBusBudget(struct usb_bus *bus)
+ *
+ * @brief   bytes/s the streams may reserve on the bus, from the speed of its root hub
+ *
+ ************************************************************************************/
+static unsigned long CamDevBusBudget(struct usb_bus *bus)
+{
+    unsigned long rate;
+
+    switch (bus->root_hub->speed)
+    {
+    case USB_SPEED_LOW:
+    case USB_SPEED_FULL:
+        rate = CAM_FS_RATE;
+        break;
+    case USB_SPEED_HIGH:
+        rate = CAM_HS_RATE;
+        break;
+    default:
+        rate = CAM_SS_RATE;
+        break;
+    }
+    return rate / 100 * min_t(unsigned int, bus_budget, 100);
+}
+
+/************************************************************************************
+ * @func    static unsigned int CamDevEpPacket(CameraDev_T *cam,
+ *                                             struct usb_host_endpoint *ep)
+ *
+ * @brief   bytes the isochronous endpoint moves per service interval
+ *
+ ************************************************************************************/
+static unsigned int CamDevEpPacket(CameraDev_T *cam, struct usb_host_endpoint *ep)
+{
+    unsigned int psize = le16_to_cpu(ep->desc.wMaxPacketSize);
+
+    if (cam->udev->speed >= USB_SPEED_SUPER)
+    {
+        return le16_to_cpu(ep->ss_ep_comp.wBytesPerInterval);
+    }
+    // high bandwidth endpoints send up to 3 packets per microframe
+    return (psize & 0x07ff) * (1 + ((psize >> 11) & 3));
+}
+
+/************************************************************************************
+ * @func    static unsigned long CamDevEpBandwidth(CameraDev_T *cam,
+ *                                                 struct usb_host_endpoint *ep)
+ *
+ * @brief   bytes/s the host controller reserves for the isochronous endpoint
+ *
+ ************************************************************************************/
+static unsigned long CamDevEpBandwidth(CameraDev_T *cam, struct usb_host_endpoint *ep)
+{
+    unsigned int interval = clamp_t(unsigned int, ep->desc.bInterval, 1, 16) - 1;
+    unsigned long perSecond = cam->udev->speed >= USB_SPEED_HIGH ? 8000 : 1000;
+
+    // one service interval every 2^(bInterval - 1) frames or microframes
+    return (unsigned long)CamDevEpPacket(cam, ep) * perSecond >> interval;
+}
+
+/************************************************************************************
+ * @func    static CamBus_T *CamDevBusFind(struct usb_bus *bus)
+ *
+ * @brief   the reservations of the bus, NULL when no stream holds one. Called with
+ *          CamBusLock held.
+ *
+ ************************************************************************************/
+static CamBus_T *CamDevBusFind(struct usb_bus *bus)
+{
+    CamBus_T *entry;
+
+    list_for_each_entry(entry, &CamBusList, list)
+    {
+        if (entry->bus == bus)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/************************************************************************************
+ * @func    static int CamDevBusReserve(CameraDev_T *cam, unsigned long bandwidth)
+ *
+ * @brief   reserve the bandwidth of the stream on the bus of the camera
+ * @return  STATUS_OK     - reserved
+ *          -ENOSPC       - the other streams of the bus leave no room for it
+ *
+ ************************************************************************************/
+static int CamDevBusReserve(CameraDev_T *cam, unsigned long bandwidth)
+{
+    struct usb_bus *bus = cam->udev->bus;
+    unsigned long budget = CamDevBusBudget(bus);
+    CamBus_T *entry;
+    int ret = STATUS_OK;
+
+    mutex_lock(&CamBusLock);
+    entry = CamDevBusFind(bus);
+    if (entry == NULL)
+    {
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if (entry == NULL)
+        {
+            mutex_unlock(&CamBusLock);
+            return -ENOMEM;
+        }
+        entry->bus = bus;
+        list_add(&entry->list, &CamBusList);
+    }
+    if (entry->reserved > budget || bandwidth > budget - entry->reserved)
+    {
+        printk(KERN_INFO "STREAM ON: %lu bytes/s do not fit, %lu of %lu free on bus %d \n", bandwidth,
+               budget - min(entry->reserved, budget), budget, bus->busnum);
+        ret = -ENOSPC;
+    }
+    else
+    {
+        entry->reserved += bandwidth;
+        entry->streams++;
+        cam->busBandwidth = bandwidth;
+    }
+    if (entry->streams == 0)
+    {
+        list_del(&entry->list);
+        kfree(entry);
+    }
+    mutex_unlock(&CamBusLock);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static void CamDevBusRelease(CameraDev_T *cam)
+ *
+ * @brief   give the bandwidth the stream reserved back to its bus
+ *
+ ************************************************************************************/
+static void CamDevBusRelease(CameraDev_T *cam)
+{
+    CamBus_T *entry;
+
+    mutex_lock(&CamBusLock);
+    entry = cam->busBandwidth != 0 ? CamDevBusFind(cam->udev->bus) : NULL;
+    if (entry != NULL)
+    {
+        entry->reserved -= cam->busBandwidth;
+        if (--entry->streams == 0)
+        {
+            list_del(&entry->list);
+            kfree(entry);
+        }
+    }
+    cam->busBandwidth = 0;
+    mutex_unlock(&CamBusLock);
+}
+
+/************************************************************************************
+ * @func    static unsigned long CamDevBusFree(CameraDev_T *cam)
+ *
+ * @brief   bytes/s of the budget of the bus of the camera no stream reserved
+ *
+ ************************************************************************************/
+static unsigned long CamDevBusFree(CameraDev_T *cam)
+{
+    unsigned long budget = CamDevBusBudget(cam->udev->bus);
+    CamBus_T *entry;
+    unsigned long reserved;
+
+    mutex_lock(&CamBusLock);
+    entry = CamDevBusFind(cam->udev->bus);
+    reserved = entry != NULL ? entry->reserved : 0;
+    mutex_unlock(&CamBusLock);
+    return budget - min(reserved, budget);
+}
+
+/************************************************************************************
+ * @func    static void CamDevVideoPause(CameraDev_T *cam)
+ *
+ * @brief   cancel the URBs but keep them, the alternate setting and the committed
+ *          parameters, so CamDevVideoStart only resubmits them. The URBs are
+ *          poisoned, so the batch still waiting to be decoded can not resubmit
+ *          them, and the batch is drained.
+ *
+ ************************************************************************************/
+static void CamDevVideoPause(CameraDev_T *cam)
+{
+    unsigned int i;
+
+    if (CamDevIsLoopback(cam) || cam->gone)
+    {
+        return;
+    }
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        if (cam->urb[i] != NULL)
+        {
+            usb_poison_urb(cam->urb[i]);
+        }
+    }
+    hrtimer_cancel(&cam->batchTimer);
+    flush_work(&cam->batchWork);
+    cancel_delayed_work_sync(&cam->retryWork);
+    cam->urbRetry = 0;
+    cam->curBuff = NULL;
+    cam->streamKept = 1;
+}
+
+/************************************************************************************
+ * @func    static void CamDevVideoRelease(CameraDev_T *cam)
+ *
+ * @brief   free the URBs kept by CamDevVideoPause and switch the streaming interface
+ *          back to zero bandwidth
+ *
+ ************************************************************************************/
+static void CamDevVideoRelease(CameraDev_T *cam)
+{
+    if (CamDevIsLoopback(cam) || cam->gone || !cam->streamKept)
+    {
+        return;
+    }
+    CamDevFreeUrbs(cam);
+    usb_set_interface(cam->udev, cam->intf->cur_altsetting->desc.bInterfaceNumber, 0);
+    CamDevBusRelease(cam);
+    cam->streamKept = 0;
+}
+
+/************************************************************************************
+ * @func    static void CamDevVideoStop(CameraDev_T *cam)
+ *
+ * @brief   cancel and free the URBs and switch the streaming interface back to zero
+ *          bandwidth
+ *
+ ************************************************************************************/
+static void CamDevVideoStop(CameraDev_T *cam)
+{
+    CamDevVideoPause(cam);
+    CamDevVideoRelease(cam);
+}
+
+/************************************************************************************
+ * @func    static int CamDevVideoSubmit(CameraDev_T *cam)
+ *
+ * @brief   reset the transfer path and submit the isochronous URBs
+ * @return  STATUS_OK     - the camera is streaming
+ *
+ ************************************************************************************/
+static int CamDevVideoSubmit(CameraDev_T *cam)
+{
+    unsigned int i;
+    int ret;
+
+    cam->curBuff = NULL;
+    cam->lastFid = -1;
+    cam->metaValid = 0;
+    cam->frameSeq = ~0U;            // the first frame boundary starts sequence 0
+    cam->frameLost = 0;
+    cam->frameDone = 0;
+    cam->frameError = 0;
+    cam->frameOffset = 0;
+    cam->frameSkip = 0;
+    cam->resync = 0;
+    cam->streamCpu = READ_ONCE(cam->workCpu);
+    cam->urbDoneHead = 0;
+    cam->urbDoneCount = 0;
+    memset(&cam->queue->stats, 0, sizeof(cam->queue->stats));
+    cam->queue->irqNs = 0;
+    cam->queue->decodeNs = 0;
+    for (i = 0; i < CAM_URBS; i++)
+    {
+        ret = usb_submit_urb(cam->urb[i], GFP_KERNEL);
+        if (ret < 0)
+        {
+            printk(KERN_INFO "STREAM ON: submit URB %u failed %d \n", i, ret);
+            CamDevVideoStop(cam);
+            return ret;
+        }
+    }
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevVideoStart(CameraDev_T *cam)
+ *
+ * @brief   commit the streaming parameters, select the alternate setting and submit
+ *          the isochronous URBs. A stream kept by CamDevVideoPause is restarted by
+ *          resubmitting its URBs, the camera is still set up for the same format.
+ * @return  STATUS_OK     - the camera is streaming
+ *          -ENOSPC       - the bus has no room left for the alternate setting
+ *
+ ************************************************************************************/
+static int CamDevVideoStart(CameraDev_T *cam)
+{
+    struct usb_host_interface *alt;
+    struct usb_host_endpoint *ep = NULL;
+    unsigned int i, psize, payload, best = 0, altNum = 0;
+    unsigned long bandwidth, bestBandwidth = 0;
+    int ret;
+
+    if (CamDevIsLoopback(cam))
+    {
+        // the output queue delivers the frames
+        memset(&cam->queue->stats, 0, sizeof(cam->queue->stats));
+        return STATUS_OK;
+    }
+    if (cam->gone)
+    {
+        return -ENODEV;
+    }
+    if (cam->streamKept)
+    {
+        for (i = 0; i < CAM_URBS; i++)
+        {
+            usb_unpoison_urb(cam->urb[i]);
+        }
+        cam->streamKept = 0;
+        ret = CamDevVideoSubmit(cam);
+        if (ret == STATUS_OK)
+        {
+            printk(KERN_INFO "STREAM ON: restarted, completions on CPU %d \n", cam->streamCpu);
+        }
+        return ret;
+    }
+
+    ret = CamDevCommit(cam);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    // the smallest setting carrying a whole payload leaves the rest of the bus to
+    // the other cameras, the largest one is taken when none does
+    payload = le32_to_cpu(cam->ctrl.dwMaxPayloadTransferSize);
+    if (payload == 0)
+    {
+        payload = UINT_MAX;
+    }
+    for (i = 0; i < cam->intf->num_altsetting; i++)
+    {
+        alt = &cam->intf->altsetting[i];
+        if (alt->desc.bNumEndpoints < 1 || !usb_endpoint_is_isoc_in(&alt->endpoint[0].desc))
+        {
+            continue;
+        }
+        psize = CamDevEpPacket(cam, &alt->endpoint[0]);
+        bandwidth = CamDevEpBandwidth(cam, &alt->endpoint[0]);
+        if (psize == 0)
+        {
+            continue;
+        }
+        if (ep == NULL || (best < payload && psize > best) || (psize >= payload && psize < best) ||
+            (psize == best && bandwidth < bestBandwidth))
+        {
+            best = psize;
+            bestBandwidth = bandwidth;
+            altNum = alt->desc.bAlternateSetting;
+            ep = &alt->endpoint[0];
+        }
+    }
+    if (ep == NULL)
+    {
+        printk(KERN_INFO "STREAM ON: no isochronous endpoint \n");
+        return -EIO;
+    }
+
+    ret = CamDevBusReserve(cam, bestBandwidth);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = usb_set_interface(cam->udev, cam->intf->cur_altsetting->desc.bInterfaceNumber, altNum);
+    if (ret < 0)
+    {
+        CamDevBusRelease(cam);
+        return ret;
+    }
+    ret = CamDevInitUrbs(cam, ep, best);
+    if (ret < 0)
+    {
+        usb_set_interface(cam->udev, cam->intf->cur_altsetting->desc.bInterfaceNumber, 0);
+        CamDevBusRelease(cam);
+        return ret;
+    }
+
+    ret = CamDevVideoSubmit(cam);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    printk(KERN_INFO "STREAM ON: alternate setting %u, packet size %u for payloads of %u, %lu bytes/s, "
+           "completions on CPU %d \n", altNum, best, payload, bestBandwidth, cam->streamCpu);
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ * @func    static int CamDevReadStart(struct file *file, CameraDev_T *cam)
+ *
+ * @brief   allocate the internal ring used by read(), queue every buffer of it and
+ *          start streaming. Called with queue->mutex held.
+ * @return  STATUS_OK     - the read ring is streaming
+ * @return  -EBUSY        - another file handle owns the buffers, other handles read
+ *                          the stream after VIDIOC_CAM_SUBSCRIBE
+ *
+ ************************************************************************************/
+static int CamDevReadStart(struct file *file, CameraDev_T *cam)
+{
+    CamManage *Cam = file->private_data;
+    UVC_cam_queue_T *queue = cam->queue;
+    unsigned int i;
+    int ret;
+
+    if (Cam->consumer != NULL)
+    {
+        return -EBUSY;
+    }
+    // only the owner reads from the ring, the read cursor is not per handle
+    if (queue->flag & QUEUE_READ_IO)
+    {
+        return queue->owner == file ? STATUS_OK : -EBUSY;
+    }
+    if ((queue->owner != NULL && queue->owner != file) || (queue->flag & QUEUE_STREAMING) ||
+        queue->ring.owner == file)
+    {
+        return -EBUSY;
+    }
+
+    ret = CamDevCacheBuffers(queue);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = CamDevAllocBuffers(queue, CAM_READ_BUFFERS, cam->format.fmt.pix.sizeimage);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    for (i = 0; i < queue->count; i++)
+    {
+        CamDevQueueBuffer(queue, &queue->buffer[i]);
+    }
+
+    ret = CamDevVideoStart(cam);
+    if (ret < 0)
+    {
+        CamDevQueueFlush(queue);
+        CamDevFreeBuffers(queue);
+        return ret;
+    }
+    queue->owner = file;
+    queue->latestFrame = Cam->latestFrame;
+    queue->decimation = Cam->decimation;
+    queue->errorFrames = Cam->errorFrames;
+    queue->flag |= QUEUE_STREAMING | QUEUE_READ_IO;
+    return STATUS_OK;
+}
+
+/************************************************************************************
+                                DEVICE FILE OPERATIONS
+ ************************************************************************************/
+
+//  declare struct v4l2_file_operations
+
+/************************************************************************************
+ * @func    int openCameraDevice(struct file *)
+ * 
+ * @brief   when application in user space use system call open(), this function will
+ *          interact with device file in kernel space
+ * @param   struct file*    - a pointer point to the device file is used by application
+ * @return  STATUS_OK       - open device file success
+ * @return  NULL_POINTER    - Allocate memory for device is failed
+ * 
+ ************************************************************************************/
+int openCameraDevice(struct file *);
+
+/************************************************************************************
+ * @func    int releaseCameraDevice(struct file *)
+
+ * 
+ * @brief   when application in user space use system call close(), the driver will 
+ *          handle this function
+ * @param   struct file*    - a pointer point to the device file is used by application
+ * 
+ ************************************************************************************/
+int releaseCameraDevice(struct file *);
+
+/************************************************************************************
+ * @func    ssize_t CameraDeviceRead(struct file *, char __user *, size_t, loff_t *)
+ *
+ * @brief   when application in user space use system call read(), copy the oldest
+ *          completed frame to user space. The first read() allocates an internal
+ *          ring of CAM_READ_BUFFERS frames and starts streaming.
+ *          A read never spans two frames: a call returns at most the bytes left in
+ *          the current frame, a shorter read leaves the rest of the frame for the
+ *          next call, and the frame goes back to the camera once fully consumed.
+ * @param   struct file*    - a pointer point to the device file is used by application
+ * @return  number of bytes copied to user space
+ * @return  -EAGAIN         - no frame is completed and the file is non-blocking
+ * @return  -EBUSY          - the buffers are used for memory mapped streaming
+ *
+ ************************************************************************************/
+ssize_t CameraDeviceRead(struct file *, char __user *, size_t, loff_t *);
+
+/************************************************************************************
+ * @func    unsigned int CameraDevicePoll(struct file *, struct poll_table_struct *)
+ *
+ * @brief   when application in user space use select() or poll(), report whether a
+ *          frame can be read or dequeued. Polling an idle device starts the read ring.
+ *
+ ************************************************************************************/
+unsigned int CameraDevicePoll(struct file *, struct poll_table_struct *);
+
+/************************************************************************************
+ * @func    ssize_t CameraDeviceWrite(struct file *, const char __user *, size_t, loff_t *)
+ *
+ * @brief   when application in user space use system call write() on a loopback node,
+ *          copy one frame into the oldest empty buffer and complete it for the capture
+ *          side. A write never spans two frames, bytes past the buffer size are dropped.
+ * @return  number of bytes taken from user space
+ * @return  -EAGAIN         - no empty buffer and the file is non-blocking
+ * @return  -EINVAL         - the node streams from a camera
+ * @return  -EBUSY          - another handle feeds the node
+ *
+ ************************************************************************************/
+ssize_t CameraDeviceWrite(struct file *, const char __user *, size_t, loff_t *);
+
+/************************************************************************************
+ * @func    ssize_t CameraDeviceSpliceRead(struct file *, loff_t *,
+ *                                         struct pipe_inode_info *, size_t, unsigned int)
+ *
+ * @brief   when application in user space use splice() or sendfile() from the device,
+ *          move the pages of the current frame into the pipe without copying them.
+ *          Shares the frame ring and the partial read rules of read(); the frame is
+ *          given back to the camera once every pipe buffer referencing it is consumed.
+ * @return  number of bytes moved into the pipe
+ * @return  -EAGAIN         - no frame is completed or the pipe is full
+ *
+ ************************************************************************************/
+ssize_t CameraDeviceSpliceRead(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+
+/*
+ * v4l2_file_operations has no splice_read, the file operations of the video
+ * node are copied once and extended with it when the device is opened.
+ */
+static struct file_operations CamSpliceFops;
+static DEFINE_MUTEX(CamSpliceFopsLock);
+
+int openCameraDevice(struct file *fileDesc)
+{
+    printk(KERN_INFO "Camera device is opened \n");
+    struct CamManage *CamHandle;
+    struct CameraDev_T *Stream;
+
+    // Allocate memory for CamManage
+    CamHandle = (CamManage *)kzalloc(sizeof(CamManage), GFP_KERNEL);
+    if (CamHandle == NULL)
+    {
+        printk(KERN_INFO "Cannot allocate memory for handle \n");
+        return -ENOMEM;
+    }
+    // get driver data from file structure fileDesc
+    Stream = video_drvdata(fileDesc);
+    Stream->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    CamHandle->camDev = Stream;
+    CamHandle->camState = 0;
+    CamHandle->latestFrame = latest_frame;
+    CamHandle->decimation = 1;
+    CamHandle->errorFrames = min_t(unsigned int, error_frames, CAM_ERROR_DROP);
+    fileDesc->private_data = CamHandle;
+
+    mutex_lock(&CamSpliceFopsLock);
+    if (CamSpliceFops.open == NULL)
+    {
+        CamSpliceFops = *fileDesc->f_op;
+        CamSpliceFops.splice_read = CameraDeviceSpliceRead;
+    }
+    mutex_unlock(&CamSpliceFopsLock);
+    fileDesc->f_op = &CamSpliceFops;
+
+    return 0;
+}
+int releaseCameraDevice(struct file *fileDesc)
+{
+    CamManage *Cam = fileDesc->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
+
+    mutex_lock(&queue->mutex);
+    if (queue->owner == fileDesc)
+    {
+        if (queue->flag & QUEUE_STREAMING)
+        {
+            CamDevVideoStop(Stream);
+            CamDevQueueFlush(queue);
+        }
+        queue->flag &= ~(QUEUE_STREAMING | QUEUE_READ_IO);
+        // a pool still in a pipe stays allocated, the next REQBUFS frees it once
+        // the pipe is drained and fails with -EBUSY until then
+        if (CamDevFreeBuffers(queue) < 0)
+        {
+            printk(KERN_INFO "RELEASE: frames still in a pipe, the pool is kept \n");
+        }
+        queue->owner = NULL;
+    }
+    // nobody streams anymore, give the bandwidth and the kept pool back
+    if (queue->owner == NULL)
+    {
+        CamDevVideoRelease(Stream);
+        if (queue->count == 0 && CamDevFreeBuffers(queue) < 0)
+        {
+            printk(KERN_INFO "RELEASE: frames still in a pipe, the pool is kept \n");
+        }
+    }
+    if (queue->writer == fileDesc)
+    {
+        CamDevOutputRelease(queue);
+        queue->writer = NULL;
+    }
+    if (queue->meta.owner == fileDesc)
+    {
+        CamDevMetaFree(queue);
+    }
+    if (queue->ring.owner == fileDesc)
+    {
+        CamDevRingFree(queue);
+    }
+    CamDevUnsubscribe(Cam, queue);
+    mutex_unlock(&queue->mutex);
+
+    kfree(Cam);
+    printk(KERN_INFO "Camera device is closed \n");
+    return 0;
+}
+
+ssize_t CameraDeviceRead(struct file *fp, char __user *buff, size_t len, loff_t *off)
+{
+    CamManage *vfh = fp->private_data;
+    CameraDev_T *Stream = vfh->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
+    CamDevBuff_T *frame;
+    size_t count;
+    int ret;
+
+    if (vfh->consumer != NULL)
+    {
+        return CamDevShareRead(fp, vfh->consumer, buff, len);
+    }
+      
+    mutex_lock(&queue->mutex);
+    ret = CamDevReadStart(fp, Stream);
+    mutex_unlock(&queue->mutex);
+    if (ret < 0)
+    {
+        return ret;
+    }
+       
+    if (mutex_lock_interruptible(&queue->readMutex))
+    {
+        return -ERESTARTSYS;
+    }
+    ret = CamDevReadCursor(queue, fp->f_flags & O_NONBLOCK, &frame);
+    if (ret < 0)
+    {
+        mutex_unlock(&queue->readMutex);
+        return ret;
+    }
+
+    count = min_t(size_t, len, frame->buf.bytesused - queue->readPos);
+    if (copy_to_user(buff, frame->mem + queue->readPos, count))
+    {
+        mutex_unlock(&queue->readMutex);
+        return -EFAULT;
+    }
+    // the whole frame is consumed, give it back to the camera
+    CamDevReadAdvance(queue, count);
+    mutex_unlock(&queue->readMutex);
+    return count;
+}
+
+ssize_t CameraDeviceWrite(struct file *fp, const char __user *buff, size_t len, loff_t *off)
+{
+    CamManage *vfh = fp->private_data;
+    CameraDev_T *Stream = vfh->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
+    CamDevBuff_T *frame;
+    size_t count;
+    int ret;
+
+    if (!CamDevIsLoopback(Stream))
+    {
+        return -EINVAL;
+    }
+    ret = CamDevOutputClaim(fp, queue);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = CamDevOutputTake(queue, fp->f_flags & O_NONBLOCK, &frame);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    count = min_t(size_t, len, frame->buf.length);
+    if (copy_from_user(frame->mem, buff, count))
+    {
+        mutex_lock(&queue->mutex);
+        if (frame->buffState == UVC_BUF_STATE_OUTPUT)
+        {
+            CamDevQueueBuffer(queue, frame);
+        }
+        mutex_unlock(&queue->mutex);
+        return -EFAULT;
+    }
+
+    mutex_lock(&queue->mutex);
+    // the capture side flushed its buffers meanwhile, the frame is lost
+    if (frame->buffState == UVC_BUF_STATE_OUTPUT)
+    {
+        frame->buf.bytesused = count;
+        CamDevBufferDone(queue, frame);
+    }
+    mutex_unlock(&queue->mutex);
+    return len;
+}
+
+/*
+ * Pipe buffer operations of the frame pages given to splice(). The pages stay
+ * owned by the buffer pool, the frame goes back to the camera when the last
+ * pipe buffer referencing it is consumed. A pipe outlives the file handle, so
+ * every pipe buffer also holds the queue and the module: an unplugged camera
+ * or a closed handle leaves the pool to the last pipe buffer.
+ */
+
+/************************************************************************************
+ * @func    static void CamDevQueueFree(struct kref *ref)
+ *
+ * @brief   free the queue of a camera once the camera and every pipe buffer let it go
+ *
+ ************************************************************************************/
+static void CamDevQueueFree(struct kref *ref)
+{
+    UVC_cam_queue_T *queue = container_of(ref, UVC_cam_queue_T, ref);
+
+    CamDevFreeBuffers(queue);
+    kfree(queue);
+}
+
+static void CamDevQueuePut(UVC_cam_queue_T *queue)
+{
+    kref_put(&queue->ref, CamDevQueueFree);
+}
+
+/* a new pipe buffer references the frame */
+static void CamDevPipeHold(CamDevBuff_T *frame)
+{
+    atomic_inc(&frame->pipeRefs);
+    kref_get(&frame->queue->ref);
+    __module_get(THIS_MODULE);
+}
+
+/* a pipe buffer let the frame go, the last one may free the queue */
+static void CamDevPipeDrop(CamDevBuff_T *frame)
+{
+    UVC_cam_queue_T *queue = frame->queue;
+
+    CamDevPutFrame(frame);
+    CamDevQueuePut(queue);
+    module_put(THIS_MODULE);
+}
+
+static void CamDevPipeRelease(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    put_page(pbuf->page);
+    CamDevPipeDrop((CamDevBuff_T *)pbuf->private);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+// the pages belong to the pool, the pipe never steals them. From 5.8 on a missing
+// try_steal refuses the same way.
+static int CamDevPipeSteal(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    return 1;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+static bool CamDevPipeGet(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    get_page(pbuf->page);
+    CamDevPipeHold((CamDevBuff_T *)pbuf->private);
+    return true;
+}
+#else
+static void CamDevPipeGet(struct pipe_inode_info *pipe, struct pipe_buffer *pbuf)
+{
+    get_page(pbuf->page);
+    CamDevPipeHold((CamDevBuff_T *)pbuf->private);
+}
+#endif
+
+static const struct pipe_buf_operations CamDevPipeOps = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0)
+    .can_merge  = 0,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+    .map        = generic_pipe_buf_map,
+    .unmap      = generic_pipe_buf_unmap,
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+    .confirm    = generic_pipe_buf_confirm,
+    .steal      = CamDevPipeSteal,
+#endif
+    .release    = CamDevPipeRelease,
+    .get        = CamDevPipeGet,
+};
+
+static void CamDevSpliceRelease(struct splice_pipe_desc *spd, unsigned int i)
+{
+    put_page(spd->pages[i]);
+    CamDevPipeDrop((CamDevBuff_T *)spd->partial[i].private);
+}
+
+ssize_t CameraDeviceSpliceRead(struct file *fp, loff_t *ppos, struct pipe_inode_info *pipe,
+                               size_t len, unsigned int flags)
+{
+    CamManage *vfh = fp->private_data;
+    CameraDev_T *Stream = vfh->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+        .flags = flags,
+#endif
+        .ops = &CamDevPipeOps,
+        .spd_release = CamDevSpliceRelease,
+    };
+    CamDevBuff_T *frame;
+    unsigned long address;
+    unsigned int left, chunk;
+    ssize_t ret;
+
+    mutex_lock(&queue->mutex);
+    ret = CamDevReadStart(fp, Stream);
+    mutex_unlock(&queue->mutex);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    if (splice_grow_spd(pipe, &spd))
+    {
+        return -ENOMEM;
+    }
+    if (mutex_lock_interruptible(&queue->readMutex))
+    {
+        splice_shrink_spd(&spd);
+        return -ERESTARTSYS;
+    }
+    ret = CamDevReadCursor(queue, (fp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK), &frame);
+    if (ret < 0)
+    {
+        goto done;
+    }
+
+    // hand out the pages of the frame, one pipe buffer per page
+    address = (unsigned long)frame->mem + queue->readPos;
+    left = min_t(size_t, len, frame->buf.bytesused - queue->readPos);
+    spd.nr_pages = 0;
+    while (left > 0 && spd.nr_pages < spd.nr_pages_max)
+    {
+        chunk = min_t(unsigned int, left, PAGE_SIZE - (address & ~PAGE_MASK));
+        spd.pages[spd.nr_pages] = vmalloc_to_page((void *)address);
+        get_page(spd.pages[spd.nr_pages]);
+        CamDevPipeHold(frame);
+        spd.partial[spd.nr_pages].offset = address & ~PAGE_MASK;
+        spd.partial[spd.nr_pages].len = chunk;
+        spd.partial[spd.nr_pages].private = (unsigned long)frame;
+        spd.nr_pages++;
+        address += chunk;
+        left -= chunk;
+    }
+
+    ret = splice_to_pipe(pipe, &spd);
+    if (ret > 0)
+    {
+        CamDevReadAdvance(queue, ret);
+    }
+done:
+    mutex_unlock(&queue->readMutex);
+    splice_shrink_spd(&spd);
+    return ret;
+}
+
+unsigned int CameraDevicePoll(struct file *fp, struct poll_table_struct *wait)
+{
+    CamManage *vfh = fp->private_data;
+    CameraDev_T *Stream = vfh->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
+    unsigned int mask = 0;
+
+    if (vfh->consumer != NULL)
+    {
+        poll_wait(fp, &queue->wait, wait);
+        return CamDevShareHasFrame(queue, vfh->consumer) ? POLLIN | POLLRDNORM : 0;
+    }
+    // the writer of a loopback node only waits for empty buffers
+    if (queue->writer == fp)
+    {
+        poll_wait(fp, &queue->wait, wait);
+        return CamDevQueueHasEmpty(queue) ? POLLOUT | POLLWRNORM : 0;
+    }
+    // a handle which only reads the metadata does not start read() streaming
+    if (queue->meta.owner == fp && queue->owner != fp)
+    {
+        poll_wait(fp, &queue->wait, wait);
+        return CamDevMetaHasDone(queue) ? POLLIN | POLLRDNORM : 0;
+    }
+
+    mutex_lock(&queue->mutex);
+    if (queue->owner == NULL && !(queue->flag & QUEUE_STREAMING) &&
+        (poll_requested_events(wait) & (POLLIN | POLLRDNORM)))
+    {
+        CamDevReadStart(fp, Stream);
+    }
+    mutex_unlock(&queue->mutex);
+
+    poll_wait(fp, &queue->wait, wait);
+    if (CamDevIsLoopback(Stream) && CamDevQueueHasEmpty(queue))
+    {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    if (!(queue->flag & QUEUE_STREAMING))
+    {
+        return mask ? mask : POLLERR;
+    }
+    if (queue->readBuff != NULL || CamDevQueueHasDone(queue) || CamDevRingHasDone(queue, fp) ||
+        (queue->meta.owner == fp && CamDevMetaHasDone(queue)))
+    {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    return mask;
+}
+
+/***********************************************************************************
+ *                              IOCTL FUNCTIONS
+ ***********************************************************************************/
+
+/************************************************************************************
+ * @func    int CameraDeviceQueryCaps(struct file *file, void *fh, 
+ *                               struct v4l2_capability *v4l2_cap);
+ * 
+ * @brief   when application in user space use ioctl call VIDIOC_QUERYCAP, driver will
+ *          fill all field of struct v4l2_capability to show informations of device  
+ * @param   struct file*  - a pointer point to the device file is used by application
+ * @param   fh
+ * @param   v4l2_cap      - a pointer to struct v4l2_capability, driver will get this 
+ *                        pointer from user space
+ * @return  STATUS_OK     - the driver filled rest of field of struct v4l2_capability
+ * 
+ ************************************************************************************/
+int CameraDeviceQueryCaps(struct file *file, void *fh, struct v4l2_capability *v4l2_cap);
+
+/************************************************************************************
+ * @func    int CameraDeviceEnumInput(struct file *file, void *fh
+ *                                      ,struct v4l2_input *inp);
+
+ * 
+ * @brief   handle the ioctl VIDIOC_ENUM_INPUT with the value of index field of struct
+ *          v4l2_input
+ * @param   struct file*  - a pointer point to the device file is used by application
+ * @param   fh
+ * @param   inp           - a pointer to struct v4l2,driver will get this pointer from  
+ *                          application in user space
+ * @return  STATUS_OK     - the driver filled rest of field of struct v4l2_input
+ * @return  EINVAL        - the index field of struct v4l2_input is invalid
+ * 
+ ************************************************************************************/
+int CameraDeviceEnumInput(struct file *file, void *fh, struct v4l2_input *inp);
+
+/************************************************************************************
+ * @func    int CameraDeviceSetInput(struct file *file, void *fh, unsigned int i);
+ * 
+ * @brief   handle the ioctl VIDIOC_S_INPUT with the value of index
+ * @param   struct file*  - a pointer point to the device file is used by application
+ * @param   fh
+ * @param   i             - index of camera device input
+ * @return  STATUS_OK     
+ * @return  EINVAL        - the index field of struct v4l2_input is invalid
+ * 
+ ************************************************************************************/
+int CameraDeviceSetInput(struct file *file, void *fh, unsigned int i);
+
+/************************************************************************************
+ * @func    int CameraDeviceEnumFormat(struct file *file, void *fh, 
+ *                                      struct v4l2_fmtdesc *format);
+ * 
+ * @brief   handle the ioctl VIDIOC_ENUM_FMT, the formats the camera advertised
+
+ * @param   struct file*  - a pointer point to the device file is used by application
+ * @param   fh
+ * @param   format        - a pointer to struct v4l2_fmtdesc
+ * @return  STATUS_OK     - format have appropriate index and format type
+ * @return  -EINVAL       - the index is past the last format
+ ************************************************************************************/
+int CameraDeviceEnumFormat(struct file *file, void *fh, struct v4l2_fmtdesc *format);
+
+/************************************************************************************
+ * @func    int CameraDeviceEnumFrameSizes(struct file *file, void *fh,
+ *                                         struct v4l2_frmsizeenum *fsize);
+ *
+ * @brief   handle the ioctl VIDIOC_ENUM_FRAMESIZES, the discrete frame sizes the
+ *          camera advertised for a format
+ * @return  STATUS_OK
+ * @return  -EINVAL       - unknown format or the index is past the last size
+ ************************************************************************************/
+int CameraDeviceEnumFrameSizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize);
+
+/************************************************************************************
+ * @func    int CameraDeviceSetFormat(struct file *file, void *fh,
+ *                                    struct v4l2_format *format);
+ *
+ * @brief   handle the ioctl VIDIOC_S_FMT, select the advertised format and frame size
+ *          closest to the request
+ * @param   struct file*  - a pointer point to the device file is used by application
+ * @param   fh
+ * @param   format        - requested format, updated with the selected one
+ * @return  STATUS_OK
+ * @return  -EBUSY        - buffers are allocated
+ *
+ ************************************************************************************/
+int CameraDeviceSetFormat(struct file *file, void *fh, struct v4l2_format *format);
+/************************************************************************************
+ * @func    int CameraDeviceGetFormat(struct file *file, void *fh, 
+ *                                    struct v4l2_format *format);
  * 
  * @brief   handle the ioctl VIDIOC_G_FMT in application from user space
  * @param   struct file*  - a pointer point to the device file is used by application
@@ -291,7 +4543,30 @@ int CameraDeviceSetFormat(struct file *file, void *fh, struct v4l2_format *forma
  * @return  STATUS_OK     
  * 
  ************************************************************************************/
-int CameraDeviceGetFormat(struct file *file, void *fh, struct v4l2_format *format);
+int CameraDeviceGetFormat(struct file *file, void *fh, struct v4l2_format *format);
+
+/************************************************************************************
+ * @func    int CameraDeviceGetSelection(struct file *file, void *fh,
+ *                                       struct v4l2_selection *sel);
+ *
+ * @brief   handle the ioctl VIDIOC_G_SELECTION, the crop rectangle and its bounds,
+ *          the frame size of the camera
+ * @return  STATUS_OK
+ *
+ ************************************************************************************/
+int CameraDeviceGetSelection(struct file *file, void *fh, struct v4l2_selection *sel);
+
+/************************************************************************************
+ * @func    int CameraDeviceSetSelection(struct file *file, void *fh,
+ *                                       struct v4l2_selection *sel);
+ *
+ * @brief   handle the ioctl VIDIOC_S_SELECTION, crop the frames of the camera to a
+ *          region of interest. The format and the buffer size follow the rectangle.
+ * @return  STATUS_OK     - sel->r holds the rectangle adjusted by the driver
+ * @return  -EBUSY        - buffers are allocated
+ *
+ ************************************************************************************/
+int CameraDeviceSetSelection(struct file *file, void *fh, struct v4l2_selection *sel);
 
 
 int CameraDeviceGetInput(struct file *file, void *fh, unsigned int *i);
@@ -306,7 +4581,8 @@ int CameraDeviceGetInput(struct file *file, void *fh, unsigned int *i);
  * @param   buffer        - a pointer to struct v4l2_requestbuffers, driver will allocate
  *                          buffer following information of fields in this pointer
  * @return  STATUS_OK     - allocate buffer in kernel space success
- * @return  -1            - allocate buffer failed
+ * @return  -EBUSY        - buffers are streaming, mapped or owned by another handle
+ * @return  -ENOMEM       - allocate buffer failed
  * 
  ************************************************************************************/
 int CameraDeviceRequestBuff(struct file *file, void *fh, struct v4l2_requestbuffers *buffer);
@@ -331,13 +4607,15 @@ int CameraDeviceQueryBuff(struct file *file, void *fh, struct v4l2_buffer *buffe
  * @func    int CameraDeviceQueueBuff(struct file *file, void *fh,
  *                                    struct v4l2_buffer *buffer);
  * 
- * @brief   handle the ioctl  VIDIOC_QBUF, add seperate buffer to main queue
+ * @brief   handle the ioctl  VIDIOC_QBUF, hand the buffer to the camera so that it
+ *          is filled with the next frame
  * 
  * @param   struct file*  - a pointer point to the device file is used by application
  * @param   fh
  * @param   buffer        - a pointer to struct v4l2_buffer
  *                          
  * @return  STATUS_OK     
+ * @return  -EINVAL       - invalid index or the buffer is already queued
  * 
  ************************************************************************************/
 int CameraDeviceQueueBuff(struct file *file, void *fh, struct v4l2_buffer *buffer);
@@ -347,13 +4625,15 @@ int CameraDeviceQueueBuff(struct file *file, void *fh, struct v4l2_buffer *buffe
  *                                       struct v4l2_buffer *buffer);
 
  * 
- * @brief   handle the ioctl  VIDIOC_DQBUF, get buffer from main queue to transfer to 
- *          user space
+ * @brief   handle the ioctl  VIDIOC_DQBUF, get the oldest completed buffer from main
+ *          queue to transfer to user space, block until a frame is completed unless
+ *          the file is non-blocking
  * @param   struct file*  - a pointer point to the device file is used by application
  * @param   fh
  * @param   buffer        - a pointer to struct v4l2_buffer
  *                          
  * @return  STATUS_OK     
+ * @return  -EAGAIN       - no frame is completed and the file is non-blocking
  ************************************************************************************/
 int CameraDeviceDequeueBuff(struct file *file, void *fh, struct v4l2_buffer *buffer);
 
@@ -367,7 +4647,7 @@ int CameraDeviceDequeueBuff(struct file *file, void *fh, struct v4l2_buffer *buf
  * @param   type          - type of buffer memory
  *                          
  * @return  STATUS_OK     - type of buffer valid
- * @return  -1            - type of buffer is invalid 
+ * @return  -EINVAL       - type of buffer is invalid
  ************************************************************************************/
 int CameraDeviceStreamOn(struct file *file, void *fh, enum v4l2_buf_type type);
 
@@ -381,23 +4661,78 @@ int CameraDeviceStreamOn(struct file *file, void *fh, enum v4l2_buf_type type);
  * @param   type          - type of buffer memory
  *                          
  * @return  STATUS_OK     - type of buffer valid
- * @return  -1            - type of buffer is invalid 
+ * @return  -EINVAL       - type of buffer is invalid
  ************************************************************************************/
 int CameraDeviceStreamOff(struct file *file, void *fh, enum v4l2_buf_type type);
 
+/************************************************************************************
+ * @func    int CameraDeviceQueryCtrl(struct file *file, void *fh,
+ *                                    struct v4l2_queryctrl *qc);
+ *
+ * @brief   handle the ioctl  VIDIOC_QUERYCTRL for the private controls of the driver
+ * @return  STATUS_OK
+ * @return  -EINVAL       - unknown control
+ ************************************************************************************/
+int CameraDeviceQueryCtrl(struct file *file, void *fh, struct v4l2_queryctrl *qc);
+
+/************************************************************************************
+ * @func    int CameraDeviceGetCtrl(struct file *file, void *fh,
+ *                                  struct v4l2_control *ctrl);
+ *
+ * @brief   handle the ioctl  VIDIOC_G_CTRL, controls are stored per file handle
+ * @return  STATUS_OK
+ * @return  -EINVAL       - unknown control
+ ************************************************************************************/
+int CameraDeviceGetCtrl(struct file *file, void *fh, struct v4l2_control *ctrl);
+
+/************************************************************************************
+ * @func    int CameraDeviceSetCtrl(struct file *file, void *fh,
+ *                                  struct v4l2_control *ctrl);
+ *
+ * @brief   handle the ioctl  VIDIOC_S_CTRL, the value applies to the queue at once
+ *          when the handle owns the buffers
+ * @return  STATUS_OK
+ * @return  -EINVAL       - unknown control
+ ************************************************************************************/
+int CameraDeviceSetCtrl(struct file *file, void *fh, struct v4l2_control *ctrl);
+
+/************************************************************************************
+ * @func    long CameraDeviceDefault(struct file *file, void *fh, bool valid_prio,
+ *                                   unsigned int cmd, void *arg);
+ *
+ * @brief   handle the private ioctls declared in cam_ioctl.h
+ * @return  STATUS_OK
+ * @return  -ENOTTY       - unknown ioctl
+ ************************************************************************************/
+long CameraDeviceDefault(struct file *file, void *fh, bool valid_prio, unsigned int cmd, void *arg);
+
 
 /*******************************************************************************
  * IOCTL FUNCTIONS
  ******************************************************************************/
 int CameraDeviceQueryCaps(struct file *file, void *fh, struct v4l2_capability *v4l2_cap)
 {
+    CamManage *Cam = file->private_data;
+
     printk(KERN_INFO "Query capabilities \n");
 
     strcpy(v4l2_cap->driver, "CameraDriver");
-    strcpy(v4l2_cap->card, "CameraDev");
+    strcpy(v4l2_cap->card, CamDevIsLoopback(Cam->camDev) ? "CamLoopback" : "CameraDev");
 
     v4l2_cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING |
-                             V4L2_CAP_READWRITE | V4L2_CAP_VIDEO_OUTPUT;
+                             V4L2_CAP_READWRITE;
+    // only a loopback node has an output queue
+    if (CamDevIsLoopback(Cam->camDev))
+    {
+        v4l2_cap->capabilities |= V4L2_CAP_VIDEO_OUTPUT;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+    // the payload headers of a camera come out on the metadata queue
+    else
+    {
+        v4l2_cap->capabilities |= V4L2_CAP_META_CAPTURE;
+    }
+#endif
 
     v4l2_cap->version = KERNEL_VERSION(3, 14, 29);
 
@@ -461,133 +4796,264 @@ int CameraDeviceGetInput(struct file *file, void *fh, unsigned int *index)
 }
 int CameraDeviceEnumFormat(struct file *file, void *fh, struct v4l2_fmtdesc *format)
 {
-    if (format->index == 1 && format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    const CamFormatDesc_T *desc;
+
+    // the output queue of a loopback node takes the formats of the capture side
+    if (format->type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
+        !(format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT && CamDevIsLoopback(Stream)))
+    {
+        return -EINVAL;
+    }
+    if (format->index >= Stream->nformats)
+    {
+        return -EINVAL;
+    }
+    desc = &Stream->formats[format->index];
+    format->pixelformat = desc->pixelformat;
+    if (desc->pixelformat == V4L2_PIX_FMT_MJPEG)
     {
         format->flags = V4L2_FMT_FLAG_COMPRESSED;
+        strscpy(format->description, "Motion-JPEG", sizeof(format->description));
+    }
+    else
+    {
+        format->flags = 0;
+        strscpy(format->description, desc->pixelformat == V4L2_PIX_FMT_YUYV ? "YUYV 4:2:2" : "Uncompressed",
+                sizeof(format->description));
     }
     return STATUS_OK;
 }
 
+int CameraDeviceEnumFrameSizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize)
+{
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    const CamFormatDesc_T *desc = NULL;
+    unsigned int i;
+
+    for (i = 0; i < Stream->nformats; i++)
+    {
+        if (Stream->formats[i].pixelformat == fsize->pixel_format)
+        {
+            desc = &Stream->formats[i];
+            break;
+        }
+    }
+    if (desc == NULL || fsize->index >= desc->nframes)
+    {
+        return -EINVAL;
+    }
+    fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    fsize->discrete.width = desc->frame[fsize->index].width;
+    fsize->discrete.height = desc->frame[fsize->index].height;
+    return STATUS_OK;
+}
+
 int CameraDeviceSetFormat(struct file *file, void *fh, struct v4l2_format *v4l2_fmt)
 {
-    fmt = (struct v4l2_format *)kmalloc(sizeof(struct v4l2_format), GFP_KERNEL);
-    if (fmt == NULL)
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    CamFormatDesc_T *oldFormat;
+    CamFrameDesc_T *oldFrame;
+    int ret;
+
+    // the output queue of a loopback node shares the format of the capture side
+    if (v4l2_fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
+        !(v4l2_fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT && CamDevIsLoopback(Stream)))
     {
-        printk(KERN_INFO "CameraDeviceSetFormat: Can not set format for fmt \n");
-        return -1;
+        return -EINVAL;
     }
-    fmt->type = v4l2_fmt->type;
-    fmt->fmt.pix.height = v4l2_fmt->fmt.pix.height;
-    fmt->fmt.pix.width = v4l2_fmt->fmt.pix.width;
-    fmt->fmt.pix.field = v4l2_fmt->fmt.pix.field;
-    fmt->fmt.pix.pixelformat = v4l2_fmt->fmt.pix.pixelformat;
-    fmt->fmt.pix.colorspace = v4l2_fmt->fmt.pix.colorspace;
-    printk(KERN_INFO "Set format successfully: %d \n", v4l2_fmt->type);
-    return 0;
+
+    mutex_lock(&Stream->queue->mutex);
+    if (Stream->queue->count != 0)
+    {
+        printk(KERN_INFO "CameraDeviceSetFormat: buffers are allocated \n");
+        mutex_unlock(&Stream->queue->mutex);
+        return -EBUSY;
+    }
+    oldFormat = Stream->curFormat;
+    oldFrame = Stream->curFrame;
+    ret = CamDevSelectFormat(Stream, &v4l2_fmt->fmt.pix);
+    if (ret == STATUS_OK)
+    {
+        Stream->format = *v4l2_fmt;
+        Stream->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        // the kept stream and pool were set up for the previous format
+        if (Stream->curFormat != oldFormat || Stream->curFrame != oldFrame)
+        {
+            CamDevVideoRelease(Stream);
+            CamDevFreeBuffers(Stream->queue);
+        }
+    }
+    mutex_unlock(&Stream->queue->mutex);
+
+    printk(KERN_INFO "Set format: %ux%u, %u bytes \n", v4l2_fmt->fmt.pix.width,
+           v4l2_fmt->fmt.pix.height, v4l2_fmt->fmt.pix.sizeimage);
+    return ret;
 }
 int CameraDeviceGetFormat(struct file *file, void *fh, struct v4l2_format *format)
 {
-    fmt->type = 1; // V4L2_BUF_TYPE_VIDEO_OUTPUT
-    fmt->fmt.pix.width = 640;
-    fmt->fmt.pix.height = 480;
-    fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_BGR24;
-    fmt->fmt.pix.field = V4L2_FIELD_ANY;
-    fmt->fmt.pix.sizeimage = (fmt->fmt.pix.width * fmt->fmt.pix.height);
-    fmt->fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    enum v4l2_buf_type type = format->type;
 
-    *(format) = *(fmt);
+    *(format) = Stream->format;
+    format->type = type;
     return STATUS_OK;
 }
-int CameraDeviceRequestBuff(struct file *file, void *fh, struct v4l2_requestbuffers *buffer)
+int CameraDeviceGetSelection(struct file *file, void *fh, struct v4l2_selection *sel)
+{
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream = Cam->camDev;
+    int ret = STATUS_OK;
+
+    if (sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        return -EINVAL;
+    }
+    mutex_lock(&Stream->queue->mutex);
+    if (Stream->curFrame == NULL)
+    {
+        ret = -EINVAL;
+    }
+    else if (sel->target == V4L2_SEL_TGT_CROP)
+    {
+        sel->r = Stream->crop;
+    }
+    else if (sel->target == V4L2_SEL_TGT_CROP_DEFAULT || sel->target == V4L2_SEL_TGT_CROP_BOUNDS)
+    {
+        sel->r.left = 0;
+        sel->r.top = 0;
+        sel->r.width = Stream->curFrame->width;
+        sel->r.height = Stream->curFrame->height;
+    }
+    else
+    {
+        ret = -EINVAL;
+    }
+    mutex_unlock(&Stream->queue->mutex);
+    return ret;
+}
+
+int CameraDeviceSetSelection(struct file *file, void *fh, struct v4l2_selection *sel)
 {
-    int size;
-    int count;
-    void *mem1;
-    int vid_limit = 16;
-    int i;
     CamManage *Cam = file->private_data;
-    CameraDev_T *stream;
-    stream = (CameraDev_T *)kmalloc(sizeof(CameraDev_T), GFP_KERNEL);
-    if (stream == NULL)
+    CameraDev_T *Stream = Cam->camDev;
+    struct v4l2_pix_format *pix = &Stream->format.fmt.pix;
+    struct v4l2_rect rect = sel->r;
+    unsigned int width, height;
+
+    // a loopback node is filled by user space as it is
+    if (sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || sel->target != V4L2_SEL_TGT_CROP ||
+        CamDevIsLoopback(Stream))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&Stream->queue->mutex);
+    if (Stream->queue->count != 0 || Stream->curFrame == NULL)
+    {
+        printk(KERN_INFO "CameraDeviceSetSelection: buffers are allocated \n");
+        mutex_unlock(&Stream->queue->mutex);
+        return -EBUSY;
+    }
+    width = Stream->curFrame->width;
+    height = Stream->curFrame->height;
+    if (Stream->curFormat->pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        // a compressed frame can not be cut, only the full frame is valid
+        rect.left = 0;
+        rect.top = 0;
+        rect.width = width;
+        rect.height = height;
+    }
+    else
     {
-        printk(KERN_INFO "REQUEST BUFF: Cannot allocate memory for stream \n ");
-        return -1;
+        // YUYV pairs two pixels, the rectangle starts and ends on a pair
+        rect.left = clamp_t(__s32, rect.left, 0, width - 2) & ~1;
+        rect.top = clamp_t(__s32, rect.top, 0, height - 1);
+        rect.width = clamp_t(__u32, rect.width, 2, width - rect.left) & ~1;
+        rect.height = clamp_t(__u32, rect.height, 1, height - rect.top);
+        pix->width = rect.width;
+        pix->height = rect.height;
+        pix->bytesperline = rect.width * 2;
+        pix->sizeimage = pix->bytesperline * rect.height;
     }
-    stream = Cam->camDev;
+    Stream->crop = rect;
+    Stream->cropped = rect.width != width || rect.height != height;
+    sel->r = rect;
+    mutex_unlock(&Stream->queue->mutex);
 
-    mutex_init(&stream->mutex);
-    mutex_init(&stream->queue->mutex);
-    INIT_LIST_HEAD(&mainqueue);
+    printk(KERN_INFO "Set crop: %ux%u at (%d, %d), %u bytes \n", rect.width, rect.height,
+           rect.left, rect.top, pix->sizeimage);
+    return STATUS_OK;
+}
 
-    stream->queue->buff_type = buffer->type;
+int CameraDeviceRequestBuff(struct file *file, void *fh, struct v4l2_requestbuffers *buffer)
+{
+    CamManage *Cam = file->private_data;
+    CameraDev_T *stream = Cam->camDev;
+    UVC_cam_queue_T *queue = stream->queue;
+    int ret;
 
     printk(KERN_INFO "Buffer infor: size of buffer: %d \n", buffer->count);
     printk(KERN_INFO "Buffer infor: memory: %d \n", buffer->memory);
     printk(KERN_INFO "Buffer infor: type of buffer: %d \n", buffer->type);
     printk(KERN_INFO "Requesting buffer \n");
 
+    if (buffer->type == V4L2_BUF_TYPE_VIDEO_OUTPUT && CamDevIsLoopback(stream) &&
+        buffer->memory == V4L2_MEMORY_MMAP)
+    {
+        return CamDevOutputRequest(file, queue, buffer);
+    }
+    if (buffer->type == V4L2_BUF_TYPE_META_CAPTURE)
+    {
+        return CamDevMetaRequest(file, stream, buffer);
+    }
     if (buffer->type != stream->type || buffer->memory != V4L2_MEMORY_MMAP)
     {
         printk(KERN_INFO "REQUEST BUFF: Different kind of buffer or memory method \n");
         return -EINVAL;
     }
-    mutex_lock(&stream->mutex);
-    printk(KERN_INFO "REQUEST BUFF: lock on mutex stream... \n");
-
-    mutex_lock(&stream->queue->mutex);
-    printk(KERN_INFO "REQUEST BUFF: lock on mutex queue... \n");
+    mutex_lock(&queue->mutex);
 
-    size = 640 * 480*3;
-    count = buffer->count;
-    while (size * count > vid_limit * 1024 * 1024)
+    if ((queue->owner != NULL && queue->owner != file) || (queue->flag & QUEUE_STREAMING) ||
+        Cam->consumer != NULL)
     {
-        (count)--;
+        printk(KERN_INFO "REQUEST BUFF: Buffers are busy \n");
+        mutex_unlock(&queue->mutex);
+        return -EBUSY;
+    }
+    // the memory stays around for a REQBUFS of the same size
+    ret = CamDevCacheBuffers(queue);
+    if (ret < 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return ret;
+    }
+    queue->owner = NULL;
+    if (buffer->count == 0)
+    {
+        mutex_unlock(&queue->mutex);
+        return STATUS_OK;
     }
-    size = PAGE_ALIGN(size);
-
 
-    mem1 = (void*)vmalloc_32(count*size);
-    if (mem1 == NULL)
+    queue->buff_type = buffer->type;
+    ret = CamDevAllocBuffers(queue, buffer->count, stream->format.fmt.pix.sizeimage);
+    if (ret < 0)
     {
-        printk(KERN_INFO "REQUEST BUFF: Allocate memory failed \n");
-        mutex_unlock(&stream->queue->mutex);
-        mutex_unlock(&stream->mutex);
-        return -1;
-    }
-
-    stream->queue->mem = mem1;
-    // mem_size = (unsigned int)mem1;
-    // printk(KERN_INFO "stream->queue->mem=%d \n", (int)mem1);
-    // printk(KERN_INFO "stream->queue->mem=%p \n",(int)mem1);
-    for (i = 0; i < buffer->count; i++)
-    {
-        memset(&stream->queue->buffer[i], 0, sizeof(stream->queue->buffer[i]));
-        stream->queue->buffer[i].buf.index = i;
-        stream->queue->buffer[i].buf.m.offset = i * size;
-        printk(KERN_INFO "REQUEST BUFF: buffer offset %d \t i=%d \n",stream->queue->buffer[i].buf.m.offset,i);
-        stream->queue->buffer[i].buf.length = size;
-        stream->queue->buffer[i].buf.type = stream->queue->buff_type;
-        stream->queue->buffer[i].buf.field = V4L2_FIELD_NONE;
-        stream->queue->buffer[i].buf.memory = V4L2_MEMORY_MMAP;
-        stream->queue->buffer[i].buf.flags = 0; // V4L2_BUF_FLAG_QUEUED
-        stream->queue->buffer[i].buffState = UVC_BUF_STATE_IDLE;
-        //BufferOffset[i] = stream->queue->buffer[i].buf.m.offset;
-         //init_waitqueue_head(&stream->queue->buffer[i].wait);
-         INIT_LIST_HEAD(&stream->queue->buffer[i].stream);
+        mutex_unlock(&queue->mutex);
+        return ret;
     }
+    buffer->count = ret;
+    queue->owner = file;
+    queue->latestFrame = Cam->latestFrame;
+    queue->decimation = Cam->decimation;
+    queue->errorFrames = Cam->errorFrames;
     
-    stream->queue->count = count;
-    stream->queue->buff_size = size;
-    buffer->count = count;
-
-    buf_count = count;
-    buf_size = size;
-
-    mutex_unlock(&stream->queue->mutex);
-    printk(KERN_INFO "REQUEST BUFF: Unlock on mutex queue... \n");
-    mutex_unlock(&stream->mutex);
-    printk(KERN_INFO "REQUEST BUFF: Unlock on mutex stream... \n");
-
+    mutex_unlock(&queue->mutex);
     return 0;
 }
 // Query the status of buffer after allocted with the REQUESTBUFF ioctl function
@@ -600,23 +5066,31 @@ int CameraDeviceQueryBuff(struct file *file, void *fh, struct v4l2_buffer *buffe
     Stream = Cam->camDev;
     CamDevBuff_T *buff;
 
-    mutex_init(&Stream->queue->mutex);
-    buff = (CamDevBuff_T *)kmalloc(sizeof(CamDevBuff_T), GFP_KERNEL);
-    if (buff == NULL)
+    if (buffer_query->type == V4L2_BUF_TYPE_META_CAPTURE)
     {
-        printk(KERN_INFO "Cannot allocated memory \n");
-        return -1;
+        return CamDevMetaQuery(file, Stream->queue, buffer_query);
     }
-    buff = &Stream->queue->buffer[buffer_query->index];
-    if (buffer_query->index > Stream->queue->count)
+    if (buffer_query->index >= Stream->queue->count)
     {
         printk(KERN_INFO "Invalid index \n");
-        return -1;
+        return -EINVAL;
     }
+    buff = &Stream->queue->buffer[buffer_query->index];
     printk(KERN_INFO "Querying buffer...... \n");
     mutex_lock(&Stream->queue->mutex);
 
     memcpy(buffer_query, &buff->buf, sizeof(struct v4l2_buffer));
+    if (Stream->queue->writer == file)
+    {
+        // seen from the output side, only the buffers it holds are dequeued
+        buffer_query->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        if (buff->buffState != UVC_BUF_STATE_OUTPUT)
+        {
+            buffer_query->flags |= V4L2_BUF_FLAG_QUEUED;
+        }
+        mutex_unlock(&Stream->queue->mutex);
+        return 0;
+    }
 
     switch (buff->buffState)
     {
@@ -627,10 +5101,13 @@ int CameraDeviceQueryBuff(struct file *file, void *fh, struct v4l2_buffer *buffe
     }
     case UVC_BUF_STATE_READY:
     case UVC_BUF_STATE_QUEUED:
+    case UVC_BUF_STATE_ACTIVE:
     {
         buffer_query->flags |= V4L2_BUF_FLAG_QUEUED;
         break;
     }
+    default:
+        break;
     }
 
     mutex_unlock(&Stream->queue->mutex);
@@ -643,43 +5120,41 @@ int CameraDeviceQueueBuff(struct file *file, void *fh, struct v4l2_buffer *buff)
     CamManage *Cam = file->private_data;
     CameraDev_T *Stream;
     Stream = Cam->camDev;
-
+    UVC_cam_queue_T *queue = Stream->queue;
     CamDevBuff_T *buf;
-    int ret = 0;
-    buf = (CamDevBuff_T *)kmalloc(sizeof(CamDevBuff_T), GFP_KERNEL);
-    if (buf == NULL)
+
+    if (buff->type == V4L2_BUF_TYPE_VIDEO_OUTPUT && queue->writer == file)
     {
-        printk(KERN_INFO "Cannot allocated buf memory \n");
-        ret = -1;
-        return ret;
+        return CamDevOutputQueue(queue, buff);
+    }
+    if (buff->type == V4L2_BUF_TYPE_META_CAPTURE)
+    {
+        return CamDevMetaQueue(file, queue, buff);
+    }
+    if (buff->type != queue->buff_type || buff->memory != V4L2_MEMORY_MMAP)
+    {
+        return -EINVAL;
     }
-    mutex_init(&Stream->queue->mutex);
     
-    Stream->queue->buff_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    mutex_lock(&queue->mutex);
+    if (queue->owner != file || (queue->flag & QUEUE_READ_IO) || buff->index >= queue->count)
+    {
+        printk(KERN_INFO "QUEUE: invalid buffer %d \n", buff->index);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
 
-    mutex_lock(&Stream->queue->mutex);
-    printk(KERN_INFO "Lock on queue... \n");
+    buf = &queue->buffer[buff->index];
+    if (buf->buffState != UVC_BUF_STATE_IDLE)
+    {
+        printk(KERN_INFO "QUEUE: buffer %d is already queued \n", buff->index);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
 
-    buf = &Stream->queue->buffer[buff->index];
-    
-    INIT_LIST_HEAD(&buf->stream);
-   // INIT_LIST_HEAD(&buf->queue);
-    INIT_LIST_HEAD(&mainqueue);
-    INIT_LIST_HEAD(&temp1);
-    // INIT_LIST_HEAD(&buf->)
+    CamDevQueueBuffer(queue, buf);
     
-
-    printk(KERN_INFO "Init list buf->stream \n");
-
-    buf->buffState = UVC_BUF_STATE_DONE;
-
-    list_add_tail(&buf->stream, &mainqueue);
-    temp1=mainqueue;
-    printk(KERN_INFO "Adding in main queue \n");
-
-    mutex_unlock(&Stream->queue->mutex);
-    printk(KERN_INFO "Unlock on queue \n");
-
+    mutex_unlock(&queue->mutex);
     return STATUS_OK;
 }
 
@@ -688,152 +5163,301 @@ int CameraDeviceDequeueBuff(struct file *file, void *fh, struct v4l2_buffer *buf
     CamManage *Cam = file->private_data;
     CameraDev_T *Stream;
     Stream = Cam->camDev;
+    UVC_cam_queue_T *queue = Stream->queue;
     int ret = 0;
     CamDevBuff_T *buff;
-    buff = (CamDevBuff_T *)kmalloc(sizeof(CamDevBuff_T), GFP_KERNEL);
-    if (buff == NULL)
+
+    if (buffer->type == V4L2_BUF_TYPE_VIDEO_OUTPUT && queue->writer == file)
+    {
+        ret = CamDevOutputTake(queue, file->f_flags & O_NONBLOCK, &buff);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        *buffer = buff->buf;
+        buffer->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        return STATUS_OK;
+    }
+    if (buffer->type == V4L2_BUF_TYPE_META_CAPTURE)
+    {
+        return CamDevMetaDequeue(file, queue, buffer);
+    }
+    if (buffer->type != queue->buff_type || queue->owner != file || (queue->flag & QUEUE_READ_IO))
+    {
+        return -EINVAL;
+    }
+    // the completed buffers are in the ring, the main queue stays empty
+    if (CamDevRingActive(queue))
+    {
+        return -EBUSY;
+    }
+
+    ret = CamDevTakeDone(queue, file->f_flags & O_NONBLOCK, &buff);
+    if (ret < 0)
     {
-        ret = -1;
-        printk(KERN_INFO "Cannot allocate memory for buff \n");
         return ret;
     }
-    
-    mutex_init(&Stream->queue->mutex);
-    mutex_lock(&Stream->queue->mutex);
+    CamDevTakeBuffer(buff);
 
-    
+    *buffer = buff->buf;
+    return ret;
+}
 
-    // INIT_LIST_HEAD(&Stream->queue->mainqueue);
-    printk(KERN_INFO "DEQUEUE: Lock on mutex \n");
-    
-    if (list_empty(&mainqueue))
+int CameraDeviceStreamOn(struct file *file, void *fh, enum v4l2_buf_type type)
+{
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream;
+    Stream = Cam->camDev;
+    int ret;
+
+    // the output side follows the capture side, there is nothing to start
+    if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT && Stream->queue->writer == file)
     {
-        printk(KERN_INFO "DEQUEUE: queue is empty \n");
-        mainqueue = temp1;
+        return STATUS_OK;
     }
-    
-    buff = list_first_entry(&mainqueue, CamDevBuff_T, stream);
-    printk(KERN_INFO "Buffer state in DQBUFF--%d buffer index %d \n", buff->buffState, buff->buf.index);
-    
-    switch (buff->buffState)
+    if (type == V4L2_BUF_TYPE_META_CAPTURE)
+    {
+        return CamDevMetaStream(file, Stream->queue, 1);
+    }
+    if (type != Stream->type)
     {
-    case UVC_BUF_STATE_ERROR:
+        printk(KERN_INFO "Invalid type of streaming on \n");
+        return -EINVAL;
+    }
+
+    mutex_lock(&Stream->queue->mutex);
+    if (Stream->queue->owner != file || Stream->queue->count == 0)
     {
-        printk(KERN_INFO "DEQUEUE: Buffer state error \n");
-        ret = -EIO;
         mutex_unlock(&Stream->queue->mutex);
-        printk(KERN_INFO "DEQUEUE : Unlock on mutex \n");
-        return ret;
+        return -EINVAL;
     }
-    case UVC_BUF_STATE_DONE:
+    if (Stream->queue->flag & QUEUE_STREAMING)
     {
-        printk(KERN_INFO "DEQUEUE: Buffer state done \n");
-        buff->buffState = UVC_BUF_STATE_IDLE;
-        break;
+        mutex_unlock(&Stream->queue->mutex);
+        return STATUS_OK;
     }
-    case UVC_BUF_STATE_QUEUED:
-    case UVC_BUF_STATE_READY:
-    default:
+
+    ret = CamDevVideoStart(Stream);
+    if (ret == STATUS_OK)
+    {
+        Stream->queue->flag |= QUEUE_STREAMING;
+    }
+
+    mutex_unlock(&Stream->queue->mutex);
+    return ret;
+}
+
+int CameraDeviceStreamOff(struct file *file, void *fh, enum v4l2_buf_type type)
+{
+    CamManage *Cam = file->private_data;
+    CameraDev_T *Stream;
+    Stream = Cam->camDev;
+
+    if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT && Stream->queue->writer == file)
     {
-        printk(KERN_INFO "DEQUEUE: Buffer state queued or ready \n");
-        ret = -1;
+        mutex_lock(&Stream->queue->mutex);
+        CamDevOutputRelease(Stream->queue);
         mutex_unlock(&Stream->queue->mutex);
-        printk(KERN_INFO "DEQUEUE : Unlock on mutex \n");
+        return STATUS_OK;
     }
+    if (type == V4L2_BUF_TYPE_META_CAPTURE)
+    {
+        return CamDevMetaStream(file, Stream->queue, 0);
     }
-    
-    
-    // memcpy(buffer, &buff->buf, sizeof(struct v4l2_buffer));
-    *buffer = buff->buf;
-    //list_del(&buff->stream);
-    // buffer->bytesused = buff->buf.bytesused;
-    printk(KERN_INFO "DEQUEUE: bytesused: %d \n", buff->buf.bytesused);
-    /*
-    switch (buff->buffState)
+    if (type != Stream->type)
+    {
+        printk(KERN_INFO " Invalid type of stream of \n");
+        return -EINVAL;
+    }
+
+    mutex_lock(&Stream->queue->mutex);
+    if (Stream->queue->owner != file || (Stream->queue->flag & QUEUE_READ_IO))
+    {
+        mutex_unlock(&Stream->queue->mutex);
+        return -EINVAL;
+    }
+    if (Stream->queue->flag & QUEUE_STREAMING)
+    {
+        // a restart with the same format only resubmits the URBs
+        if (keep_stream)
+        {
+            CamDevVideoPause(Stream);
+        }
+        else
+        {
+            CamDevVideoStop(Stream);
+        }
+        Stream->queue->flag &= ~QUEUE_STREAMING;
+        CamDevQueueFlush(Stream->queue);
+    }
+
+    mutex_unlock(&Stream->queue->mutex);
+    printk(KERN_INFO "STREAM OFF: done \n");
+    return 0;
+}
+
+int CameraDeviceQueryCtrl(struct file *file, void *fh, struct v4l2_queryctrl *qc)
+{
+    switch (qc->id)
     {
-    case UVC_BUF_STATE_DONE:
+    case CAM_CID_LATEST_FRAME:
     {
-        buffer->flags |= V4L2_BUF_FLAG_DONE;
-        break;
+        strcpy(qc->name, "Latest Frame Only");
+        qc->type = V4L2_CTRL_TYPE_BOOLEAN;
+        qc->minimum = 0;
+        qc->maximum = 1;
+        qc->step = 1;
+        qc->default_value = latest_frame;
+        qc->flags = 0;
+        return STATUS_OK;
     }
-    case UVC_BUF_STATE_QUEUED:
-    case UVC_BUF_STATE_READY:
+    case CAM_CID_DECIMATION:
     {
-        buffer->flags |= V4L2_BUF_FLAG_QUEUED;
-        break;
+        strcpy(qc->name, "Frame Decimation");
+        qc->type = V4L2_CTRL_TYPE_INTEGER;
+        qc->minimum = 1;
+        qc->maximum = CAM_MAX_DECIMATION;
+        qc->step = 1;
+        qc->default_value = 1;
+        qc->flags = 0;
+        return STATUS_OK;
     }
-    default:
+    case CAM_CID_ERROR_FRAMES:
     {
-        break;
+        strcpy(qc->name, "Frames With Errors");
+        qc->type = V4L2_CTRL_TYPE_INTEGER;
+        qc->minimum = CAM_ERROR_DELIVER;
+        qc->maximum = CAM_ERROR_DROP;
+        qc->step = 1;
+        qc->default_value = min_t(unsigned int, error_frames, CAM_ERROR_DROP);
+        qc->flags = 0;
+        return STATUS_OK;
     }
+    default:
+        return -EINVAL;
     }
-    */
-    mutex_unlock(&Stream->queue->mutex);
-    printk(KERN_INFO "DEQUEUE : Unlock on mutex \n");
-    return ret;
 }
 
-int CameraDeviceStreamOn(struct file *file, void *fh, enum v4l2_buf_type type)
+int CameraDeviceGetCtrl(struct file *file, void *fh, struct v4l2_control *ctrl)
 {
     CamManage *Cam = file->private_data;
-    CameraDev_T *Stream;
-    Stream = Cam->camDev;
-    Stream->queue = (UVC_cam_queue_T *)kmalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
-    mutex_init(&Stream->queue->mutex);
-    printk(KERN_INFO "In stream on : %d", Stream->type);
 
-    if (type != Stream->type)
+    switch (ctrl->id)
     {
-        printk(KERN_INFO "Invalid type of streaming on \n");
-        return -1;
+    case CAM_CID_LATEST_FRAME:
+        ctrl->value = Cam->latestFrame;
+        return STATUS_OK;
+    case CAM_CID_DECIMATION:
+        ctrl->value = Cam->decimation;
+        return STATUS_OK;
+    case CAM_CID_ERROR_FRAMES:
+        ctrl->value = Cam->errorFrames;
+        return STATUS_OK;
+    default:
+        return -EINVAL;
     }
-    mutex_lock(&Stream->mutex);
-    printk(KERN_INFO " STREAM ON :  mutex lock \n");
-
-    mutex_lock(&Stream->queue->mutex);
-    printk(KERN_INFO "STREAM ON: Mutex lock on stream->queue \n");
-
-    Stream->queue->flag |= QUEUE_STREAMING;
-    printk(KERN_INFO "STREAM ON: Flags changed \n");
-
-    mutex_unlock(&Stream->queue->mutex);
-    printk(KERN_INFO "STREAM ON: Mutex unlock on Stream->queue \n");
-
-    mutex_unlock(&Stream->mutex);
-    printk(KERN_INFO "STREAM ON: Mutex unlock on Stream \n");
-    return 0;
 }
 
-int CameraDeviceStreamOff(struct file *file, void *fh, enum v4l2_buf_type type)
+int CameraDeviceSetCtrl(struct file *file, void *fh, struct v4l2_control *ctrl)
 {
     CamManage *Cam = file->private_data;
-    CameraDev_T *Stream;
-    Stream = Cam->camDev;
-
-    Stream->queue = (UVC_cam_queue_T *)kmalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
+    UVC_cam_queue_T *queue = Cam->camDev->queue;
+    unsigned long flags;
 
-    mutex_init(&Stream->queue->mutex);
-    printk(KERN_INFO "In stream off \n");
-
-    if (type != Stream->type)
+    switch (ctrl->id)
     {
-        printk(KERN_INFO " Invalid type of stream of \n");
-        return -1;
+    case CAM_CID_LATEST_FRAME:
+    {
+        Cam->latestFrame = !!ctrl->value;
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (queue->owner == file)
+        {
+            queue->latestFrame = Cam->latestFrame;
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return STATUS_OK;
     }
-    mutex_lock(&Stream->mutex);
-    printk(KERN_INFO " STREAM OFF :  mutex lock \n");
-
-    mutex_lock(&Stream->queue->mutex);
-    printk(KERN_INFO "STREAM OFF: Mutex lock on stream->queue \n");
-
-    Stream->queue->flag = ~QUEUE_STREAMING;
+    case CAM_CID_DECIMATION:
+    {
+        if (ctrl->value < 1 || ctrl->value > CAM_MAX_DECIMATION)
+        {
+            return -ERANGE;
+        }
+        Cam->decimation = ctrl->value;
+        // a running stream picks it up at its next frame
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (queue->owner == file)
+        {
+            queue->decimation = Cam->decimation;
+        }
+        if (Cam->consumer != NULL)
+        {
+            Cam->consumer->decimation = Cam->decimation;
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return STATUS_OK;
+    }
+    case CAM_CID_ERROR_FRAMES:
+    {
+        if (ctrl->value < CAM_ERROR_DELIVER || ctrl->value > CAM_ERROR_DROP)
+        {
+            return -ERANGE;
+        }
+        Cam->errorFrames = ctrl->value;
+        spin_lock_irqsave(&queue->irqlock, flags);
+        if (queue->owner == file)
+        {
+            queue->errorFrames = Cam->errorFrames;
+        }
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return STATUS_OK;
+    }
+    default:
+        return -EINVAL;
+    }
+}
 
-    mutex_unlock(&Stream->queue->mutex);
-    printk(KERN_INFO "STREAM OFF: Mutex unlock on stream->queue \n");
+long CameraDeviceDefault(struct file *file, void *fh, bool valid_prio, unsigned int cmd, void *arg)
+{
+    CamManage *Cam = file->private_data;
+    UVC_cam_queue_T *queue = Cam->camDev->queue;
+    unsigned long flags;
 
-    mutex_unlock(&Stream->mutex);
-    printk(KERN_INFO "STREAM OFF: Mutex unlock on stream \n");
-    return 0;
+    switch (cmd)
+    {
+    case VIDIOC_CAM_G_STATS:
+    {
+        struct cam_stats *stats = arg;
+
+        spin_lock_irqsave(&queue->irqlock, flags);
+        memcpy(stats, &queue->stats, sizeof(queue->stats));
+        stats->irq_us = div_u64(queue->irqNs, NSEC_PER_USEC);
+        stats->decode_us = div_u64(queue->decodeNs, NSEC_PER_USEC);
+        stats->consumers = queue->nconsumers;
+        stats->dropped = Cam->consumer != NULL ? Cam->consumer->dropped : 0;
+        spin_unlock_irqrestore(&queue->irqlock, flags);
+        return STATUS_OK;
+    }
+    case VIDIOC_CAM_SUBSCRIBE:
+        return CamDevSubscribe(file, queue, arg);
+    case VIDIOC_CAM_UNSUBSCRIBE:
+    {
+        mutex_lock(&queue->mutex);
+        CamDevUnsubscribe(Cam, queue);
+        mutex_unlock(&queue->mutex);
+        return STATUS_OK;
+    }
+    case VIDIOC_CAM_DQSHARED:
+        return Cam->consumer != NULL ? CamDevShareDequeue(file, Cam->consumer, arg) : -EINVAL;
+    case VIDIOC_CAM_QSHARED:
+        return Cam->consumer != NULL ? CamDevShareQueue(file, Cam->consumer, arg) : -EINVAL;
+    case VIDIOC_CAM_BATCH:
+        return CamDevBatch(file, queue, arg);
+    case VIDIOC_CAM_RING:
+        return CamDevRingSetup(file, queue, arg);
+    default:
+        return -ENOTTY;
+    }
 }
 
 static struct v4l2_ioctl_ops ioctl_operation =
@@ -842,16 +5466,77 @@ static struct v4l2_ioctl_ops ioctl_operation =
         .vidioc_s_input     = CameraDeviceSetInput,
         .vidioc_enum_input  = CameraDeviceEnumInput,
         .vidioc_g_input     = CameraDeviceGetInput,
+        .vidioc_enum_fmt_vid_cap = CameraDeviceEnumFormat,
+        .vidioc_enum_fmt_vid_out = CameraDeviceEnumFormat,
+        .vidioc_enum_framesizes = CameraDeviceEnumFrameSizes,
         .vidioc_s_fmt_vid_cap = CameraDeviceSetFormat,
         .vidioc_g_fmt_vid_cap = CameraDeviceGetFormat,
+        .vidioc_s_fmt_vid_out = CameraDeviceSetFormat,
+        .vidioc_g_fmt_vid_out = CameraDeviceGetFormat,
+        .vidioc_g_selection = CameraDeviceGetSelection,
+        .vidioc_s_selection = CameraDeviceSetSelection,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+        .vidioc_enum_fmt_meta_cap = CamDevMetaEnumFormat,
+        .vidioc_g_fmt_meta_cap = CamDevMetaFormat,
+        .vidioc_s_fmt_meta_cap = CamDevMetaFormat,
+        .vidioc_try_fmt_meta_cap = CamDevMetaFormat,
+#endif
         .vidioc_reqbufs     = CameraDeviceRequestBuff,
         .vidioc_querybuf    = CameraDeviceQueryBuff,
         .vidioc_qbuf        = CameraDeviceQueueBuff,
         .vidioc_dqbuf       = CameraDeviceDequeueBuff,
         .vidioc_streamon    = CameraDeviceStreamOn,
         .vidioc_streamoff   = CameraDeviceStreamOff,
+        .vidioc_queryctrl   = CameraDeviceQueryCtrl,
+        .vidioc_g_ctrl      = CameraDeviceGetCtrl,
+        .vidioc_s_ctrl      = CameraDeviceSetCtrl,
+        .vidioc_default     = CameraDeviceDefault,
 
 };
+/************************************************************************************
+ * @func    static int MapperContig(CamDevBuff_T *buff, struct vm_area_struct *vmaStruct)
+ *
+ * @brief   map a buffer of a contiguous pool as raw page frames, with huge pages for
+ *          every whole chunk when the mapping starts on a PMD boundary
+ *
+ ************************************************************************************/
+static int MapperContig(CamDevBuff_T *buff, struct vm_area_struct *vmaStruct)
+{
+    // raw page frames can not be copied on write
+    if (!(vmaStruct->vm_flags & VM_SHARED) && (vmaStruct->vm_flags & VM_MAYWRITE))
+    {
+        return -EINVAL;
+    }
+    vmaStruct->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vmaStruct->vm_private_data = buff;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+    // the pages are inserted on fault, as huge pages when the mapping allows it
+    vmaStruct->vm_flags |= VM_HUGEPAGE;
+    vmaStruct->vm_ops = &my_vm_contig_ops;
+#else
+    {
+        unsigned long chunk = PAGE_SIZE << CamDevContigOrder();
+        unsigned long offset;
+        int ret;
+
+        for (offset = 0; offset < vmaStruct->vm_end - vmaStruct->vm_start; offset += chunk)
+        {
+            ret = remap_pfn_range(vmaStruct, vmaStruct->vm_start + offset,
+                                  page_to_pfn(buff->pages[offset >> PAGE_SHIFT]),
+                                  min(chunk, vmaStruct->vm_end - vmaStruct->vm_start - offset),
+                                  vmaStruct->vm_page_prot);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+    }
+    vmaStruct->vm_ops = &my_vm_ops;
+#endif
+    my_vm_open(vmaStruct);
+    return STATUS_OK;
+}
+
 /************************************************************************************
  * @func    static int Mapper(struct UVC_cam_queue_T *queue, 
  *                          struct vm_area_struct *vmaStruct)
@@ -861,48 +5546,41 @@ static struct v4l2_ioctl_ops ioctl_operation =
  ************************************************************************************/
 static int Mapper(struct UVC_cam_queue_T *queue, struct vm_area_struct *vmaStruct)
 {
-    struct CamDevBuff_T *buff;
+    struct CamDevBuff_T *buff = NULL;
     struct page *Page;
     unsigned long address, start, size;
     unsigned int i;
     int ret = 0;
-    //queue = kmalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
-    buff = (CamDevBuff_T *)kmalloc(sizeof(CamDevBuff_T), GFP_KERNEL);
-    if (buff == NULL)
-    {
-        ret = -1;
-        printk(KERN_INFO "Can not allocated memory \n");
-        return ret;
-    }
-
-    mutex_init(&queue->mutex);
 
     start = vmaStruct->vm_start;
     size = vmaStruct->vm_end - vmaStruct->vm_start;
-    printk(KERN_INFO "Mapper: size = %d \n", size);
     mutex_lock(&queue->mutex);
-    printk(KERN_INFO "Mutex lock on queue \n");
 
     vmaStruct->vm_flags |= VM_IO;
-    printk(KERN_INFO "Mapper: vm_Start : %lu \t vm_end: %d  \t msize : %d \n", 
-                vmaStruct->vm_start, vmaStruct->vm_end, (unsigned int)queue->mem);
-    printk(KERN_INFO "Mapper: buffer count: %d \n", queue->count);
-    printk(KERN_INFO "Page size: %lu \n ", PAGE_SIZE);
 
     for (i = 0; i < queue->count; i++)
     {
-        buff = &queue->buffer[i];
-        printk(KERN_INFO "mapper: buffer_offset ... %d  vma_pgoff : %lu",buff->buf.m.offset,vmaStruct->vm_pgoff);
-        if ((buff->buf.m.offset >> PAGE_SHIFT) == vmaStruct->vm_pgoff)
+        if ((queue->buffer[i].buf.m.offset >> PAGE_SHIFT) == vmaStruct->vm_pgoff)
         {
-            printk(KERN_INFO "mapper: breaking out of for loop ... %d \n", i);
+            buff = &queue->buffer[i];
             break;
         }
     }
+    if (buff == NULL || size > buff->buf.length)
+    {
+        printk(KERN_INFO "Mapper: no buffer at offset %lu \n", vmaStruct->vm_pgoff << PAGE_SHIFT);
+        mutex_unlock(&queue->mutex);
+        return -EINVAL;
+    }
+
+    if (queue->allocMode == CAM_ALLOC_CONTIG)
+    {
+        ret = MapperContig(buff, vmaStruct);
+        mutex_unlock(&queue->mutex);
+        return ret;
+    }
 
-    address = (unsigned long)queue->mem + buff->buf.m.offset;
-    printk(KERN_INFO "Mem location: %p \n", queue->mem);
-    printk(KERN_INFO "Mem location: %d \n", queue->mem);
+    address = (unsigned long)buff->mem;
 
     while (size > 0)
     {
@@ -931,7 +5609,6 @@ static int Mapper(struct UVC_cam_queue_T *queue, struct vm_area_struct *vmaStruc
     vmaStruct->vm_private_data = buff;
     my_vm_open(vmaStruct);
     mutex_unlock(&queue->mutex);
-    printk(KERN_INFO "Unlock on queue mutex \n");
 
     return ret;
 }
@@ -949,6 +5626,23 @@ int MyMapper(struct file *fileDesc, struct vm_area_struct *vmaStruct)
         printk(KERN_INFO "Vma is null \n");
         return 0;
     }
+    if (vmaStruct->vm_pgoff >= (CAM_RING_OFFSET >> PAGE_SHIFT))
+    {
+        return CamDevRingMap(fileDesc, Stream->queue, vmaStruct);
+    }
+    if (vmaStruct->vm_pgoff >= (CAM_META_OFFSET >> PAGE_SHIFT))
+    {
+        return CamDevMetaMap(fileDesc, Stream->queue, vmaStruct);
+    }
+    // consumers share the frames of the streaming handle, read-only
+    if (Cam->consumer != NULL)
+    {
+        if (vmaStruct->vm_flags & VM_WRITE)
+        {
+            return -EACCES;
+        }
+        vmaStruct->vm_flags &= ~VM_MAYWRITE;
+    }
     ret = Mapper(Stream->queue, vmaStruct);
     return ret;
 }
@@ -956,16 +5650,13 @@ int MyMapper(struct file *fileDesc, struct vm_area_struct *vmaStruct)
 /************************************************************************************
                                  OS SPECIFICS
  ************************************************************************************/
-static struct v4l2_device v4l2_device =
-{
-        .name = "CamDev",
-};
-
 static struct v4l2_file_operations v4l2_fops =
 {
         .owner  = THIS_MODULE,
         .open   = openCameraDevice,
-        // .read   = my_read,
+        .read   = CameraDeviceRead,
+        .write  = CameraDeviceWrite,
+        .poll   = CameraDevicePoll,
         .release        = releaseCameraDevice,
         .unlocked_ioctl = video_ioctl2,
         .mmap           = MyMapper,
@@ -979,11 +5670,261 @@ static struct video_device video_dev =
         .fops = &v4l2_fops,
         .ioctl_ops = &ioctl_operation,
         .release = video_device_release,
-        .v4l2_dev = &v4l2_device,
         .lock = NULL,
         .dev_parent = NULL,
 };
 
+static struct v4l2_device loopback_v4l2_device =
+{
+        .name = "CamLoopback",
+};
+
+/************************************************************************************
+ * @func    static int CamDevLoopbackCreate(void)
+ *
+ * @brief   register a video node without camera, its capture side streams the frames
+ *          queued on its output side. VFL_DIR_M2M lets the v4l2 core accept both
+ *          buffer types on the node.
+ * @return  STATUS_OK     - the node is registered
+ *
+ ************************************************************************************/
+static int CamDevLoopbackCreate(void)
+{
+    CameraDev_T *cam;
+    int ret;
+
+    cam = kzalloc(sizeof(CameraDev_T), GFP_KERNEL);
+    if (cam == NULL)
+    {
+        return -ENOMEM;
+    }
+    cam->queue = kzalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
+    if (cam->queue == NULL)
+    {
+        kfree(cam);
+        return -ENOMEM;
+    }
+    CamDevQueueInit(cam->queue);
+    mutex_init(&cam->mutex);
+    cam->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->numaNode = -1;
+    cam->workCpu = -1;
+    cam->streamCpu = -1;
+
+    CamDevLoopbackFormats(cam);
+    cam->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->format.fmt.pix.width = 640;
+    cam->format.fmt.pix.height = 480;
+    cam->format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    CamDevSelectFormat(cam, &cam->format.fmt.pix);
+
+    ret = v4l2_device_register(NULL, &loopback_v4l2_device);
+    if (ret < 0)
+    {
+        goto free_cam;
+    }
+    LoopbackDev = video_device_alloc();
+    if (LoopbackDev == NULL)
+    {
+        ret = -ENOMEM;
+        goto unregister_v4l2;
+    }
+    *LoopbackDev = video_dev;
+    strscpy(LoopbackDev->name, "CamLoopback", sizeof(LoopbackDev->name));
+    LoopbackDev->vfl_dir = VFL_DIR_M2M;
+    LoopbackDev->v4l2_dev = &loopback_v4l2_device;
+    video_set_drvdata(LoopbackDev, cam);
+
+    ret = video_register_device(LoopbackDev, VFL_TYPE_VIDEO, -1);
+    if (ret < 0)
+    {
+        video_device_release(LoopbackDev);
+        LoopbackDev = NULL;
+        goto unregister_v4l2;
+    }
+    cam->VDev = LoopbackDev;
+    cam->V4L2Dev = &loopback_v4l2_device;
+    printk(KERN_INFO "Loopback node registered as video%d \n", LoopbackDev->num);
+    return STATUS_OK;
+
+unregister_v4l2:
+    v4l2_device_unregister(&loopback_v4l2_device);
+free_cam:
+    kfree(cam->queue);
+    kfree(cam);
+    return ret;
+}
+
+/************************************************************************************
+ * @func    static void CamDevLoopbackDestroy(void)
+ *
+ * @brief   unregister the loopback node, the module is only unloaded once every
+ *          handle of the node is closed
+ *
+ ************************************************************************************/
+static void CamDevLoopbackDestroy(void)
+{
+    CameraDev_T *cam;
+
+    if (LoopbackDev == NULL)
+    {
+        return;
+    }
+    cam = video_get_drvdata(LoopbackDev);
+    video_unregister_device(LoopbackDev);
+    v4l2_device_unregister(&loopback_v4l2_device);
+    CamDevQueuePut(cam->queue);
+    kfree(cam);
+    LoopbackDev = NULL;
+}
+
+/************************************************************************************
+                                CPU AND NUMA AFFINITY
+ ************************************************************************************/
+/*
+ * completion_cpus binds the decoding of the URBs to a CPU of the set instead of
+ * the CPU taking the host controller interrupt (see /proc/irq to steer that one
+ * too), the payloads are decoded in order so one CPU of the set does it per
+ * stream. buffer_node selects the NUMA node of the buffer pool, -1 uses the node
+ * of that CPU. A new CPU applies on the next STREAMON, a new node on the next
+ * VIDIOC_REQBUFS.
+ */
+
+/************************************************************************************
+ * @func    static void CamDevApplyAffinity(CameraDev_T *cam)
+ *
+ * @brief   derive the completion CPU and the node of the pool from the knobs.
+ *          Called with cam->mutex held.
+ *
+ ************************************************************************************/
+static void CamDevApplyAffinity(CameraDev_T *cam)
+{
+    int cpu = -1;
+    int node = NUMA_NO_NODE;
+
+    if (!cpumask_empty(&cam->cpus))
+    {
+        cpu = cpumask_first_and(&cam->cpus, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+        {
+            cpu = -1;
+        }
+    }
+    if (cam->numaNode >= 0)
+    {
+        node = cam->numaNode;
+    }
+    else if (cpu >= 0)
+    {
+        node = cpu_to_node(cpu);
+    }
+    WRITE_ONCE(cam->workCpu, cpu);
+    WRITE_ONCE(cam->queue->node, node);
+}
+
+static ssize_t completion_cpus_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+    ssize_t len;
+
+    mutex_lock(&cam->mutex);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
+    len = scnprintf(buf, PAGE_SIZE, "%*pbl\n", cpumask_pr_args(&cam->cpus));
+#else
+    len = cpulist_scnprintf(buf, PAGE_SIZE - 1, &cam->cpus);
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+#endif
+    mutex_unlock(&cam->mutex);
+    return len;
+}
+
+static ssize_t completion_cpus_store(struct device *dev, struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+    cpumask_var_t mask;
+    int ret;
+
+    if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+    {
+        return -ENOMEM;
+    }
+    ret = cpulist_parse(buf, mask);
+    if (ret == 0 && !cpumask_empty(mask) && !cpumask_intersects(mask, cpu_online_mask))
+    {
+        ret = -EINVAL;
+    }
+    if (ret == 0)
+    {
+        mutex_lock(&cam->mutex);
+        cpumask_copy(&cam->cpus, mask);
+        CamDevApplyAffinity(cam);
+        mutex_unlock(&cam->mutex);
+    }
+    free_cpumask_var(mask);
+    return ret < 0 ? ret : count;
+}
+static DEVICE_ATTR_RW(completion_cpus);
+
+static ssize_t buffer_node_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+
+    return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(cam->numaNode));
+}
+
+static ssize_t buffer_node_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+    int node, ret;
+
+    ret = kstrtoint(buf, 0, &node);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    if (node < -1 || (node >= 0 && (node >= MAX_NUMNODES || !node_online(node))))
+    {
+        return -EINVAL;
+    }
+    mutex_lock(&cam->mutex);
+    cam->numaNode = node;
+    CamDevApplyAffinity(cam);
+    mutex_unlock(&cam->mutex);
+    return count;
+}
+static DEVICE_ATTR_RW(buffer_node);
+
+/*
+ * bus_free is the bandwidth (bytes/s) the streams of the cameras on the bus of
+ * this one can still reserve, stream_bandwidth the part the stream of this one
+ * holds, 0 while it does not stream.
+ */
+static ssize_t bus_free_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+
+    if (READ_ONCE(cam->gone))
+    {
+        return -ENODEV;
+    }
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", CamDevBusFree(cam));
+}
+static DEVICE_ATTR_RO(bus_free);
+
+static ssize_t stream_bandwidth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    CameraDev_T *cam = video_get_drvdata(to_video_device(dev));
+    unsigned long bandwidth;
+
+    mutex_lock(&CamBusLock);
+    bandwidth = cam->busBandwidth;
+    mutex_unlock(&CamBusLock);
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", bandwidth);
+}
+static DEVICE_ATTR_RO(stream_bandwidth);
+
 static struct usb_device_id mydev_table[] = 
 {
     {USB_DEVICE(0x1908, 0x2311)}, {}
@@ -991,95 +5932,197 @@ static struct usb_device_id mydev_table[] =
 };
 MODULE_DEVICE_TABLE(usb, mydev_table);      /**< Register id of device with usb core*/
 
+/************************************************************************************
+ * @func    static void CamDevNodeRelease(struct video_device *vdev)
+ *
+ * @brief   free a camera once its node is unregistered and its last handle closed
+ *
+ ************************************************************************************/
+static void CamDevNodeRelease(struct video_device *vdev)
+{
+    CameraDev_T *cam = video_get_drvdata(vdev);
+
+    v4l2_device_unregister(&cam->v4l2Device);
+    destroy_workqueue(cam->workqueue);
+    usb_put_dev(cam->udev);
+    // pipes may still hold frames of the pool, the last one frees the queue
+    CamDevQueuePut(cam->queue);
+    kfree(cam);
+    video_device_release(vdev);
+}
+
 /************************************************************************************
  * @func    static void UVCCamDisconnect(struct usb_interface *interface)
  * 
  * 
- * @brief   this function is call when remove usb camera 
+ * @brief   this function is call when remove usb camera. The stream, running or
+ *          kept, is stopped while the device is still there; the handles left open
+ *          see a stopped stream and every later USB request fails with -ENODEV.
+ *          The node is unregistered, CamDevNodeRelease frees the camera once its
+ *          last handle is closed.
  * 
  ************************************************************************************/
 static void UVCCamDisconnect(struct usb_interface *interface)
 {
-    //unregister and unallocate memory for device when unload kernel module
-    printk(KERN_INFO "UVC device is removed \n");
-    printk(KERN_INFO "Interface camera No.%d now is disconected \n", interface->cur_altsetting->desc.bInterfaceNumber);
-    printk(KERN_INFO "Exit \n");
+    CameraDev_T *cam = usb_get_intfdata(interface);
+    UVC_cam_queue_T *queue;
+
+    if (cam == NULL)
+    {
+        return;
+    }
+    // the URBs and the bandwidth belong to the device going away
+    queue = cam->queue;
+    mutex_lock(&queue->mutex);
+    if (queue->flag & QUEUE_STREAMING)
+    {
+        CamDevVideoStop(cam);
+        // waiters in DQBUF, read() and poll() see the stream stopped
+        queue->flag &= ~QUEUE_STREAMING;
+        CamDevQueueFlush(queue);
+    }
+    CamDevVideoRelease(cam);
+    WRITE_ONCE(cam->gone, 1);
+    mutex_unlock(&queue->mutex);
+
+    printk(KERN_INFO "Interface camera No.%d of video%d now is disconected \n",
+           interface->cur_altsetting->desc.bInterfaceNumber, cam->VDev->num);
+    usb_set_intfdata(interface, NULL);
+    device_remove_file(&cam->VDev->dev, &dev_attr_completion_cpus);
+    device_remove_file(&cam->VDev->dev, &dev_attr_buffer_node);
+    device_remove_file(&cam->VDev->dev, &dev_attr_bus_free);
+    device_remove_file(&cam->VDev->dev, &dev_attr_stream_bandwidth);
+    v4l2_device_disconnect(&cam->v4l2Device);
+    video_unregister_device(cam->VDev);
 }
 
 /************************************************************************************
- * @func    static void UVCCamDisconnect(struct usb_interface *interface)
+ * @func    static int UVCCamProbe(struct usb_interface *interface,
+ *                                 const struct usb_device_id *id)
  * 
  * 
- * @brief   Allocate memory and create device file in /dev/video*
+ * @brief   Allocate memory and create device file in /dev/video*, one node with its
+ *          own v4l2 device per camera
  * 
  ************************************************************************************/
 static int UVCCamProbe(struct usb_interface *interface, const struct usb_device_id *id)
 {
     struct usb_host_interface *interfaceDesc;
+    struct usb_device *udev = interface_to_usbdev(interface);
+    struct video_device *vdev;
     CameraDev_T *cam_dev;
     int ret;
     interfaceDesc = interface->cur_altsetting;
-     device = kmalloc(sizeof(struct usb_device),GFP_KERNEL);
-    if(device == NULL)
+
+    // the video node streams from the video streaming interface only
+    if (interfaceDesc->desc.bInterfaceClass != USB_CLASS_VIDEO ||
+        interfaceDesc->desc.bInterfaceSubClass != UVC_SC_VIDEOSTREAMING)
     {
-        printk(KERN_INFO "UVCCamProbe: Allocate memory for usb device failed \n");
-        ret = -1;
-        return ret;
+        return -ENODEV;
     }
-    device = interface_to_usbdev(interface);
-    cam_dev = kmalloc(sizeof(CameraDev_T), GFP_KERNEL);
     printk(KERN_INFO "Probe: UVC device (%04X, %04X) plugged \n", id->idVendor, id->idProduct);
-    if(cam_dev == NULL)
+    cam_dev = kzalloc(sizeof(CameraDev_T), GFP_KERNEL);
+    if (cam_dev == NULL)
     {
-        ret = -1;
         printk(KERN_INFO "Can not allocate memory for cam_dev \n");
-        return ret;
+        return -ENOMEM;
     }
-    // register module with kernel
-    CameraDev = video_device_alloc();
-    if (CameraDev == NULL)
+    cam_dev->queue = kzalloc(sizeof(UVC_cam_queue_T), GFP_KERNEL);
+    if (cam_dev->queue == NULL)
     {
-        ret = -1;
-        printk(KERN_INFO "Cannot allocate memory for device  !!! \n");
+        printk(KERN_INFO "Can not allocate memory for queue \n");
         kfree(cam_dev);
-        return ret;
+        return -ENOMEM;
     }
-    printk(KERN_INFO "Allocate memory for device success !!! \n");
-    *CameraDev = video_dev;
-    //CameraDev->dev = device->dev;
-
-    ret = video_register_device(CameraDev, VFL_TYPE_GRABBER, 0);
-    if (ret < 0)
+    CamDevQueueInit(cam_dev->queue);
+    mutex_init(&cam_dev->mutex);
+    cam_dev->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam_dev->udev = usb_get_dev(udev);
+    cam_dev->intf = interface;
+    cam_dev->numaNode = -1;
+    cam_dev->workCpu = -1;
+    cam_dev->streamCpu = -1;
+    // completed URBs are decoded by a high priority worker, not in the interrupt
+    INIT_WORK(&cam_dev->batchWork, CamDevBatchWork);
+    INIT_DELAYED_WORK(&cam_dev->retryWork, CamDevRetryWork);
+    hrtimer_init(&cam_dev->batchTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cam_dev->batchTimer.function = CamDevBatchTimer;
+    spin_lock_init(&cam_dev->urbLock);
+    cam_dev->workqueue = alloc_workqueue("cam_source", WQ_HIGHPRI, 1);
+    if (cam_dev->workqueue == NULL)
     {
-        ret = -1;
-        printk(KERN_INFO "Cannot register video device \n");
-        video_device_release(CameraDev);
-        kfree(cam_dev);
-        return ret;
+        printk(KERN_INFO "Can not allocate the completion workqueue \n");
+        ret = -ENOMEM;
+        goto free_cam;
     }
 
-    video_set_drvdata(CameraDev, cam_dev); 
-    cam_dev->VDev = CameraDev;
-    CameraDev->dev.init_name = "USB_Cam_dev";
-    printk(KERN_INFO "v4l2 device number: %d \n", CameraDev->num);
+    // start with the first advertised format at 640x480
+    CamDevParseFormats(cam_dev);
+    cam_dev->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam_dev->format.fmt.pix.width = 640;
+    cam_dev->format.fmt.pix.height = 480;
+    cam_dev->format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    CamDevSelectFormat(cam_dev, &cam_dev->format.fmt.pix);
 
-    ret = v4l2_device_register(&CameraDev->dev, CameraDev->v4l2_dev);
+    // register module with kernel, the name comes from the interface
+    ret = v4l2_device_register(&interface->dev, &cam_dev->v4l2Device);
     if (ret < 0)
     {
         printk(KERN_INFO "v4l2 registation failed \n");
-        video_device_release(CameraDev);
-        kfree(cam_dev);
-        return ret;
+        goto free_workqueue;
+    }
+    cam_dev->V4L2Dev = &cam_dev->v4l2Device;
+
+    vdev = video_device_alloc();
+    if (vdev == NULL)
+    {
+        printk(KERN_INFO "Cannot allocate memory for device  !!! \n");
+        ret = -ENOMEM;
+        goto unregister_v4l2;
+    }
+    *vdev = video_dev;
+    vdev->v4l2_dev = &cam_dev->v4l2Device;
+    vdev->release = CamDevNodeRelease;
+    video_set_drvdata(vdev, cam_dev);
+    cam_dev->VDev = vdev;
+    usb_set_intfdata(interface, cam_dev);
+
+    ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+    if (ret < 0)
+    {
+        printk(KERN_INFO "Cannot register video device \n");
+        usb_set_intfdata(interface, NULL);
+        video_device_release(vdev);
+        goto unregister_v4l2;
     }
 
-    cam_dev->V4L2Dev = CameraDev->v4l2_dev;
+    if (device_create_file(&vdev->dev, &dev_attr_completion_cpus) < 0 ||
+        device_create_file(&vdev->dev, &dev_attr_buffer_node) < 0)
+    {
+        printk(KERN_INFO "Can not create the affinity attributes \n");
+    }
+    if (device_create_file(&vdev->dev, &dev_attr_bus_free) < 0 ||
+        device_create_file(&vdev->dev, &dev_attr_stream_bandwidth) < 0)
+    {
+        printk(KERN_INFO "Can not create the bandwidth attributes \n");
+    }
 
-    v4l2_info(CameraDev->v4l2_dev, "V4L2 registered as: %d \t %s \t %d \t %d \n", CameraDev->num, CameraDev->name,
-              MAJOR(CameraDev->dev.devt), MINOR(CameraDev->dev.devt));
-    printk(KERN_INFO " Camera interface no.  %d now probed: (%04X:%04X)\n",\
-            interfaceDesc->desc.bInterfaceNumber, device->descriptor.idVendor,device->descriptor.idProduct);
+    v4l2_info(vdev->v4l2_dev, "V4L2 registered as: %d \t %s \t %d \t %d \n", vdev->num, vdev->name,
+              MAJOR(vdev->dev.devt), MINOR(vdev->dev.devt));
+    printk(KERN_INFO " Camera interface no.  %d on bus %d now probed: (%04X:%04X)\n",\
+            interfaceDesc->desc.bInterfaceNumber, udev->bus->busnum, udev->descriptor.idVendor,
+            udev->descriptor.idProduct);
     printk(KERN_INFO " Video device registered successfully !! \n");
+    return STATUS_OK;
 
+unregister_v4l2:
+    v4l2_device_unregister(&cam_dev->v4l2Device);
+free_workqueue:
+    destroy_workqueue(cam_dev->workqueue);
+free_cam:
+    usb_put_dev(cam_dev->udev);
+    kfree(cam_dev->queue);
+    kfree(cam_dev);
     return ret;
 }
 
@@ -1102,16 +6145,25 @@ static int __init cam_driver_init(void)
         printk(KERN_INFO "Cannot register usb device \n");
         return ret;
     }
+    if (loopback)
+    {
+        ret = CamDevLoopbackCreate();
+        if (ret < 0)
+        {
+            printk(KERN_INFO "Cannot register loopback node \n");
+            usb_deregister(&USB_Driver);
+            return ret;
+        }
+    }
     printk(KERN_INFO "Register device success \n");
     return ret;
 }
 // module exit
 static void __exit cam_driver_exit(void)
 {
+    // disconnects every camera, each one unregisters its node
     usb_deregister(&USB_Driver);
-    v4l2_device_unregister(CameraDev->v4l2_dev);
-    video_unregister_device(CameraDev);
-    video_device_release(CameraDev);
+    CamDevLoopbackDestroy();
     printk(KERN_INFO "Exit \n");
 }
 module_init(cam_driver_init);
@@ -1119,4 +6171,4 @@ module_exit(cam_driver_exit);
 
 MODULE_AUTHOR(DRIVER_AUTHOR);
 MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION(DRIVER_DESC);
\ No newline at end of file
+MODULE_DESCRIPTION(DRIVER_DESC);
@@ -0,0 +1,69 @@
+/*
+* @file     cam_trace.h
+* @author   Trong Phuoc
+* @brief    Tracepoints of the camera driver, enabled under
+*           /sys/kernel/debug/tracing/events/cam_source/
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cam_source
+
+#if !defined(CAM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CAM_TRACE_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <linux/tracepoint.h>
+
+/*******************************************************************************
+ *  EVENTS
+ ******************************************************************************/
+/* an URB completed, ns is the time the completion handler ran with interrupts off */
+TRACE_EVENT(cam_urb_complete,
+    TP_PROTO(unsigned int packets, unsigned int pending, u64 ns),
+    TP_ARGS(packets, pending, ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, packets)
+        __field(unsigned int, pending)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->packets = packets;
+        __entry->pending = pending;
+        __entry->ns = ns;
+    ),
+    TP_printk("packets=%u pending=%u irq_ns=%llu",
+              __entry->packets, __entry->pending, (unsigned long long)__entry->ns)
+);
+
+/*
+ * a batch of URBs was decoded by the worker: latency_ns is the wait of its oldest
+ * URB, ns the decoding time the completion handler does not spend anymore
+ */
+TRACE_EVENT(cam_batch,
+    TP_PROTO(unsigned int urbs, unsigned int frames, u64 latency_ns, u64 ns),
+    TP_ARGS(urbs, frames, latency_ns, ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, urbs)
+        __field(unsigned int, frames)
+        __field(u64, latency_ns)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->urbs = urbs;
+        __entry->frames = frames;
+        __entry->latency_ns = latency_ns;
+        __entry->ns = ns;
+    ),
+    TP_printk("urbs=%u frames=%u latency_ns=%llu decode_ns=%llu",
+              __entry->urbs, __entry->frames, (unsigned long long)__entry->latency_ns,
+              (unsigned long long)__entry->ns)
+);
+
+#endif /* CAM_TRACE_H */
+
+/* define_trace.h includes this file again from the directory of the driver */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cam_trace
+#include <trace/define_trace.h>
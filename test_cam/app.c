@@ -8,12 +8,279 @@
  ******************************************************************************/
 #include "cam_test.h"
 
+static const char short_options[] = "rmso:c:nLx:j:d:S:a:C:D:M:z:Z:P:U:b:f:k:T:B:RE:h";
 
-void main()
+static const struct option long_options[] = {
+    {"read", no_argument, NULL, 'r'},
+    {"mmap", no_argument, NULL, 'm'},
+    {"splice", no_argument, NULL, 's'},
+    {"output", required_argument, NULL, 'o'},
+    {"count", required_argument, NULL, 'c'},
+    {"no-write", no_argument, NULL, 'n'},
+    {"latest", no_argument, NULL, 'L'},
+    {"convert", required_argument, NULL, 'x'},
+    {"decode", required_argument, NULL, 'j'},
+    {"device", required_argument, NULL, 'd'},
+    {"share", required_argument, NULL, 'S'},
+    {"affinity", required_argument, NULL, 'a'},
+    {"crop", required_argument, NULL, 'C'},
+    {"decimate", required_argument, NULL, 'D'},
+    {"motion", required_argument, NULL, 'M'},
+    {"compress", required_argument, NULL, 'z'},
+    {"compress-threads", required_argument, NULL, 'Z'},
+    {"publish", required_argument, NULL, 'P'},
+    {"serve", required_argument, NULL, 'U'},
+    {"buffers", required_argument, NULL, 'b'},
+    {"format", required_argument, NULL, 'f'},
+    {"config", required_argument, NULL, 'k'},
+    {"tune", required_argument, NULL, 'T'},
+    {"batch", required_argument, NULL, 'B'},
+    {"ring", no_argument, NULL, 'R'},
+    {"errors", required_argument, NULL, 'E'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}};
+
+static void usage(const char *name)
 {
-    //opening the device
+    printf("Usage: %s [options] \n"
+           "-r | --read          Use read() to get frames \n"
+           "-m | --mmap          Use memory mapped buffers (default) \n"
+           "-s | --splice        Splice frames into the output file without copying \n"
+           "-o | --output FILE   Record all frames into FILE \n"
+           "-c | --count N       Number of frames to capture \n"
+           "-n | --no-write      Do not write frames into .raw files \n"
+           "-L | --latest        Always get the newest frame, drop the stale ones \n"
+           "-x | --convert FMT   Convert frames to rgb24, bgra, i420, nv12 or y8 \n"
+           "-j | --decode N      Capture MJPEG and decode it to RGB24 with N threads \n"
+           "-d | --device NODE   Video node to open (default " DEVICE_NAME ") \n"
+           "-S | --share POLICY[:DEPTH] \n"
+           "                     Read the frames another process streams, a lagging \n"
+           "                     reader drops the oldest, newest or all but the latest \n"
+           "-a | --affinity CPUS Pin the capture to a CPU list (0-3,8) or auto, the \n"
+           "                     completion CPUs or buffer node of the driver \n"
+           "-C | --crop WxH+X+Y  Only get a region of interest of the YUYV frames \n"
+           "-D | --decimate N    Only get every Nth frame of the camera \n"
+           "-M | --motion T[:MAX] \n"
+           "                     Only write YUYV frames whose mean luma changed by T \n"
+           "                     (0-255), and one after MAX static frames \n"
+           "-z | --compress CODEC[:LEVEL] \n"
+           "                     Compress the recorded frames with lz4, zstd or zlib \n"
+           "-Z | --compress-threads N \n"
+           "                     Threads of the compression stage (default 2) \n"
+           "-P | --publish SLOTS Copy every frame into a shared memory ring of SLOTS \n"
+           "                     frames for local readers (see ring_reader.c) \n"
+           "-U | --serve PATH    Hand every frame as a memfd to the clients of a Unix \n"
+           "                     socket at PATH (see frame_client.c) \n"
+           "-b | --buffers N     Buffers of the mmap method (default 4) \n"
+           "-f | --format WxH[:FOURCC] \n"
+           "                     Frame size and pixel format (default 640x480:YUYV) \n"
+           "-k | --config FILE   Load device, I/O method, format and buffers from FILE, \n"
+           "                     the options after it override it \n"
+           "-T | --tune FILE     Try every format, I/O method and buffer count of the \n"
+           "                     device and write the best one to FILE for -k \n"
+           "-B | --batch N       Exchange up to N mmap buffers per system call instead \n"
+           "                     of a DQBUF and a QBUF per frame \n"
+           "-R | --ring          Spin on the completion ring of the driver for mmap \n"
+           "                     frames, no system call per frame \n"
+           "-E | --errors deliver|drop \n"
+           "                     Frames that lost data on the bus come flagged with \n"
+           "                     V4L2_BUF_FLAG_ERROR or are dropped by the driver \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tune_path = NULL;
     int fd;
+    int c;
+
+    for (;;)
+    {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1)
+        {
+            break;
+        }
+        switch (c)
+        {
+        case 'r':
+            io = IO_METHOD_READ;
+            break;
+        case 'm':
+            io = IO_METHOD_MMAP;
+            break;
+        case 's':
+            io = IO_METHOD_SPLICE;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'c':
+            frame_count = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            write_frames = 0;
+            break;
+        case 'L':
+            latest_frame = 1;
+            break;
+        case 'x':
+            if (setConvert(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'j':
+            decode_threads = strtoul(optarg, NULL, 0);
+            if (decode_threads == 0 || decode_threads > POOL_MAX_THREADS)
+            {
+                printf("Decode threads must be 1..%d \n", POOL_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'd':
+            device_name = optarg;
+            break;
+        case 'S':
+            if (setShare(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'a':
+            affinity_cpus = optarg;
+            break;
+        case 'C':
+            if (setCrop(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'D':
+            frame_decimation = strtoul(optarg, NULL, 0);
+            if (frame_decimation == 0 || frame_decimation > CAM_MAX_DECIMATION)
+            {
+                printf("Decimation must be 1..%d \n", CAM_MAX_DECIMATION);
+                return 1;
+            }
+            break;
+        case 'M':
+            if (setMotion(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'z':
+            if (setCompress(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'Z':
+            compress_threads = strtoul(optarg, NULL, 0);
+            if (compress_threads == 0 || compress_threads > POOL_MAX_THREADS)
+            {
+                printf("Compression threads must be 1..%d \n", POOL_MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'P':
+            publish_slots = strtoul(optarg, NULL, 0);
+            if (publish_slots == 0)
+            {
+                printf("The ring needs at least 1 slot \n");
+                return 1;
+            }
+            break;
+        case 'U':
+            serve_path = optarg;
+            break;
+        case 'b':
+            buffer_count = strtoul(optarg, NULL, 0);
+            if (buffer_count < 2 || buffer_count > MAX_BUFFERS)
+            {
+                printf("Buffers must be 2..%d \n", MAX_BUFFERS);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (setFrameFormat(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'k':
+            if (loadConfig(optarg) != RETURN_STATUS_OK)
+            {
+                return 1;
+            }
+            break;
+        case 'T':
+            tune_path = optarg;
+            break;
+        case 'B':
+            batch_size = strtoul(optarg, NULL, 0);
+            if (batch_size == 0 || batch_size > CAM_MAX_BATCH)
+            {
+                printf("The batch must be 1..%d buffers \n", CAM_MAX_BATCH);
+                return 1;
+            }
+            break;
+        case 'R':
+            spin_ring = 1;
+            break;
+        case 'E':
+            if (strcmp(optarg, "deliver") == 0)
+            {
+                error_frames = CAM_ERROR_DELIVER;
+            }
+            else if (strcmp(optarg, "drop") == 0)
+            {
+                error_frames = CAM_ERROR_DROP;
+            }
+            else
+            {
+                printf("Frames with errors are delivered or dropped \n");
+                return 1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // pin before anything is allocated, the frames are first touched on the node
+    if (affinity_cpus != NULL && setAffinity(affinity_cpus) != RETURN_STATUS_OK)
+    {
+        return 1;
+    }
+    if (tune_path != NULL)
+    {
+        return tuneDevice(tune_path) == RETURN_STATUS_OK ? 0 : 1;
+    }
+    //opening the device
     fd = openDevice();
+    if (fd < 0)
+    {
+        return 1;
+    }
+    if (latest_frame)
+    {
+        setLatestFrame(fd, 1);
+    }
+    if (frame_decimation > 1)
+    {
+        setDecimation(fd, frame_decimation);
+    }
+    if (error_frames >= 0)
+    {
+        setErrorFrames(fd, error_frames);
+    }
     // init device
     deviceInit(fd);
     //capturing
@@ -23,8 +290,11 @@ void main()
     // readFrame(fd);
     // stop capturing
     stopCapturing(fd);
+    printDriverStatistics(fd);
     // release device
     deviceUninit();
     // close device
     closeDevice(fd);
+    printStatistics();
+    return 0;
 }
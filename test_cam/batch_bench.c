@@ -0,0 +1,387 @@
+/*
+* @file     batch_bench.c
+* @author   Trong Phuoc
+* @brief    System calls and CPU time per frame of the buffer exchange: a
+*           VIDIOC_DQBUF and a VIDIOC_QBUF per frame against VIDIOC_CAM_BATCH,
+*           which gives back the previous frames and takes the completed ones in
+*           one call. Small frames at a high rate show the difference best
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+#include "../KernelModule/cam_ioctl.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_BUFFERS       16
+#define BENCH_TIMEOUT_MS    5000    /* a camera which sends nothing for 5 s is stuck */
+#define BENCH_MIN_QUEUED    2       /* buffers left to the driver while frames are held */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct benchBuffer
+{
+    void *start;
+    size_t length;
+} benchBuffer;
+
+typedef struct benchResult
+{
+    unsigned long frames;
+    unsigned long calls;            /**< poll and buffer ioctls */
+    unsigned long long ioctlNs;     /**< time spent in the buffer ioctls */
+    unsigned long long cpuNs;       /**< user and system time of the process */
+    unsigned long long wallNs;
+} benchResult;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static benchBuffer buffers[BENCH_BUFFERS];
+static unsigned int n_buffers;
+static unsigned long n_frames = 1200;
+static unsigned long interval_us = 0;
+static volatile unsigned int sink;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-d | --device NODE   Video node to open (default /dev/video2) \n"
+           "-f | --format WxH    YUYV frame size (default 320x240) \n"
+           "-c | --count N       Frames per run (default 1200) \n"
+           "-i | --interval US   Sleep US microseconds between rounds, as a loop \n"
+           "                     serving several cameras, so frames pile up \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long getCpuNs(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int initBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+
+    memset(&req, 0, sizeof(req));
+    req.count = BENCH_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count <= BENCH_MIN_QUEUED)
+    {
+        printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+        return -1;
+    }
+    if (req.count > BENCH_BUFFERS)
+    {
+        req.count = BENCH_BUFFERS;
+    }
+    for (n_buffers = 0; n_buffers < req.count; n_buffers++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n_buffers;
+        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            printf("VIDIOC_QUERYBUF failed: %s \n", strerror(errno));
+            return -1;
+        }
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[n_buffers].start == MAP_FAILED)
+        {
+            printf("Can not map buffer %u \n", n_buffers);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int queueBuffer(int fd, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    return ioctl(fd, VIDIOC_QBUF, &buf);
+}
+
+/* the application reads the frame, one byte per cache line */
+static void touchFrame(unsigned int index, unsigned int size)
+{
+    const unsigned char *data = buffers[index].start;
+    unsigned int i;
+
+    for (i = 0; i < size; i += 64)
+    {
+        sink += data[i];
+    }
+}
+
+static int waitFrames(int fd, benchResult *res)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ret;
+
+    if (interval_us)
+    {
+        usleep(interval_us);
+    }
+    do
+    {
+        ret = poll(&pfd, 1, BENCH_TIMEOUT_MS);
+        res->calls++;
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+    {
+        printf("No frame within %d ms \n", BENCH_TIMEOUT_MS);
+        return -1;
+    }
+    return 0;
+}
+
+/* a DQBUF and a QBUF per frame, every completed frame is taken per round */
+static int runSingle(int fd, benchResult *res)
+{
+    struct v4l2_buffer buf;
+    unsigned long long start;
+    int ret;
+
+    while (res->frames < n_frames)
+    {
+        if (waitFrames(fd, res) < 0)
+        {
+            return -1;
+        }
+        for (;;)
+        {
+            memset(&buf, 0, sizeof(buf));
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            start = getTimeNs();
+            ret = ioctl(fd, VIDIOC_DQBUF, &buf);
+            res->ioctlNs += getTimeNs() - start;
+            res->calls++;
+            if (ret < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    break;
+                }
+                printf("VIDIOC_DQBUF failed: %s \n", strerror(errno));
+                return -1;
+            }
+            touchFrame(buf.index, buf.bytesused);
+            start = getTimeNs();
+            queueBuffer(fd, buf.index);
+            res->ioctlNs += getTimeNs() - start;
+            res->calls++;
+            res->frames++;
+        }
+    }
+    return 0;
+}
+
+/* VIDIOC_CAM_BATCH gives back the frames of the previous round and takes the new ones */
+static int runBatch(int fd, unsigned int size, benchResult *res)
+{
+    struct cam_batch batch;
+    unsigned long long start;
+    unsigned int i;
+
+    memset(&batch, 0, sizeof(batch));
+    while (res->frames < n_frames)
+    {
+        if (waitFrames(fd, res) < 0)
+        {
+            return -1;
+        }
+        batch.ndone = size;
+        start = getTimeNs();
+        if (ioctl(fd, VIDIOC_CAM_BATCH, &batch) < 0)
+        {
+            printf("VIDIOC_CAM_BATCH failed: %s \n", strerror(errno));
+            return -1;
+        }
+        res->ioctlNs += getTimeNs() - start;
+        res->calls++;
+        batch.nqueue = 0;
+        for (i = 0; i < batch.ndone; i++)
+        {
+            touchFrame(batch.done[i].index, batch.done[i].bytesused);
+            batch.queue[batch.nqueue++] = batch.done[i].index;
+        }
+        res->frames += batch.ndone;
+        // the camera needs buffers while the frames wait for the next round
+        if (n_buffers - batch.nqueue < BENCH_MIN_QUEUED)
+        {
+            batch.ndone = 0;
+            start = getTimeNs();
+            ioctl(fd, VIDIOC_CAM_BATCH, &batch);
+            res->ioctlNs += getTimeNs() - start;
+            res->calls++;
+            batch.nqueue = 0;
+        }
+    }
+    return 0;
+}
+
+/* one stream: queue every buffer, run the mode, stop. size 0 is DQBUF/QBUF */
+static int runMode(int fd, unsigned int size)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    benchResult res;
+    unsigned long long start, cpu;
+    unsigned int i;
+    int ret;
+
+    memset(&res, 0, sizeof(res));
+    for (i = 0; i < n_buffers; i++)
+    {
+        queueBuffer(fd, i);
+    }
+    if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+    {
+        printf("VIDIOC_STREAMON failed: %s \n", strerror(errno));
+        return -1;
+    }
+    start = getTimeNs();
+    cpu = getCpuNs();
+    ret = size ? runBatch(fd, size, &res) : runSingle(fd, &res);
+    res.cpuNs = getCpuNs() - cpu;
+    res.wallNs = getTimeNs() - start;
+    ioctl(fd, VIDIOC_STREAMOFF, &type);
+    if (ret < 0 || res.frames == 0)
+    {
+        return -1;
+    }
+
+    if (size)
+    {
+        printf("batch %-4u", size);
+    }
+    else
+    {
+        printf("%-10s", "DQBUF/QBUF");
+    }
+    printf(" %8lu %8.2f %10.2f %10.2f %8.1f \n", res.frames, (double)res.calls / res.frames,
+           res.ioctlNs / 1000.0 / res.frames, res.cpuNs / 1000.0 / res.frames, res.frames * 1e9 / res.wallNs);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"format", required_argument, NULL, 'f'},
+        {"count", required_argument, NULL, 'c'},
+        {"interval", required_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    static const unsigned int sizes[] = {0, 1, 4, 8, 16};
+    const char *device = "/dev/video2";
+    struct v4l2_format fmt;
+    unsigned int width = 320, height = 240, i;
+    int status = 0;
+    int fd, c;
+
+    while ((c = getopt_long(argc, argv, "d:f:c:i:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'f':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            n_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", device);
+        return 1;
+    }
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
+    {
+        printf("VIDIOC_S_FMT failed: %s \n", strerror(errno));
+    }
+    if (initBuffers(fd) < 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    printf("%ux%u YUYV, %u buffers, %lu frames per run, %lu us between rounds \n", fmt.fmt.pix.width,
+           fmt.fmt.pix.height, n_buffers, n_frames, interval_us);
+    printf("%-10s %8s %8s %10s %10s %8s \n", "exchange", "frames", "calls/f", "ioctl us/f", "cpu us/f", "fps");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && status == 0; i++)
+    {
+        status = runMode(fd, sizes[i]) < 0;
+    }
+    for (i = 0; i < n_buffers; i++)
+    {
+        munmap(buffers[i].start, buffers[i].length);
+    }
+    close(fd);
+    return status;
+}
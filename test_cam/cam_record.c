@@ -0,0 +1,417 @@
+/*
+* @file     cam_record.c
+* @author   Trong Phuoc
+* @brief    Recording container for captured frames, see cam_record.h
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#define _GNU_SOURCE /* splice() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "cam_record.h"
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+struct recordWriter
+{
+    int fd;
+    uint64_t offset;            /**< end of the data written so far */
+    recordIndexEntry *index;    /**< kept in memory until recordClose */
+    uint64_t count;
+    uint64_t cap;
+};
+
+struct recordReader
+{
+    const uint8_t *map;
+    size_t size;
+    const recordHeader *header;
+    const recordIndexEntry *index;  /**< points into the mapping or to recovered */
+    recordIndexEntry *recovered;    /**< index rebuilt from the frame headers */
+    int isRecovered;
+    uint64_t count;
+};
+
+static const uint8_t zeroPad[RECORD_ALIGN];
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+/* the frame header sits right before the payload, which starts on RECORD_ALIGN */
+static uint64_t recordNextHeader(uint64_t end)
+{
+    uint64_t payload = (end + sizeof(recordFrameHeader) + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+    return payload - sizeof(recordFrameHeader);
+}
+
+static int recordWriteAll(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t done;
+
+    while (iovcnt > 0)
+    {
+        done = writev(fd, iov, iovcnt);
+        if (done < 0)
+        {
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+static int recordAddEntry(recordWriter *rec, uint64_t offset, uint32_t size, uint32_t rawSize,
+                          uint64_t timestampNs, uint32_t sequence, uint32_t flags)
+{
+    recordIndexEntry *entry;
+
+    if (rec->count == rec->cap)
+    {
+        uint64_t cap = rec->cap ? rec->cap * 2 : 1024;
+        entry = realloc(rec->index, cap * sizeof(*entry));
+        if (entry == NULL)
+        {
+            return -1;
+        }
+        rec->index = entry;
+        rec->cap = cap;
+    }
+    entry = &rec->index[rec->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = offset;
+    entry->size = size;
+    entry->flags = flags;
+    entry->timestampNs = timestampNs;
+    entry->sequence = sequence;
+    entry->rawSize = rawSize;
+    return 0;
+}
+
+/* fill the iovecs of the padding and the frame header, the payload follows them */
+static int recordFrameStart(recordWriter *rec, struct iovec *iov, recordFrameHeader *fh, uint32_t size,
+                            uint32_t rawSize, uint64_t timestampNs, uint32_t sequence, uint32_t flags)
+{
+    uint64_t header = recordNextHeader(rec->offset);
+
+    memset(fh, 0, sizeof(*fh));
+    fh->magic = RECORD_FRAME_MAGIC;
+    fh->size = size;
+    fh->timestampNs = timestampNs;
+    fh->sequence = sequence;
+    fh->flags = flags;
+    fh->rawSize = rawSize;
+    iov[0].iov_base = (void *)zeroPad;
+    iov[0].iov_len = header - rec->offset;
+    iov[1].iov_base = fh;
+    iov[1].iov_len = sizeof(*fh);
+    return 2;
+}
+
+recordWriter *recordCreate(const char *path, const struct v4l2_pix_format *pix)
+{
+    return recordCreateCodec(path, pix, RECORD_CODEC_NONE, 0);
+}
+
+recordWriter *recordCreateCodec(const char *path, const struct v4l2_pix_format *pix, uint32_t codec,
+                                int32_t level)
+{
+    recordWriter *rec = calloc(1, sizeof(*rec));
+    recordHeader header;
+    struct iovec iov;
+
+    if (rec == NULL)
+    {
+        return NULL;
+    }
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec->fd < 0)
+    {
+        free(rec);
+        return NULL;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = codec != RECORD_CODEC_NONE ? RECORD_VERSION : RECORD_VERSION_RAW;
+    header.headerSize = sizeof(header);
+    header.width = pix->width;
+    header.height = pix->height;
+    header.pixelformat = pix->pixelformat;
+    header.field = pix->field;
+    header.bytesperline = pix->bytesperline;
+    header.sizeimage = pix->sizeimage;
+    header.colorspace = pix->colorspace;
+    header.codec = codec;
+    header.level = codec != RECORD_CODEC_NONE ? level : 0;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    if (recordWriteAll(rec->fd, &iov, 1) < 0)
+    {
+        close(rec->fd);
+        free(rec);
+        return NULL;
+    }
+    rec->offset = sizeof(header);
+    return rec;
+}
+
+int recordWrite(recordWriter *rec, const void *data, uint32_t size, uint64_t timestampNs,
+                uint32_t sequence, uint32_t flags)
+{
+    return recordWriteCompressed(rec, data, size, 0, timestampNs, sequence, flags);
+}
+
+int recordWriteCompressed(recordWriter *rec, const void *data, uint32_t size, uint32_t rawSize,
+                          uint64_t timestampNs, uint32_t sequence, uint32_t flags)
+{
+    recordFrameHeader fh;
+    struct iovec iov[3];
+    int n = recordFrameStart(rec, iov, &fh, size, rawSize, timestampNs, sequence, flags);
+    uint64_t payload = rec->offset + iov[0].iov_len + iov[1].iov_len;
+
+    iov[n].iov_base = (void *)data;
+    iov[n].iov_len = size;
+    if (recordWriteAll(rec->fd, iov, n + 1) < 0)
+    {
+        return -1;
+    }
+    rec->offset = payload + size;
+    return recordAddEntry(rec, payload, size, rawSize, timestampNs, sequence, flags);
+}
+
+int recordWriteSplice(recordWriter *rec, int pipeFd, uint32_t size, uint64_t timestampNs,
+                      uint32_t sequence, uint32_t flags)
+{
+    recordFrameHeader fh;
+    struct iovec iov[2];
+    int n = recordFrameStart(rec, iov, &fh, size, 0, timestampNs, sequence, flags);
+    uint64_t payload = rec->offset + iov[0].iov_len + iov[1].iov_len;
+    uint32_t left = size;
+    ssize_t moved;
+
+    if (recordWriteAll(rec->fd, iov, n) < 0)
+    {
+        return -1;
+    }
+    rec->offset = payload;
+    while (left > 0)
+    {
+        moved = splice(pipeFd, NULL, rec->fd, NULL, left, SPLICE_F_MOVE);
+        if (moved <= 0)
+        {
+            // the frame header is written, the reader stops at this frame
+            return -1;
+        }
+        left -= moved;
+        rec->offset += moved;
+    }
+    return recordAddEntry(rec, payload, size, 0, timestampNs, sequence, flags);
+}
+
+int recordClose(recordWriter *rec)
+{
+    recordFooter footer;
+    struct iovec iov[3];
+    uint64_t indexOffset = (rec->offset + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+    int ret;
+
+    memset(&footer, 0, sizeof(footer));
+    footer.indexOffset = indexOffset;
+    footer.count = rec->count;
+    memcpy(footer.magic, RECORD_INDEX_MAGIC, sizeof(footer.magic));
+    iov[0].iov_base = (void *)zeroPad;
+    iov[0].iov_len = indexOffset - rec->offset;
+    iov[1].iov_base = rec->index;
+    iov[1].iov_len = rec->count * sizeof(*rec->index);
+    iov[2].iov_base = &footer;
+    iov[2].iov_len = sizeof(footer);
+    ret = recordWriteAll(rec->fd, iov, 3);
+    if (close(rec->fd) < 0)
+    {
+        ret = -1;
+    }
+    free(rec->index);
+    free(rec);
+    return ret;
+}
+
+/* rebuild the index of a file without footer from the frame headers */
+static int recordRecover(recordReader *rd)
+{
+    uint64_t cap = 0, header = recordNextHeader(sizeof(recordHeader));
+    const recordFrameHeader *fh;
+    recordIndexEntry *entry;
+
+    while (header + sizeof(*fh) <= rd->size)
+    {
+        fh = (const recordFrameHeader *)(rd->map + header);
+        if (fh->magic != RECORD_FRAME_MAGIC || fh->size > rd->size - header - sizeof(*fh))
+        {
+            break;
+        }
+        if (rd->count == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            entry = realloc(rd->recovered, cap * sizeof(*entry));
+            if (entry == NULL)
+            {
+                return -1;
+            }
+            rd->recovered = entry;
+        }
+        entry = &rd->recovered[rd->count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->offset = header + sizeof(*fh);
+        entry->size = fh->size;
+        entry->flags = fh->flags;
+        entry->timestampNs = fh->timestampNs;
+        entry->sequence = fh->sequence;
+        entry->rawSize = fh->rawSize;
+        header = recordNextHeader(entry->offset + entry->size);
+    }
+    rd->index = rd->recovered;
+    rd->isRecovered = 1;
+    return 0;
+}
+
+recordReader *recordOpen(const char *path)
+{
+    recordReader *rd;
+    const recordFooter *footer;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(recordHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    rd = calloc(1, sizeof(*rd));
+    if (rd == NULL)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    rd->map = map;
+    rd->size = st.st_size;
+    rd->header = map;
+    if (memcmp(rd->header->magic, RECORD_MAGIC, sizeof(rd->header->magic)) != 0 ||
+        rd->header->version < RECORD_VERSION_RAW || rd->header->version > RECORD_VERSION ||
+        rd->header->headerSize != sizeof(recordHeader))
+    {
+        recordRelease(rd);
+        return NULL;
+    }
+
+    footer = (const recordFooter *)(rd->map + rd->size - sizeof(*footer));
+    if (rd->size >= sizeof(recordHeader) + sizeof(*footer) &&
+        memcmp(footer->magic, RECORD_INDEX_MAGIC, sizeof(footer->magic)) == 0 &&
+        footer->indexOffset % RECORD_ALIGN == 0 &&
+        footer->count <= (rd->size - sizeof(*footer)) / sizeof(recordIndexEntry) &&
+        footer->indexOffset + footer->count * sizeof(recordIndexEntry) + sizeof(*footer) == rd->size)
+    {
+        rd->index = (const recordIndexEntry *)(rd->map + footer->indexOffset);
+        rd->count = footer->count;
+    }
+    else if (recordRecover(rd) < 0)
+    {
+        recordRelease(rd);
+        return NULL;
+    }
+    return rd;
+}
+
+void recordRelease(recordReader *rd)
+{
+    munmap((void *)rd->map, rd->size);
+    free(rd->recovered);
+    free(rd);
+}
+
+const recordHeader *recordFormat(const recordReader *rd)
+{
+    return rd->header;
+}
+
+uint32_t recordCodec(const recordReader *rd)
+{
+    return rd->header->codec;
+}
+
+uint64_t recordCount(const recordReader *rd)
+{
+    return rd->count;
+}
+
+int recordRecovered(const recordReader *rd)
+{
+    return rd->isRecovered;
+}
+
+const recordIndexEntry *recordEntry(const recordReader *rd, uint64_t i)
+{
+    return i < rd->count ? &rd->index[i] : NULL;
+}
+
+const void *recordFrame(const recordReader *rd, uint64_t i, uint32_t *size)
+{
+    const recordIndexEntry *entry = recordEntry(rd, i);
+
+    if (entry == NULL || entry->offset > rd->size || entry->size > rd->size - entry->offset)
+    {
+        return NULL;
+    }
+    if (size != NULL)
+    {
+        *size = entry->size;
+    }
+    return rd->map + entry->offset;
+}
+
+int64_t recordSeek(const recordReader *rd, uint64_t timestampNs)
+{
+    uint64_t low = 0, high = rd->count, mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (rd->index[mid].timestampNs < timestampNs)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low < rd->count ? (int64_t)low : -1;
+}
@@ -0,0 +1,244 @@
+/*
+* @file     cam_record.h
+* @author   Trong Phuoc
+* @brief    Append-only recording container for captured frames and a reader that
+*           maps it into memory for random access without copies
+*/
+#ifndef CAM_RECORD_H
+#define CAM_RECORD_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
+
+/*
+ * File layout, all fields in host byte order:
+ *
+ *   recordHeader          format of the frames, RECORD_ALIGN bytes
+ *   recordFrameHeader     \
+ *   payload               |  once per frame, every payload starts on a
+ *   padding               /  RECORD_ALIGN boundary
+ *   ...
+ *   recordIndexEntry[n]   written on close
+ *   recordFooter          last bytes of the file, points to the index
+ *
+ * A file whose writer died has no footer, the reader then rebuilds the index
+ * from the frame headers.
+ *
+ * A compressed recording (version 2) names its codec in the header. Every
+ * payload is then one independent block of that codec which decompresses to
+ * rawSize bytes, so frames stay randomly accessible. Recordings without codec
+ * are still written as version 1.
+ */
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define RECORD_MAGIC        "CAMREC01"
+#define RECORD_INDEX_MAGIC  "CAMRIDX1"
+#define RECORD_FRAME_MAGIC  0x4d415246u   /* "FRAM" */
+#define RECORD_VERSION      2
+#define RECORD_VERSION_RAW  1             /**< no codec, readable by older readers */
+#define RECORD_ALIGN        64
+
+#define RECORD_FLAG_ERROR   (1u << 0)     /**< the frame is known to be corrupted */
+#define RECORD_FLAG_KEY     (1u << 1)     /**< the frame can be decoded alone */
+
+#define RECORD_CODEC_NONE   0
+#define RECORD_CODEC_LZ4    1
+#define RECORD_CODEC_ZSTD   2
+#define RECORD_CODEC_ZLIB   3
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct recordHeader
+{
+    char magic[8];              /**< RECORD_MAGIC */
+    uint32_t version;           /**< RECORD_VERSION */
+    uint32_t headerSize;        /**< sizeof(recordHeader) */
+    uint32_t width;             /**< negotiated struct v4l2_pix_format */
+    uint32_t height;
+    uint32_t pixelformat;
+    uint32_t field;
+    uint32_t bytesperline;
+    uint32_t sizeimage;
+    uint32_t colorspace;
+    uint32_t codec;             /**< RECORD_CODEC_* of the payloads */
+    int32_t level;              /**< compression level the writer used */
+    uint32_t reserved[3];
+} recordHeader;
+
+typedef struct recordFrameHeader
+{
+    uint32_t magic;             /**< RECORD_FRAME_MAGIC */
+    uint32_t size;              /**< bytes of payload, without padding */
+    uint64_t timestampNs;
+    uint32_t sequence;
+    uint32_t flags;             /**< RECORD_FLAG_* */
+    uint32_t rawSize;           /**< bytes once decompressed, 0 when stored as is */
+    uint32_t reserved;
+} recordFrameHeader;
+
+typedef struct recordIndexEntry
+{
+    uint64_t offset;            /**< file offset of the payload */
+    uint32_t size;
+    uint32_t flags;
+    uint64_t timestampNs;
+    uint32_t sequence;
+    uint32_t rawSize;           /**< bytes once decompressed, 0 when stored as is */
+} recordIndexEntry;
+
+typedef struct recordFooter
+{
+    uint64_t indexOffset;       /**< file offset of the first index entry */
+    uint64_t count;             /**< number of index entries */
+    char magic[8];              /**< RECORD_INDEX_MAGIC */
+    uint64_t reserved;
+} recordFooter;
+
+typedef struct recordWriter recordWriter;
+typedef struct recordReader recordReader;
+
+/*******************************************************************************
+ * FUNCTIONS - WRITER
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    recordWriter *recordCreate(const char *path, const struct v4l2_pix_format *pix)
+ *
+ * @brief   create a recording and write its header
+ * @return  the writer, NULL when the file can not be created
+***********************************************************************************/
+recordWriter *recordCreate(const char *path, const struct v4l2_pix_format *pix);
+
+/**********************************************************************************
+ * @func    recordWriter *recordCreateCodec(const char *path, const struct v4l2_pix_format *pix,
+ *                                          uint32_t codec, int32_t level)
+ *
+ * @brief   create a recording whose payloads are compressed with codec
+ *          (RECORD_CODEC_*), the frames are written with recordWriteCompressed
+ * @return  the writer, NULL when the file can not be created
+***********************************************************************************/
+recordWriter *recordCreateCodec(const char *path, const struct v4l2_pix_format *pix, uint32_t codec,
+                                int32_t level);
+
+/**********************************************************************************
+ * @func    int recordWrite(recordWriter *rec, const void *data, uint32_t size,
+ *                          uint64_t timestampNs, uint32_t sequence, uint32_t flags)
+ *
+ * @brief   append a frame, header, payload and padding go out in one writev()
+ * @return  0 - Success, -1 - write failed
+***********************************************************************************/
+int recordWrite(recordWriter *rec, const void *data, uint32_t size, uint64_t timestampNs,
+                uint32_t sequence, uint32_t flags);
+
+/**********************************************************************************
+ * @func    int recordWriteCompressed(recordWriter *rec, const void *data, uint32_t size,
+ *                                    uint32_t rawSize, uint64_t timestampNs,
+ *                                    uint32_t sequence, uint32_t flags)
+ *
+ * @brief   append a frame compressed into one block of size bytes, rawSize is the
+ *          size of the frame before compression
+ * @return  0 - Success, -1 - write failed
+***********************************************************************************/
+int recordWriteCompressed(recordWriter *rec, const void *data, uint32_t size, uint32_t rawSize,
+                          uint64_t timestampNs, uint32_t sequence, uint32_t flags);
+
+/**********************************************************************************
+ * @func    int recordWriteSplice(recordWriter *rec, int pipeFd, uint32_t size,
+ *                                uint64_t timestampNs, uint32_t sequence, uint32_t flags)
+ *
+ * @brief   append a frame of size bytes waiting in a pipe, the payload is moved
+ *          with splice() and never copied to user space
+ * @return  0 - Success, -1 - write failed
+***********************************************************************************/
+int recordWriteSplice(recordWriter *rec, int pipeFd, uint32_t size, uint64_t timestampNs,
+                      uint32_t sequence, uint32_t flags);
+
+/**********************************************************************************
+ * @func    int recordClose(recordWriter *rec)
+ *
+ * @brief   write the index and the footer, then close the file
+ * @return  0 - Success, -1 - write failed, the reader recovers the frames
+***********************************************************************************/
+int recordClose(recordWriter *rec);
+
+/*******************************************************************************
+ * FUNCTIONS - READER
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    recordReader *recordOpen(const char *path)
+ *
+ * @brief   map a recording, the index is used in place when the footer is valid
+ * @return  the reader, NULL when the file is not a recording
+***********************************************************************************/
+recordReader *recordOpen(const char *path);
+
+/**********************************************************************************
+ * @func    void recordRelease(recordReader *rd)
+ *
+ * @brief   unmap a recording, the pointers got from it become invalid
+***********************************************************************************/
+void recordRelease(recordReader *rd);
+
+/**********************************************************************************
+ * @func    const recordHeader *recordFormat(const recordReader *rd)
+ *
+ * @brief   get the format of the frames
+***********************************************************************************/
+const recordHeader *recordFormat(const recordReader *rd);
+
+/**********************************************************************************
+ * @func    uint32_t recordCodec(const recordReader *rd)
+ *
+ * @brief   get the codec of the payloads, RECORD_CODEC_NONE when stored as is
+***********************************************************************************/
+uint32_t recordCodec(const recordReader *rd);
+
+/**********************************************************************************
+ * @func    uint64_t recordCount(const recordReader *rd)
+ *
+ * @brief   get the number of frames
+***********************************************************************************/
+uint64_t recordCount(const recordReader *rd);
+
+/**********************************************************************************
+ * @func    int recordRecovered(const recordReader *rd)
+ *
+ * @brief   tell whether the index was rebuilt because the footer was missing
+***********************************************************************************/
+int recordRecovered(const recordReader *rd);
+
+/**********************************************************************************
+ * @func    const recordIndexEntry *recordEntry(const recordReader *rd, uint64_t i)
+ *
+ * @brief   get the index entry of frame i in O(1)
+ * @return  NULL when i is out of range
+***********************************************************************************/
+const recordIndexEntry *recordEntry(const recordReader *rd, uint64_t i);
+
+/**********************************************************************************
+ * @func    const void *recordFrame(const recordReader *rd, uint64_t i, uint32_t *size)
+ *
+ * @brief   get the payload of frame i in O(1), it points into the mapping. In a
+ *          compressed recording it is the compressed block, entry->rawSize gives
+ *          the size to decompress it to
+ * @return  NULL when i is out of range
+***********************************************************************************/
+const void *recordFrame(const recordReader *rd, uint64_t i, uint32_t *size);
+
+/**********************************************************************************
+ * @func    int64_t recordSeek(const recordReader *rd, uint64_t timestampNs)
+ *
+ * @brief   find the first frame taken at or after timestampNs, binary search
+ *          in the index
+ * @return  the frame number, -1 when every frame is older
+***********************************************************************************/
+int64_t recordSeek(const recordReader *rd, uint64_t timestampNs);
+
+#endif /* CAM_RECORD_H */
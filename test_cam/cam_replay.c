@@ -0,0 +1,386 @@
+/*
+* @file     cam_replay.c
+* @author   Trong Phuoc
+* @brief    Replay a recording written by cam_test -o through the output queue of
+*           a loopback node, the capture side of the node then streams it as if a
+*           camera was plugged
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include "cam_record.h"
+#include "frame_compress.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define REPLAY_MAX_BUFFERS  32
+#define REPLAY_RETRY_NS     100000000ULL  /* wait between REQBUFS tries */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct replayBuffer
+{
+    void *start;
+    size_t length;
+} replayBuffer;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static replayBuffer buffers[REPLAY_MAX_BUFFERS];
+static unsigned int n_buffers;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] NODE FILE \n"
+           "-f | --fast          Do not pace frames by their recorded timestamps \n"
+           "-l | --loop N        Play the recording N times, 0 loops forever \n"
+           "-w | --write         Use write() instead of memory mapped buffers \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(unsigned long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/* the node only takes the formats it advertises, tell when the capture side differs */
+static void setFormat(int fd, const recordHeader *header)
+{
+    struct v4l2_format format;
+
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    format.fmt.pix.width = header->width;
+    format.fmt.pix.height = header->height;
+    format.fmt.pix.pixelformat = header->pixelformat;
+    format.fmt.pix.field = header->field;
+    if (ioctl(fd, VIDIOC_S_FMT, &format) < 0)
+    {
+        // the capture side already allocated its buffers, it keeps its format
+        printf("Can not set the format: %s \n", strerror(errno));
+    }
+}
+
+static void checkFormat(int fd, const recordHeader *header)
+{
+    struct v4l2_format format;
+
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if (ioctl(fd, VIDIOC_G_FMT, &format) < 0)
+    {
+        return;
+    }
+    if (format.fmt.pix.width != header->width || format.fmt.pix.height != header->height ||
+        format.fmt.pix.pixelformat != header->pixelformat)
+    {
+        printf("Warning: the node streams %ux%u %.4s, the recording is %ux%u %.4s \n",
+               format.fmt.pix.width, format.fmt.pix.height, (const char *)&format.fmt.pix.pixelformat,
+               header->width, header->height, (const char *)&header->pixelformat);
+    }
+}
+
+/* the output queue shares the buffers of the capture side, wait until they exist */
+static int initBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    int waiting = 0;
+
+    for (;;)
+    {
+        memset(&req, 0, sizeof(req));
+        req.count = REPLAY_MAX_BUFFERS;
+        req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        req.memory = V4L2_MEMORY_MMAP;
+        if (ioctl(fd, VIDIOC_REQBUFS, &req) == 0)
+        {
+            break;
+        }
+        if (errno != EBUSY)
+        {
+            printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+            return -1;
+        }
+        if (!waiting)
+        {
+            printf("Waiting for a capture client \n");
+            waiting = 1;
+        }
+        sleepUntil(getTimeNs() + REPLAY_RETRY_NS);
+    }
+
+    if (req.count > REPLAY_MAX_BUFFERS)
+    {
+        req.count = REPLAY_MAX_BUFFERS;
+    }
+    for (n_buffers = 0; n_buffers < req.count; n_buffers++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n_buffers;
+        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            printf("VIDIOC_QUERYBUF failed: %s \n", strerror(errno));
+            return -1;
+        }
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[n_buffers].start == MAP_FAILED)
+        {
+            printf("Can not map buffer %u \n", n_buffers);
+            return -1;
+        }
+    }
+    printf("%u buffers shared with the capture side \n", n_buffers);
+    return 0;
+}
+
+static void uninitBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i;
+
+    for (i = 0; i < n_buffers; i++)
+    {
+        munmap(buffers[i].start, buffers[i].length);
+    }
+    memset(&req, 0, sizeof(req));
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    ioctl(fd, VIDIOC_REQBUFS, &req);
+}
+
+/* fill the oldest empty buffer of the capture side with the frame */
+static int queueFrame(int fd, const void *data, uint32_t size, uint64_t timestampNs)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0)
+    {
+        printf("VIDIOC_DQBUF failed: %s \n", strerror(errno));
+        return -1;
+    }
+    if (buf.index >= n_buffers)
+    {
+        return -1;
+    }
+    if (size > buffers[buf.index].length)
+    {
+        size = buffers[buf.index].length;
+    }
+    memcpy(buffers[buf.index].start, data, size);
+    buf.bytesused = size;
+    buf.field = V4L2_FIELD_NONE;
+    buf.timestamp.tv_sec = timestampNs / 1000000000ULL;
+    buf.timestamp.tv_usec = (timestampNs % 1000000000ULL) / 1000;
+    if (ioctl(fd, VIDIOC_QBUF, &buf) < 0)
+    {
+        printf("VIDIOC_QBUF failed: %s \n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"fast", no_argument, NULL, 'f'},
+        {"loop", required_argument, NULL, 'l'},
+        {"write", no_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const recordIndexEntry *entry;
+    const void *payload;
+    uint8_t *raw = NULL;
+    recordReader *rd;
+    unsigned long long start, due, firstNs, lastNs, offsetNs = 0, late = 0, bytes = 0, frames = 0;
+    unsigned long loops = 1, pass;
+    uint64_t i, count;
+    uint32_t size;
+    int fast = 0;
+    int useWrite = 0;
+    int status = 0;
+    int fd, c;
+
+    while ((c = getopt_long(argc, argv, "fl:wh", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'f':
+            fast = 1;
+            break;
+        case 'l':
+            loops = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            useWrite = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rd = recordOpen(argv[optind + 1]);
+    if (rd == NULL)
+    {
+        printf("%s is not a recording \n", argv[optind + 1]);
+        return 1;
+    }
+    count = recordCount(rd);
+    if (!compressSupported(recordCodec(rd)))
+    {
+        printf("%s is compressed with a codec not built in \n", argv[optind + 1]);
+        recordRelease(rd);
+        return 1;
+    }
+    if (count == 0)
+    {
+        printf("%s has no frame \n", argv[optind + 1]);
+        recordRelease(rd);
+        return 1;
+    }
+    fd = open(argv[optind], O_RDWR);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", argv[optind]);
+        recordRelease(rd);
+        return 1;
+    }
+
+    setFormat(fd, recordFormat(rd));
+    if (!useWrite && initBuffers(fd) < 0)
+    {
+        close(fd);
+        recordRelease(rd);
+        return 1;
+    }
+    checkFormat(fd, recordFormat(rd));
+
+    // one frame is decompressed at a time, none is bigger than an image
+    if (recordCodec(rd) != RECORD_CODEC_NONE)
+    {
+        raw = malloc(recordFormat(rd)->sizeimage);
+        if (raw == NULL)
+        {
+            printf("Out of memory \n");
+            status = -1;
+        }
+    }
+    firstNs = recordEntry(rd, 0)->timestampNs;
+    lastNs = recordEntry(rd, count - 1)->timestampNs;
+    start = getTimeNs();
+    for (pass = 0; status == 0 && (loops == 0 || pass < loops); pass++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            entry = recordEntry(rd, i);
+            payload = recordFrame(rd, i, &size);
+            if (payload == NULL)
+            {
+                continue;
+            }
+            if (entry->rawSize != 0)
+            {
+                if (entry->rawSize > recordFormat(rd)->sizeimage ||
+                    compressDecode(recordCodec(rd), payload, size, raw, entry->rawSize) < 0)
+                {
+                    printf("Can not decompress frame %" PRIu64 " \n", i);
+                    continue;
+                }
+                payload = raw;
+                size = entry->rawSize;
+            }
+            if (!fast)
+            {
+                due = start + offsetNs + (entry->timestampNs - firstNs);
+                if (getTimeNs() > due)
+                {
+                    late++;
+                }
+                sleepUntil(due);
+            }
+            // the timestamps keep growing across loops
+            if (useWrite)
+            {
+                status = write(fd, payload, size) < 0 ? -1 : 0;
+            }
+            else
+            {
+                status = queueFrame(fd, payload, size, entry->timestampNs + offsetNs);
+            }
+            if (status < 0)
+            {
+                printf("Replay stopped at frame %" PRIu64 " \n", i);
+                break;
+            }
+            frames++;
+            bytes += size;
+        }
+        // one average frame interval between the last frame and the next loop
+        offsetNs += lastNs - firstNs + (count > 1 ? (lastNs - firstNs) / (count - 1) : 0);
+    }
+
+    printf("------------------> Replay statistics <-------------------- \n");
+    printf("Frames: %llu, %llu bytes in %.3f s, %.1f fps \n", frames, bytes, (getTimeNs() - start) / 1e9,
+           frames * 1e9 / (getTimeNs() - start));
+    if (!fast)
+    {
+        printf("Late frames: %llu \n", late);
+    }
+
+    if (!useWrite)
+    {
+        uninitBuffers(fd);
+    }
+    close(fd);
+    free(raw);
+    recordRelease(rd);
+    return status < 0 ? 1 : 0;
+}
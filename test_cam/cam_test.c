@@ -16,25 +16,322 @@ buffer *buffers;
 static unsigned int n_buffers;
 unsigned int frame_number = 0;
 unsigned frame_count = 1;
+int write_frames = 1;
+const char *output_name = NULL;
+int latest_frame = 0;
+unsigned int frame_decimation = 1;
+int error_frames = -1;
+unsigned int buffer_count = 4;
+unsigned int frame_width = 640;
+unsigned int frame_height = 480;
+unsigned int frame_fourcc = 0;
+unsigned int batch_size = 0;
+static struct cam_batch batch_req;  /* nqueue holds the frames given back on the next call */
+int spin_ring = 0;
+static struct cam_ring *completion_ring = NULL;
+static size_t ring_size;
+static __u32 ring_tail;             /* done[] entries consumed, ring_tail is published as done_tail */
+static __u32 ring_free;             /* indexes written to free[] */
+static captureStats stats;
+static unsigned long long *latency_samples = NULL; /* per frame, capture to done */
+static unsigned long n_latency;
+static unsigned long latency_size;
+static recordWriter *recorder = NULL;
+static unsigned long long frame_timestamp;  /* metadata of the frame given to processImage */
+static unsigned int frame_sequence;
+static int have_sequence = 0;       /* last_sequence holds the previous buffer */
+static unsigned int last_sequence;
+static int splice_pipe[2] = {-1, -1};
+static unsigned int splice_size;
+const char *convert_name = NULL;
+static convertFunc convert_func = NULL;
+static unsigned int convert_fourcc;
+static unsigned int convert_num;    /* destination bytes per 2 pixels */
+static unsigned char *convert_buff = NULL;
+static struct v4l2_pix_format frame_pix;
+unsigned int decode_threads = 0;
+static framePool *decode_pool = NULL;
+const char *device_name = DEVICE_NAME;
+int share_policy = -1;
+unsigned int share_depth = 0;
+const char *affinity_cpus = NULL;
+struct v4l2_rect crop_rect;
+double motion_threshold = -1.0;
+unsigned int motion_max_skip = 0;
+static motionGate *motion_gate = NULL;
+compressConfig compress_config = {RECORD_CODEC_NONE, 0};
+unsigned int compress_threads = 2;
+static framePool *compress_pool = NULL;
+unsigned int publish_slots = 0;
+static frameRing *publish_ring = NULL;
+const char *serve_path = NULL;
+static frameServer *frame_server = NULL;
+
+/*******************************************************************************
+ * @func    static unsigned long long getTimeNs(void)
+ * 
+ * @brief   read the monotonic clock in nanoseconds
+ *******************************************************************************/
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * @func    static void accountFrame(unsigned int size, unsigned long long ns)
+ * 
+ * @brief   add a frame and the time spent to get it into the capture statistics
+ *******************************************************************************/
+static void accountFrame(unsigned int size, unsigned long long ns)
+{
+    unsigned long long now = getTimeNs();
+    if (stats.frames == 0)
+    {
+        stats.startNs = now;
+    }
+    stats.endNs = now;
+    stats.frames++;
+    stats.bytes += size;
+    stats.transferNs += ns;
+}
+
+/*******************************************************************************
+ * @func    static void accountLatency(unsigned long long since)
+ * 
+ * @brief   keep the time from since to now as the latency of the current frame
+ *******************************************************************************/
+static void accountLatency(unsigned long long since)
+{
+    unsigned long long now = getTimeNs();
+    if (n_latency < latency_size)
+    {
+        latency_samples[n_latency++] = now > since ? now - since : 0;
+    }
+}
+
+static int compareNs(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+ * @func    static void checkSequence(const struct v4l2_buffer *buf)
+ * 
+ * @brief   count the frames skipped since the previous buffer and the corrupted
+ *          frames, and report them as they happen
+ *******************************************************************************/
+static void checkSequence(const struct v4l2_buffer *buf)
+{
+    unsigned int gap;
+
+    // the sequence restarts with the stream, decimated frames are not missed
+    if (have_sequence && buf->sequence > last_sequence + frame_decimation)
+    {
+        gap = (buf->sequence - last_sequence) / frame_decimation - 1;
+        stats.missed += gap;
+        printf("Frame %u: %u frames missed \n", buf->sequence, gap);
+    }
+    have_sequence = 1;
+    last_sequence = buf->sequence;
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+    {
+        stats.errorFrames++;
+        printf("Frame %u: corrupted \n", buf->sequence);
+    }
+}
+
+/*******************************************************************************
+ * @func    static void decodeWrite(poolJob *job)
+ * 
+ * @brief   write a decoded frame and give its job back to the decode pool
+ *******************************************************************************/
+static void decodeWrite(poolJob *job)
+{
+    if (job->status == 0)
+    {
+        stats.decoded++;
+        frame_timestamp = job->timestamp;
+        frame_sequence = job->flags;
+        processImage(job->out, job->outSize);
+    }
+    else
+    {
+        stats.decodeErrors++;
+    }
+    framePoolRelease(decode_pool, job);
+}
+
+/*******************************************************************************
+ * @func    static void decodeOutput(int wait)
+ * 
+ * @brief   write the decoded frames in capture order, with wait set it returns
+ *          only when every submitted frame is written
+ *******************************************************************************/
+static void decodeOutput(int wait)
+{
+    poolJob *job;
+    while ((job = framePoolReceive(decode_pool, wait)) != NULL)
+    {
+        decodeWrite(job);
+    }
+}
+
+/*******************************************************************************
+ * @func    static int decodeSubmit(const void *data, unsigned int size)
+ * 
+ * @brief   copy a MJPEG frame into the decode pool, the driver buffer can be
+ *          queued again as soon as this returns
+ *******************************************************************************/
+static int decodeSubmit(const void *data, unsigned int size)
+{
+    unsigned long long start = getTimeNs();
+    poolJob *job;
+    while ((job = framePoolGetJob(decode_pool, 0)) == NULL)
+    {
+        // all decoders are busy, write the oldest frame to free a job
+        decodeWrite(framePoolReceive(decode_pool, 1));
+    }
+    stats.decodeWaitNs += getTimeNs() - start;
+    if (framePoolSetInput(job, data, size) < 0)
+    {
+        printf("Out of memory \n");
+        return RETURN_STATUS_ERR;
+    }
+    job->timestamp = frame_timestamp;
+    job->flags = frame_sequence;
+    framePoolSubmit(decode_pool, job);
+    return RETURN_STATUS_OK;
+}
+
+/*******************************************************************************
+ * @func    static void publishFrame(const void *data, unsigned int size)
+ * 
+ * @brief   copy a dequeued frame into the shared ring and hand it to the
+ *          socket clients, the readers never hold up the capture
+ *******************************************************************************/
+static void publishFrame(const void *data, unsigned int size)
+{
+    unsigned long long start;
+    if (publish_ring != NULL)
+    {
+        start = getTimeNs();
+        if (frameRingPublish(publish_ring, data, size, frame_timestamp, frame_sequence) < 0)
+        {
+            printf("Frame %u does not fit in a ring slot \n", frame_sequence);
+        }
+        else
+        {
+            stats.published++;
+            stats.publishNs += getTimeNs() - start;
+        }
+    }
+    if (frame_server != NULL)
+    {
+        start = getTimeNs();
+        if (frameServerPublish(frame_server, data, size, frame_timestamp, frame_sequence) > 0)
+        {
+            stats.served++;
+        }
+        stats.serveNs += getTimeNs() - start;
+    }
+}
+
+/*******************************************************************************
+ * @func    static void compressWrite(poolJob *job)
+ * 
+ * @brief   write a compressed frame, or the frame as is when it did not shrink,
+ *          and give its job back to the compression pool
+ *******************************************************************************/
+static void compressWrite(poolJob *job)
+{
+    unsigned long long start = getTimeNs();
+    int ret;
+    if (job->status == 0)
+    {
+        ret = recordWriteCompressed(recorder, job->out, job->outSize, job->inSize, job->timestamp,
+                                    job->flags, 0);
+        stats.packedBytes += job->outSize;
+    }
+    else
+    {
+        ret = recordWrite(recorder, job->in, job->inSize, job->timestamp, job->flags, 0);
+        stats.packedBytes += job->inSize;
+        stats.storedRaw++;
+    }
+    if (ret < 0)
+    {
+        printf("Write frame %u failed \n", job->flags);
+    }
+    stats.compressed++;
+    stats.rawBytes += job->inSize;
+    stats.compressCpuNs += job->cpuNs;
+    stats.writeNs += getTimeNs() - start;
+    framePoolRelease(compress_pool, job);
+}
+
+/*******************************************************************************
+ * @func    static void compressOutput(int wait)
+ * 
+ * @brief   write the compressed frames in capture order, with wait set it
+ *          returns only when every submitted frame is written
+ *******************************************************************************/
+static void compressOutput(int wait)
+{
+    poolJob *job;
+    while ((job = framePoolReceive(compress_pool, wait)) != NULL)
+    {
+        compressWrite(job);
+    }
+}
+
+/*******************************************************************************
+ * @func    static int compressSubmit(const void *data, unsigned int size)
+ * 
+ * @brief   copy a frame into the compression pool, the caller can reuse its
+ *          buffer as soon as this returns
+ *******************************************************************************/
+static int compressSubmit(const void *data, unsigned int size)
+{
+    poolJob *job;
+    while ((job = framePoolGetJob(compress_pool, 0)) == NULL)
+    {
+        // all workers are busy, write the oldest frame to free a job
+        compressWrite(framePoolReceive(compress_pool, 1));
+    }
+    if (framePoolSetInput(job, data, size) < 0)
+    {
+        printf("Out of memory \n");
+        return RETURN_STATUS_ERR;
+    }
+    job->timestamp = frame_timestamp;
+    job->flags = frame_sequence;
+    framePoolSubmit(compress_pool, job);
+    compressOutput(0);
+    return RETURN_STATUS_OK;
+}
 
 /*******************************************************************************
  * FUNCTIONS - API
  ******************************************************************************/
 
 /*******************************************************************************
- * @func    static int openDevice(void)
+ * @func    int openDevice(void)
  * 
  * @brief   open the device file in /dev/video*       
  * @return  fd(file descriptor when open a file) - Success
  * @return  ERROR - Open device file is failed
  *******************************************************************************/
-static int openDevice(void)
+int openDevice(void)
 {
     int fd;
-    fd = open(DEVICE_NAME, O_RDWR | O_NONBLOCK, 0);
+    fd = open(device_name, O_RDWR | O_NONBLOCK, 0);
     if (fd < 0)
     {
-        printf("Can not open camera device \n");
+        printf("Can not open camera device %s \n", device_name);
         return RETURN_STATUS_ERR;
     }
     else
@@ -43,14 +340,14 @@ static int openDevice(void)
     }
 }
 /*******************************************************************************
- * @func    static int closeDevice(int fd)
+ * @func    int closeDevice(int fd)
  *
  * @brief   close the device file in /dev/video*       
  * @param   fd - file descriptor of device file
  * @return  RETURN_STATUS_OK  -  close success
  * @return  RETURN_STATUS_ERR -  Close device failed
  *******************************************************************************/
-static int closeDevice(int fd)
+int closeDevice(int fd)
 {
     int ret = 0;
     if (close(fd) == -1)
@@ -62,7 +359,7 @@ static int closeDevice(int fd)
     return RETURN_STATUS_OK;
 }
 /**********************************************************************************
- * @func     static int printCapabilities(int fd, struct v4l2_capability caps)
+ * @func     int printCapabilities(int fd, struct v4l2_capability caps)
  * 
  * @brief    enumerate capabilities of uvc device
  * @param    fd - file descriptor when open the device
@@ -72,7 +369,7 @@ static int closeDevice(int fd)
  * @return    0 - query capability of device success
  * 
 ***********************************************************************************/
-static int printCapabilities(int fd, struct v4l2_capability caps)
+int printCapabilities(int fd, struct v4l2_capability caps)
 {
 
     int ret = 0;
@@ -100,6 +397,7 @@ static int printCapabilities(int fd, struct v4l2_capability caps)
     switch (io)
     {
     case IO_METHOD_READ:
+    case IO_METHOD_SPLICE:
     {
         if (!(caps.capabilities & V4L2_CAP_READWRITE))
         {
@@ -124,7 +422,7 @@ static int printCapabilities(int fd, struct v4l2_capability caps)
 
     return 0;
 }
-static int getInput(int fd, unsigned int *index)
+int getInput(int fd, unsigned int *index)
 {
 
     int ret = 0;
@@ -137,7 +435,7 @@ static int getInput(int fd, unsigned int *index)
     return ret;
 }
 /**********************************************************************************
- * @func     static int enumInput(int fd, struct v4l2_input input)
+ * @func     int enumInput(int fd, struct v4l2_input input)
 
  * @brief    enumerate video device input
  * @param    fd - file descriptor when open the device
@@ -146,7 +444,7 @@ static int getInput(int fd, unsigned int *index)
  * @return   0 - enumerate video device input success
  * 
 ***********************************************************************************/
-static int enumInput(int fd, struct v4l2_input input)
+int enumInput(int fd, struct v4l2_input input)
 {
     int ret = 0;
     ret = ioctl(fd, VIDIOC_ENUMINPUT, &input);
@@ -168,7 +466,7 @@ static int enumInput(int fd, struct v4l2_input input)
     return ret;
 }
 
-static int setInput(int fd, int index)
+int setInput(int fd, int index)
 {
     int ret = 0;
     ret = ioctl(fd, VIDIOC_S_INPUT, &index);
@@ -181,7 +479,7 @@ static int setInput(int fd, int index)
     return ret;
 }
 /**********************************************************************************
- * @func    static int setFormat(int fd, struct v4l2_format format)
+ * @func    int setFormat(int fd, struct v4l2_format format)
  * 
  * @brief   Negotiate format of pixel with device
  * @para    fd - file descriptor when open the device
@@ -189,7 +487,7 @@ static int setInput(int fd, int index)
  * @return  negative number - the ioctl VIDIOC_S_FMT is failed
  * @return  0 - setting format success
 **********************************************************************************/
-static int setFormat(int fd, struct v4l2_format format)
+int setFormat(int fd, struct v4l2_format format)
 {
     int ret = 0;
     format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -209,7 +507,7 @@ static int setFormat(int fd, struct v4l2_format format)
     return ret;
 }
 /**********************************************************************************
- * @func    static int getFormat(int fd, struct v4l2_format format)
+ * @func    int getFormat(int fd, struct v4l2_format format)
  * 
  * @brief   get format of pixel
  * @param   fd - file descriptor when open the device
@@ -217,7 +515,7 @@ static int setFormat(int fd, struct v4l2_format format)
  * @return  negative number - the ioctl VIDIOC_G_FMT is failed
  * @return  0 - getting format success
 **********************************************************************************/
-static int getFormat(int fd, struct v4l2_format format)
+int getFormat(int fd, struct v4l2_format format)
 {
     if (ioctl(fd, VIDIOC_G_FMT, &format) < 0)
     {
@@ -244,7 +542,7 @@ static int getFormat(int fd, struct v4l2_format format)
     return 0;
 }
 /**********************************************************************************
- * @func    static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
+ * @func    int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
  * 
  * @brief   Allocate device buffers
  * @para    fd - file descriptor when open the device
@@ -254,10 +552,10 @@ static int getFormat(int fd, struct v4l2_format format)
  * @return  INSUFFICENT_BUFF - not enough buffer
  * @return  0 - request buffer success
 ***********************************************************************************/
-static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
+int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
 {
     int ret = 0;
-    reqbuff->count = 4;
+    reqbuff->count = buffer_count;
     reqbuff->memory = V4L2_MEMORY_MMAP;
     reqbuff->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     // CLEAR(reqbuff->reserved);
@@ -281,7 +579,7 @@ static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
     return ret;
 }
 /**********************************************************************************
- * @func    static void init_mmap_method(int fd)
+ * @func    void init_mmap_method(int fd)
  * 
  * @brief   Initialize to use MMAP method to exchange data between user space and 
  *          kernel space 
@@ -290,16 +588,22 @@ static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
  * @return  MAP_FAILED - mapping memory address between user space and kernel space 
  *          is failed  
 /**********************************************************************************/
-static void init_mmap_method(int fd)
+void init_mmap_method(int fd)
 {
     int ret =0 ;
     struct v4l2_requestbuffers reqbuff;
-    requestBuffer(fd, &reqbuff);
+    CLEAR(reqbuff);
+    n_buffers = 0;
+    if (requestBuffer(fd, &reqbuff) != RETURN_STATUS_OK)
+    {
+        return;
+    }
     printf("buffer count : %d \n", reqbuff.count);
     buffers = (buffer *)calloc(reqbuff.count, sizeof(*buffers));
     if (buffers == NULL)
     {
         printf("Allocation memory failed \n");
+        return;
     }
 
     for (n_buffers = 0; n_buffers < reqbuff.count; n_buffers++)
@@ -329,181 +633,769 @@ static void init_mmap_method(int fd)
 }
 
 /**********************************************************************************
- * @func    static int enumFormat(int fd)
+ * @func    void initRead(unsigned int size)
  * 
- * @brief   Enumerate format of the device
- * @param   fd - file descriptor when open the device
- * @return  ERROR - ioctl VIDIOC_ENUM_FMT is failed
- * @return  0 - enumerate format success
- 
+ * @brief   Initialize to use read() to copy frames from kernel space, the driver
+ *          starts streaming on the first read
+ * @param   size: size of a frame reported by VIDIOC_G_FMT
 ***********************************************************************************/
-static int enumFormat(int fd)
+void initRead(unsigned int size)
 {
-    struct v4l2_fmtdesc formatCap;
-    int ret;
-    formatCap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    formatCap.index = 0;
-    ret = 0;
-
-    ret = ioctl(fd, VIDIOC_ENUM_FMT, &formatCap);
-    printf("------------------> Format cap %d <-------------------- \n", formatCap.index);
-    printf("flags : %d \n", formatCap.flags);
-    // printf("Width: %d \n", formatCap.pixelformat)
-    printf("Description : %s \n", formatCap.description);
-    printf("Pixel format: %d \n", formatCap.pixelformat);
-    return ret;
+    buffers = (buffer *)calloc(1, sizeof(*buffers));
+    if (buffers == NULL)
+    {
+        printf("Allocation memory failed \n");
+        return;
+    }
+    buffers[0].length = size;
+    buffers[0].start = malloc(size);
+    if (buffers[0].start == NULL)
+    {
+        printf("Allocation memory failed \n");
+    }
 }
 
 /**********************************************************************************
- * @func  static void deviceInit(int fd)
- * 
- * @brief: Initialize the camera device to get information of the device and set 
- *         some requirement depend on users
- * @param: fd - file descriptor when open the device
+ * @func    void initSplice(unsigned int size)
  * 
+ * @brief   Initialize to splice() frames from the driver through a pipe into the
+ *          output file, the frame data never reaches user space
+ * @param   size: size of a frame reported by VIDIOC_G_FMT
 ***********************************************************************************/
-static void deviceInit(int fd)
+void initSplice(unsigned int size)
 {
-    struct v4l2_capability caps;
-    struct v4l2_format fmt;
-    struct v4l2_input input;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-
-    unsigned int index;
-    unsigned int min;
-    CLEAR(input);
-    /**************************** Query and set up driver *************************/
-    // printf capabilities of device
-    printCapabilities(fd, caps);
-    // enum format
-    enumFormat(fd);
-    // get input
-    getInput(fd, &index);
-    // enumerates input
-    input.index = index;
-    enumInput(fd, input);
-    // set input
-    setInput(fd, index);
-    /*************************** Negotiate format with driver *************************/
-    // set format
-    //setFormat(fd, fmt);
-    // get format
-    //getFormat(fd, format);
-    // enumerate format
-    CLEAR(fmt);
-
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    
-    fmt.fmt.pix.width = 640;                     //replace
-    fmt.fmt.pix.height = 480;                    //replace
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV; //replace
-    // printf("pixel format before set: %d \n", fmt.fmt.pix.pixelformat);
-    fmt.fmt.pix.colorspace = V4L2_COLORSPACE_DEFAULT;
-    fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    
-    if (-1 == ioctl(fd, VIDIOC_S_FMT, &fmt))
+    splice_size = size;
+    if (output_name == NULL)
     {
-        printf("Set format failed \n");
+        printf("Splice method needs an output file \n");
+        return;
     }
-
-    /* Note VIDIOC_S_FMT may change width and height. */
-    
-    /* Preserve original settings as set by v4l2-ctl for example */
-    if (-1 == ioctl(fd, VIDIOC_G_FMT, &fmt))
+    recorder = recordCreate(output_name, &frame_pix);
+    if (recorder == NULL)
     {
-        printf("Get format failed \n");
+        printf("Can not open file %s \n", output_name);
+        return;
     }
-    printf("width of pixel: %d \n", fmt.fmt.pix.width);
-    printf("height of pixel: %d \n", fmt.fmt.pix.height);
-
-    printf("Field: %d \n", fmt.fmt.pix.field);
-    printf("Pixel format %d: \n", fmt.fmt.pix.pixelformat);
-    printf("Colorspace: %d \n", fmt.fmt.pix.colorspace);
-
-    switch (io)
+    if (pipe(splice_pipe) < 0)
     {
-    case IO_METHOD_READ:
-        // init_read(fmt.fmt.pix.sizeimage);
-        break;
-
-    case IO_METHOD_MMAP:
-        init_mmap_method(fd);
-        break;
-
-    case IO_METHOD_USRPTR:
-        break;
+        printf("Can not create pipe \n");
+        return;
+    }
+    // a pipe large enough for a whole frame moves it with a single splice()
+    if (fcntl(splice_pipe[1], F_SETPIPE_SZ, size) < 0)
+    {
+        printf("Can not resize pipe, frames are moved in several calls \n");
     }
-
-    // init mapping method
-    // init_mmap_method(fd);
-    // init_read(fmt.fmt.pix.sizeimage);
 }
 
-static int startCapturing(int fd)
+/**********************************************************************************
+ * @func    static void initShared(int fd, unsigned int size)
+ * 
+ * @brief   subscribe to the frames of the process which streams, the buffers of
+ *          the mmap method are mapped read-only the first time the driver hands
+ *          them out
+ * @param   size: size of a frame reported by VIDIOC_G_FMT
+***********************************************************************************/
+static void initShared(int fd, unsigned int size)
 {
-    unsigned int i;
-    int ret;
-    enum v4l2_buf_type type;
-    switch (io)
-    {
-    case IO_METHOD_READ:
+    struct cam_subscribe sub;
+
+    if (io == IO_METHOD_SPLICE)
     {
-        printf("Using read method \n");
-        break;
+        printf("A shared consumer can not splice frames \n");
+        exit(EXIT_FAILURE);
     }
-    case IO_METHOD_USRPTR:
+    if (io == IO_METHOD_READ)
     {
-        break;
+        initRead(size);
     }
-    case IO_METHOD_MMAP:
+    else
     {
-        printf("MMAP method \n");
-        for (i = 0; i < n_buffers; i++)
-        {
-            struct v4l2_buffer buf;
-            CLEAR(buf);
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.index = i;
-
-            if (ioctl(fd, VIDIOC_QBUF, &buf) < 0)
-            {
-                printf("queue buffer failed %d \n", i);
-            }
-        }
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+        buffers = (buffer *)calloc(SHARED_BUFFERS, sizeof(*buffers));
+        if (buffers == NULL)
         {
-            printf("Streaming on error \n");
+            printf("Allocation memory failed \n");
+            exit(EXIT_FAILURE);
         }
-        printf("Start capturing \n");
-        break;
+        n_buffers = SHARED_BUFFERS;
     }
+    CLEAR(sub);
+    sub.policy = share_policy;
+    sub.depth = share_depth;
+    if (ioctl(fd, VIDIOC_CAM_SUBSCRIBE, &sub) < 0)
+    {
+        printf("Subscribe failed: %s \n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    return ret;
+    printf("Shared consumer, %u frames at most \n", sub.depth);
 }
 
-static void stopCapturing(int fd)
+/**********************************************************************************
+ * @func    static int readShared(int fd)
+ * 
+ * @brief   take the oldest frame the driver kept for this consumer, process it
+ *          in place and give it back
+***********************************************************************************/
+static int readShared(int fd)
 {
-    enum v4l2_buf_type type;
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    struct v4l2_buffer buf;
+    unsigned long long start, transfer;
+    int ret = 0;
 
-    if (ioctl(fd, VIDIOC_STREAMOFF, &type) < 0)
+    CLEAR(buf);
+    start = getTimeNs();
+    if (ioctl(fd, VIDIOC_CAM_DQSHARED, &buf) < 0)
     {
-        printf("Stream off error \n");
+        if (errno != EAGAIN)
+        {
+            printf("Dequeue shared buffer failed \n");
+            ret = -1;
+        }
+        return ret;
     }
-    printf("Stop capturing \n");
-}
-/*************************************   processImage  ******************************************
- * @desc: write frame data from memory mapped into raw files 
+    transfer = getTimeNs() - start;
+    assert(buf.index < n_buffers);
+    if (buffers[buf.index].start == NULL)
+    {
+        buffers[buf.index].start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[buf.index].start == MAP_FAILED)
+        {
+            printf("Mapping memory failed: %d \n", buf.index);
+            buffers[buf.index].start = NULL;
+            ioctl(fd, VIDIOC_CAM_QSHARED, &buf);
+            return -1;
+        }
+        buffers[buf.index].length = buf.length;
+    }
+    frame_timestamp = buf.timestamp.tv_sec || buf.timestamp.tv_usec ?
+                      (unsigned long long)buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL :
+                      getTimeNs();
+    frame_sequence = buf.sequence;
+    checkSequence(&buf);
+    publishFrame(buffers[buf.index].start, buf.bytesused);
+    if (decode_pool != NULL)
+    {
+        ret = decodeSubmit(buffers[buf.index].start, buf.bytesused);
+    }
+    else
+    {
+        processImage(buffers[buf.index].start, buf.bytesused);
+    }
+
+    start = getTimeNs();
+    if (ioctl(fd, VIDIOC_CAM_QSHARED, &buf) < 0)
+    {
+        printf("Queue shared buffer failed \n");
+        ret = -1;
+    }
+    accountFrame(buf.bytesused, transfer + getTimeNs() - start);
+    accountLatency(frame_timestamp);
+    stats.captureCalls += 2;
+    if (decode_pool != NULL)
+    {
+        decodeOutput(0);
+    }
+    return ret;
+}
+
+/*******************************************************************************
+ * @func    static int readBatch(int fd)
+ * 
+ * @brief   give back the frames of the previous call and take the completed
+ *          ones with VIDIOC_CAM_BATCH, one system call for all of them. The
+ *          frames stay with the application until the next call, unless that
+ *          would leave the driver fewer than BATCH_MIN_QUEUED buffers to fill
+ *******************************************************************************/
+static int readBatch(int fd)
+{
+    struct v4l2_buffer buf;
+    const struct cam_batch_buffer *done;
+    unsigned long long start;
+    unsigned int i, ndone;
+    int ret = 0;
+
+    batch_req.ndone = batch_size;
+    batch_req.flags = 0;
+    start = getTimeNs();
+    if (ioctl(fd, VIDIOC_CAM_BATCH, &batch_req) < 0)
+    {
+        printf("Batch of buffers failed \n");
+        return -1;
+    }
+    stats.transferNs += getTimeNs() - start;
+    stats.captureCalls++;
+    ndone = batch_req.ndone;
+    batch_req.nqueue = 0;
+    for (i = 0; i < ndone; i++)
+    {
+        done = &batch_req.done[i];
+        assert(done->index < n_buffers);
+        CLEAR(buf);
+        buf.index = done->index;
+        buf.sequence = done->sequence;
+        buf.flags = done->flags;
+        frame_timestamp = done->timestamp ? done->timestamp : getTimeNs();
+        frame_sequence = done->sequence;
+        checkSequence(&buf);
+        publishFrame(buffers[done->index].start, done->bytesused);
+        if (decode_pool != NULL)
+        {
+            ret = decodeSubmit(buffers[done->index].start, done->bytesused);
+        }
+        else
+        {
+            processImage(buffers[done->index].start, done->bytesused);
+        }
+        // the time of the call is already counted
+        accountFrame(done->bytesused, 0);
+        accountLatency(frame_timestamp);
+        batch_req.queue[batch_req.nqueue++] = done->index;
+    }
+    if (decode_pool != NULL)
+    {
+        decodeOutput(0);
+    }
+
+    // the camera would run out of buffers while the next call waits for a frame
+    if (batch_req.nqueue > 0 && n_buffers - batch_req.nqueue < BATCH_MIN_QUEUED)
+    {
+        batch_req.ndone = 0;
+        start = getTimeNs();
+        if (ioctl(fd, VIDIOC_CAM_BATCH, &batch_req) < 0)
+        {
+            printf("Batch of buffers failed \n");
+            return -1;
+        }
+        stats.transferNs += getTimeNs() - start;
+        stats.captureCalls++;
+        batch_req.nqueue = 0;
+    }
+    return ret;
+}
+
+/*******************************************************************************
+ * @func    static int initRing(int fd)
+ *
+ * @brief   turn the completion ring of the driver on and map it, before the
+ *          buffers are queued for the first time
+ *******************************************************************************/
+static int initRing(int fd)
+{
+    struct cam_ring_setup setup;
+    void *map;
+
+    if (completion_ring == NULL)
+    {
+        CLEAR(setup);
+        setup.enable = 1;
+        if (ioctl(fd, VIDIOC_CAM_RING, &setup) < 0)
+        {
+            printf("The driver has no completion ring \n");
+            return -1;
+        }
+        map = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, setup.offset);
+        if (map == MAP_FAILED)
+        {
+            printf("Mapping the completion ring failed \n");
+            return -1;
+        }
+        completion_ring = map;
+        ring_size = setup.size;
+    }
+    // STREAMOFF set the counters of the driver back to 0
+    ring_tail = 0;
+    ring_free = 0;
+    return 0;
+}
+
+/*******************************************************************************
+ * @func    static int readRing(void)
+ *
+ * @brief   spin until the driver writes a frame to the completion ring, then
+ *          take every frame in it and give their buffers back through free[].
+ *          No system call is made
+ * @return  the number of frames, 0 when none came within a second
+ *******************************************************************************/
+static int readRing(void)
+{
+    struct v4l2_buffer buf;
+    const struct cam_batch_buffer *done;
+    unsigned long long deadline = getTimeNs() + 1000000000ULL;
+    unsigned int spins = 0;
+    __u32 head;
+    int n = 0;
+
+    while ((head = __atomic_load_n(&completion_ring->done_head, __ATOMIC_ACQUIRE)) == ring_tail)
+    {
+        CPU_RELAX();
+        if (++spins % RING_SPIN_CHECK == 0 && getTimeNs() > deadline)
+        {
+            return 0;
+        }
+    }
+    for (; ring_tail != head; ring_tail++, n++)
+    {
+        done = &completion_ring->done[ring_tail % CAM_RING_ENTRIES];
+        assert(done->index < n_buffers);
+        CLEAR(buf);
+        buf.index = done->index;
+        buf.sequence = done->sequence;
+        buf.flags = done->flags;
+        frame_timestamp = done->timestamp ? done->timestamp : getTimeNs();
+        frame_sequence = done->sequence;
+        checkSequence(&buf);
+        publishFrame(buffers[done->index].start, done->bytesused);
+        if (decode_pool != NULL)
+        {
+            decodeSubmit(buffers[done->index].start, done->bytesused);
+        }
+        else
+        {
+            processImage(buffers[done->index].start, done->bytesused);
+        }
+        accountFrame(done->bytesused, 0);
+        accountLatency(frame_timestamp);
+
+        // the entry is read before the buffer index is handed back
+        completion_ring->free[ring_free % CAM_RING_ENTRIES] = done->index;
+        ring_free++;
+        __atomic_store_n(&completion_ring->free_head, ring_free, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&completion_ring->done_tail, ring_tail, __ATOMIC_RELEASE);
+    if (decode_pool != NULL)
+    {
+        decodeOutput(0);
+    }
+    return n;
+}
+
+/**********************************************************************************
+ * @func    int enumFormat(int fd)
+ * 
+ * @brief   Enumerate format of the device
+ * @param   fd - file descriptor when open the device
+ * @return  ERROR - ioctl VIDIOC_ENUM_FMT is failed
+ * @return  0 - enumerate format success
+ 
+***********************************************************************************/
+int enumFormat(int fd)
+{
+    struct v4l2_fmtdesc formatCap;
+    struct v4l2_frmsizeenum size;
+    CLEAR(formatCap);
+    formatCap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (formatCap.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &formatCap) == 0; formatCap.index++)
+    {
+        printf("------------------> Format cap %d <-------------------- \n", formatCap.index);
+        printf("flags : %d \n", formatCap.flags);
+        printf("Description : %s \n", formatCap.description);
+        printf("Pixel format: %.4s \n", (const char *)&formatCap.pixelformat);
+        CLEAR(size);
+        size.pixel_format = formatCap.pixelformat;
+        for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+        {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+            {
+                printf("Frame size: %ux%u \n", size.discrete.width, size.discrete.height);
+            }
+            else
+            {
+                printf("Frame size: %ux%u to %ux%u \n", size.stepwise.min_width, size.stepwise.min_height,
+                       size.stepwise.max_width, size.stepwise.max_height);
+                break;
+            }
+        }
+    }
+    return formatCap.index > 0 ? RETURN_STATUS_OK : IOCTL_ERROR;
+}
+
+/**********************************************************************************
+ * @func  void deviceInit(int fd)
+ * 
+ * @brief: Initialize the camera device to get information of the device and set 
+ *         some requirement depend on users
+ * @param: fd - file descriptor when open the device
+ * 
+***********************************************************************************/
+void deviceInit(int fd)
+{
+    struct v4l2_capability caps;
+    struct v4l2_format fmt;
+    struct v4l2_input input;
+    struct v4l2_selection sel;
+
+    unsigned int index;
+    unsigned int min;
+    CLEAR(input);
+    /**************************** Query and set up driver *************************/
+    // printf capabilities of device
+    printCapabilities(fd, caps);
+    // enum format
+    enumFormat(fd);
+    // get input
+    getInput(fd, &index);
+    // enumerates input
+    input.index = index;
+    enumInput(fd, input);
+    // set input
+    setInput(fd, index);
+    /*************************** Negotiate format with driver *************************/
+    // set format
+    //setFormat(fd, fmt);
+    // get format
+    //getFormat(fd, format);
+    // enumerate format
+    CLEAR(fmt);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    
+    fmt.fmt.pix.width = frame_width;
+    fmt.fmt.pix.height = frame_height;
+    if (frame_fourcc != 0)
+    {
+        fmt.fmt.pix.pixelformat = frame_fourcc;
+    }
+    else
+    {
+        fmt.fmt.pix.pixelformat = decode_threads ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+    }
+    // printf("pixel format before set: %d \n", fmt.fmt.pix.pixelformat);
+    fmt.fmt.pix.colorspace = V4L2_COLORSPACE_DEFAULT;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    
+    // a shared consumer takes the format of the streaming process
+    if (share_policy < 0 && -1 == ioctl(fd, VIDIOC_S_FMT, &fmt))
+    {
+        printf("Set format failed \n");
+    }
+    // the format follows the crop, G_FMT below returns the size of the rectangle
+    if (share_policy < 0 && crop_rect.width != 0)
+    {
+        CLEAR(sel);
+        sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        sel.target = V4L2_SEL_TGT_CROP;
+        sel.r = crop_rect;
+        if (-1 == ioctl(fd, VIDIOC_S_SELECTION, &sel))
+        {
+            printf("Set crop failed \n");
+        }
+        else
+        {
+            printf("Crop: %ux%u at (%d, %d) \n", sel.r.width, sel.r.height, sel.r.left, sel.r.top);
+        }
+    }
+
+    /* Note VIDIOC_S_FMT may change width and height. */
+    
+    /* Preserve original settings as set by v4l2-ctl for example */
+    if (-1 == ioctl(fd, VIDIOC_G_FMT, &fmt))
+    {
+        printf("Get format failed \n");
+    }
+    printf("width of pixel: %d \n", fmt.fmt.pix.width);
+    printf("height of pixel: %d \n", fmt.fmt.pix.height);
+
+    printf("Field: %d \n", fmt.fmt.pix.field);
+    printf("Pixel format %d: \n", fmt.fmt.pix.pixelformat);
+    printf("Colorspace: %d \n", fmt.fmt.pix.colorspace);
+    frame_pix = fmt.fmt.pix;
+    if (latency_size < frame_count)
+    {
+        free(latency_samples);
+        latency_samples = malloc(frame_count * sizeof(*latency_samples));
+        latency_size = latency_samples != NULL ? frame_count : 0;
+    }
+    if (decode_threads)
+    {
+        if (frame_pix.pixelformat != V4L2_PIX_FMT_MJPEG || io == IO_METHOD_SPLICE)
+        {
+            printf("Decoding needs MJPEG frames in user space, disabled \n");
+        }
+        else
+        {
+            decode_pool = framePoolCreate(decode_threads, decode_threads * 2, &mjpegDecodeOps, NULL);
+            if (decode_pool == NULL)
+            {
+                printf("Can not start %u decode threads \n", decode_threads);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (convert_func != NULL)
+    {
+        if (frame_pix.pixelformat != V4L2_PIX_FMT_YUYV || io == IO_METHOD_SPLICE)
+        {
+            printf("Conversion needs YUYV frames in user space, disabled \n");
+            convert_func = NULL;
+        }
+        else
+        {
+            convert_buff = malloc((size_t)frame_pix.width * frame_pix.height / 2 * convert_num);
+            if (convert_buff == NULL)
+            {
+                printf("Out of memory \n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (publish_slots)
+    {
+        if (io == IO_METHOD_SPLICE)
+        {
+            printf("Publishing needs frames in user space, disabled \n");
+        }
+        else
+        {
+            publish_ring = frameRingCreate("cam_ring", &frame_pix, publish_slots);
+            if (publish_ring == NULL)
+            {
+                printf("Can not create a ring of %u frames \n", publish_slots);
+                exit(EXIT_FAILURE);
+            }
+            printf("Publishing frames on /proc/%d/fd/%d \n", (int)getpid(), frameRingFd(publish_ring));
+        }
+    }
+    if (serve_path != NULL)
+    {
+        if (io == IO_METHOD_SPLICE)
+        {
+            printf("Serving needs frames in user space, disabled \n");
+        }
+        else
+        {
+            frame_server = frameServerCreate(serve_path, &frame_pix, SERVER_BUFFERS, SERVER_DEPTH);
+            if (frame_server == NULL)
+            {
+                printf("Can not serve frames on %s \n", serve_path);
+                exit(EXIT_FAILURE);
+            }
+            printf("Serving frames on %s \n", serve_path);
+        }
+    }
+    if (compress_config.codec != RECORD_CODEC_NONE)
+    {
+        if (output_name == NULL || io == IO_METHOD_SPLICE)
+        {
+            printf("Compression needs a recording (-o) in user space, disabled \n");
+        }
+        else
+        {
+            compress_pool = framePoolCreate(compress_threads, compress_threads * 2, &compressOps,
+                                            &compress_config);
+            if (compress_pool == NULL)
+            {
+                printf("Can not start %u compression threads \n", compress_threads);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (motion_threshold >= 0)
+    {
+        if (frame_pix.pixelformat != V4L2_PIX_FMT_YUYV || io == IO_METHOD_SPLICE)
+        {
+            printf("Motion gate needs YUYV frames in user space, disabled \n");
+        }
+        else
+        {
+            // every 4th line is enough for a scene change and keeps 1080p well under 1 ms
+            motion_gate = motionGateCreate(frame_pix.width, frame_pix.height, MOTION_ROW_STEP,
+                                           motion_threshold, motion_max_skip);
+            if (motion_gate == NULL)
+            {
+                printf("Out of memory \n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (share_policy >= 0)
+    {
+        initShared(fd, fmt.fmt.pix.sizeimage);
+        return;
+    }
+    switch (io)
+    {
+    case IO_METHOD_READ:
+        initRead(fmt.fmt.pix.sizeimage);
+        break;
+
+    case IO_METHOD_SPLICE:
+        initSplice(fmt.fmt.pix.sizeimage);
+        break;
+
+    case IO_METHOD_MMAP:
+        init_mmap_method(fd);
+        break;
+
+    case IO_METHOD_USRPTR:
+        break;
+    }
+
+    // init mapping method
+    // init_mmap_method(fd);
+    // init_read(fmt.fmt.pix.sizeimage);
+}
+
+/* a stream the driver could not start, -ENOSPC when its USB bus is full */
+static void printStreamError(const char *what)
+{
+    printf("%s: %s \n", what, strerror(errno));
+    if (errno == ENOSPC)
+    {
+        printf("No bandwidth left on the USB bus of the camera (see bus_free in sysfs), stop another camera "
+               "of the bus or pick a smaller frame size or format \n");
+    }
+}
+
+int startCapturing(int fd)
+{
+    unsigned int i;
+    int ret;
+    enum v4l2_buf_type type;
+    if (share_policy >= 0)
+    {
+        return RETURN_STATUS_OK;
+    }
+    switch (io)
+    {
+    case IO_METHOD_READ:
+    case IO_METHOD_SPLICE:
+    {
+        printf("Using read method \n");
+        break;
+    }
+    case IO_METHOD_USRPTR:
+    {
+        break;
+    }
+    case IO_METHOD_MMAP:
+    {
+        printf("MMAP method \n");
+        batch_req.nqueue = 0;
+        if (spin_ring && initRing(fd) < 0)
+        {
+            spin_ring = 0;
+        }
+        for (i = 0; i < n_buffers; i++)
+        {
+            struct v4l2_buffer buf;
+            CLEAR(buf);
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.index = i;
+
+            if (ioctl(fd, VIDIOC_QBUF, &buf) < 0)
+            {
+                printf("queue buffer failed %d \n", i);
+            }
+        }
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+        {
+            printStreamError("Streaming on error");
+        }
+        printf("Start capturing \n");
+        break;
+    }
+    }
+    return ret;
+}
+
+void stopCapturing(int fd)
+{
+    enum v4l2_buf_type type;
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (share_policy >= 0)
+    {
+        ioctl(fd, VIDIOC_CAM_UNSUBSCRIBE);
+        return;
+    }
+    // the read ring is stopped by the driver when the device is closed
+    if (io == IO_METHOD_READ || io == IO_METHOD_SPLICE)
+    {
+        return;
+    }
+    if (ioctl(fd, VIDIOC_STREAMOFF, &type) < 0)
+    {
+        printf("Stream off error \n");
+    }
+    printf("Stop capturing \n");
+}
+/*************************************   processImage  ******************************************
+ * @desc: write frame data from memory mapped into raw files 
  * @para: fd: file descriptor when open the device
  * @para: size: the size of frame is wrote into raw file
  * 
 *************************************************************************************************/
-static void processImage(const void *pointer, int size)
+void processImage(const void *pointer, int size)
 {
     frame_number++;
+    if (!write_frames)
+    {
+        return;
+    }
+    unsigned long long start = getTimeNs();
+    if (motion_gate != NULL && (unsigned int)size >= frame_pix.width * frame_pix.height * 2)
+    {
+        int keep = motionGateCheck(motion_gate, pointer, NULL);
+        stats.motionNs += getTimeNs() - start;
+        if (!keep)
+        {
+            stats.staticFrames++;
+            return;
+        }
+        start = getTimeNs();
+    }
+    if (convert_func != NULL && (unsigned int)size >= frame_pix.width * frame_pix.height * 2)
+    {
+        convert_func(pointer, convert_buff, frame_pix.width, frame_pix.height);
+        pointer = convert_buff;
+        size = frame_pix.width * frame_pix.height / 2 * convert_num;
+        stats.convertNs += getTimeNs() - start;
+        start = getTimeNs();
+    }
+    if (output_name != NULL)
+    {
+        if (recorder == NULL)
+        {
+            struct v4l2_pix_format pix = frame_pix;
+            // describe the frames as written, after conversion or decoding
+            if (decode_pool != NULL)
+            {
+                pix.pixelformat = V4L2_PIX_FMT_RGB24;
+                pix.bytesperline = pix.width * 3;
+                pix.sizeimage = size;
+            }
+            else if (convert_func != NULL)
+            {
+                pix.pixelformat = convert_fourcc;
+                pix.bytesperline = convert_num >= 6 ? pix.width * convert_num / 2 : pix.width;
+                pix.sizeimage = size;
+            }
+            recorder = compress_pool != NULL ?
+                       recordCreateCodec(output_name, &pix, compress_config.codec, compress_config.level) :
+                       recordCreate(output_name, &pix);
+            if (recorder == NULL)
+            {
+                printf("Can not open file %s \n", output_name);
+                return;
+            }
+        }
+        if (compress_pool != NULL)
+        {
+            // the write time is counted when the block comes back in order
+            compressSubmit(pointer, size);
+            return;
+        }
+        if (recordWrite(recorder, pointer, size, frame_timestamp, frame_sequence, 0) < 0)
+        {
+            printf("Write frame %u failed \n", frame_sequence);
+        }
+        stats.writeNs += getTimeNs() - start;
+        return;
+    }
     char filename[15];
     sprintf(filename, "frame-%d.raw", frame_number);
     FILE *fp = fopen(filename, "wb");
@@ -514,21 +1406,81 @@ static void processImage(const void *pointer, int size)
     fflush(fp);
     fwrite(pointer, size, 1, fp);
     fclose(fp);
+    stats.writeNs += getTimeNs() - start;
 }
 /*************************************     readFrame    ******************************************
  * @desc: read frames from queue 
  * @para: fd: file descriptor when open the device
  * 
 *************************************************************************************************/
-static int readFrame(int fd)
+int readFrame(int fd)
 {
     struct v4l2_buffer buf;
     //unsigned int i;
     int ret = 0;
+    ssize_t size;
+    unsigned long long start, transfer;
     switch (io)
     {
     case IO_METHOD_READ:
     {
+        // the driver never returns more than one frame per read
+        start = getTimeNs();
+        size = read(fd, buffers[0].start, buffers[0].length);
+        stats.captureCalls++;
+        if (size < 0)
+        {
+            if (errno != EAGAIN)
+            {
+                printStreamError("Read frame failed");
+                ret = -1;
+            }
+            break;
+        }
+        accountFrame(size, getTimeNs() - start);
+        frame_timestamp = stats.endNs;
+        frame_sequence = stats.frames - 1;
+        publishFrame(buffers[0].start, size);
+        if (decode_pool != NULL)
+        {
+            ret = decodeSubmit(buffers[0].start, size);
+            decodeOutput(0);
+        }
+        else
+        {
+            processImage(buffers[0].start, size);
+        }
+        // read() gives no time stamp, the latency starts when the frame was asked for
+        accountLatency(start);
+        break;
+    }
+    case IO_METHOD_SPLICE:
+    {
+        // device -> pipe: the driver hands the frame pages to the pipe
+        start = getTimeNs();
+        size = splice(fd, NULL, splice_pipe[1], NULL, splice_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        stats.captureCalls++;
+        if (size < 0)
+        {
+            if (errno != EAGAIN)
+            {
+                printStreamError("Splice frame failed");
+                ret = -1;
+            }
+            break;
+        }
+        transfer = getTimeNs() - start;
+        accountFrame(size, transfer);
+
+        // pipe -> file, behind a frame header of the recording
+        start = getTimeNs();
+        if (recordWriteSplice(recorder, splice_pipe[0], size, stats.endNs, stats.frames - 1, 0) < 0)
+        {
+            printf("Splice to file failed \n");
+            ret = -1;
+        }
+        stats.writeNs += getTimeNs() - start;
+        frame_number++;
         break;
     }
     case IO_METHOD_USRPTR:
@@ -537,6 +1489,16 @@ static int readFrame(int fd)
     }
     case IO_METHOD_MMAP:
     {
+        if (share_policy >= 0)
+        {
+            ret = readShared(fd);
+            break;
+        }
+        if (batch_size)
+        {
+            ret = readBatch(fd);
+            break;
+        }
         CLEAR(buf);
         printf("Reading frame use mmap method \n");
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -544,32 +1506,75 @@ static int readFrame(int fd)
         buf.reserved = 0;
         buf.reserved2 = 0;
 
+        start = getTimeNs();
         if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0)
         {
             printf("Dequeue buffer failed \n");
             ret = -1;
+            break;
         }
+        transfer = getTimeNs() - start;
         printf("ReadFrame: %d \n", buf.bytesused);
         assert(buf.index < n_buffers);
-        processImage(buffers[buf.index].start, buf.bytesused);
+        frame_timestamp = buf.timestamp.tv_sec || buf.timestamp.tv_usec ?
+                          (unsigned long long)buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL :
+                          getTimeNs();
+        frame_sequence = buf.sequence;
+        checkSequence(&buf);
+        publishFrame(buffers[buf.index].start, buf.bytesused);
+        if (decode_pool != NULL)
+        {
+            // only copy the compressed frame here, the buffer goes back right away
+            ret = decodeSubmit(buffers[buf.index].start, buf.bytesused);
+        }
+        else
+        {
+            processImage(buffers[buf.index].start, buf.bytesused);
+        }
 
+        start = getTimeNs();
         if (ioctl(fd, VIDIOC_QBUF, &buf) < 0)
         {
             printf("Queue buffer failed \n");
             ret = -1;
         }
+        accountFrame(buf.bytesused, transfer + getTimeNs() - start);
+        accountLatency(frame_timestamp);
+        stats.captureCalls += 2;
+        if (decode_pool != NULL)
+        {
+            decodeOutput(0);
+        }
         break;
     }
     }
     return ret;
 }
 
-static void mainloop(int fd)
+void mainloop(int fd)
 {
     unsigned int count;
+    unsigned int timeouts = 0;
     count = frame_count;
     while (count > 0)
     {
+        // no select either, the loop spins on the ring until a frame comes
+        if (completion_ring != NULL && spin_ring)
+        {
+            if (readRing() == 0)
+            {
+                printf("Time out \n");
+                if (++timeouts == MAINLOOP_TIMEOUTS)
+                {
+                    printf("No frame for %d s, stop capturing \n", MAINLOOP_TIMEOUTS);
+                    return;
+                }
+                continue;
+            }
+            timeouts = 0;
+            count--;
+            continue;
+        }
         for (;;)
         {
             fd_set SetofFileDescriptor;
@@ -583,6 +1588,7 @@ static void mainloop(int fd)
             timeout.tv_usec = 0;
 
             result = select(fd + 1, &SetofFileDescriptor, NULL, NULL, &timeout);
+            stats.captureCalls++;
             if (result < 0)
             {
                 printf("Error in select function \n");
@@ -590,9 +1596,16 @@ static void mainloop(int fd)
             else if (result == 0)
             {
                 printf("Time out \n");
+                // a stream that never started would keep the loop here forever
+                if (++timeouts == MAINLOOP_TIMEOUTS)
+                {
+                    printf("No frame for %d s, stop capturing \n", MAINLOOP_TIMEOUTS);
+                    return;
+                }
             }
             else
             {
+                timeouts = 0;
                 readFrame(fd);
                 break;
             }
@@ -601,9 +1614,16 @@ static void mainloop(int fd)
     }
 }
 
-static void deviceUninit()
+void deviceUninit()
 {
     unsigned int i;
+    if (decode_pool != NULL)
+    {
+        // the frames still in the pool were captured, write them too
+        decodeOutput(1);
+        framePoolDestroy(decode_pool);
+        decode_pool = NULL;
+    }
     switch (io)
     {
     case IO_METHOD_READ:
@@ -611,6 +1631,12 @@ static void deviceUninit()
         free(buffers[0].start);
         break;
     }
+    case IO_METHOD_SPLICE:
+    {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        break;
+    }
     case IO_METHOD_USRPTR:
     {
         for (i = 0; i < n_buffers; ++i)
@@ -621,15 +1647,482 @@ static void deviceUninit()
     {
         for (i = 0; i < n_buffers; i++)
         {
+            // a shared consumer only mapped the buffers it was handed
+            if (buffers[i].start == NULL)
+            {
+                continue;
+            }
             if (munmap(buffers[i].start, buffers[i].length) < 0)
             {
                 printf("Unmap failed %d \n", i);
             }
         }
+        // closing the device turns the ring off
+        if (completion_ring != NULL)
+        {
+            munmap(completion_ring, ring_size);
+            completion_ring = NULL;
+        }
         break;
     }
     }
     free(buffers);
+    free(convert_buff);
+    motionGateDestroy(motion_gate);
+    motion_gate = NULL;
+    // the readers see the ring closed and keep their mapping
+    frameRingDestroy(publish_ring);
+    publish_ring = NULL;
+    if (frame_server != NULL)
+    {
+        printf("Served frames: %lu, dropped with all buffers held: %lu \n", stats.served,
+               frameServerDropped(frame_server));
+        frameServerDestroy(frame_server);
+        frame_server = NULL;
+    }
+    if (compress_pool != NULL)
+    {
+        // after the decode pool, its last frames went through this one
+        compressOutput(1);
+        framePoolDestroy(compress_pool);
+        compress_pool = NULL;
+    }
+    if (recorder != NULL)
+    {
+        // the index goes at the end of the file, without it the reader rescans
+        if (recordClose(recorder) < 0)
+        {
+            printf("Write index of %s failed \n", output_name);
+        }
+        recorder = NULL;
+    }
     printf("Device is de init \n");
 }
 
+void resetStatistics(void)
+{
+    CLEAR(stats);
+    frame_number = 0;
+    have_sequence = 0;
+    n_latency = 0;
+}
+
+void getCaptureResult(captureResult *res)
+{
+    unsigned long long *sorted;
+    unsigned long n;
+
+    CLEAR(*res);
+    res->frames = stats.frames;
+    res->missed = stats.missed;
+    if (stats.frames > 1 && stats.endNs > stats.startNs)
+    {
+        res->fps = (stats.frames - 1) * 1e9 / (stats.endNs - stats.startNs);
+    }
+    // the first frames waited in the queue while the capture started
+    if (n_latency <= LATENCY_WARMUP)
+    {
+        return;
+    }
+    n = n_latency - LATENCY_WARMUP;
+    sorted = malloc(n * sizeof(*sorted));
+    if (sorted == NULL)
+    {
+        return;
+    }
+    memcpy(sorted, latency_samples + LATENCY_WARMUP, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compareNs);
+    res->p50Ns = sorted[(n - 1) / 2];
+    res->p99Ns = sorted[(n - 1) * 99 / 100 + ((n - 1) * 99 % 100 != 0)];
+    res->maxNs = sorted[n - 1];
+    free(sorted);
+}
+
+void printStatistics(void)
+{
+    captureResult res;
+    double seconds;
+
+    printf("------------------> Capture statistics <-------------------- \n");
+    printf("I/O method: %s \n", io == IO_METHOD_READ ? "read" : io == IO_METHOD_SPLICE ? "splice" : "mmap");
+    printf("Frames: %lu \n", stats.frames);
+    if (stats.frames == 0)
+    {
+        return;
+    }
+    printf("Bytes: %llu \n", stats.bytes);
+    if (io == IO_METHOD_MMAP)
+    {
+        printf("Missed frames: %lu (%.2f%%), corrupted frames: %lu \n", stats.missed,
+               100.0 * stats.missed / (stats.frames + stats.missed), stats.errorFrames);
+    }
+    printf("Transfer time per frame: %.1f us \n", stats.transferNs / 1000.0 / stats.frames);
+    printf("System calls per frame: %.2f (%s) \n", (double)stats.captureCalls / stats.frames,
+           io == IO_METHOD_READ ? "select and read" : io == IO_METHOD_SPLICE ? "select and splice" :
+           spin_ring ? "completion ring" : batch_size ? "select and VIDIOC_CAM_BATCH" : "select and DQBUF/QBUF");
+    printf("Transfer throughput: %.1f MB/s \n",
+           stats.transferNs ? stats.bytes * 1000.0 / stats.transferNs : 0.0);
+    if (stats.writeNs)
+    {
+        printf("Write time per frame: %.1f us \n", stats.writeNs / 1000.0 / stats.frames);
+        printf("Record throughput: %.1f MB/s \n",
+               stats.bytes * 1000.0 / (stats.transferNs + stats.writeNs));
+    }
+    if (stats.convertNs)
+    {
+        printf("Convert time per frame (%s, %s): %.1f us \n", convert_name,
+               yuyvGetConverter()->name, stats.convertNs / 1000.0 / stats.frames);
+    }
+    if (stats.compressed)
+    {
+        printf("Compression (%s level %d, %u threads): ratio %.2f, %lu frames stored as is \n",
+               compressName(compress_config.codec), compress_config.level, compress_threads,
+               stats.packedBytes ? (double)stats.rawBytes / stats.packedBytes : 0.0, stats.storedRaw);
+        printf("Compression CPU time per frame: %.1f us \n", stats.compressCpuNs / 1000.0 / stats.compressed);
+    }
+    if (stats.published)
+    {
+        printf("Published frames: %lu, copy into the ring per frame: %.1f us \n", stats.published,
+               stats.publishNs / 1000.0 / stats.published);
+    }
+    if (stats.served)
+    {
+        printf("Frame server time per frame (copy and send): %.1f us \n", stats.serveNs / 1000.0 / stats.frames);
+    }
+    if (stats.motionNs)
+    {
+        printf("Static frames not written: %lu (%.1f%%) \n", stats.staticFrames,
+               100.0 * stats.staticFrames / stats.frames);
+        printf("Motion gate time per frame: %.1f us \n", stats.motionNs / 1000.0 / stats.frames);
+    }
+    if (decode_threads)
+    {
+        printf("Decoded frames: %lu (%lu corrupted) with %u threads \n", stats.decoded, stats.decodeErrors,
+               decode_threads);
+        printf("Wait for a decoder per frame: %.1f us \n", stats.decodeWaitNs / 1000.0 / stats.frames);
+    }
+    seconds = (stats.endNs - stats.startNs) / 1e9;
+    if (stats.frames > 1 && seconds > 0)
+    {
+        printf("Frame rate: %.2f fps \n", (stats.frames - 1) / seconds);
+    }
+    getCaptureResult(&res);
+    if (res.p99Ns)
+    {
+        printf("Frame latency%s: p50 %.3f ms, p99 %.3f ms, max %.3f ms \n",
+               io == IO_METHOD_READ ? " (from read)" : " (from capture)", res.p50Ns / 1e6, res.p99Ns / 1e6,
+               res.maxNs / 1e6);
+    }
+}
+
+int setLatestFrame(int fd, int enable)
+{
+    struct v4l2_control ctrl;
+    CLEAR(ctrl);
+    ctrl.id = CAM_CID_LATEST_FRAME;
+    ctrl.value = enable;
+    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+    {
+        printf("Setting latest frame mode failed \n");
+        return IOCTL_ERROR;
+    }
+    return RETURN_STATUS_OK;
+}
+
+int setDecimation(int fd, unsigned int n)
+{
+    struct v4l2_control ctrl;
+    CLEAR(ctrl);
+    ctrl.id = CAM_CID_DECIMATION;
+    ctrl.value = n;
+    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+    {
+        printf("Setting frame decimation failed \n");
+        return IOCTL_ERROR;
+    }
+    return RETURN_STATUS_OK;
+}
+
+int setErrorFrames(int fd, int policy)
+{
+    struct v4l2_control ctrl;
+    CLEAR(ctrl);
+    ctrl.id = CAM_CID_ERROR_FRAMES;
+    ctrl.value = policy;
+    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+    {
+        printf("Setting the policy for frames with errors failed \n");
+        return IOCTL_ERROR;
+    }
+    return RETURN_STATUS_OK;
+}
+
+void printDriverStatistics(int fd)
+{
+    struct cam_stats driver;
+    CLEAR(driver);
+    if (ioctl(fd, VIDIOC_CAM_G_STATS, &driver) < 0)
+    {
+        printf("Getting driver statistics failed \n");
+        return;
+    }
+    printf("Driver frames: %u \n", driver.frames);
+    printf("Driver replaced frames: %u \n", driver.replaced);
+    printf("Shared consumers: %u \n", driver.consumers);
+    printf("Driver lost frames (no buffer queued): %u, corrupted frames: %u \n", driver.lost, driver.errors);
+    if (driver.decimated > 0)
+    {
+        printf("Driver decimated frames: %u \n", driver.decimated);
+    }
+    if (driver.urb_errors > 0 || driver.packet_errors > 0 || driver.urb_retries > 0)
+    {
+        printf("Driver transfer errors: %u URBs, %u packets, %u URBs submitted late \n", driver.urb_errors,
+               driver.packet_errors, driver.urb_retries);
+    }
+    if (driver.error_drops > 0)
+    {
+        printf("Driver frames dropped for errors: %u \n", driver.error_drops);
+    }
+    if (driver.batches > 0)
+    {
+        printf("Driver URBs: %u in %u batches, %.1f per batch \n", driver.urbs, driver.batches,
+               (double)driver.urbs / driver.batches);
+        printf("Driver completion handler: %u us, decoding: %u us \n", driver.irq_us, driver.decode_us);
+    }
+    if (share_policy >= 0)
+    {
+        printf("Frames dropped for this consumer: %u \n", driver.dropped);
+    }
+}
+
+int setConvert(const char *name)
+{
+    const yuyvConverter *conv = yuyvGetConverter();
+
+    if (strcmp(name, "rgb24") == 0)
+    {
+        convert_func = conv->toRgb24;
+        convert_fourcc = V4L2_PIX_FMT_RGB24;
+        convert_num = 6;
+    }
+    else if (strcmp(name, "bgra") == 0)
+    {
+        convert_func = conv->toBgra;
+        convert_fourcc = V4L2_PIX_FMT_BGR32;
+        convert_num = 8;
+    }
+    else if (strcmp(name, "i420") == 0)
+    {
+        convert_func = conv->toI420;
+        convert_fourcc = V4L2_PIX_FMT_YUV420;
+        convert_num = 3;
+    }
+    else if (strcmp(name, "nv12") == 0)
+    {
+        convert_func = conv->toNv12;
+        convert_fourcc = V4L2_PIX_FMT_NV12;
+        convert_num = 3;
+    }
+    else if (strcmp(name, "y8") == 0)
+    {
+        convert_func = conv->toY8;
+        convert_fourcc = V4L2_PIX_FMT_GREY;
+        convert_num = 2;
+    }
+    else
+    {
+        printf("Unknown format %s \n", name);
+        return RETURN_STATUS_ERR;
+    }
+    convert_name = name;
+    return RETURN_STATUS_OK;
+}
+
+int setShare(const char *arg)
+{
+    const char *depth = strchr(arg, ':');
+    size_t len = depth != NULL ? (size_t)(depth - arg) : strlen(arg);
+
+    if (len == 6 && strncmp(arg, "oldest", len) == 0)
+    {
+        share_policy = CAM_SHARE_DROP_OLDEST;
+    }
+    else if (len == 6 && strncmp(arg, "newest", len) == 0)
+    {
+        share_policy = CAM_SHARE_DROP_NEWEST;
+    }
+    else if (len == 6 && strncmp(arg, "latest", len) == 0)
+    {
+        share_policy = CAM_SHARE_LATEST;
+    }
+    else
+    {
+        printf("Unknown drop policy %.*s \n", (int)len, arg);
+        return RETURN_STATUS_ERR;
+    }
+    share_depth = depth != NULL ? strtoul(depth + 1, NULL, 0) : 0;
+    return RETURN_STATUS_OK;
+}
+
+/* parse a CPU list as printed by the kernel, e.g. 0-3,8,10-11 */
+static int parseCpuList(const char *list, cpu_set_t *set)
+{
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO(set);
+    while (*list != '\0' && *list != '\n')
+    {
+        first = strtoul(list, &end, 10);
+        if (end == list)
+        {
+            return RETURN_STATUS_ERR;
+        }
+        last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list || last < first)
+            {
+                return RETURN_STATUS_ERR;
+            }
+        }
+        if (last >= CPU_SETSIZE)
+        {
+            return RETURN_STATUS_ERR;
+        }
+        for (; first <= last; first++)
+        {
+            CPU_SET(first, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set) > 0 ? RETURN_STATUS_OK : RETURN_STATUS_ERR;
+}
+
+/* read the first line of a sysfs file, an empty string when it does not exist */
+static void readSysfs(const char *path, char *line, size_t size)
+{
+    FILE *file = fopen(path, "r");
+
+    line[0] = '\0';
+    if (file == NULL)
+    {
+        return;
+    }
+    if (fgets(line, size, file) == NULL)
+    {
+        line[0] = '\0';
+    }
+    fclose(file);
+}
+
+int setAffinity(const char *arg)
+{
+    char path[PATH_MAX + 64], node[PATH_MAX], line[256];
+    const char *name;
+    cpu_set_t set;
+
+    if (strcmp(arg, "auto") == 0)
+    {
+        // the attributes live on the class device of the node, /dev links are resolved
+        if (realpath(device_name, node) == NULL)
+        {
+            printf("Can not resolve %s \n", device_name);
+            return RETURN_STATUS_ERR;
+        }
+        name = strrchr(node, '/') != NULL ? strrchr(node, '/') + 1 : node;
+        snprintf(path, sizeof(path), "/sys/class/video4linux/%s/completion_cpus", name);
+        readSysfs(path, line, sizeof(line));
+        if (line[0] == '\0' || line[0] == '\n')
+        {
+            snprintf(path, sizeof(path), "/sys/class/video4linux/%s/buffer_node", name);
+            readSysfs(path, line, sizeof(line));
+            if (line[0] == '\0' || atoi(line) < 0)
+            {
+                printf("%s has no completion CPUs nor buffer node, not pinned \n", device_name);
+                return RETURN_STATUS_OK;
+            }
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", atoi(line));
+            readSysfs(path, line, sizeof(line));
+        }
+        arg = line;
+    }
+    if (parseCpuList(arg, &set) != RETURN_STATUS_OK)
+    {
+        printf("Invalid CPU list %s \n", arg);
+        return RETURN_STATUS_ERR;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    {
+        printf("sched_setaffinity failed: %s \n", strerror(errno));
+        return RETURN_STATUS_ERR;
+    }
+    printf("Capture pinned to CPUs %s%s", arg, strchr(arg, '\n') != NULL ? "" : " \n");
+    return RETURN_STATUS_OK;
+}
+
+int setCrop(const char *arg)
+{
+    int left = 0, top = 0;
+    unsigned int width, height;
+
+    if (sscanf(arg, "%ux%u+%d+%d", &width, &height, &left, &top) < 2 || width == 0 || height == 0 ||
+        left < 0 || top < 0)
+    {
+        printf("Invalid crop %s, expected WIDTHxHEIGHT+LEFT+TOP \n", arg);
+        return RETURN_STATUS_ERR;
+    }
+    crop_rect.left = left;
+    crop_rect.top = top;
+    crop_rect.width = width;
+    crop_rect.height = height;
+    return RETURN_STATUS_OK;
+}
+
+int setMotion(const char *arg)
+{
+    char *end;
+    double threshold = strtod(arg, &end);
+
+    if (end == arg || threshold < 0 || threshold > 255 || (*end != '\0' && *end != ':'))
+    {
+        printf("Invalid motion threshold %s, expected 0..255[:MAX] \n", arg);
+        return RETURN_STATUS_ERR;
+    }
+    motion_threshold = threshold;
+    motion_max_skip = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+    return RETURN_STATUS_OK;
+}
+
+int setFrameFormat(const char *arg)
+{
+    char code[5] = "    ";
+    unsigned int width, height, i;
+    int n = 0;
+
+    if (sscanf(arg, "%ux%u%n", &width, &height, &n) != 2 || width == 0 || height == 0 ||
+        (arg[n] != '\0' && (arg[n] != ':' || strlen(arg + n + 1) == 0 || strlen(arg + n + 1) > 4)))
+    {
+        printf("Invalid format %s, expected WIDTHxHEIGHT[:FOURCC] \n", arg);
+        return RETURN_STATUS_ERR;
+    }
+    frame_width = width;
+    frame_height = height;
+    if (arg[n] == ':')
+    {
+        // short codes are padded with spaces, as in the V4L2 headers
+        for (i = 0; arg[n + 1 + i] != '\0'; i++)
+        {
+            code[i] = toupper((unsigned char)arg[n + 1 + i]);
+        }
+        frame_fourcc = v4l2_fourcc(code[0], code[1], code[2], code[3]);
+    }
+    return RETURN_STATUS_OK;
+}
+
+int setCompress(const char *arg)
+{
+    return compressParse(arg, &compress_config) < 0 ? RETURN_STATUS_ERR : RETURN_STATUS_OK;
+}
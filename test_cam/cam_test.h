@@ -6,6 +6,7 @@
 /*******************************************************************************
  *  INCLUDES
  ******************************************************************************/
+#define _GNU_SOURCE /* splice() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,7 +24,19 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <time.h>
+#include <sched.h> /* sched_setaffinity() */
+#include <limits.h> /* PATH_MAX */
+#include <ctype.h> /* toupper() */
 #include <linux/videodev2.h>
+#include "../KernelModule/cam_ioctl.h"
+#include "yuyv_convert.h"
+#include "motion_gate.h"
+#include "mjpeg_decode.h"
+#include "frame_compress.h"
+#include "frame_ring.h"
+#include "frame_server.h"
+#include "cam_record.h"
 /*******************************************************************************
  *  DEFINE 
  ******************************************************************************/
@@ -35,11 +48,28 @@
 #define INSUFFICENT_BUFF   -1
 #define INVALID_METHOD     -1
 #define MEM_MAP_FAILED     -1
+#define SHARED_BUFFERS     32   /* buffers a shared consumer may be handed */
+#define MOTION_ROW_STEP    4    /* the motion gate compares one line out of 4 */
+#define SERVER_BUFFERS     8    /* memfd buffers of the frame server */
+#define SERVER_DEPTH       4    /* buffers a client of the frame server may hold */
+#define MAX_BUFFERS        32   /* buffers the driver allocates at most */
+#define MAINLOOP_TIMEOUTS  5    /* seconds without a frame before mainloop gives up */
+#define LATENCY_WARMUP     5    /* first frames left out of the latency percentiles */
+#define BATCH_MIN_QUEUED   2    /* buffers the driver keeps to fill while frames are batched */
+#define RING_SPIN_CHECK    4096 /* spins on the completion ring between two clock reads */
 
 /*******************************************************************************
  *  MACRO 
  ******************************************************************************/
 #define CLEAR(x) memset(&x, 0, sizeof(x))
+/* tell the core it is a spin loop, a sibling hyperthread gets the pipeline */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
 
 /*********************************************************************************
  * TYPEDEF
@@ -55,33 +85,102 @@ enum ioMethod
     IO_METHOD_READ,   /**<  Read/Write method to exchange data with driver */
     IO_METHOD_MMAP,   /**<  MMAP method to exchange pointer to data */
     IO_METHOD_USRPTR, /**<  USER POINTER method */
+    IO_METHOD_SPLICE, /**<  splice() frames from the driver into a file */
 };
 
+typedef struct captureStats
+{
+    unsigned long frames;            /**< frames got from the driver */
+    unsigned long long bytes;        /**< payload bytes of those frames */
+    unsigned long long transferNs;   /**< time spent in read(), splice() or DQBUF/QBUF */
+    unsigned long long writeNs;      /**< time spent writing frames into files */
+    unsigned long long convertNs;    /**< time spent converting YUYV frames */
+    unsigned long decoded;           /**< MJPEG frames decoded by the worker pool */
+    unsigned long decodeErrors;      /**< corrupted MJPEG frames */
+    unsigned long long decodeWaitNs; /**< time the capture loop waited for a free decoder */
+    unsigned long long startNs;      /**< time of the first frame */
+    unsigned long long endNs;        /**< time of the last frame */
+    unsigned long missed;            /**< frames skipped by the buffer sequence numbers */
+    unsigned long errorFrames;       /**< frames the driver flagged V4L2_BUF_FLAG_ERROR */
+    unsigned long staticFrames;      /**< frames the motion gate did not write */
+    unsigned long long motionNs;     /**< time spent in the motion gate */
+    unsigned long compressed;        /**< frames through the compression stage */
+    unsigned long storedRaw;         /**< of those, frames stored as is */
+    unsigned long long rawBytes;     /**< bytes of those frames before compression */
+    unsigned long long packedBytes;  /**< bytes written for those frames */
+    unsigned long long compressCpuNs; /**< CPU time of the compression workers */
+    unsigned long published;         /**< frames copied into the shared ring */
+    unsigned long long publishNs;    /**< time spent copying them */
+    unsigned long served;            /**< frames handed to the socket clients */
+    unsigned long long serveNs;      /**< time spent copying and sending them */
+    unsigned long captureCalls;      /**< select, read, splice and buffer ioctls of the capture loop */
+} captureStats;
+
+typedef struct captureResult
+{
+    unsigned long frames;            /**< frames got from the driver */
+    unsigned long missed;            /**< frames skipped by the buffer sequence numbers */
+    double fps;                      /**< sustained frame rate, first to last frame */
+    unsigned long long p50Ns;        /**< latency percentiles, capture to frame done */
+    unsigned long long p99Ns;
+    unsigned long long maxNs;
+} captureResult;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+extern enum ioMethod io;         /**< I/O method used to get frames */
+extern unsigned frame_count;     /**< number of frames captured by mainloop */
+extern int write_frames;         /**< write every frame into a .raw file */
+extern const char *output_name;  /**< record every frame into this container file */
+extern int latest_frame;         /**< ask the driver for the latest frame only */
+extern unsigned int frame_decimation; /**< the driver delivers every Nth frame of the camera */
+extern int error_frames;         /**< CAM_ERROR_* asked of the driver, -1 keeps its default */
+extern unsigned int buffer_count; /**< buffers asked for with VIDIOC_REQBUFS */
+extern unsigned int frame_width; /**< frame size asked for with VIDIOC_S_FMT */
+extern unsigned int frame_height;
+extern unsigned int frame_fourcc; /**< pixel format asked for, 0 for YUYV or MJPEG when decoding */
+extern unsigned int batch_size;  /**< frames taken per VIDIOC_CAM_BATCH, 0 for DQBUF/QBUF per frame */
+extern int spin_ring;            /**< take the mmap frames from the completion ring, spinning */
+extern const char *convert_name; /**< convert YUYV frames to this format before writing */
+extern unsigned int decode_threads; /**< capture MJPEG and decode it with this many threads */
+extern const char *device_name;  /**< video node opened by openDevice */
+extern int share_policy;         /**< CAM_SHARE_* when subscribed to the stream of another process, -1 otherwise */
+extern unsigned int share_depth; /**< frames the driver keeps for this consumer, 0 for its default */
+extern const char *affinity_cpus; /**< CPU list or "auto" the capture thread is pinned to */
+extern struct v4l2_rect crop_rect; /**< region of interest the driver crops to, width 0 for none */
+extern double motion_threshold;  /**< mean luma difference a frame needs to be written, < 0 writes all */
+extern unsigned int motion_max_skip; /**< write a frame after this many static ones, 0 for never */
+extern compressConfig compress_config; /**< codec of the recording, RECORD_CODEC_NONE for none */
+extern unsigned int compress_threads; /**< worker threads of the compression stage */
+extern unsigned int publish_slots; /**< slots of the shared frame ring, 0 publishes nothing */
+extern const char *serve_path;   /**< Unix socket the frames are served on, NULL for none */
+
 /*******************************************************************************
  * FUNCTIONS - API
  ******************************************************************************/
 
 /*******************************************************************************
- * @func    static int openDevice(void)
+ * @func    int openDevice(void)
  * 
  * @brief   open the device file in /dev/video*       
  * @return  fd(file descriptor when open a file) - Success
  * @return  ERROR - Open device file is failed
  *******************************************************************************/
-static int openDevice(void);
+int openDevice(void);
 
 /*******************************************************************************
- * @func    static int closeDevice(int fd)
+ * @func    int closeDevice(int fd)
  *
  * @brief   close the device file in /dev/video*       
  * @param   fd - file descriptor of device file
  * @return  RETURN_STATUS_OK - close success
  * @return  ERROR            - Close device failed
  *******************************************************************************/
-static int closeDevice(int fd);
+int closeDevice(int fd);
 
 /**********************************************************************************
- * @func     static int printCapabilities(int fd, struct v4l2_capability caps)
+ * @func     int printCapabilities(int fd, struct v4l2_capability caps)
  * 
  * @brief    enumerate capabilities of uvc device
  * @param    fd     - file descriptor when open the device
@@ -90,10 +189,10 @@ static int closeDevice(int fd);
  * @return   RETURN_STATUS_OK  - query capability of device success
  * 
 ***********************************************************************************/
-static int printCapabilities(int fd, struct v4l2_capability caps);
+int printCapabilities(int fd, struct v4l2_capability caps);
 
 /**********************************************************************************
- * @func     static int getInput(int fd, unsigned int *index)
+ * @func     int getInput(int fd, unsigned int *index)
  * 
  * @brief    get index of camera device input
  * @param    fd     - file descriptor when open the device
@@ -102,10 +201,10 @@ static int printCapabilities(int fd, struct v4l2_capability caps);
  * @return   RETURN_STATUS_OK - query capability of device success
  * 
 ***********************************************************************************/
-static int getInput(int fd, unsigned int *index);
+int getInput(int fd, unsigned int *index);
 
 /**********************************************************************************
- * @func     static int enumInput(int fd, struct v4l2_input input)
+ * @func     int enumInput(int fd, struct v4l2_input input)
 
  * @brief    enumerate video device input
  * @param    fd     - file descriptor when open the device
@@ -114,10 +213,10 @@ static int getInput(int fd, unsigned int *index);
  * @return   RETURN_STATUS_OK - enumerate video device input success
  * 
 ***********************************************************************************/
-static int enumInput(int fd, struct v4l2_input input);
+int enumInput(int fd, struct v4l2_input input);
 
 /**********************************************************************************
- * @func     static int setInput(int fd, int index)
+ * @func     int setInput(int fd, int index)
  * 
  * @brief    set index of camera device input
  * @param    fd     - file descriptor when open the device
@@ -126,10 +225,10 @@ static int enumInput(int fd, struct v4l2_input input);
  * @return   RETURN_STATUS_OK - enumerate video device input success
  * 
 ***********************************************************************************/
-static int setInput(int fd, int index);
+int setInput(int fd, int index);
 
 /**********************************************************************************
- * @func    static int setFormat(int fd, struct v4l2_format format)
+ * @func    int setFormat(int fd, struct v4l2_format format)
  * 
  * @brief   Negotiate format of pixel with device
  * @para    fd     - file descriptor when open the device
@@ -137,10 +236,10 @@ static int setInput(int fd, int index);
  * @return  IOCTL_ERROR      - the ioctl VIDIOC_S_FMT is failed
  * @return  RETURN_STATUS_OK - setting format success
 **********************************************************************************/
-static int setFormat(int fd, struct v4l2_format format);
+int setFormat(int fd, struct v4l2_format format);
 
 /**********************************************************************************
- * @func    static int getFormat(int fd, struct v4l2_format format)
+ * @func    int getFormat(int fd, struct v4l2_format format)
  * 
  * @brief   get format of pixel
  * @param   fd      - file descriptor when open the device
@@ -148,10 +247,10 @@ static int setFormat(int fd, struct v4l2_format format);
  * @return  IOCTL_ERROR      - the ioctl VIDIOC_G_FMT is failed
  * @return  RETURN_STATUS_OK - getting format success
 **********************************************************************************/
-static int getFormat(int fd, struct v4l2_format format);
+int getFormat(int fd, struct v4l2_format format);
 
 /**********************************************************************************
- * @func    static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
+ * @func    int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff)
  * 
  * @brief   Allocate device buffers
  * @param   fd      - file descriptor when open the device
@@ -160,10 +259,10 @@ static int getFormat(int fd, struct v4l2_format format);
  * @return  INSUFFICENT_BUFF - not enough buffer
  * @return  RETURN_STATUS_OK - request buffer success
 ***********************************************************************************/
-static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff);
+int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff);
 
 /**********************************************************************************
- * @func    static void init_mmap_method(int fd)
+ * @func    void init_mmap_method(int fd)
  * 
  * @brief   Initialize to use MMAP method to exchange data between user space and 
  *          kernel space 
@@ -172,10 +271,28 @@ static int requestBuffer(int fd, struct v4l2_requestbuffers *reqbuff);
  * @return  MAP_FAILED  - mapping memory address between user space and kernel space 
  *          is failed  
 /**********************************************************************************/
-static void init_mmap_method(int fd);
+void init_mmap_method(int fd);
+
+/**********************************************************************************
+ * @func    void initRead(unsigned int size)
+ * 
+ * @brief   Initialize to use read() to copy frames from kernel space, the driver
+ *          starts streaming on the first read
+ * @param   size: size of a frame reported by VIDIOC_G_FMT
+***********************************************************************************/
+void initRead(unsigned int size);
 
 /**********************************************************************************
- * @func    static int enumFormat(int fd)
+ * @func    void initSplice(unsigned int size)
+ * 
+ * @brief   Initialize to splice() frames from the driver through a pipe into the
+ *          output file, the frame data never reaches user space
+ * @param   size: size of a frame reported by VIDIOC_G_FMT
+***********************************************************************************/
+void initSplice(unsigned int size);
+
+/**********************************************************************************
+ * @func    int enumFormat(int fd)
  * 
  * @brief   Enumerate format of the device
  * @param   fd - file descriptor when open the device
@@ -183,28 +300,28 @@ static void init_mmap_method(int fd);
  * @return  RETURN_STATUS_OK - enumerate format success
  
 ***********************************************************************************/
-static int enumFormat(int fd);
+int enumFormat(int fd);
 
 /**********************************************************************************
- * @func  static void deviceInit(int fd)
+ * @func  void deviceInit(int fd)
  * 
  * @brief: Initialize the camera device to get information of the device and set 
  *         some requirement depend on users
  * @param: fd - file descriptor when open the device
  * 
 ***********************************************************************************/
-static void deviceInit(int fd);
+void deviceInit(int fd);
 
 /**********************************************************************************
- * @func  static void deviceUninit();
+ * @func  void deviceUninit();
  * 
  * @brief: Uninitialize the camera device 
  * 
 ***********************************************************************************/
-static void deviceUninit();
+void deviceUninit();
 
 /**********************************************************************************
- * @func    static int startCapturing(int fd)
+ * @func    int startCapturing(int fd)
  * 
  * @brief   Start capturing image from camera device
  * @param   fd - file descriptor when open the device
@@ -212,29 +329,29 @@ static void deviceUninit();
  * @return  RETURN_STATUS_OK - Success
  
 ***********************************************************************************/
-static int startCapturing(int fd);
+int startCapturing(int fd);
 
 /**********************************************************************************
- * @func    static void stopCapturing(int fd)
+ * @func    void stopCapturing(int fd)
  * 
  * @brief   Stop capturing image from camera device
  * @param   fd - file descriptor when open the device
  * @return  IOCTL_ERROR      - ioctl VIDIOC_STREAMOFF is failed
  * @return  RETURN_STATUS_OK - success
 ***********************************************************************************/
-static void stopCapturing(int fd);
+void stopCapturing(int fd);
 
 /**********************************************************************************
- * @func    static void processImage(const void *pointer, int size)
+ * @func    void processImage(const void *pointer, int size)
  * 
  * @brief   Write data captured from device to file .raw
  * @param   fd      - file descriptor when open the device
  * @param   size    - the size of frame is wrote into raw file
  * *******************************************************************************/
-static void processImage(const void *pointer, int size);
+void processImage(const void *pointer, int size);
 
 /**********************************************************************************
- * @func    static int readFrame(int fd)
+ * @func    int readFrame(int fd)
  * 
  * @brief   Get data(frame) from kernel space 
  * @param   fd      - file descriptor when open the device
@@ -242,14 +359,189 @@ static void processImage(const void *pointer, int size);
  *                            (user read kernel log to get detail error)
  * @return  RETURN_STATUS_OK - Success
  * *******************************************************************************/
-static int readFrame(int fd);
+int readFrame(int fd);
 
 /**********************************************************************************
- * @func    static void mainloop(int fd)
+ * @func    void mainloop(int fd)
  * 
  * @brief   loop program use I/O multiplexing method to prevent infinity loop when
  *          open an device file that not exist or not really to use
  * @param   fd      - file descriptor when open the device
  *
  * *******************************************************************************/
-static void mainloop(int fd);
+void mainloop(int fd);
+
+/**********************************************************************************
+ * @func    void resetStatistics(void)
+ * 
+ * @brief   clear the capture statistics before another capture in the same process
+***********************************************************************************/
+void resetStatistics(void);
+
+/**********************************************************************************
+ * @func    void getCaptureResult(captureResult *res)
+ * 
+ * @brief   get the frame rate and the latency percentiles of the last capture. The
+ *          latency runs from the time stamp of the buffer, or from the read() call
+ *          with the read method, to the frame being written and queued again
+***********************************************************************************/
+void getCaptureResult(captureResult *res);
+
+/**********************************************************************************
+ * @func    void printStatistics(void)
+ * 
+ * @brief   print the number of frames, the time spent to get them from the driver
+ *          and the throughput of the capture
+ * *******************************************************************************/
+void printStatistics(void);
+
+/**********************************************************************************
+ * @func    int setLatestFrame(int fd, int enable)
+ * 
+ * @brief   enable or disable the latest frame mode of the driver: a new frame
+ *          replaces the completed frames not dequeued yet
+ * @param   fd      - file descriptor when open the device
+ * @return  IOCTL_ERROR      - ioctl VIDIOC_S_CTRL is failed
+ * @return  RETURN_STATUS_OK - Success
+ * *******************************************************************************/
+int setLatestFrame(int fd, int enable);
+
+/**********************************************************************************
+ * @func    int setDecimation(int fd, unsigned int n)
+ * 
+ * @brief   ask the driver for every Nth frame of the camera only, the others are
+ *          dropped in the driver before they are assembled
+ * @param   fd      - file descriptor when open the device
+ * @param   n       - 1 delivers every frame
+ * @return  IOCTL_ERROR      - ioctl VIDIOC_S_CTRL is failed
+ * @return  RETURN_STATUS_OK - Success
+ * *******************************************************************************/
+int setDecimation(int fd, unsigned int n);
+
+/**********************************************************************************
+ * @func    int setErrorFrames(int fd, int policy)
+ * 
+ * @brief   tell the driver what to do with frames that lost data on the bus:
+ *          deliver them with V4L2_BUF_FLAG_ERROR set or drop them
+ * @param   fd      - file descriptor when open the device
+ * @param   policy  - CAM_ERROR_DELIVER or CAM_ERROR_DROP
+ * @return  IOCTL_ERROR      - ioctl VIDIOC_S_CTRL is failed
+ * @return  RETURN_STATUS_OK - Success
+ * *******************************************************************************/
+int setErrorFrames(int fd, int policy);
+
+/**********************************************************************************
+ * @func    void printDriverStatistics(int fd)
+ * 
+ * @brief   print the frame counters kept by the driver
+ * @param   fd      - file descriptor when open the device
+ * *******************************************************************************/
+void printDriverStatistics(int fd);
+
+/**********************************************************************************
+ * @func    int setConvert(const char *name)
+ * 
+ * @brief   select the format processImage converts YUYV frames to: rgb24, bgra,
+ *          i420, nv12 or y8. The fastest kernels of the CPU are used
+ * @param   name    - name of the destination format
+ * @return  RETURN_STATUS_ERR - unknown format
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setConvert(const char *name);
+
+/**********************************************************************************
+ * @func    int setShare(const char *arg)
+ * 
+ * @brief   read the frames another process streams instead of streaming, arg is
+ *          the drop policy (oldest, newest or latest) and an optional depth
+ *          after a colon
+ * @param   arg     - POLICY[:DEPTH]
+ * @return  RETURN_STATUS_ERR - unknown policy
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setShare(const char *arg);
+
+/**********************************************************************************
+ * @func    int setAffinity(const char *arg)
+ * 
+ * @brief   pin the capture thread, and the threads it starts later, to a list of
+ *          CPUs such as 0-3,8. "auto" takes the completion CPUs of the driver or
+ *          the CPUs of its buffer node, so the frames are processed on the node
+ *          that holds them
+ * @param   arg     - CPU list or auto
+ * @return  RETURN_STATUS_ERR - invalid list or sched_setaffinity() failed
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setAffinity(const char *arg);
+
+/**********************************************************************************
+ * @func    int setCrop(const char *arg)
+ * 
+ * @brief   crop the frames in the driver to a region of interest, only the
+ *          rectangle is copied into the buffers (YUYV only)
+ * @param   arg     - WIDTHxHEIGHT+LEFT+TOP, the offsets are optional
+ * @return  RETURN_STATUS_ERR - invalid rectangle
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setCrop(const char *arg);
+
+/**********************************************************************************
+ * @func    int setMotion(const char *arg)
+ * 
+ * @brief   only write the YUYV frames whose mean absolute luma difference to the
+ *          last written frame reaches a threshold (0 to 255). An optional count
+ *          after a colon writes a frame after that many static ones, so a still
+ *          scene keeps a reference now and then
+ * @param   arg     - THRESHOLD[:MAX]
+ * @return  RETURN_STATUS_ERR - invalid threshold
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setMotion(const char *arg);
+
+/**********************************************************************************
+ * @func    int setCompress(const char *arg)
+ * 
+ * @brief   compress every frame of the recording (-o) alone on a pool of
+ *          compress_threads workers, between DQBUF and the writer
+ * @param   arg     - CODEC[:LEVEL], lz4, zstd or zlib when built in
+ * @return  RETURN_STATUS_ERR - unknown codec or not built in
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setCompress(const char *arg);
+
+/**********************************************************************************
+ * @func    int setFrameFormat(const char *arg)
+ * 
+ * @brief   set the frame size and optionally the pixel format asked for, the
+ *          driver picks the closest size it has
+ * @param   arg     - WIDTHxHEIGHT[:FOURCC], 640x480:YUYV or 1280x720:MJPG
+ * @return  RETURN_STATUS_ERR - invalid format
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int setFrameFormat(const char *arg);
+
+/*******************************************************************************
+ * FUNCTIONS - TUNING
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    int loadConfig(const char *path)
+ * 
+ * @brief   set the device, I/O method, format and buffer count from a file in the
+ *          format tuneDevice writes, one "key = value" per line
+ * @return  RETURN_STATUS_ERR - the file can not be read or has an invalid line
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int loadConfig(const char *path);
+
+/**********************************************************************************
+ * @func    int tuneDevice(const char *path)
+ * 
+ * @brief   run a short capture for every format and frame size the device
+ *          enumerates, every I/O method and several buffer counts, keep the
+ *          configuration with the best sustained frame rate and then the lowest
+ *          p99 latency, and write it to path for loadConfig
+ * @return  RETURN_STATUS_ERR - no configuration delivered frames
+ * @return  RETURN_STATUS_OK  - Success
+ * *******************************************************************************/
+int tuneDevice(const char *path);
@@ -0,0 +1,327 @@
+/*
+* @file     cam_tune.c
+* @author   Trong Phuoc
+* @brief    Sweep the formats, frame sizes, I/O methods and buffer counts of the
+*           device with short captures and keep the best configuration in a
+*           file the capture tool loads with -k
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include "cam_test.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define TUNE_FRAMES         120     /* frames of every trial, 4 s at 30 fps */
+#define TUNE_MAX_SIZES      32      /* formats times frame sizes tried at most */
+#define TUNE_FPS_MARGIN     0.02    /* frame rates within 2% are equal, latency decides */
+#define CONFIG_LINE         256
+#define TUNE_COUNTS         (sizeof(tune_buffers) / sizeof(tune_buffers[0]))
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct tuneConfig
+{
+    enum ioMethod io;
+    unsigned int fourcc;
+    unsigned int width;
+    unsigned int height;
+    unsigned int buffers;           /**< 0 with the read method, the driver keeps its ring */
+    captureResult result;
+} tuneConfig;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const unsigned int tune_buffers[] = {2, 3, 4, 6, 8};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static const char *ioName(enum ioMethod method)
+{
+    return method == IO_METHOD_READ ? "read" : method == IO_METHOD_SPLICE ? "splice" : "mmap";
+}
+
+/* the formats and discrete frame sizes the device enumerates */
+static unsigned int tuneFormats(tuneConfig *sizes)
+{
+    struct v4l2_fmtdesc desc;
+    struct v4l2_frmsizeenum size;
+    unsigned int n = 0;
+    int fd;
+
+    fd = openDevice();
+    if (fd < 0)
+    {
+        return 0;
+    }
+    CLEAR(desc);
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+    {
+        CLEAR(size);
+        size.pixel_format = desc.pixelformat;
+        for (size.index = 0; n < TUNE_MAX_SIZES && ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+        {
+            // a stepwise range is tried at its largest size only
+            sizes[n].fourcc = desc.pixelformat;
+            sizes[n].width = size.type == V4L2_FRMSIZE_TYPE_DISCRETE ? size.discrete.width : size.stepwise.max_width;
+            sizes[n].height = size.type == V4L2_FRMSIZE_TYPE_DISCRETE ? size.discrete.height :
+                              size.stepwise.max_height;
+            n++;
+            if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+            {
+                break;
+            }
+        }
+    }
+    closeDevice(fd);
+    return n;
+}
+
+/* one short capture with the configuration in the globals */
+static void tuneRun(tuneConfig *cfg)
+{
+    int fd;
+
+    io = cfg->io;
+    frame_fourcc = cfg->fourcc;
+    frame_width = cfg->width;
+    frame_height = cfg->height;
+    buffer_count = cfg->buffers ? cfg->buffers : buffer_count;
+    CLEAR(cfg->result);
+    fd = openDevice();
+    if (fd < 0)
+    {
+        return;
+    }
+    if (latest_frame)
+    {
+        setLatestFrame(fd, 1);
+    }
+    if (frame_decimation > 1)
+    {
+        setDecimation(fd, frame_decimation);
+    }
+    if (error_frames >= 0)
+    {
+        setErrorFrames(fd, error_frames);
+    }
+    resetStatistics();
+    deviceInit(fd);
+    startCapturing(fd);
+    mainloop(fd);
+    stopCapturing(fd);
+    deviceUninit();
+    closeDevice(fd);
+    getCaptureResult(&cfg->result);
+}
+
+/* better: a higher frame rate, then a lower p99 latency */
+static int tuneBetter(const tuneConfig *a, const tuneConfig *b)
+{
+    if (a->result.frames < TUNE_FRAMES / 2 || a->result.p99Ns == 0)
+    {
+        return 0;
+    }
+    if (b == NULL || a->result.fps > b->result.fps * (1.0 + TUNE_FPS_MARGIN))
+    {
+        return 1;
+    }
+    return a->result.fps >= b->result.fps * (1.0 - TUNE_FPS_MARGIN) && a->result.p99Ns < b->result.p99Ns;
+}
+
+static void tunePrint(const tuneConfig *cfg)
+{
+    char buffers[16] = "-";
+
+    if (cfg->buffers)
+    {
+        snprintf(buffers, sizeof(buffers), "%u", cfg->buffers);
+    }
+    printf("%-6s %4ux%-4u %.4s %7s %8lu %8lu %8.2f %9.3f %9.3f \n", ioName(cfg->io), cfg->width, cfg->height,
+           (const char *)&cfg->fourcc, buffers, cfg->result.frames, cfg->result.missed, cfg->result.fps,
+           cfg->result.p50Ns / 1e6, cfg->result.p99Ns / 1e6);
+}
+
+static int saveConfig(const char *path, const tuneConfig *best, unsigned int tried)
+{
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        printf("Can not write %s \n", path);
+        return RETURN_STATUS_ERR;
+    }
+    fprintf(file, "# written by cam_test -T, best of %u configurations on this machine\n", tried);
+    fprintf(file, "# %.2f fps, latency p50 %.3f ms, p99 %.3f ms\n", best->result.fps, best->result.p50Ns / 1e6,
+            best->result.p99Ns / 1e6);
+    fprintf(file, "device = %s\n", device_name);
+    fprintf(file, "io = %s\n", ioName(best->io));
+    fprintf(file, "format = %ux%u:%.4s\n", best->width, best->height, (const char *)&best->fourcc);
+    if (best->buffers)
+    {
+        fprintf(file, "buffers = %u\n", best->buffers);
+    }
+    return fclose(file) == 0 ? RETURN_STATUS_OK : RETURN_STATUS_ERR;
+}
+
+int loadConfig(const char *path)
+{
+    char line[CONFIG_LINE], key[CONFIG_LINE], value[CONFIG_LINE];
+    unsigned int number = 0;
+    int ret = RETURN_STATUS_OK;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        printf("Can not open config %s \n", path);
+        return RETURN_STATUS_ERR;
+    }
+    while (ret == RETURN_STATUS_OK && fgets(line, sizeof(line), file) != NULL)
+    {
+        number++;
+        if (sscanf(line, " %[^= \t\n] = %[^\n]", key, value) != 2)
+        {
+            // blank lines and comments
+            if (sscanf(line, " %1s", key) == 1 && key[0] != '#')
+            {
+                ret = RETURN_STATUS_ERR;
+            }
+            continue;
+        }
+        if (key[0] == '#')
+        {
+            continue;
+        }
+        value[strcspn(value, " \t\r#")] = '\0';
+        if (strcmp(key, "device") == 0)
+        {
+            device_name = strdup(value);
+        }
+        else if (strcmp(key, "io") == 0)
+        {
+            if (strcmp(value, "mmap") == 0)
+            {
+                io = IO_METHOD_MMAP;
+            }
+            else if (strcmp(value, "read") == 0)
+            {
+                io = IO_METHOD_READ;
+            }
+            else if (strcmp(value, "splice") == 0)
+            {
+                io = IO_METHOD_SPLICE;
+            }
+            else
+            {
+                ret = RETURN_STATUS_ERR;
+            }
+        }
+        else if (strcmp(key, "format") == 0)
+        {
+            ret = setFrameFormat(value);
+        }
+        else if (strcmp(key, "buffers") == 0)
+        {
+            buffer_count = strtoul(value, NULL, 0);
+            ret = buffer_count >= 2 && buffer_count <= MAX_BUFFERS ? RETURN_STATUS_OK : RETURN_STATUS_ERR;
+        }
+        else
+        {
+            ret = RETURN_STATUS_ERR;
+        }
+    }
+    fclose(file);
+    if (ret != RETURN_STATUS_OK)
+    {
+        printf("Invalid line %u in config %s \n", number, path);
+    }
+    return ret;
+}
+
+int tuneDevice(const char *path)
+{
+    tuneConfig sizes[TUNE_MAX_SIZES];
+    tuneConfig *configs, *best = NULL;
+    unsigned int nsizes, nconfigs = 0, i, j;
+    unsigned int count = frame_count;
+    int write = write_frames;
+    int ret;
+    const char *output = output_name;
+
+    nsizes = tuneFormats(sizes);
+    if (nsizes == 0)
+    {
+        // a device that enumerates nothing is tuned at the format asked for
+        printf("The device enumerates no format, tuning %ux%u only \n", frame_width, frame_height);
+        sizes[0].fourcc = frame_fourcc ? frame_fourcc : decode_threads ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+        sizes[0].width = frame_width;
+        sizes[0].height = frame_height;
+        nsizes = 1;
+    }
+    configs = calloc(nsizes * (TUNE_COUNTS + 1), sizeof(*configs));
+    if (configs == NULL)
+    {
+        printf("Out of memory \n");
+        return RETURN_STATUS_ERR;
+    }
+    for (i = 0; i < nsizes; i++)
+    {
+        // read() uses the ring of the driver, the buffer count does not apply
+        configs[nconfigs] = sizes[i];
+        configs[nconfigs].io = IO_METHOD_READ;
+        configs[nconfigs++].buffers = 0;
+        for (j = 0; j < TUNE_COUNTS; j++)
+        {
+            configs[nconfigs] = sizes[i];
+            configs[nconfigs].io = IO_METHOD_MMAP;
+            configs[nconfigs++].buffers = tune_buffers[j];
+        }
+    }
+
+    // no files while tuning, the splice method only writes a recording
+    frame_count = TUNE_FRAMES;
+    write_frames = 0;
+    output_name = NULL;
+    for (i = 0; i < nconfigs; i++)
+    {
+        printf("------------------> Tuning %u/%u: %s %ux%u %.4s, %u buffers <-------------------- \n", i + 1,
+               nconfigs, ioName(configs[i].io), configs[i].width, configs[i].height,
+               (const char *)&configs[i].fourcc, configs[i].buffers);
+        tuneRun(&configs[i]);
+        if (tuneBetter(&configs[i], best))
+        {
+            best = &configs[i];
+        }
+    }
+    frame_count = count;
+    write_frames = write;
+    output_name = output;
+
+    printf("------------------> Tuning results <-------------------- \n");
+    printf("%-6s %9s %-4s %7s %8s %8s %8s %9s %9s \n", "io", "size", "fmt", "buffers", "frames", "missed", "fps",
+           "p50 ms", "p99 ms");
+    for (i = 0; i < nconfigs; i++)
+    {
+        tunePrint(&configs[i]);
+    }
+    if (best == NULL)
+    {
+        printf("No configuration delivered frames \n");
+        free(configs);
+        return RETURN_STATUS_ERR;
+    }
+    printf("Best: %s %ux%u %.4s", ioName(best->io), best->width, best->height, (const char *)&best->fourcc);
+    if (best->buffers)
+    {
+        printf(", %u buffers", best->buffers);
+    }
+    printf(", %.2f fps, p99 %.3f ms, written to %s \n", best->result.fps, best->result.p99Ns / 1e6, path);
+    ret = saveConfig(path, best, nconfigs);
+    free(configs);
+    return ret;
+}
@@ -0,0 +1,267 @@
+/*
+* @file     compress_bench.c
+* @author   Trong Phuoc
+* @brief    Compression ratio and CPU time per frame of every codec and level
+*           built in, over the frames of a recording or synthetic YUYV frames.
+*           Every block is checked by decompressing it
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "frame_compress.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_FRAMES    60      /* synthetic frames, 2 s at 30 fps */
+#define BENCH_WIDTH     640
+#define BENCH_HEIGHT    480
+#define BENCH_BLOCK     96      /* side of the block moving over the scene */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct benchLevel
+{
+    uint32_t codec;
+    int level;
+} benchLevel;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const benchLevel levels[] = {
+    {RECORD_CODEC_LZ4, -8}, {RECORD_CODEC_LZ4, 1}, {RECORD_CODEC_LZ4, 4}, {RECORD_CODEC_LZ4, 9},
+    {RECORD_CODEC_ZSTD, -3}, {RECORD_CODEC_ZSTD, 1}, {RECORD_CODEC_ZSTD, 3}, {RECORD_CODEC_ZSTD, 9},
+    {RECORD_CODEC_ZLIB, 1}, {RECORD_CODEC_ZLIB, 6}, {RECORD_CODEC_ZLIB, 9},
+};
+
+static uint8_t **frames;
+static uint32_t *frameSizes;
+static unsigned int n_frames;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-i | --input FILE    Compress the frames of a recording instead of synthetic \n"
+           "                     640x480 YUYV frames \n"
+           "-n | --frames N      Use at most N frames of the recording \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getCpuNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a lit gradient with sensor noise and a block moving across it */
+static int makeFrames(void)
+{
+    uint32_t size = BENCH_WIDTH * BENCH_HEIGHT * 2;
+    unsigned int f, x, y;
+    uint8_t *p;
+
+    frames = calloc(BENCH_FRAMES, sizeof(*frames));
+    frameSizes = calloc(BENCH_FRAMES, sizeof(*frameSizes));
+    if (frames == NULL || frameSizes == NULL)
+    {
+        return -1;
+    }
+    srand(1);
+    for (f = 0; f < BENCH_FRAMES; f++)
+    {
+        frames[f] = malloc(size);
+        if (frames[f] == NULL)
+        {
+            return -1;
+        }
+        frameSizes[f] = size;
+        for (y = 0; y < BENCH_HEIGHT; y++)
+        {
+            p = frames[f] + y * BENCH_WIDTH * 2;
+            for (x = 0; x < BENCH_WIDTH; x++, p += 2)
+            {
+                p[0] = 32 + (x + y) / 8 + (rand() & 3);
+                p[1] = x & 1 ? 120 : 136;
+                if (x >= f * 8 && x < f * 8 + BENCH_BLOCK && y >= 192 && y < 192 + BENCH_BLOCK)
+                {
+                    p[0] = 200;
+                    p[1] = x & 1 ? 90 : 160;
+                }
+            }
+        }
+    }
+    n_frames = BENCH_FRAMES;
+    return 0;
+}
+
+/* copy the frames of a recording, decompressed when needed */
+static int loadFrames(const char *path, unsigned int max)
+{
+    const recordIndexEntry *entry;
+    const void *payload;
+    recordReader *rd;
+    uint32_t size;
+    uint64_t i;
+
+    rd = recordOpen(path);
+    if (rd == NULL)
+    {
+        printf("%s is not a recording \n", path);
+        return -1;
+    }
+    n_frames = recordCount(rd) < max ? recordCount(rd) : max;
+    frames = calloc(n_frames, sizeof(*frames));
+    frameSizes = calloc(n_frames, sizeof(*frameSizes));
+    if (n_frames == 0 || frames == NULL || frameSizes == NULL)
+    {
+        recordRelease(rd);
+        return -1;
+    }
+    for (i = 0; i < n_frames; i++)
+    {
+        entry = recordEntry(rd, i);
+        payload = recordFrame(rd, i, &size);
+        frameSizes[i] = entry->rawSize ? entry->rawSize : size;
+        frames[i] = malloc(frameSizes[i]);
+        if (payload == NULL || frames[i] == NULL)
+        {
+            recordRelease(rd);
+            return -1;
+        }
+        if (entry->rawSize == 0)
+        {
+            memcpy(frames[i], payload, size);
+        }
+        else if (compressDecode(recordCodec(rd), payload, size, frames[i], entry->rawSize) < 0)
+        {
+            printf("Can not decompress frame %u \n", (unsigned int)i);
+            recordRelease(rd);
+            return -1;
+        }
+    }
+    recordRelease(rd);
+    return 0;
+}
+
+/* compress every frame with one level, 0 when all blocks decompress to the frame */
+static int benchLevelRun(const benchLevel *bl)
+{
+    compressConfig config = {bl->codec, bl->level};
+    unsigned long long packCpu = 0, unpackCpu = 0, raw = 0, packed = 0, start;
+    unsigned int f, asIs = 0;
+    poolJob job;
+    uint8_t *check;
+    void *ctx;
+    int status = 0;
+
+    ctx = compressOps.ctxCreate(&config);
+    if (ctx == NULL)
+    {
+        printf("  %-5s %3d  can not create the context \n", compressName(bl->codec), bl->level);
+        return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    for (f = 0; f < n_frames && status == 0; f++)
+    {
+        job.in = frames[f];
+        job.inSize = frameSizes[f];
+        start = getCpuNs();
+        job.status = compressOps.work(ctx, &job);
+        packCpu += getCpuNs() - start;
+        raw += frameSizes[f];
+        if (job.status < 0)
+        {
+            packed += frameSizes[f];
+            asIs++;
+            continue;
+        }
+        packed += job.outSize;
+
+        check = malloc(frameSizes[f]);
+        start = getCpuNs();
+        if (check == NULL || compressDecode(bl->codec, job.out, job.outSize, check, frameSizes[f]) < 0 ||
+            memcmp(check, frames[f], frameSizes[f]) != 0)
+        {
+            printf("  %-5s %3d  MISMATCH on frame %u \n", compressName(bl->codec), bl->level, f);
+            status = -1;
+        }
+        unpackCpu += getCpuNs() - start;
+        free(check);
+    }
+    if (status == 0)
+    {
+        printf("  %-5s %3d  ratio %6.2f  compress %8.1f us/frame  decompress %7.1f us/frame  %3u as is \n",
+               compressName(bl->codec), bl->level, (double)raw / packed, packCpu / 1000.0 / n_frames,
+               n_frames > asIs ? unpackCpu / 1000.0 / (n_frames - asIs) : 0.0, asIs);
+    }
+    free(job.out);
+    compressOps.ctxDestroy(ctx);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"input", required_argument, NULL, 'i'},
+        {"frames", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *input = NULL;
+    unsigned int max = 300, i, tried = 0;
+    int status = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "i:n:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            input = optarg;
+            break;
+        case 'n':
+            max = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((input != NULL ? loadFrames(input, max) : makeFrames()) < 0)
+    {
+        printf("Can not get the frames \n");
+        return 1;
+    }
+    printf("%u frames of %u bytes, CPU time of one thread \n", n_frames, frameSizes[0]);
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        if (!compressSupported(levels[i].codec))
+        {
+            continue;
+        }
+        status |= benchLevelRun(&levels[i]);
+        tried++;
+    }
+    if (tried == 0)
+    {
+        printf("No codec built in, add -DHAVE_LZ4 -llz4, -DHAVE_ZSTD -lzstd or -DHAVE_ZLIB -lz \n");
+        return 1;
+    }
+    return status < 0 ? 1 : 0;
+}
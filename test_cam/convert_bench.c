@@ -0,0 +1,125 @@
+/*
+* @file     convert_bench.c
+* @author   Trong Phuoc
+* @brief    Microbenchmark of the YUYV conversion kernels, checks every SIMD kernel
+*           against the scalar one and prints the throughput in GB/s
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "yuyv_convert.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_MIN_NS 200000000ULL /* run every kernel for at least 0.2 s */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct benchKernel
+{
+    const char *name;
+    size_t offset;      /**< offset of the kernel in yuyvConverter */
+    unsigned int num;   /**< destination bytes per 2 pixels */
+} benchKernel;
+
+static const benchKernel kernels[] = {
+    {"rgb24", offsetof(yuyvConverter, toRgb24), 6},
+    {"bgra", offsetof(yuyvConverter, toBgra), 8},
+    {"i420", offsetof(yuyvConverter, toI420), 3},
+    {"nv12", offsetof(yuyvConverter, toNv12), 3},
+    {"y8", offsetof(yuyvConverter, toY8), 2},
+};
+
+static const unsigned int sizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static convertFunc getKernel(const yuyvConverter *conv, const benchKernel *kernel)
+{
+    return *(const convertFunc *)((const char *)conv + kernel->offset);
+}
+
+int main(void)
+{
+    const yuyvConverter *scalar = yuyvGetConverterIsa(CONVERT_ISA_SCALAR);
+    const yuyvConverter *conv;
+    unsigned char *src, *dst, *ref;
+    unsigned long long start, ns;
+    unsigned int s, k, isa, i, runs;
+    size_t srcSize, dstSize;
+    int status = 0;
+
+    printf("best kernels: %s \n", yuyvGetConverter()->name);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        srcSize = (size_t)sizes[s][0] * sizes[s][1] * 2;
+        src = malloc(srcSize);
+        dst = malloc(srcSize * 2);
+        ref = malloc(srcSize * 2);
+        if (src == NULL || dst == NULL || ref == NULL)
+        {
+            printf("Out of memory \n");
+            return 1;
+        }
+        srand(s + 1);
+        for (i = 0; i < srcSize; i++)
+        {
+            src[i] = rand();
+        }
+
+        printf("\n%ux%u \n", sizes[s][0], sizes[s][1]);
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        {
+            dstSize = srcSize / 4 * kernels[k].num;
+            getKernel(scalar, &kernels[k])(src, ref, sizes[s][0], sizes[s][1]);
+            for (isa = 0; isa < CONVERT_ISA_COUNT; isa++)
+            {
+                conv = yuyvGetConverterIsa(isa);
+                if (conv == NULL)
+                {
+                    continue;
+                }
+                memset(dst, 0, dstSize);
+                getKernel(conv, &kernels[k])(src, dst, sizes[s][0], sizes[s][1]);
+                if (memcmp(dst, ref, dstSize) != 0)
+                {
+                    printf("  %-6s %-7s MISMATCH with scalar \n", kernels[k].name, conv->name);
+                    status = 1;
+                    continue;
+                }
+
+                runs = 0;
+                start = getTimeNs();
+                do
+                {
+                    getKernel(conv, &kernels[k])(src, dst, sizes[s][0], sizes[s][1]);
+                    runs++;
+                    ns = getTimeNs() - start;
+                } while (ns < BENCH_MIN_NS);
+                // GB/s of YUYV input, the same for every output format
+                printf("  %-6s %-7s %8.2f GB/s %9.1f us/frame \n", kernels[k].name, conv->name,
+                       (double)srcSize * runs / ns, ns / 1000.0 / runs);
+            }
+        }
+        free(src);
+        free(dst);
+        free(ref);
+    }
+    return status;
+}
@@ -0,0 +1,173 @@
+/*
+* @file     frame_client.c
+* @author   Trong Phuoc
+* @brief    Take the frames cam_test -U serves on a Unix socket, each one a
+*           memfd passed with SCM_RIGHTS, and report the latency from capture
+*           and from sending to the client and the frames the client missed
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "frame_server.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define CLIENT_TIMEOUT_MS   5000    /* a server which sends nothing for 5 s is stuck */
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] SOCKET \n"
+           "SOCKET is the path given to cam_test -U \n"
+           "-c | --count N       Number of frames to read (default 300) \n"
+           "-s | --slow US       Spend US microseconds on every frame, to see skips \n"
+           "-v | --verbose       Print every frame \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* read the whole frame as a consumer would, one byte per cache line is enough */
+static unsigned int touchFrame(const uint8_t *data, uint32_t size)
+{
+    unsigned int sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < size; i += 64)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"count", required_argument, NULL, 'c'},
+        {"slow", required_argument, NULL, 's'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const serverHello *hello;
+    frameClient *cl;
+    clientFrame frame;
+    unsigned long long now, latency, latencySum = 0, latencyMax = 0, sendSum = 0, sendMax = 0;
+    unsigned long long start = 0, slowNs = 0;
+    unsigned long count = 300, frames = 0, missed = 0;
+    uint32_t lastSequence = 0;
+    unsigned int sum = 0;
+    int verbose = 0;
+    int status = 0;
+    int c, ret;
+
+    while ((c = getopt_long(argc, argv, "c:s:vh", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            slowNs = strtoull(optarg, NULL, 0) * 1000ULL;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cl = frameClientConnect(argv[optind]);
+    if (cl == NULL)
+    {
+        printf("No frame server on %s \n", argv[optind]);
+        return 1;
+    }
+    hello = frameClientFormat(cl);
+    printf("%ux%u %.4s, %u buffers of %u bytes, %u held at most \n", hello->width, hello->height,
+           (const char *)&hello->pixelformat, hello->buffers, hello->bufferSize, hello->depth);
+
+    while (frames < count)
+    {
+        ret = frameClientNext(cl, &frame, CLIENT_TIMEOUT_MS);
+        if (ret == 0)
+        {
+            printf("No frame within %d ms \n", CLIENT_TIMEOUT_MS);
+            status = 1;
+            break;
+        }
+        if (ret < 0)
+        {
+            printf("The server went away \n");
+            break;
+        }
+        now = getTimeNs();
+        start = start ? start : now;
+        if (frames > 0 && frame.info.sequence - lastSequence > 1)
+        {
+            missed += frame.info.sequence - lastSequence - 1;
+        }
+        lastSequence = frame.info.sequence;
+        sum += touchFrame(frame.data, frame.info.size);
+        while (slowNs && getTimeNs() - now < slowNs)
+        {
+        }
+        if (frameClientRelease(cl, &frame) < 0)
+        {
+            printf("The server went away \n");
+            break;
+        }
+        latency = now > frame.info.timestampNs ? now - frame.info.timestampNs : 0;
+        latencySum += latency;
+        latencyMax = latency > latencyMax ? latency : latencyMax;
+        latency = now > frame.info.sentNs ? now - frame.info.sentNs : 0;
+        sendSum += latency;
+        sendMax = latency > sendMax ? latency : sendMax;
+        frames++;
+        if (verbose)
+        {
+            printf("seq %8u  buffer %2u  %8u bytes  latency %.3f ms \n", frame.info.sequence, frame.info.buffer,
+                   frame.info.size, (now - frame.info.timestampNs) / 1e6);
+        }
+    }
+
+    printf("------------------> Frame client statistics <-------------------- \n");
+    printf("Frames: %lu, missed: %lu, checksum %08x \n", frames, missed, sum);
+    if (frames > 0)
+    {
+        printf("Latency from capture: avg %.3f ms, max %.3f ms \n", latencySum / 1e6 / frames, latencyMax / 1e6);
+        printf("Latency from sending: avg %.1f us, max %.1f us \n", sendSum / 1e3 / frames, sendMax / 1e3);
+    }
+    if (frames > 1)
+    {
+        printf("Frame rate: %.2f fps \n", (frames - 1) * 1e9 / (getTimeNs() - start));
+    }
+    frameClientDisconnect(cl);
+    return status;
+}
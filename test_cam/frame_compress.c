@@ -0,0 +1,323 @@
+/*
+* @file     frame_compress.c
+* @author   Trong Phuoc
+* @brief    Frame compression stage running on a frame pool, see frame_compress.h
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_compress.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct compressCtx
+{
+    compressConfig config;
+#ifdef HAVE_LZ4
+    void *lz4State;                 /**< state of the fast or of the HC compressor */
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+#ifdef HAVE_ZLIB
+    z_stream zlib;
+    int zlibReady;
+#endif
+} compressCtx;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const char *const codecNames[] = {
+    [RECORD_CODEC_NONE] = "none",
+    [RECORD_CODEC_LZ4] = "lz4",
+    [RECORD_CODEC_ZSTD] = "zstd",
+    [RECORD_CODEC_ZLIB] = "zlib",
+};
+
+static const int defaultLevels[] = {
+    [RECORD_CODEC_NONE] = 0,
+    [RECORD_CODEC_LZ4] = 1,
+    [RECORD_CODEC_ZSTD] = 3,
+    [RECORD_CODEC_ZLIB] = 6,
+};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+/* worst case size of a block, 0 when the codec is not built in */
+static size_t compressBoundOf(uint32_t codec, size_t size)
+{
+    (void)size;     /* unused when no codec is built in */
+    switch (codec)
+    {
+#ifdef HAVE_LZ4
+    case RECORD_CODEC_LZ4:
+        return LZ4_compressBound(size);
+#endif
+#ifdef HAVE_ZSTD
+    case RECORD_CODEC_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+#ifdef HAVE_ZLIB
+    case RECORD_CODEC_ZLIB:
+        return compressBound(size);
+#endif
+    default:
+        return 0;
+    }
+}
+
+static void compressDestroy(void *data)
+{
+    compressCtx *ctx = data;
+
+#ifdef HAVE_LZ4
+    free(ctx->lz4State);
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(ctx->zstd);
+#endif
+#ifdef HAVE_ZLIB
+    if (ctx->zlibReady)
+    {
+        deflateEnd(&ctx->zlib);
+    }
+#endif
+    free(ctx);
+}
+
+static void *compressCreate(void *arg)
+{
+    const compressConfig *config = arg;
+    compressCtx *ctx;
+
+    if (!compressSupported(config->codec) || config->codec == RECORD_CODEC_NONE)
+    {
+        return NULL;
+    }
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+    ctx->config = *config;
+    // the contexts are made once per thread, a frame only resets them
+    switch (config->codec)
+    {
+#ifdef HAVE_LZ4
+    case RECORD_CODEC_LZ4:
+        ctx->lz4State = malloc(config->level > 1 ? LZ4_sizeofStateHC() : LZ4_sizeofState());
+        if (ctx->lz4State == NULL)
+        {
+            compressDestroy(ctx);
+            return NULL;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case RECORD_CODEC_ZSTD:
+        ctx->zstd = ZSTD_createCCtx();
+        if (ctx->zstd == NULL)
+        {
+            compressDestroy(ctx);
+            return NULL;
+        }
+        break;
+#endif
+#ifdef HAVE_ZLIB
+    case RECORD_CODEC_ZLIB:
+        if (deflateInit(&ctx->zlib, config->level) != Z_OK)
+        {
+            compressDestroy(ctx);
+            return NULL;
+        }
+        ctx->zlibReady = 1;
+        break;
+#endif
+    default:
+        break;
+    }
+    return ctx;
+}
+
+static int compressWork(void *data, poolJob *job)
+{
+    compressCtx *ctx = data;
+    size_t bound = compressBoundOf(ctx->config.codec, job->inSize);
+    size_t size = 0;
+
+    job->outSize = 0;
+    if (bound == 0)
+    {
+        return -1;
+    }
+    if (bound > job->outCap)
+    {
+        void *out = realloc(job->out, bound);
+        if (out == NULL)
+        {
+            return -1;
+        }
+        job->out = out;
+        job->outCap = bound;
+    }
+
+    switch (ctx->config.codec)
+    {
+#ifdef HAVE_LZ4
+    case RECORD_CODEC_LZ4:
+    {
+        int ret;
+        if (ctx->config.level > 1)
+        {
+            ret = LZ4_compress_HC_extStateHC(ctx->lz4State, job->in, job->out, job->inSize, bound,
+                                             ctx->config.level);
+        }
+        else
+        {
+            // 1 and below is the fast compressor, a negative level accelerates it
+            ret = LZ4_compress_fast_extState(ctx->lz4State, job->in, job->out, job->inSize, bound,
+                                             ctx->config.level < 1 ? -ctx->config.level : 1);
+        }
+        size = ret > 0 ? (size_t)ret : 0;
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case RECORD_CODEC_ZSTD:
+        size = ZSTD_compressCCtx(ctx->zstd, job->out, bound, job->in, job->inSize, ctx->config.level);
+        if (ZSTD_isError(size))
+        {
+            size = 0;
+        }
+        break;
+#endif
+#ifdef HAVE_ZLIB
+    case RECORD_CODEC_ZLIB:
+        deflateReset(&ctx->zlib);
+        ctx->zlib.next_in = job->in;
+        ctx->zlib.avail_in = job->inSize;
+        ctx->zlib.next_out = job->out;
+        ctx->zlib.avail_out = bound;
+        size = deflate(&ctx->zlib, Z_FINISH) == Z_STREAM_END ? ctx->zlib.total_out : 0;
+        break;
+#endif
+    default:
+        break;
+    }
+    // noise does not compress, such a frame is cheaper to store as is
+    if (size == 0 || size >= job->inSize)
+    {
+        return -1;
+    }
+    job->outSize = size;
+    return 0;
+}
+
+const framePoolOps compressOps = {
+    .ctxCreate = compressCreate,
+    .ctxDestroy = compressDestroy,
+    .work = compressWork,
+};
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+const char *compressName(uint32_t codec)
+{
+    return codec < sizeof(codecNames) / sizeof(codecNames[0]) ? codecNames[codec] : NULL;
+}
+
+int compressSupported(uint32_t codec)
+{
+    switch (codec)
+    {
+    case RECORD_CODEC_NONE:
+#ifdef HAVE_LZ4
+    case RECORD_CODEC_LZ4:
+#endif
+#ifdef HAVE_ZSTD
+    case RECORD_CODEC_ZSTD:
+#endif
+#ifdef HAVE_ZLIB
+    case RECORD_CODEC_ZLIB:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int compressParse(const char *arg, compressConfig *config)
+{
+    const char *level = strchr(arg, ':');
+    size_t len = level != NULL ? (size_t)(level - arg) : strlen(arg);
+    uint32_t codec;
+
+    for (codec = 0; codec < sizeof(codecNames) / sizeof(codecNames[0]); codec++)
+    {
+        if (strlen(codecNames[codec]) == len && strncmp(arg, codecNames[codec], len) == 0)
+        {
+            break;
+        }
+    }
+    if (codec == sizeof(codecNames) / sizeof(codecNames[0]))
+    {
+        printf("Unknown codec %.*s \n", (int)len, arg);
+        return -1;
+    }
+    if (!compressSupported(codec))
+    {
+        printf("%s is not built in, rebuild with -DHAVE_%s \n", codecNames[codec],
+               codec == RECORD_CODEC_LZ4 ? "LZ4" : codec == RECORD_CODEC_ZSTD ? "ZSTD" : "ZLIB");
+        return -1;
+    }
+    config->codec = codec;
+    config->level = level != NULL ? atoi(level + 1) : defaultLevels[codec];
+    return 0;
+}
+
+int compressDecode(uint32_t codec, const void *src, size_t size, void *dst, size_t rawSize)
+{
+    /* unused when no codec is built in */
+    (void)src;
+    (void)size;
+    (void)dst;
+    (void)rawSize;
+    switch (codec)
+    {
+#ifdef HAVE_LZ4
+    case RECORD_CODEC_LZ4:
+        return LZ4_decompress_safe(src, dst, size, rawSize) == (int)rawSize ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case RECORD_CODEC_ZSTD:
+        return ZSTD_decompress(dst, rawSize, src, size) == rawSize ? 0 : -1;
+#endif
+#ifdef HAVE_ZLIB
+    case RECORD_CODEC_ZLIB:
+    {
+        uLongf len = rawSize;
+        return uncompress(dst, &len, src, size) == Z_OK && len == rawSize ? 0 : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
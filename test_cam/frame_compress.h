@@ -0,0 +1,81 @@
+/*
+* @file     frame_compress.h
+* @author   Trong Phuoc
+* @brief    Frame compression stage running on a frame pool, one compression
+*           context per worker thread. Every frame is compressed alone into one
+*           block, so a recording stays randomly accessible
+*/
+#ifndef FRAME_COMPRESS_H
+#define FRAME_COMPRESS_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+#include "frame_pool.h"
+#include "cam_record.h"
+
+/*
+ * The codecs are built in when their library is: -DHAVE_LZ4 -llz4,
+ * -DHAVE_ZSTD -lzstd, -DHAVE_ZLIB -lz. Levels follow each library: lz4 1 is
+ * the fast compressor, 2..12 the HC one and a negative level the acceleration
+ * of the fast one, zstd goes from 1 to 19, zlib from 1 to 9.
+ */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct compressConfig
+{
+    uint32_t codec;             /**< RECORD_CODEC_* */
+    int level;
+} compressConfig;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+/*
+ * Work functions of the compression stage, the pool argument is a
+ * compressConfig which must live as long as the pool. job->in holds one frame,
+ * job->out gets the block. job->status is 0 on success and -1 when the codec
+ * failed or the block would not be smaller than the frame, the frame is then
+ * stored as is.
+ */
+extern const framePoolOps compressOps;
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    const char *compressName(uint32_t codec)
+ *
+ * @brief   get the name of a codec, "none" for RECORD_CODEC_NONE
+ * @return  NULL for an unknown codec
+***********************************************************************************/
+const char *compressName(uint32_t codec);
+
+/**********************************************************************************
+ * @func    int compressSupported(uint32_t codec)
+ *
+ * @brief   tell whether the library of a codec is built in
+***********************************************************************************/
+int compressSupported(uint32_t codec);
+
+/**********************************************************************************
+ * @func    int compressParse(const char *arg, compressConfig *config)
+ *
+ * @brief   parse CODEC[:LEVEL], the level defaults to the usual one of the codec
+ * @return  0 - Success, -1 - unknown codec or not built in
+***********************************************************************************/
+int compressParse(const char *arg, compressConfig *config);
+
+/**********************************************************************************
+ * @func    int compressDecode(uint32_t codec, const void *src, size_t size,
+ *                             void *dst, size_t rawSize)
+ *
+ * @brief   decompress one block into exactly rawSize bytes
+ * @return  0 - Success, -1 - corrupted block or codec not built in
+***********************************************************************************/
+int compressDecode(uint32_t codec, const void *src, size_t size, void *dst, size_t rawSize);
+
+#endif /* FRAME_COMPRESS_H */
@@ -0,0 +1,228 @@
+/*
+* @file     frame_pool.c
+* @author   Trong Phuoc
+* @brief    Pool of worker threads processing frames, see frame_pool.h
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "frame_pool.h"
+
+/*
+ * The jobs form a ring indexed by sequence % depth. The application fills and
+ * submits them in sequence order, the workers take them in the same order but
+ * may finish them in any order, and framePoolReceive only gives back the job of
+ * outSeq, so the results are reordered without any sorting. A job is reused
+ * only after it was released, which bounds the frames in flight to depth.
+ */
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static unsigned long long poolThreadCpuNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *poolWorkerThread(void *data)
+{
+    poolWorker *worker = data;
+    framePool *pool = worker->pool;
+    poolJob *job;
+    unsigned long long cpu;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->stop && pool->workSeq == pool->submitSeq)
+        {
+            pthread_cond_wait(&pool->workCond, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        job = &pool->jobs[pool->workSeq % pool->depth];
+        pool->workSeq++;
+        job->state = POOL_JOB_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+
+        cpu = poolThreadCpuNs();
+        job->status = pool->ops->work(worker->ctx, job);
+        job->cpuNs = poolThreadCpuNs() - cpu;
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = POOL_JOB_DONE;
+        pthread_cond_broadcast(&pool->doneCond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+framePool *framePoolCreate(unsigned int threads, unsigned int depth, const framePoolOps *ops, void *arg)
+{
+    framePool *pool;
+    unsigned int i;
+
+    if (threads == 0 || threads > POOL_MAX_THREADS || depth == 0)
+    {
+        return NULL;
+    }
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->jobs = calloc(depth, sizeof(*pool->jobs));
+    if (pool->jobs == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->ops = ops;
+    pool->arg = arg;
+    pool->depth = depth;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workCond, NULL);
+    pthread_cond_init(&pool->doneCond, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        poolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        if (ops->ctxCreate != NULL)
+        {
+            worker->ctx = ops->ctxCreate(arg);
+            if (worker->ctx == NULL)
+            {
+                printf("Can not create the context of worker %u \n", i);
+                break;
+            }
+        }
+        if (pthread_create(&worker->thread, NULL, poolWorkerThread, worker) != 0)
+        {
+            printf("Can not create worker %u \n", i);
+            if (ops->ctxDestroy != NULL)
+            {
+                ops->ctxDestroy(worker->ctx);
+            }
+            break;
+        }
+        pool->nthreads++;
+    }
+    if (pool->nthreads != threads)
+    {
+        framePoolDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void framePoolDestroy(framePool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->workCond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        if (pool->ops->ctxDestroy != NULL)
+        {
+            pool->ops->ctxDestroy(pool->workers[i].ctx);
+        }
+    }
+    for (i = 0; i < pool->depth; i++)
+    {
+        free(pool->jobs[i].in);
+        free(pool->jobs[i].out);
+    }
+    pthread_cond_destroy(&pool->doneCond);
+    pthread_cond_destroy(&pool->workCond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->jobs);
+    free(pool);
+}
+
+poolJob *framePoolGetJob(framePool *pool, int wait)
+{
+    poolJob *job = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->submitSeq - pool->outSeq >= pool->depth && wait)
+    {
+        pthread_cond_wait(&pool->doneCond, &pool->lock);
+    }
+    if (pool->submitSeq - pool->outSeq < pool->depth)
+    {
+        job = &pool->jobs[pool->submitSeq % pool->depth];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+int framePoolSetInput(poolJob *job, const void *data, size_t size)
+{
+    if (size > job->inCap)
+    {
+        void *in = realloc(job->in, size);
+        if (in == NULL)
+        {
+            return -1;
+        }
+        job->in = in;
+        job->inCap = size;
+    }
+    memcpy(job->in, data, size);
+    job->inSize = size;
+    return 0;
+}
+
+void framePoolSubmit(framePool *pool, poolJob *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    job->sequence = pool->submitSeq++;
+    job->state = POOL_JOB_QUEUED;
+    pthread_cond_signal(&pool->workCond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+poolJob *framePoolReceive(framePool *pool, int wait)
+{
+    poolJob *job = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->outSeq != pool->submitSeq)
+    {
+        job = &pool->jobs[pool->outSeq % pool->depth];
+        while (job->state != POOL_JOB_DONE && wait)
+        {
+            pthread_cond_wait(&pool->doneCond, &pool->lock);
+        }
+        if (job->state != POOL_JOB_DONE)
+        {
+            job = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+void framePoolRelease(framePool *pool, poolJob *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    job->state = POOL_JOB_FREE;
+    pool->outSeq++;
+    pthread_cond_broadcast(&pool->doneCond);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,143 @@
+/*
+* @file     frame_pool.h
+* @author   Trong Phuoc
+* @brief    Pool of worker threads processing frames out of order and giving the
+*           results back in the order the frames were submitted
+*/
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stddef.h>
+#include <pthread.h>
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define POOL_MAX_THREADS 64
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef enum poolJobState
+{
+    POOL_JOB_FREE,     /**<  owned by the application, can be filled */
+    POOL_JOB_QUEUED,   /**<  submitted, waiting for a worker */
+    POOL_JOB_BUSY,     /**<  a worker processes it */
+    POOL_JOB_DONE,     /**<  processed, waiting to be received in order */
+} poolJobState;
+
+typedef struct poolJob
+{
+    unsigned long sequence;        /**< submit order, set by framePoolSubmit */
+    poolJobState state;
+    unsigned long long timestamp;  /**< free for the application, kept with the job */
+    unsigned int flags;            /**< free for the application, kept with the job */
+    void *in;                      /**< input data, owned by the pool */
+    size_t inSize;
+    size_t inCap;
+    void *out;                     /**< output data, (re)allocated by the work function */
+    size_t outSize;
+    size_t outCap;
+    unsigned int width;            /**< geometry of the output, set by the work function */
+    unsigned int height;
+    int status;                    /**< return value of the work function */
+    unsigned long long cpuNs;      /**< thread CPU time the work function took */
+} poolJob;
+
+typedef struct framePoolOps
+{
+    void *(*ctxCreate)(void *arg);          /**< per thread context, e.g. a decoder */
+    void (*ctxDestroy)(void *ctx);
+    int (*work)(void *ctx, poolJob *job);   /**< process job->in into job->out */
+} framePoolOps;
+
+typedef struct poolWorker
+{
+    struct framePool *pool;
+    void *ctx;                     /**< context of this thread */
+    pthread_t thread;
+} poolWorker;
+
+typedef struct framePool
+{
+    const framePoolOps *ops;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;       /**< a job was submitted or the pool stops */
+    pthread_cond_t doneCond;       /**< a job was processed or released */
+    poolJob *jobs;                 /**< ring of depth jobs, job i holds sequence i % depth */
+    unsigned int depth;
+    unsigned long submitSeq;       /**< next sequence to submit */
+    unsigned long workSeq;         /**< next sequence taken by a worker */
+    unsigned long outSeq;          /**< next sequence given back to the application */
+    unsigned int nthreads;
+    poolWorker workers[POOL_MAX_THREADS];
+    int stop;
+} framePool;
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    framePool *framePoolCreate(unsigned int threads, unsigned int depth,
+ *                                     const framePoolOps *ops, void *arg)
+ *
+ * @brief   start threads workers, each with its own context created by
+ *          ops->ctxCreate(arg). At most depth jobs are in flight
+ * @return  the pool, NULL when a context or a thread can not be created
+***********************************************************************************/
+framePool *framePoolCreate(unsigned int threads, unsigned int depth, const framePoolOps *ops, void *arg);
+
+/**********************************************************************************
+ * @func    void framePoolDestroy(framePool *pool)
+ *
+ * @brief   stop the workers and free the pool, jobs not received are dropped
+***********************************************************************************/
+void framePoolDestroy(framePool *pool);
+
+/**********************************************************************************
+ * @func    poolJob *framePoolGetJob(framePool *pool, int wait)
+ *
+ * @brief   get the job to fill for the next frame. Waiting only makes sense when
+ *          another thread receives and releases the jobs
+ * @return  NULL when all jobs are in flight and wait is 0, the caller has to
+ *          receive the finished jobs first
+***********************************************************************************/
+poolJob *framePoolGetJob(framePool *pool, int wait);
+
+/**********************************************************************************
+ * @func    int framePoolSetInput(poolJob *job, const void *data, size_t size)
+ *
+ * @brief   copy the input of a job, the source buffer can be reused right after
+ * @return  0 - Success, -1 - out of memory
+***********************************************************************************/
+int framePoolSetInput(poolJob *job, const void *data, size_t size);
+
+/**********************************************************************************
+ * @func    void framePoolSubmit(framePool *pool, poolJob *job)
+ *
+ * @brief   hand the job got by framePoolGetJob to the workers
+***********************************************************************************/
+void framePoolSubmit(framePool *pool, poolJob *job);
+
+/**********************************************************************************
+ * @func    poolJob *framePoolReceive(framePool *pool, int wait)
+ *
+ * @brief   get the oldest submitted job once it is processed, jobs always come
+ *          back in submit order even when a later one finished first
+ * @return  NULL when nothing is pending, or when wait is 0 and the oldest job
+ *          is not processed yet
+***********************************************************************************/
+poolJob *framePoolReceive(framePool *pool, int wait);
+
+/**********************************************************************************
+ * @func    void framePoolRelease(framePool *pool, poolJob *job)
+ *
+ * @brief   give back a job got by framePoolReceive, its buffers are kept for reuse
+***********************************************************************************/
+void framePoolRelease(framePool *pool, poolJob *job);
+
+#endif /* FRAME_POOL_H */
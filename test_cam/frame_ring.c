@@ -0,0 +1,317 @@
+/*
+* @file     frame_ring.c
+* @author   Trong Phuoc
+* @brief    Frame ring in a memfd shared with local processes, see frame_ring.h
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "frame_ring.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define RING_ROUND(x) (((x) + RING_ALIGN - 1) & ~(uint64_t)(RING_ALIGN - 1))
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+struct frameRing
+{
+    int fd;
+    uint8_t *map;
+    ringHeader *header;
+    ringSlot *slots;
+    uint64_t head;              /**< only the publisher writes head, it keeps a copy */
+};
+
+struct frameRingReader
+{
+    const uint8_t *map;         /**< the whole ring, read-only */
+    size_t size;
+    ringHeader *header;         /**< the header page mapped again writable, for waiters */
+    const ringSlot *slots;
+    uint64_t next;              /**< ring sequence of the next frame to read */
+    uint64_t lost;
+};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+/* shared futex, the readers are other processes */
+static int ringFutex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+frameRing *frameRingCreate(const char *name, const struct v4l2_pix_format *pix, unsigned int slots)
+{
+    frameRing *ring;
+    ringHeader *header;
+    uint64_t slotSize = RING_ROUND(pix->sizeimage);
+    uint64_t dataOffset = RING_ROUND(sizeof(ringHeader) + (uint64_t)slots * sizeof(ringSlot));
+    uint64_t mapSize = dataOffset + slots * slotSize;
+    unsigned int i;
+
+    if (slots == 0 || pix->sizeimage == 0 || slotSize > UINT32_MAX)
+    {
+        return NULL;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+    // sealed, a reader can trust the size it maps
+    if (ftruncate(ring->fd, mapSize) < 0 ||
+        fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+    ring->map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+    header = (ringHeader *)ring->map;
+    ring->header = header;
+    ring->slots = (ringSlot *)(ring->map + sizeof(ringHeader));
+    for (i = 0; i < slots; i++)
+    {
+        ring->slots[i].sequence = RING_SEQ_BUSY;
+    }
+    header->version = RING_VERSION;
+    header->slots = slots;
+    header->slotSize = slotSize;
+    header->width = pix->width;
+    header->height = pix->height;
+    header->pixelformat = pix->pixelformat;
+    header->bytesperline = pix->bytesperline;
+    header->sizeimage = pix->sizeimage;
+    header->dataOffset = dataOffset;
+    header->mapSize = mapSize;
+    // the magic goes last, a reader never sees a half filled header
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+    return ring;
+}
+
+int frameRingFd(const frameRing *ring)
+{
+    return ring->fd;
+}
+
+int frameRingPublish(frameRing *ring, const void *data, uint32_t size, uint64_t timestampNs,
+                     uint32_t frameSequence)
+{
+    ringHeader *header = ring->header;
+    uint64_t n = ring->head;
+    ringSlot *slot = &ring->slots[n % header->slots];
+
+    if (size > header->slotSize)
+    {
+        return -1;
+    }
+    // a reader still on the previous frame of this slot sees it change
+    __atomic_store_n(&slot->sequence, RING_SEQ_BUSY, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(ring->map + header->dataOffset + (n % header->slots) * (uint64_t)header->slotSize, data, size);
+    slot->timestampNs = timestampNs;
+    slot->frameSequence = frameSequence;
+    slot->size = size;
+    __atomic_store_n(&slot->sequence, n, __ATOMIC_RELEASE);
+
+    ring->head = n + 1;
+    __atomic_store_n(&header->head, n + 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&header->notify, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        ringFutex(&header->notify, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    return 0;
+}
+
+void frameRingDestroy(frameRing *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->header->notify, 1, __ATOMIC_SEQ_CST);
+    ringFutex(&ring->header->notify, FUTEX_WAKE, INT_MAX, NULL);
+    munmap(ring->map, ring->header->mapSize);
+    close(ring->fd);
+    free(ring);
+}
+
+frameRingReader *frameRingAttach(int fd)
+{
+    frameRingReader *rd;
+    const ringHeader *header;
+    struct stat st;
+    void *map, *rw;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < RING_ALIGN)
+    {
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    header = map;
+    if (memcmp(header->magic, RING_MAGIC, sizeof(header->magic)) != 0 || header->version != RING_VERSION ||
+        header->slots == 0 || header->mapSize != (uint64_t)st.st_size ||
+        header->dataOffset < sizeof(ringHeader) + (uint64_t)header->slots * sizeof(ringSlot) ||
+        header->dataOffset + (uint64_t)header->slots * header->slotSize > header->mapSize)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // only the counters are written, the frames stay read-only
+    rw = mmap(NULL, RING_ALIGN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (rw == MAP_FAILED)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    rd = calloc(1, sizeof(*rd));
+    if (rd == NULL)
+    {
+        munmap(rw, RING_ALIGN);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    rd->map = map;
+    rd->size = st.st_size;
+    rd->header = rw;
+    rd->slots = (const ringSlot *)(rd->map + sizeof(ringHeader));
+    rd->next = __atomic_load_n(&rd->header->head, __ATOMIC_ACQUIRE);
+    return rd;
+}
+
+const ringHeader *frameRingHeader(const frameRingReader *rd)
+{
+    return rd->header;
+}
+
+int frameRingNext(frameRingReader *rd, ringFrame *frame, int timeoutMs)
+{
+    ringHeader *header = rd->header;
+    const ringSlot *slot;
+    struct timespec timeout;
+    uint64_t head, sequence;
+    uint32_t notify;
+    int ret;
+
+    for (;;)
+    {
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (head - rd->next > header->slots)
+        {
+            // lapped, the oldest frame still in the ring is the next one
+            rd->lost += head - header->slots - rd->next;
+            rd->next = head - header->slots;
+        }
+        if (rd->next < head)
+        {
+            slot = &rd->slots[rd->next % header->slots];
+            sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            if (sequence != rd->next)
+            {
+                // overwritten since head was read
+                rd->lost++;
+                rd->next++;
+                continue;
+            }
+            frame->data = rd->map + header->dataOffset + (rd->next % header->slots) * (uint64_t)header->slotSize;
+            frame->size = slot->size < header->slotSize ? slot->size : header->slotSize;
+            frame->timestampNs = slot->timestampNs;
+            frame->frameSequence = slot->frameSequence;
+            frame->sequence = sequence;
+            rd->next++;
+            return 1;
+        }
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+        {
+            return -1;
+        }
+        if (timeoutMs == 0)
+        {
+            return 0;
+        }
+
+        // caught up: announce the sleep, then check head again before sleeping
+        __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+        notify = __atomic_load_n(&header->notify, __ATOMIC_SEQ_CST);
+        ret = 0;
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == rd->next &&
+            !__atomic_load_n(&header->closed, __ATOMIC_SEQ_CST))
+        {
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            ret = ringFutex(&header->notify, FUTEX_WAIT, notify, timeoutMs > 0 ? &timeout : NULL);
+        }
+        __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+        if (ret < 0 && errno == ETIMEDOUT)
+        {
+            return 0;
+        }
+    }
+}
+
+int frameRingDone(frameRingReader *rd, const ringFrame *frame)
+{
+    const ringSlot *slot = &rd->slots[frame->sequence % rd->header->slots];
+
+    // the data reads happen before the slot is checked again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != frame->sequence)
+    {
+        rd->lost++;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t frameRingLost(const frameRingReader *rd)
+{
+    return rd->lost;
+}
+
+void frameRingDetach(frameRingReader *rd)
+{
+    if (rd == NULL)
+    {
+        return;
+    }
+    munmap(rd->header, RING_ALIGN);
+    munmap((void *)rd->map, rd->size);
+    free(rd);
+}
@@ -0,0 +1,186 @@
+/*
+* @file     frame_ring.h
+* @author   Trong Phuoc
+* @brief    Frame ring in a memfd shared with local processes: one publisher
+*           copies every frame into the next slot, readers map the ring and take
+*           the frames in place, woken with a futex only when they caught up
+*/
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
+
+/*
+ * Memory layout, all fields in host byte order:
+ *
+ *   ringHeader            format and counters, RING_ALIGN bytes
+ *   ringSlot[slots]       descriptor of every slot
+ *   data[slots]           slotSize bytes per slot, every one on RING_ALIGN
+ *
+ * The publisher never waits for a reader. Frame n goes into slot n % slots:
+ * the slot sequence is set to RING_SEQ_BUSY, the frame copied, then the slot
+ * sequence set to n and head to n + 1. A reader took frame n safely when the
+ * slot still holds sequence n after it is done with the data, otherwise the
+ * publisher overran it. A reader more than slots frames behind head lost the
+ * frames in between and restarts at the oldest one still in the ring.
+ *
+ * The fields shared with the readers are only accessed with __atomic builtins.
+ * A reader that caught up increments waiters, reads notify, checks head again
+ * and sleeps in FUTEX_WAIT on notify. The publisher increments notify after
+ * head and calls FUTEX_WAKE only when waiters is not 0, so neither side makes
+ * a system call while frames flow.
+ */
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define RING_MAGIC          "CAMRING1"
+#define RING_VERSION        1
+#define RING_ALIGN          4096
+#define RING_SEQ_BUSY       (~0ULL)       /**< the slot is being written */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct ringHeader
+{
+    char magic[8];              /**< RING_MAGIC */
+    uint32_t version;           /**< RING_VERSION */
+    uint32_t slots;             /**< number of slots */
+    uint32_t slotSize;          /**< bytes of data per slot */
+    uint32_t width;             /**< format of the frames */
+    uint32_t height;
+    uint32_t pixelformat;
+    uint32_t bytesperline;
+    uint32_t sizeimage;
+    uint64_t dataOffset;        /**< offset of the data of slot 0 */
+    uint64_t mapSize;           /**< bytes of the whole ring */
+    uint8_t pad0[64 - 56];
+    uint64_t head;              /**< sequence of the next frame to publish */
+    uint8_t pad1[56];           /**< head, notify and waiters on their own lines */
+    uint32_t notify;            /**< futex word, incremented on every frame */
+    uint32_t closed;            /**< the publisher stopped */
+    uint8_t pad2[56];
+    uint32_t waiters;           /**< readers sleeping or about to sleep on notify */
+} ringHeader;
+
+typedef struct ringSlot
+{
+    uint64_t sequence;          /**< ring sequence of the frame, RING_SEQ_BUSY while written */
+    uint64_t timestampNs;       /**< time stamp of the frame */
+    uint32_t frameSequence;     /**< sequence of the buffer the frame came from */
+    uint32_t size;              /**< bytes of the frame */
+} ringSlot;
+
+typedef struct frameRing frameRing;
+typedef struct frameRingReader frameRingReader;
+
+typedef struct ringFrame
+{
+    const void *data;           /**< points into the ring, valid until frameRingDone */
+    uint32_t size;
+    uint64_t timestampNs;
+    uint32_t frameSequence;
+    uint64_t sequence;          /**< ring sequence */
+} ringFrame;
+
+/*******************************************************************************
+ * FUNCTIONS - PUBLISHER
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    frameRing *frameRingCreate(const char *name, const struct v4l2_pix_format *pix,
+ *                                     unsigned int slots)
+ *
+ * @brief   create a ring of slots frames of pix->sizeimage bytes in a sealed memfd
+ * @return  the ring, NULL when the memfd can not be created or mapped
+***********************************************************************************/
+frameRing *frameRingCreate(const char *name, const struct v4l2_pix_format *pix, unsigned int slots);
+
+/**********************************************************************************
+ * @func    int frameRingFd(const frameRing *ring)
+ *
+ * @brief   get the memfd of the ring, readers open it through /proc/PID/fd/N or
+ *          get it over a socket
+***********************************************************************************/
+int frameRingFd(const frameRing *ring);
+
+/**********************************************************************************
+ * @func    int frameRingPublish(frameRing *ring, const void *data, uint32_t size,
+ *                               uint64_t timestampNs, uint32_t frameSequence)
+ *
+ * @brief   copy a frame into the next slot and wake the sleeping readers, never
+ *          waits for a reader
+ * @return  0 - Success, -1 - the frame is bigger than a slot
+***********************************************************************************/
+int frameRingPublish(frameRing *ring, const void *data, uint32_t size, uint64_t timestampNs,
+                     uint32_t frameSequence);
+
+/**********************************************************************************
+ * @func    void frameRingDestroy(frameRing *ring)
+ *
+ * @brief   mark the ring closed, wake the readers and unmap it. The readers keep
+ *          their mapping
+***********************************************************************************/
+void frameRingDestroy(frameRing *ring);
+
+/*******************************************************************************
+ * FUNCTIONS - READER
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    frameRingReader *frameRingAttach(int fd)
+ *
+ * @brief   map the ring of a memfd opened read-write, the frames are mapped
+ *          read-only and only the header page writable. The first frame read
+ *          is the next one published. The fd can be closed afterwards
+ * @return  the reader, NULL when fd is not a ring
+***********************************************************************************/
+frameRingReader *frameRingAttach(int fd);
+
+/**********************************************************************************
+ * @func    const ringHeader *frameRingHeader(const frameRingReader *rd)
+ *
+ * @brief   get the format of the frames
+***********************************************************************************/
+const ringHeader *frameRingHeader(const frameRingReader *rd);
+
+/**********************************************************************************
+ * @func    int frameRingNext(frameRingReader *rd, ringFrame *frame, int timeoutMs)
+ *
+ * @brief   get the next frame in place, sleeps only when no frame is waiting.
+ *          Frames overwritten before the reader came to them are skipped and
+ *          counted as lost
+ * @param   timeoutMs   - -1 waits forever, 0 never sleeps
+ * @return  1 - got a frame, 0 - timeout, -1 - the publisher closed the ring
+***********************************************************************************/
+int frameRingNext(frameRingReader *rd, ringFrame *frame, int timeoutMs);
+
+/**********************************************************************************
+ * @func    int frameRingDone(frameRingReader *rd, const ringFrame *frame)
+ *
+ * @brief   end the use of a frame got by frameRingNext and tell whether the data
+ *          stayed intact, an overwritten frame is counted as lost
+ * @return  0 - the data read was the frame, -1 - overrun while reading
+***********************************************************************************/
+int frameRingDone(frameRingReader *rd, const ringFrame *frame);
+
+/**********************************************************************************
+ * @func    uint64_t frameRingLost(const frameRingReader *rd)
+ *
+ * @brief   get the frames lost by this reader, skipped or overrun
+***********************************************************************************/
+uint64_t frameRingLost(const frameRingReader *rd);
+
+/**********************************************************************************
+ * @func    void frameRingDetach(frameRingReader *rd)
+ *
+ * @brief   unmap the ring
+***********************************************************************************/
+void frameRingDetach(frameRingReader *rd);
+
+#endif /* FRAME_RING_H */
@@ -0,0 +1,480 @@
+/*
+* @file     frame_server.c
+* @author   Trong Phuoc
+* @brief    Local frame server passing memfd buffers over a Unix socket, see
+*           frame_server.h
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#define _GNU_SOURCE /* memfd_create(), accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "frame_server.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define SERVER_PAGE 4096
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct serverBuffer
+{
+    int fd;                     /**< memfd passed to the clients */
+    uint8_t *map;
+    unsigned int refs;          /**< clients holding the buffer */
+} serverBuffer;
+
+typedef struct serverClient
+{
+    int fd;
+    uint32_t held;              /**< bit i set while the client holds buffer i */
+    unsigned int nheld;
+} serverClient;
+
+struct frameServer
+{
+    int listenFd;
+    struct sockaddr_un addr;
+    serverHello hello;
+    serverBuffer buffers[SERVER_MAX_BUFFERS];
+    unsigned int nbuffers;      /**< buffers created, all mapped */
+    size_t bufferSize;
+    unsigned int next;          /**< buffer tried first, the pool is used round robin */
+    serverClient clients[SERVER_MAX_CLIENTS];
+    unsigned int nclients;
+    unsigned long dropped;
+};
+
+struct frameClient
+{
+    int fd;
+    serverHello hello;
+    const uint8_t *maps[SERVER_MAX_BUFFERS]; /**< buffers mapped so far */
+};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static unsigned long long serverTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* drop a client, the buffers it held go back to the pool */
+static void serverDropClient(frameServer *srv, unsigned int i)
+{
+    serverClient *client = &srv->clients[i];
+    unsigned int b;
+
+    for (b = 0; b < srv->nbuffers; b++)
+    {
+        if (client->held & (1u << b))
+        {
+            srv->buffers[b].refs--;
+        }
+    }
+    close(client->fd);
+    srv->clients[i] = srv->clients[--srv->nclients];
+}
+
+static void serverAccept(frameServer *srv)
+{
+    serverClient *client;
+    int fd;
+
+    while ((fd = accept4(srv->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (srv->nclients == SERVER_MAX_CLIENTS ||
+            send(fd, &srv->hello, sizeof(srv->hello), MSG_NOSIGNAL) != sizeof(srv->hello))
+        {
+            close(fd);
+            continue;
+        }
+        client = &srv->clients[srv->nclients++];
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+    }
+}
+
+/* take the release messages of a client, -1 when it went away */
+static int serverReceive(frameServer *srv, serverClient *client)
+{
+    serverRelease msg;
+    ssize_t n;
+
+    for (;;)
+    {
+        n = recv(client->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        // a client can only give back what it holds
+        if (n == sizeof(msg) && msg.type == SERVER_MSG_RELEASE && msg.buffer < srv->nbuffers &&
+            (client->held & (1u << msg.buffer)))
+        {
+            client->held &= ~(1u << msg.buffer);
+            client->nheld--;
+            srv->buffers[msg.buffer].refs--;
+        }
+    }
+}
+
+/* send a frame and the fd of its buffer, -1 when the client went away */
+static int serverSend(serverClient *client, const serverFrame *msg, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {(void *)msg, sizeof(*msg)};
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(control, 0, sizeof(control));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(client->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*msg))
+    {
+        return 1;
+    }
+    // a full socket only skips this frame for the client
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+}
+
+frameServer *frameServerCreate(const char *path, const struct v4l2_pix_format *pix, unsigned int buffers,
+                               unsigned int depth)
+{
+    frameServer *srv;
+    serverBuffer *buf;
+    size_t size = ((size_t)pix->sizeimage + SERVER_PAGE - 1) & ~(size_t)(SERVER_PAGE - 1);
+    unsigned int i;
+
+    if (buffers == 0 || buffers > SERVER_MAX_BUFFERS || depth == 0 || size == 0 ||
+        strlen(path) >= sizeof(srv->addr.sun_path))
+    {
+        return NULL;
+    }
+    srv = calloc(1, sizeof(*srv));
+    if (srv == NULL)
+    {
+        return NULL;
+    }
+    srv->listenFd = -1;
+    srv->bufferSize = size;
+    for (i = 0; i < buffers; i++)
+    {
+        buf = &srv->buffers[i];
+        buf->map = MAP_FAILED;
+        buf->fd = memfd_create("cam_frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (buf->fd >= 0 && ftruncate(buf->fd, size) == 0 &&
+            fcntl(buf->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == 0)
+        {
+            buf->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd, 0);
+        }
+        if (buf->map == MAP_FAILED)
+        {
+            if (buf->fd >= 0)
+            {
+                close(buf->fd);
+            }
+            frameServerDestroy(srv);
+            return NULL;
+        }
+        srv->nbuffers++;
+#ifdef F_SEAL_FUTURE_WRITE
+        // only the mapping of the server writes, a client can not map it writable (Linux 5.1)
+        fcntl(buf->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+    }
+
+    srv->addr.sun_family = AF_UNIX;
+    strcpy(srv->addr.sun_path, path);
+    srv->listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (srv->listenFd < 0 || bind(srv->listenFd, (struct sockaddr *)&srv->addr, sizeof(srv->addr)) < 0 ||
+        listen(srv->listenFd, SERVER_MAX_CLIENTS) < 0)
+    {
+        frameServerDestroy(srv);
+        return NULL;
+    }
+
+    srv->hello.type = SERVER_MSG_HELLO;
+    srv->hello.magic = SERVER_MAGIC;
+    srv->hello.version = SERVER_VERSION;
+    srv->hello.buffers = buffers;
+    srv->hello.bufferSize = size;
+    srv->hello.depth = depth < buffers ? depth : buffers;
+    srv->hello.width = pix->width;
+    srv->hello.height = pix->height;
+    srv->hello.pixelformat = pix->pixelformat;
+    srv->hello.bytesperline = pix->bytesperline;
+    srv->hello.sizeimage = pix->sizeimage;
+    return srv;
+}
+
+void frameServerPoll(frameServer *srv)
+{
+    unsigned int i = 0;
+
+    serverAccept(srv);
+    while (i < srv->nclients)
+    {
+        if (serverReceive(srv, &srv->clients[i]) < 0)
+        {
+            // the last client moved into slot i
+            serverDropClient(srv, i);
+            continue;
+        }
+        i++;
+    }
+}
+
+int frameServerPublish(frameServer *srv, const void *data, uint32_t size, uint64_t timestampNs,
+                       uint32_t sequence)
+{
+    serverBuffer *buf = NULL;
+    serverClient *client;
+    serverFrame msg;
+    unsigned int b, i = 0;
+    int sent = 0, ret;
+
+    frameServerPoll(srv);
+    if (srv->nclients == 0)
+    {
+        return 0;
+    }
+    for (b = 0; b < srv->nbuffers && buf == NULL; b++)
+    {
+        if (srv->buffers[(srv->next + b) % srv->nbuffers].refs == 0)
+        {
+            buf = &srv->buffers[(srv->next + b) % srv->nbuffers];
+        }
+    }
+    if (buf == NULL || size > srv->hello.bufferSize)
+    {
+        srv->dropped++;
+        return -1;
+    }
+    b = buf - srv->buffers;
+    srv->next = (b + 1) % srv->nbuffers;
+    memcpy(buf->map, data, size);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = SERVER_MSG_FRAME;
+    msg.buffer = b;
+    msg.size = size;
+    msg.sequence = sequence;
+    msg.timestampNs = timestampNs;
+    while (i < srv->nclients)
+    {
+        client = &srv->clients[i];
+        if (client->nheld >= srv->hello.depth)
+        {
+            i++;
+            continue;
+        }
+        msg.sentNs = serverTimeNs();
+        ret = serverSend(client, &msg, buf->fd);
+        if (ret < 0)
+        {
+            serverDropClient(srv, i);
+            continue;
+        }
+        if (ret > 0)
+        {
+            client->held |= 1u << b;
+            client->nheld++;
+            buf->refs++;
+            sent++;
+        }
+        i++;
+    }
+    return sent;
+}
+
+unsigned long frameServerDropped(const frameServer *srv)
+{
+    return srv->dropped;
+}
+
+void frameServerDestroy(frameServer *srv)
+{
+    unsigned int i;
+
+    if (srv == NULL)
+    {
+        return;
+    }
+    while (srv->nclients > 0)
+    {
+        serverDropClient(srv, 0);
+    }
+    if (srv->listenFd >= 0)
+    {
+        close(srv->listenFd);
+        unlink(srv->addr.sun_path);
+    }
+    for (i = 0; i < srv->nbuffers; i++)
+    {
+        munmap(srv->buffers[i].map, srv->bufferSize);
+        close(srv->buffers[i].fd);
+    }
+    free(srv);
+}
+
+frameClient *frameClientConnect(const char *path)
+{
+    struct sockaddr_un addr;
+    frameClient *cl;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return NULL;
+    }
+    cl = calloc(1, sizeof(*cl));
+    if (cl == NULL)
+    {
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    cl->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (cl->fd < 0 || connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        recv(cl->fd, &cl->hello, sizeof(cl->hello), 0) != sizeof(cl->hello) ||
+        cl->hello.type != SERVER_MSG_HELLO || cl->hello.magic != SERVER_MAGIC ||
+        cl->hello.version != SERVER_VERSION || cl->hello.buffers > SERVER_MAX_BUFFERS)
+    {
+        if (cl->fd >= 0)
+        {
+            close(cl->fd);
+        }
+        free(cl);
+        return NULL;
+    }
+    return cl;
+}
+
+const serverHello *frameClientFormat(const frameClient *cl)
+{
+    return &cl->hello;
+}
+
+int frameClientNext(frameClient *cl, clientFrame *frame, int timeoutMs)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct pollfd pfd = {cl->fd, POLLIN, 0};
+    struct iovec iov = {&frame->info, sizeof(frame->info)};
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    void *map;
+    ssize_t n;
+    int fd = -1;
+    int ret;
+
+    do
+    {
+        ret = poll(&pfd, 1, timeoutMs);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0)
+    {
+        return 0;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    n = recvmsg(cl->fd, &hdr, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (n != sizeof(frame->info) || frame->info.type != SERVER_MSG_FRAME ||
+        frame->info.buffer >= cl->hello.buffers || frame->info.size > cl->hello.bufferSize)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    // the fd of a buffer never changes, it is mapped once
+    if (cl->maps[frame->info.buffer] == NULL)
+    {
+        map = fd >= 0 ? mmap(NULL, cl->hello.bufferSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return -1;
+        }
+        cl->maps[frame->info.buffer] = map;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    frame->data = cl->maps[frame->info.buffer];
+    return 1;
+}
+
+int frameClientRelease(frameClient *cl, const clientFrame *frame)
+{
+    serverRelease msg = {SERVER_MSG_RELEASE, frame->info.buffer};
+
+    return send(cl->fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+}
+
+void frameClientDisconnect(frameClient *cl)
+{
+    unsigned int i;
+
+    if (cl == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < SERVER_MAX_BUFFERS; i++)
+    {
+        if (cl->maps[i] != NULL)
+        {
+            munmap((void *)cl->maps[i], cl->hello.bufferSize);
+        }
+    }
+    close(cl->fd);
+    free(cl);
+}
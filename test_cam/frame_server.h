@@ -0,0 +1,180 @@
+/*
+* @file     frame_server.h
+* @author   Trong Phuoc
+* @brief    Local frame server: every frame is copied into a memfd buffer whose
+*           file descriptor is passed with SCM_RIGHTS over a Unix socket, with
+*           the metadata inline. Clients give the buffers back by message, so a
+*           sandboxed consumer needs neither the device nor the file system
+*/
+#ifndef FRAME_SERVER_H
+#define FRAME_SERVER_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+/*
+ * Protocol on a SOCK_SEQPACKET socket, one message per packet, host byte order:
+ *
+ *   server -> client   serverHello     once, after accept
+ *   server -> client   serverFrame     per frame, with the fd of its buffer
+ *   client -> server   serverRelease   when the client is done with a buffer
+ *
+ * A buffer goes back to the pool once every client it was sent to released it
+ * or disconnected. The server never waits for a client: a frame is not sent to
+ * a client which holds depth buffers or whose socket is full, and is dropped
+ * when no buffer is free. The fd of a buffer is the same for the whole session,
+ * a client maps it once and closes the copies it gets afterwards.
+ */
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define SERVER_MAGIC        0x56524653u   /* "SFRV" */
+#define SERVER_VERSION      1
+#define SERVER_MAX_BUFFERS  32
+#define SERVER_MAX_CLIENTS  16
+
+#define SERVER_MSG_HELLO    1
+#define SERVER_MSG_FRAME    2
+#define SERVER_MSG_RELEASE  3
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct serverHello
+{
+    uint32_t type;              /**< SERVER_MSG_HELLO */
+    uint32_t magic;             /**< SERVER_MAGIC */
+    uint32_t version;           /**< SERVER_VERSION */
+    uint32_t buffers;           /**< buffers of the pool, indexes go up to buffers - 1 */
+    uint32_t bufferSize;        /**< bytes of every buffer */
+    uint32_t depth;             /**< buffers a client may hold at once */
+    uint32_t width;             /**< format of the frames */
+    uint32_t height;
+    uint32_t pixelformat;
+    uint32_t bytesperline;
+    uint32_t sizeimage;
+    uint32_t reserved;
+} serverHello;
+
+typedef struct serverFrame
+{
+    uint32_t type;              /**< SERVER_MSG_FRAME */
+    uint32_t buffer;            /**< index of the buffer, its fd comes with the message */
+    uint32_t size;              /**< bytes of the frame */
+    uint32_t sequence;          /**< sequence of the frame, gaps are frames the client missed */
+    uint64_t timestampNs;       /**< CLOCK_MONOTONIC time stamp of the frame */
+    uint64_t sentNs;            /**< CLOCK_MONOTONIC time the server sent the frame */
+} serverFrame;
+
+typedef struct serverRelease
+{
+    uint32_t type;              /**< SERVER_MSG_RELEASE */
+    uint32_t buffer;
+} serverRelease;
+
+typedef struct frameServer frameServer;
+typedef struct frameClient frameClient;
+
+typedef struct clientFrame
+{
+    const void *data;           /**< mapping of the buffer, valid until frameClientRelease */
+    serverFrame info;
+} clientFrame;
+
+/*******************************************************************************
+ * FUNCTIONS - SERVER
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    frameServer *frameServerCreate(const char *path, const struct v4l2_pix_format *pix,
+ *                                         unsigned int buffers, unsigned int depth)
+ *
+ * @brief   listen on a Unix socket at path and allocate buffers memfd buffers of
+ *          pix->sizeimage bytes. A client holds at most depth of them
+ * @return  the server, NULL when the socket or the buffers can not be created
+***********************************************************************************/
+frameServer *frameServerCreate(const char *path, const struct v4l2_pix_format *pix, unsigned int buffers,
+                               unsigned int depth);
+
+/**********************************************************************************
+ * @func    void frameServerPoll(frameServer *srv)
+ *
+ * @brief   accept the waiting clients and take their release messages, never
+ *          blocks. frameServerPublish calls it first
+***********************************************************************************/
+void frameServerPoll(frameServer *srv);
+
+/**********************************************************************************
+ * @func    int frameServerPublish(frameServer *srv, const void *data, uint32_t size,
+ *                                 uint64_t timestampNs, uint32_t sequence)
+ *
+ * @brief   copy a frame into a free buffer and send it to every client that can
+ *          take it
+ * @return  the number of clients it was sent to, -1 when no buffer was free
+***********************************************************************************/
+int frameServerPublish(frameServer *srv, const void *data, uint32_t size, uint64_t timestampNs,
+                       uint32_t sequence);
+
+/**********************************************************************************
+ * @func    unsigned long frameServerDropped(const frameServer *srv)
+ *
+ * @brief   get the frames dropped because no buffer was free
+***********************************************************************************/
+unsigned long frameServerDropped(const frameServer *srv);
+
+/**********************************************************************************
+ * @func    void frameServerDestroy(frameServer *srv)
+ *
+ * @brief   close the clients, the buffers and the socket and remove its path.
+ *          The clients keep the buffers they mapped
+***********************************************************************************/
+void frameServerDestroy(frameServer *srv);
+
+/*******************************************************************************
+ * FUNCTIONS - CLIENT
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    frameClient *frameClientConnect(const char *path)
+ *
+ * @brief   connect to a frame server and read its hello
+ * @return  the client, NULL when nothing serves frames at path
+***********************************************************************************/
+frameClient *frameClientConnect(const char *path);
+
+/**********************************************************************************
+ * @func    const serverHello *frameClientFormat(const frameClient *cl)
+ *
+ * @brief   get the format and the pool geometry the server announced
+***********************************************************************************/
+const serverHello *frameClientFormat(const frameClient *cl);
+
+/**********************************************************************************
+ * @func    int frameClientNext(frameClient *cl, clientFrame *frame, int timeoutMs)
+ *
+ * @brief   wait for the next frame, its buffer is mapped on first use
+ * @param   timeoutMs   - -1 waits forever
+ * @return  1 - got a frame, 0 - timeout, -1 - the server went away
+***********************************************************************************/
+int frameClientNext(frameClient *cl, clientFrame *frame, int timeoutMs);
+
+/**********************************************************************************
+ * @func    int frameClientRelease(frameClient *cl, const clientFrame *frame)
+ *
+ * @brief   give the buffer of a frame back to the server
+ * @return  0 - Success, -1 - the server went away
+***********************************************************************************/
+int frameClientRelease(frameClient *cl, const clientFrame *frame);
+
+/**********************************************************************************
+ * @func    void frameClientDisconnect(frameClient *cl)
+ *
+ * @brief   unmap the buffers and close the connection, the server takes back the
+ *          buffers still held
+***********************************************************************************/
+void frameClientDisconnect(frameClient *cl);
+
+#endif /* FRAME_SERVER_H */
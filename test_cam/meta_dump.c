@@ -0,0 +1,325 @@
+/*
+* @file     meta_dump.c
+* @author   Trong Phuoc
+* @brief    Stream a camera with its metadata queue and print the payload header
+*           record of every frame, matched to the video frames by sequence, with
+*           the interval statistics of the host and camera time stamps
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include "../KernelModule/cam_ioctl.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define DUMP_VIDEO_BUFFERS  4
+#define DUMP_META_BUFFERS   8
+#define DUMP_SEQ_HISTORY    32      /* video sequences a record can be matched against */
+#define DUMP_TIMEOUT_MS     5000
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static void *video_mem[DUMP_VIDEO_BUFFERS];
+static size_t video_len[DUMP_VIDEO_BUFFERS];
+static unsigned int n_video;
+static const struct cam_meta *meta_mem[DUMP_META_BUFFERS];
+static unsigned int n_meta;
+static unsigned int video_seq[DUMP_SEQ_HISTORY];
+static unsigned int n_video_seq;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-d | --device NODE   Video node to open (default /dev/video2) \n"
+           "-c | --count N       Number of frames to capture (default 100) \n"
+           "-q | --quiet         Only print the summary \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static int requestBuffers(int fd, enum v4l2_buf_type type, unsigned int count)
+{
+    struct v4l2_requestbuffers req;
+
+    memset(&req, 0, sizeof(req));
+    req.count = count;
+    req.type = type;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0)
+    {
+        return -1;
+    }
+    return req.count < count ? req.count : count;
+}
+
+static void *mapBuffer(int fd, enum v4l2_buf_type type, unsigned int index, size_t *length)
+{
+    struct v4l2_buffer buf;
+    void *mem;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+    {
+        return NULL;
+    }
+    mem = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+    if (mem == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *length = buf.length;
+    return mem;
+}
+
+static int queueBuffer(int fd, enum v4l2_buf_type type, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    return ioctl(fd, VIDIOC_QBUF, &buf);
+}
+
+static int initBuffers(int fd)
+{
+    size_t length;
+    int count;
+
+    count = requestBuffers(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, DUMP_VIDEO_BUFFERS);
+    if (count <= 0)
+    {
+        printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+        return -1;
+    }
+    for (n_video = 0; n_video < (unsigned int)count; n_video++)
+    {
+        video_mem[n_video] = mapBuffer(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, n_video, &video_len[n_video]);
+        if (video_mem[n_video] == NULL)
+        {
+            printf("Can not map video buffer %u \n", n_video);
+            return -1;
+        }
+    }
+
+    count = requestBuffers(fd, V4L2_BUF_TYPE_META_CAPTURE, DUMP_META_BUFFERS);
+    if (count <= 0)
+    {
+        printf("No metadata queue: %s \n", strerror(errno));
+        return -1;
+    }
+    for (n_meta = 0; n_meta < (unsigned int)count; n_meta++)
+    {
+        meta_mem[n_meta] = mapBuffer(fd, V4L2_BUF_TYPE_META_CAPTURE, n_meta, &length);
+        if (meta_mem[n_meta] == NULL || length < sizeof(struct cam_meta))
+        {
+            printf("Can not map metadata buffer %u \n", n_meta);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void uninitBuffers(int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_video; i++)
+    {
+        munmap(video_mem[i], video_len[i]);
+    }
+    for (i = 0; i < n_meta; i++)
+    {
+        munmap((void *)meta_mem[i], sizeof(struct cam_meta));
+    }
+    requestBuffers(fd, V4L2_BUF_TYPE_META_CAPTURE, 0);
+    requestBuffers(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, 0);
+}
+
+static int seenVideo(unsigned int sequence)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_video_seq && i < DUMP_SEQ_HISTORY; i++)
+    {
+        if (video_seq[i] == sequence)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"count", required_argument, NULL, 'c'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *device = "/dev/video2";
+    enum v4l2_buf_type vtype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    enum v4l2_buf_type mtype = V4L2_BUF_TYPE_META_CAPTURE;
+    struct pollfd pfd;
+    struct v4l2_buffer buf;
+    struct cam_meta rec, last;
+    unsigned long count = 100, frames = 0, records = 0, matched = 0, gaps = 0, errors = 0;
+    unsigned long long hostSum = 0, hostMin = ~0ULL, hostMax = 0, interval;
+    unsigned long long ptsSum = 0, ptsCount = 0;
+    unsigned int i;
+    int quiet = 0;
+    int status = 0;
+    int fd, c, ret;
+
+    while ((c = getopt_long(argc, argv, "d:c:qh", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", device);
+        return 1;
+    }
+    if (initBuffers(fd) < 0)
+    {
+        uninitBuffers(fd);
+        close(fd);
+        return 1;
+    }
+    for (i = 0; i < n_video; i++)
+    {
+        queueBuffer(fd, vtype, i);
+    }
+    for (i = 0; i < n_meta; i++)
+    {
+        queueBuffer(fd, mtype, i);
+    }
+    // the records follow the video stream, start them first to get the first frame
+    if (ioctl(fd, VIDIOC_STREAMON, &mtype) < 0 || ioctl(fd, VIDIOC_STREAMON, &vtype) < 0)
+    {
+        printf("VIDIOC_STREAMON failed: %s \n", strerror(errno));
+        uninitBuffers(fd);
+        close(fd);
+        return 1;
+    }
+
+    memset(&last, 0, sizeof(last));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (frames < count)
+    {
+        ret = poll(&pfd, 1, DUMP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            printf("No frame within %d ms \n", DUMP_TIMEOUT_MS);
+            status = 1;
+            break;
+        }
+        // the video frame of a record is completed before the record
+        memset(&buf, 0, sizeof(buf));
+        buf.type = vtype;
+        buf.memory = V4L2_MEMORY_MMAP;
+        while (ioctl(fd, VIDIOC_DQBUF, &buf) == 0)
+        {
+            video_seq[n_video_seq++ % DUMP_SEQ_HISTORY] = buf.sequence;
+            frames++;
+            queueBuffer(fd, vtype, buf.index);
+        }
+        memset(&buf, 0, sizeof(buf));
+        buf.type = mtype;
+        buf.memory = V4L2_MEMORY_MMAP;
+        while (ioctl(fd, VIDIOC_DQBUF, &buf) == 0)
+        {
+            // copy the record out before the buffer goes back to the driver
+            rec = *meta_mem[buf.index];
+            queueBuffer(fd, mtype, buf.index);
+            matched += seenVideo(rec.sequence);
+            errors += (rec.flags & CAM_META_ERROR) != 0;
+            if (records > 0)
+            {
+                gaps += rec.sequence - last.sequence - 1;
+                interval = rec.timestamp - last.timestamp;
+                hostSum += interval;
+                hostMin = interval < hostMin ? interval : hostMin;
+                hostMax = interval > hostMax ? interval : hostMax;
+                if (rec.flags & last.flags & CAM_META_PTS)
+                {
+                    ptsSum += rec.pts - last.pts;
+                    ptsCount++;
+                }
+            }
+            if (!quiet)
+            {
+                printf("seq %6u  ts %llu.%09llu  pts %10u  scr %10u/%4u  usb %4u  %3u payloads %8u bytes%s%s \n",
+                       rec.sequence, (unsigned long long)rec.timestamp / 1000000000ULL,
+                       (unsigned long long)rec.timestamp % 1000000000ULL,
+                       rec.pts, rec.scr_stc, rec.scr_sof, rec.usb_frame, rec.payloads, rec.bytes,
+                       rec.ext_length ? "  ext" : "", (rec.flags & CAM_META_ERROR) ? "  error" : "");
+            }
+            last = rec;
+            records++;
+        }
+    }
+
+    ioctl(fd, VIDIOC_STREAMOFF, &vtype);
+    ioctl(fd, VIDIOC_STREAMOFF, &mtype);
+    uninitBuffers(fd);
+    close(fd);
+
+    printf("Frames: %lu, records: %lu, matched by sequence: %lu, records skipped: %lu, with error: %lu \n",
+           frames, records, matched, gaps, errors);
+    if (records > 1)
+    {
+        printf("Host interval: min %.3f ms, avg %.3f ms, max %.3f ms \n", hostMin / 1e6,
+               hostSum / 1e6 / (records - 1), hostMax / 1e6);
+    }
+    if (ptsCount > 0)
+    {
+        printf("PTS interval: avg %.1f camera clock ticks \n", (double)ptsSum / ptsCount);
+    }
+    return status;
+}
@@ -0,0 +1,170 @@
+/*
+* @file     mjpeg_bench.c
+* @author   Trong Phuoc
+* @brief    Scaling of the MJPEG decode stage with 1 to N worker threads on
+*           1920x1080 frames
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include "mjpeg_decode.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_WIDTH  1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 240
+#define BENCH_DEPTH_PER_THREAD 2
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* encode a test picture as a camera would: 4:2:2, no Huffman tables in the frame */
+static unsigned char *makeFrame(unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *image, *jpeg = NULL, *p;
+    JSAMPROW row;
+    unsigned int x, y;
+
+    image = malloc(BENCH_WIDTH * BENCH_HEIGHT * 3);
+    if (image == NULL)
+    {
+        return NULL;
+    }
+    for (y = 0; y < BENCH_HEIGHT; y++)
+    {
+        for (x = 0; x < BENCH_WIDTH; x++)
+        {
+            p = image + (y * BENCH_WIDTH + x) * 3;
+            p[0] = x * 255 / BENCH_WIDTH;
+            p[1] = y * 255 / BENCH_HEIGHT;
+            p[2] = ((x / 16 + y / 16) & 1) ? 200 : 40;
+            p[0] ^= rand() & 0x0f;  // some texture for the entropy coder
+        }
+    }
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg, size);
+    cinfo.image_width = BENCH_WIDTH;
+    cinfo.image_height = BENCH_HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    jpeg_suppress_tables(&cinfo, TRUE);
+    cinfo.quant_tbl_ptrs[0]->sent_table = FALSE;
+    cinfo.quant_tbl_ptrs[1]->sent_table = FALSE;
+    jpeg_start_compress(&cinfo, FALSE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        row = image + cinfo.next_scanline * BENCH_WIDTH * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(image);
+    return jpeg;
+}
+
+/*
+ * decode BENCH_FRAMES frames, the main thread plays the capture loop: copy the
+ * frame into a job, submit it and write the results in order
+ */
+static int runPool(unsigned int threads, const unsigned char *frame, unsigned long size, double *fps)
+{
+    framePool *pool = framePoolCreate(threads, threads * BENCH_DEPTH_PER_THREAD, &mjpegDecodeOps, NULL);
+    unsigned long submitted = 0, received = 0;
+    unsigned long long start;
+    poolJob *job;
+    int status = 0;
+
+    if (pool == NULL)
+    {
+        return -1;
+    }
+    start = getTimeNs();
+    while (received < BENCH_FRAMES)
+    {
+        job = submitted < BENCH_FRAMES ? framePoolGetJob(pool, 0) : NULL;
+        if (job != NULL)
+        {
+            framePoolSetInput(job, frame, size);
+            framePoolSubmit(pool, job);
+            submitted++;
+            continue;
+        }
+        job = framePoolReceive(pool, 1);
+        if (job->sequence != received || job->status != 0 ||
+            job->width != BENCH_WIDTH || job->height != BENCH_HEIGHT)
+        {
+            printf("frame %lu: sequence %lu status %d \n", received, job->sequence, job->status);
+            status = -1;
+        }
+        received++;
+        framePoolRelease(pool, job);
+    }
+    *fps = BENCH_FRAMES * 1e9 / (getTimeNs() - start);
+    framePoolDestroy(pool);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int maxThreads = argc > 1 ? strtoul(argv[1], NULL, 0) : (cpus > 0 ? cpus : 1);
+    unsigned long size;
+    unsigned char *frame;
+    unsigned int threads;
+    double fps, base = 0;
+
+    if (maxThreads == 0 || maxThreads > POOL_MAX_THREADS)
+    {
+        printf("Usage: %s [max threads, 1..%d] \n", argv[0], POOL_MAX_THREADS);
+        return 1;
+    }
+    frame = makeFrame(&size);
+    if (frame == NULL)
+    {
+        printf("Can not encode the test frame \n");
+        return 1;
+    }
+    printf("%dx%d MJPEG, %lu bytes per frame, %d frames, %ld CPUs \n",
+           BENCH_WIDTH, BENCH_HEIGHT, size, BENCH_FRAMES, cpus);
+    printf("threads       fps   speedup \n");
+    for (threads = 1; threads <= maxThreads; threads++)
+    {
+        if (runPool(threads, frame, size, &fps) != 0)
+        {
+            printf("Decode failed with %u threads \n", threads);
+            free(frame);
+            return 1;
+        }
+        if (threads == 1)
+        {
+            base = fps;
+        }
+        printf("%7u %9.1f %8.2fx \n", threads, fps, fps / base);
+    }
+    free(frame);
+    return 0;
+}
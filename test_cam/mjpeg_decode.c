@@ -0,0 +1,117 @@
+/*
+* @file     mjpeg_decode.c
+* @author   Trong Phuoc
+* @brief    MJPEG decode stage running on a frame pool
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "mjpeg_decode.h"
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct mjpegDecoder
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf escape;                  /**< left by longjmp on a corrupted frame */
+} mjpegDecoder;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void mjpegErrorExit(j_common_ptr cinfo)
+{
+    mjpegDecoder *dec = (mjpegDecoder *)cinfo;
+
+    longjmp(dec->escape, 1);
+}
+
+/* corrupted frames are common on a lossy USB link, do not print every warning */
+static void mjpegOutputMessage(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+static void *mjpegCreate(void *arg)
+{
+    mjpegDecoder *dec = calloc(1, sizeof(*dec));
+
+    (void)arg;
+    if (dec == NULL)
+    {
+        return NULL;
+    }
+    dec->cinfo.err = jpeg_std_error(&dec->jerr);
+    dec->jerr.error_exit = mjpegErrorExit;
+    dec->jerr.output_message = mjpegOutputMessage;
+    jpeg_create_decompress(&dec->cinfo);
+    return dec;
+}
+
+static void mjpegDestroy(void *ctx)
+{
+    mjpegDecoder *dec = ctx;
+
+    jpeg_destroy_decompress(&dec->cinfo);
+    free(dec);
+}
+
+static int mjpegDecode(void *ctx, poolJob *job)
+{
+    mjpegDecoder *dec = ctx;
+    struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+    JSAMPROW row;
+    size_t size;
+
+    job->outSize = 0;
+    if (setjmp(dec->escape))
+    {
+        // the decoder is reused for the next frame
+        jpeg_abort_decompress(cinfo);
+        return -1;
+    }
+    jpeg_mem_src(cinfo, job->in, job->inSize);
+    if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK)
+    {
+        jpeg_abort_decompress(cinfo);
+        return -1;
+    }
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_start_decompress(cinfo);
+
+    size = (size_t)cinfo->output_width * cinfo->output_height * 3;
+    if (size > job->outCap)
+    {
+        void *out = realloc(job->out, size);
+        if (out == NULL)
+        {
+            jpeg_abort_decompress(cinfo);
+            return -1;
+        }
+        job->out = out;
+        job->outCap = size;
+    }
+    while (cinfo->output_scanline < cinfo->output_height)
+    {
+        row = (JSAMPROW)job->out + (size_t)cinfo->output_scanline * cinfo->output_width * 3;
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(cinfo);
+    job->width = cinfo->output_width;
+    job->height = cinfo->output_height;
+    job->outSize = size;
+    return 0;
+}
+
+const framePoolOps mjpegDecodeOps = {
+    .ctxCreate = mjpegCreate,
+    .ctxDestroy = mjpegDestroy,
+    .work = mjpegDecode,
+};
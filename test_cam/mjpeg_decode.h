@@ -0,0 +1,25 @@
+/*
+* @file     mjpeg_decode.h
+* @author   Trong Phuoc
+* @brief    MJPEG decode stage running on a frame pool, one libjpeg decoder per
+*           worker thread
+*/
+#ifndef MJPEG_DECODE_H
+#define MJPEG_DECODE_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include "frame_pool.h"
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+/*
+ * Work functions of the decode stage. job->in holds one MJPEG frame, job->out
+ * gets the RGB24 image of job->width x job->height pixels. job->status is 0 on
+ * success and -1 when the frame is corrupted (job->outSize is 0 then).
+ * UVC cameras leave out the default Huffman tables, libjpeg-turbo fills them in.
+ */
+extern const framePoolOps mjpegDecodeOps;
+
+#endif /* MJPEG_DECODE_H */
@@ -0,0 +1,159 @@
+/*
+* @file     motion_bench.c
+* @author   Trong Phuoc
+* @brief    Microbenchmark of the motion gate: checks every SIMD SAD kernel against
+*           the scalar one and prints the cost of the gate per frame for a few
+*           line steps
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "motion_gate.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_MIN_NS    200000000ULL    /* run every case for at least 0.2 s */
+#define BENCH_BLOCK     64              /* side of the block moved between the frames */
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const char *isaNames[CONVERT_ISA_COUNT] = {
+    [CONVERT_ISA_SCALAR] = "scalar",
+    [CONVERT_ISA_SSE2] = "sse2",
+    [CONVERT_ISA_AVX2] = "avx2",
+    [CONVERT_ISA_NEON] = "neon",
+};
+
+static const unsigned int sizes[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+static const unsigned int steps[] = {1, 2, 4};
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a bright block at x on a flat noisy background */
+static void drawFrame(unsigned char *frame, unsigned int width, unsigned int height, unsigned int x)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < width * height * 2; i++)
+    {
+        frame[i] = 96 + (rand() & 3);
+    }
+    for (j = height / 2; j < height / 2 + BENCH_BLOCK && j < height; j++)
+    {
+        for (i = x; i < x + BENCH_BLOCK && i < width; i++)
+        {
+            frame[(j * width + i) * 2] = 224;
+        }
+    }
+}
+
+int main(void)
+{
+    sadFunc scalar = motionGetSad(CONVERT_ISA_SCALAR);
+    sadFunc sad;
+    motionGate *gate;
+    unsigned char *frames[2];
+    unsigned long long start, ns;
+    unsigned int s, t, isa, i, runs, kept;
+    uint64_t ref, got;
+    double score;
+    int status = 0;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        unsigned int width = sizes[s][0], height = sizes[s][1];
+
+        frames[0] = malloc((size_t)width * height * 2);
+        frames[1] = malloc((size_t)width * height * 2);
+        if (frames[0] == NULL || frames[1] == NULL)
+        {
+            printf("Out of memory \n");
+            return 1;
+        }
+        srand(s + 1);
+        drawFrame(frames[0], width, height, width / 4);
+        drawFrame(frames[1], width, height, width / 4 + BENCH_BLOCK / 2);
+
+        printf("\n%ux%u \n", width, height);
+        for (isa = 0; isa < CONVERT_ISA_COUNT; isa++)
+        {
+            sad = motionGetSad(isa);
+            if (sad == NULL)
+            {
+                continue;
+            }
+            // every line, the odd widths of the tails included
+            for (i = 0; i < height; i++)
+            {
+                ref = scalar(frames[0] + i * width * 2, frames[1] + i * width * 2, width - (i & 7) * 2);
+                got = sad(frames[0] + i * width * 2, frames[1] + i * width * 2, width - (i & 7) * 2);
+                if (got != ref)
+                {
+                    printf("  %-7s MISMATCH with scalar on line %u \n", isaNames[isa], i);
+                    status = 1;
+                    break;
+                }
+            }
+            if (i < height)
+            {
+                continue;
+            }
+
+            runs = 0;
+            start = getTimeNs();
+            do
+            {
+                for (i = 0; i < height; i++)
+                {
+                    got += sad(frames[0] + i * width * 2, frames[1] + i * width * 2, width);
+                }
+                runs++;
+                ns = getTimeNs() - start;
+            } while (ns < BENCH_MIN_NS);
+            printf("  sad    %-7s %8.2f GB/s %9.1f us/frame (all lines) \n", isaNames[isa],
+                   (double)width * height * 2 * runs / ns, ns / 1000.0 / runs);
+        }
+
+        // the whole gate with the best kernel, threshold 0 keeps every frame so each
+        // check also copies its lines into the reference, the worst case
+        for (t = 0; t < sizeof(steps) / sizeof(steps[0]); t++)
+        {
+            gate = motionGateCreate(width, height, steps[t], 0.0, 0);
+            if (gate == NULL)
+            {
+                printf("Out of memory \n");
+                return 1;
+            }
+            runs = 0;
+            kept = 0;
+            start = getTimeNs();
+            do
+            {
+                kept += motionGateCheck(gate, frames[runs & 1], &score);
+                runs++;
+                ns = getTimeNs() - start;
+            } while (ns < BENCH_MIN_NS);
+            printf("  gate   step %u  %9.1f us/frame, score %.2f, kept %u of %u \n", steps[t],
+                   ns / 1000.0 / runs, score, kept, runs);
+            motionGateDestroy(gate);
+        }
+        free(frames[0]);
+        free(frames[1]);
+    }
+    return status;
+}
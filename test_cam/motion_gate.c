@@ -0,0 +1,228 @@
+/*
+* @file     motion_gate.c
+* @author   Trong Phuoc
+* @brief    Scalar, SSE2, AVX2 and NEON luma SAD kernels and the motion gate
+*           built on them
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "motion_gate.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MOTION_X86 1
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MOTION_NEON 1
+#endif
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+struct motionGate
+{
+    sadFunc sad;
+    unsigned int width;
+    unsigned int height;
+    unsigned int rowStep;
+    unsigned int lines;         /**< lines compared per frame */
+    double threshold;
+    unsigned int maxSkip;
+    unsigned int skipped;       /**< frames skipped since the last kept one */
+    int haveReference;
+    uint8_t *reference;         /**< compared lines of the last kept frame */
+};
+
+/*******************************************************************************
+ *  SAD KERNELS
+ ******************************************************************************/
+static uint64_t rowSadScalar(const uint8_t *a, const uint8_t *b, unsigned int x, unsigned int width)
+{
+    uint64_t sum = 0;
+
+    for (; x < width; x++)
+    {
+        sum += abs((int)a[x * 2] - (int)b[x * 2]);
+    }
+    return sum;
+}
+
+static uint64_t sadScalar(const uint8_t *a, const uint8_t *b, unsigned int width)
+{
+    return rowSadScalar(a, b, 0, width);
+}
+
+#ifdef MOTION_X86
+/* psadbw sums 8 byte differences, the chroma bytes are zeroed on both sides */
+static SSE2_TARGET uint64_t sadSse2(const uint8_t *a, const uint8_t *b, unsigned int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i acc = _mm_setzero_si128();
+    __m128i a0, b0, a1, b1;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        a0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + x * 2)), mask);
+        b0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + x * 2)), mask);
+        a1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + x * 2 + 16)), mask);
+        b1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + x * 2 + 16)), mask);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(a0, b0));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(a1, b1));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    return (uint64_t)_mm_cvtsi128_si64(acc) + rowSadScalar(a, b, x, width);
+}
+
+static AVX2_TARGET uint64_t sadAvx2(const uint8_t *a, const uint8_t *b, unsigned int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    __m256i acc = _mm256_setzero_si256();
+    __m256i a0, b0, a1, b1;
+    __m128i sum;
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        a0 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + x * 2)), mask);
+        b0 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(b + x * 2)), mask);
+        a1 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + x * 2 + 32)), mask);
+        b1 = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(b + x * 2 + 32)), mask);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a0, b0));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a1, b1));
+    }
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return (uint64_t)_mm_cvtsi128_si64(sum) + rowSadScalar(a, b, x, width);
+}
+#endif
+
+#ifdef MOTION_NEON
+static uint64_t sadNeon(const uint8_t *a, const uint8_t *b, unsigned int width)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint8x16_t diff;
+    uint64x2_t sum;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        diff = vabdq_u8(vld2q_u8(a + x * 2).val[0], vld2q_u8(b + x * 2).val[0]);
+        acc = vpadalq_u16(acc, vpaddlq_u8(diff));
+    }
+    sum = vpaddlq_u32(acc);
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + rowSadScalar(a, b, x, width);
+}
+#endif
+
+static const sadFunc kernels[CONVERT_ISA_COUNT] =
+{
+    [CONVERT_ISA_SCALAR] = sadScalar,
+#ifdef MOTION_X86
+    [CONVERT_ISA_SSE2] = sadSse2,
+    [CONVERT_ISA_AVX2] = sadAvx2,
+#endif
+#ifdef MOTION_NEON
+    [CONVERT_ISA_NEON] = sadNeon,
+#endif
+};
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+sadFunc motionGetSad(convertIsa isa)
+{
+    // the converters know which instruction sets the CPU runs
+    if (isa >= CONVERT_ISA_COUNT || kernels[isa] == NULL || yuyvGetConverterIsa(isa) == NULL)
+    {
+        return NULL;
+    }
+    return kernels[isa];
+}
+
+motionGate *motionGateCreate(unsigned int width, unsigned int height, unsigned int rowStep,
+                             double threshold, unsigned int maxSkip)
+{
+    motionGate *gate;
+    int isa;
+
+    if (width < 2 || height == 0 || rowStep == 0)
+    {
+        return NULL;
+    }
+    gate = calloc(1, sizeof(*gate));
+    if (gate == NULL)
+    {
+        return NULL;
+    }
+    gate->width = width & ~1u;
+    gate->height = height;
+    gate->rowStep = rowStep;
+    gate->lines = (height + rowStep - 1) / rowStep;
+    gate->threshold = threshold;
+    gate->maxSkip = maxSkip;
+    gate->reference = malloc((size_t)gate->lines * width * 2);
+    if (gate->reference == NULL)
+    {
+        free(gate);
+        return NULL;
+    }
+    for (isa = CONVERT_ISA_COUNT - 1; isa >= CONVERT_ISA_SCALAR && gate->sad == NULL; isa--)
+    {
+        gate->sad = motionGetSad((convertIsa)isa);
+    }
+    return gate;
+}
+
+int motionGateCheck(motionGate *gate, const uint8_t *frame, double *score)
+{
+    size_t stride = (size_t)gate->width * 2;
+    uint64_t sum = 0;
+    double diff = 255.0;
+    unsigned int i;
+
+    if (gate->haveReference)
+    {
+        for (i = 0; i < gate->lines; i++)
+        {
+            sum += gate->sad(frame + i * gate->rowStep * stride, gate->reference + i * stride, gate->width);
+        }
+        diff = (double)sum / ((double)gate->lines * gate->width);
+    }
+    if (score != NULL)
+    {
+        *score = diff;
+    }
+
+    if (gate->haveReference && diff < gate->threshold &&
+        (gate->maxSkip == 0 || gate->skipped < gate->maxSkip))
+    {
+        gate->skipped++;
+        return 0;
+    }
+    // compare the next frames to this one, slow changes add up until they count
+    for (i = 0; i < gate->lines; i++)
+    {
+        memcpy(gate->reference + i * stride, frame + i * gate->rowStep * stride, stride);
+    }
+    gate->haveReference = 1;
+    gate->skipped = 0;
+    return 1;
+}
+
+void motionGateDestroy(motionGate *gate)
+{
+    if (gate == NULL)
+    {
+        return;
+    }
+    free(gate->reference);
+    free(gate);
+}
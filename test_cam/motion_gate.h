@@ -0,0 +1,71 @@
+/*
+* @file     motion_gate.h
+* @author   Trong Phuoc
+* @brief    Motion gate in front of the storage: a YUYV frame is only kept when
+*           its luma differs enough from the last kept frame, measured as a
+*           row subsampled SAD with SIMD kernels selected at run time
+*/
+#ifndef MOTION_GATE_H
+#define MOTION_GATE_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+#include "yuyv_convert.h"
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+/*
+ * Sum of the absolute differences of the luma bytes of two YUYV lines of width
+ * pixels, the chroma bytes are ignored. width must be even.
+ */
+typedef uint64_t (*sadFunc)(const uint8_t *a, const uint8_t *b, unsigned int width);
+
+typedef struct motionGate motionGate;
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    sadFunc motionGetSad(convertIsa isa)
+ *
+ * @brief   get the SAD kernel of one instruction set, used to compare them
+ * @return  NULL when the instruction set is not built in or not supported by the CPU
+***********************************************************************************/
+sadFunc motionGetSad(convertIsa isa);
+
+/**********************************************************************************
+ * @func    motionGate *motionGateCreate(unsigned int width, unsigned int height,
+ *                                       unsigned int rowStep, double threshold,
+ *                                       unsigned int maxSkip)
+ *
+ * @brief   create a gate for YUYV frames of width x height pixels with the fastest
+ *          SAD kernel of the CPU. One line out of rowStep is compared. A frame is
+ *          kept when the mean absolute luma difference of those lines reaches
+ *          threshold (0 to 255), or when maxSkip frames in a row were skipped
+ *          (0 never forces a frame)
+ * @return  the gate, NULL when out of memory
+***********************************************************************************/
+motionGate *motionGateCreate(unsigned int width, unsigned int height, unsigned int rowStep,
+                             double threshold, unsigned int maxSkip);
+
+/**********************************************************************************
+ * @func    int motionGateCheck(motionGate *gate, const uint8_t *frame, double *score)
+ *
+ * @brief   compare a frame to the last kept frame, a kept frame becomes the new
+ *          reference. The first frame is always kept
+ * @param   score   - when not NULL, gets the mean absolute luma difference
+ * @return  1 - keep the frame, 0 - skip it
+***********************************************************************************/
+int motionGateCheck(motionGate *gate, const uint8_t *frame, double *score);
+
+/**********************************************************************************
+ * @func    void motionGateDestroy(motionGate *gate)
+ *
+ * @brief   free the gate and its reference lines
+***********************************************************************************/
+void motionGateDestroy(motionGate *gate);
+
+#endif /* MOTION_GATE_H */
@@ -0,0 +1,178 @@
+/*
+* @file     record_tool.c
+* @author   Trong Phuoc
+* @brief    Inspect recordings written by cam_test -o: print the format and the
+*           index, seek by timestamp and extract frames
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include "cam_record.h"
+#include "frame_compress.h"
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] FILE \n"
+           "-l | --list          Print every index entry \n"
+           "-t | --seek NS       Find the first frame taken at or after NS \n"
+           "-f | --frame N       Select frame N \n"
+           "-x | --extract OUT   Write the selected frame into OUT, decompressed \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static void printEntry(const recordReader *rd, uint64_t i)
+{
+    const recordIndexEntry *entry = recordEntry(rd, i);
+
+    printf("%8" PRIu64 " seq %8u ts %20" PRIu64 " offset %12" PRIu64 " size %9u", i, entry->sequence,
+           entry->timestampNs, entry->offset, entry->size);
+    if (entry->rawSize)
+    {
+        printf(" raw %9u", entry->rawSize);
+    }
+    printf("%s \n", entry->flags & RECORD_FLAG_ERROR ? " error" : "");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"list", no_argument, NULL, 'l'},
+        {"seek", required_argument, NULL, 't'},
+        {"frame", required_argument, NULL, 'f'},
+        {"extract", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *extract = NULL;
+    const recordHeader *header;
+    const recordIndexEntry *entry;
+    const void *payload;
+    void *raw = NULL;
+    recordReader *rd;
+    int64_t frame = -1;
+    uint64_t i, last, seekNs = 0;
+    uint32_t size;
+    int list = 0;
+    int seek = 0;
+    int c;
+    FILE *fp;
+
+    while ((c = getopt_long(argc, argv, "lt:f:x:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            list = 1;
+            break;
+        case 't':
+            seekNs = strtoull(optarg, NULL, 0);
+            seek = 1;
+            break;
+        case 'f':
+            frame = strtoll(optarg, NULL, 0);
+            break;
+        case 'x':
+            extract = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rd = recordOpen(argv[optind]);
+    if (rd == NULL)
+    {
+        printf("%s is not a recording \n", argv[optind]);
+        return 1;
+    }
+    header = recordFormat(rd);
+    printf("%ux%u %.4s, %u bytes per line, %u bytes per image \n", header->width, header->height,
+           (const char *)&header->pixelformat, header->bytesperline, header->sizeimage);
+    printf("%" PRIu64 " frames%s \n", recordCount(rd), recordRecovered(rd) ? ", index rebuilt from frame headers" : "");
+    if (recordCodec(rd) != RECORD_CODEC_NONE)
+    {
+        printf("compressed with %s level %d%s \n", compressName(recordCodec(rd)) ? compressName(recordCodec(rd)) : "?",
+               header->level, compressSupported(recordCodec(rd)) ? "" : ", codec not built in");
+    }
+    if (recordCount(rd) > 0)
+    {
+        last = recordCount(rd) - 1;
+        printf("timestamps %" PRIu64 " .. %" PRIu64 " ns \n", recordEntry(rd, 0)->timestampNs,
+               recordEntry(rd, last)->timestampNs);
+    }
+    if (list)
+    {
+        for (i = 0; i < recordCount(rd); i++)
+        {
+            printEntry(rd, i);
+        }
+    }
+
+    if (seek)
+    {
+        frame = recordSeek(rd, seekNs);
+        if (frame < 0)
+        {
+            printf("No frame at or after this timestamp \n");
+            recordRelease(rd);
+            return 1;
+        }
+    }
+    if (frame >= 0)
+    {
+        payload = recordFrame(rd, frame, &size);
+        if (payload == NULL)
+        {
+            printf("No frame %" PRId64 " \n", frame);
+            recordRelease(rd);
+            return 1;
+        }
+        printEntry(rd, frame);
+        entry = recordEntry(rd, frame);
+        // a frame that did not shrink is stored as is, even in a compressed recording
+        if (extract != NULL && entry->rawSize != 0)
+        {
+            raw = malloc(entry->rawSize);
+            if (raw == NULL || compressDecode(recordCodec(rd), payload, size, raw, entry->rawSize) < 0)
+            {
+                printf("Can not decompress frame %" PRId64 " \n", frame);
+                free(raw);
+                recordRelease(rd);
+                return 1;
+            }
+            payload = raw;
+            size = entry->rawSize;
+        }
+        if (extract != NULL)
+        {
+            fp = fopen(extract, "wb");
+            if (fp == NULL || fwrite(payload, size, 1, fp) != 1)
+            {
+                printf("Can not write %s \n", extract);
+            }
+            if (fp != NULL)
+            {
+                fclose(fp);
+            }
+        }
+    }
+    free(raw);
+    recordRelease(rd);
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+* @file     restart_bench.c
+* @author   Trong Phuoc
+* @brief    Restart latency of a stream: time from VIDIOC_STREAMON to the first
+*           frame over repeated STREAMOFF/STREAMON cycles, optionally releasing
+*           and requesting the buffers in between as a mode switch does
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_BUFFERS       4
+#define BENCH_TIMEOUT_MS    5000    /* a camera which sends nothing for 5 s is stuck */
+#define BENCH_STEADY_FRAMES 10      /* frames timed after the first one for the frame time */
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct benchBuffer
+{
+    void *start;
+    size_t length;
+} benchBuffer;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static benchBuffer buffers[BENCH_BUFFERS];
+static unsigned int n_buffers;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-d | --device NODE   Video node to open (default /dev/video2) \n"
+           "-n | --cycles N      STREAMOFF/STREAMON cycles (default 20) \n"
+           "-r | --reqbufs       Release and request the buffers on every cycle \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int initBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+
+    memset(&req, 0, sizeof(req));
+    req.count = BENCH_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0)
+    {
+        printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+        return -1;
+    }
+    if (req.count > BENCH_BUFFERS)
+    {
+        req.count = BENCH_BUFFERS;
+    }
+    for (n_buffers = 0; n_buffers < req.count; n_buffers++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n_buffers;
+        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            printf("VIDIOC_QUERYBUF failed: %s \n", strerror(errno));
+            return -1;
+        }
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[n_buffers].start == MAP_FAILED)
+        {
+            printf("Can not map buffer %u \n", n_buffers);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void uninitBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i;
+
+    for (i = 0; i < n_buffers; i++)
+    {
+        munmap(buffers[i].start, buffers[i].length);
+    }
+    n_buffers = 0;
+    memset(&req, 0, sizeof(req));
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    ioctl(fd, VIDIOC_REQBUFS, &req);
+}
+
+static int queueBuffer(int fd, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    return ioctl(fd, VIDIOC_QBUF, &buf);
+}
+
+/* wait for the next frame and give its buffer back, -1 on timeout or error */
+static int waitFrame(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    struct v4l2_buffer buf;
+    int ret;
+
+    do
+    {
+        ret = poll(&pfd, 1, BENCH_TIMEOUT_MS);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+    {
+        printf("No frame within %d ms \n", BENCH_TIMEOUT_MS);
+        return -1;
+    }
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0)
+    {
+        printf("VIDIOC_DQBUF failed: %s \n", strerror(errno));
+        return -1;
+    }
+    return queueBuffer(fd, buf.index);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"cycles", required_argument, NULL, 'n'},
+        {"reqbufs", no_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *device = "/dev/video2";
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned long long start, first, latency, total = 0, min = ~0ULL, max = 0, frameNs = 0;
+    unsigned long cycles = 20, cycle, done = 0;
+    unsigned int i;
+    int reqbufs = 0;
+    int status = 0;
+    int fd, c;
+
+    while ((c = getopt_long(argc, argv, "d:n:rh", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'n':
+            cycles = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            reqbufs = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", device);
+        return 1;
+    }
+    if (initBuffers(fd) < 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    // cycle 0 is the cold start, the others are restarts
+    for (cycle = 0; cycle <= cycles; cycle++)
+    {
+        if (reqbufs && cycle > 0 && initBuffers(fd) < 0)
+        {
+            status = 1;
+            break;
+        }
+        for (i = 0; i < n_buffers; i++)
+        {
+            queueBuffer(fd, i);
+        }
+        start = getTimeNs();
+        if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+        {
+            printf("VIDIOC_STREAMON failed: %s \n", strerror(errno));
+            status = 1;
+            break;
+        }
+        if (waitFrame(fd) < 0)
+        {
+            status = 1;
+            break;
+        }
+        first = getTimeNs();
+        latency = first - start;
+        if (cycle == 0)
+        {
+            printf("Cold start: %.2f ms \n", latency / 1e6);
+            for (i = 0; i < BENCH_STEADY_FRAMES && status == 0; i++)
+            {
+                status = waitFrame(fd) < 0;
+            }
+            frameNs = (getTimeNs() - first) / BENCH_STEADY_FRAMES;
+        }
+        else
+        {
+            total += latency;
+            min = latency < min ? latency : min;
+            max = latency > max ? latency : max;
+            done++;
+        }
+        ioctl(fd, VIDIOC_STREAMOFF, &type);
+        if (reqbufs)
+        {
+            uninitBuffers(fd);
+        }
+    }
+
+    if (done > 0)
+    {
+        printf("Restart to first frame over %lu cycles%s: min %.2f ms, avg %.2f ms, max %.2f ms \n",
+               done, reqbufs ? " with REQBUFS" : "", min / 1e6, total / 1e6 / done, max / 1e6);
+        printf("Frame time: %.2f ms, average restart costs %.2f frames \n", frameNs / 1e6,
+               frameNs > 0 ? (double)total / done / frameNs : 0.0);
+    }
+    if (n_buffers > 0)
+    {
+        uninitBuffers(fd);
+    }
+    close(fd);
+    return status;
+}
@@ -0,0 +1,401 @@
+/*
+* @file     ring_bench.c
+* @author   Trong Phuoc
+* @brief    Latency from the time stamp of a frame to the application holding it:
+*           poll() and VIDIOC_DQBUF against the completion ring of the driver,
+*           waited for with poll() or spun on without any system call
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+#include "../KernelModule/cam_ioctl.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_BUFFERS       8
+#define BENCH_TIMEOUT_MS    5000    /* a camera which sends nothing for 5 s is stuck */
+#define BENCH_WARMUP        10      /* first frames left out, the stream settles */
+#define SPIN_CHECK          4096    /* spins between two clock reads */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef enum benchMode
+{
+    MODE_DQBUF = 0,     /**< poll() then VIDIOC_DQBUF and VIDIOC_QBUF */
+    MODE_RING_POLL,     /**< poll() then the ring, the wake up without the ioctls */
+    MODE_RING_SPIN,     /**< spin on the ring */
+} benchMode;
+
+typedef struct benchBuffer
+{
+    void *start;
+    size_t length;
+} benchBuffer;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const char *mode_names[] = {"poll+DQBUF", "ring+poll", "ring spin"};
+static benchBuffer buffers[BENCH_BUFFERS];
+static unsigned int n_buffers;
+static unsigned long n_frames = 600;
+static unsigned long long *samples;
+static struct cam_ring *ring;
+static size_t ring_size;
+static volatile unsigned int sink;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-d | --device NODE   Video node to open (default /dev/video2) \n"
+           "-f | --format WxH    YUYV frame size (default 640x480) \n"
+           "-c | --count N       Frames per mode (default 600) \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long getCpuNs(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int compareNs(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int initBuffers(int fd)
+{
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+
+    memset(&req, 0, sizeof(req));
+    req.count = BENCH_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0)
+    {
+        printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+        return -1;
+    }
+    if (req.count > BENCH_BUFFERS)
+    {
+        req.count = BENCH_BUFFERS;
+    }
+    for (n_buffers = 0; n_buffers < req.count; n_buffers++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = n_buffers;
+        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0)
+        {
+            printf("VIDIOC_QUERYBUF failed: %s \n", strerror(errno));
+            return -1;
+        }
+        buffers[n_buffers].length = buf.length;
+        buffers[n_buffers].start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+        if (buffers[n_buffers].start == MAP_FAILED)
+        {
+            printf("Can not map buffer %u \n", n_buffers);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int initRing(int fd)
+{
+    struct cam_ring_setup setup;
+    void *map;
+
+    memset(&setup, 0, sizeof(setup));
+    setup.enable = 1;
+    if (ioctl(fd, VIDIOC_CAM_RING, &setup) < 0)
+    {
+        printf("VIDIOC_CAM_RING failed: %s \n", strerror(errno));
+        return -1;
+    }
+    map = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, setup.offset);
+    if (map == MAP_FAILED)
+    {
+        printf("Can not map the completion ring \n");
+        return -1;
+    }
+    ring = map;
+    ring_size = setup.size;
+    return 0;
+}
+
+static int queueBuffer(int fd, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    return ioctl(fd, VIDIOC_QBUF, &buf);
+}
+
+static int waitPoll(int fd, unsigned long *calls)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ret;
+
+    do
+    {
+        ret = poll(&pfd, 1, BENCH_TIMEOUT_MS);
+        (*calls)++;
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+    {
+        printf("No frame within %d ms \n", BENCH_TIMEOUT_MS);
+        return -1;
+    }
+    return 0;
+}
+
+static int waitSpin(__u32 tail)
+{
+    unsigned long long deadline = getTimeNs() + BENCH_TIMEOUT_MS * 1000000ULL;
+    unsigned int spins = 0;
+
+    while (__atomic_load_n(&ring->done_head, __ATOMIC_ACQUIRE) == tail)
+    {
+        CPU_RELAX();
+        if (++spins % SPIN_CHECK == 0 && getTimeNs() > deadline)
+        {
+            printf("No frame within %d ms \n", BENCH_TIMEOUT_MS);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the latency ends when the application holds the frame, before it reads it */
+static unsigned long takeDqbuf(int fd, unsigned long n, unsigned long *calls)
+{
+    struct v4l2_buffer buf;
+
+    for (;;)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        (*calls)++;
+        if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0)
+        {
+            return n;
+        }
+        if (n < n_frames)
+        {
+            samples[n++] = getTimeNs() - (buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL);
+        }
+        sink += *(const unsigned char *)buffers[buf.index].start;
+        queueBuffer(fd, buf.index);
+        (*calls)++;
+    }
+}
+
+static unsigned long takeRing(unsigned long n, __u32 *tail, __u32 *freeHead)
+{
+    __u32 head = __atomic_load_n(&ring->done_head, __ATOMIC_ACQUIRE);
+    const struct cam_batch_buffer *done;
+    unsigned long long now = getTimeNs();
+
+    for (; *tail != head; (*tail)++)
+    {
+        done = &ring->done[*tail % CAM_RING_ENTRIES];
+        if (n < n_frames)
+        {
+            samples[n++] = now - done->timestamp;
+        }
+        sink += *(const unsigned char *)buffers[done->index].start;
+        ring->free[*freeHead % CAM_RING_ENTRIES] = done->index;
+        (*freeHead)++;
+        __atomic_store_n(&ring->free_head, *freeHead, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&ring->done_tail, *tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* one stream in one mode, the latency percentiles of its frames */
+static int runMode(int fd, benchMode mode)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned long n = 0, calls = 0, count;
+    unsigned long long cpu, start, wall;
+    __u32 tail = 0, freeHead = 0;
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < n_buffers; i++)
+    {
+        queueBuffer(fd, i);
+    }
+    if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+    {
+        printf("VIDIOC_STREAMON failed: %s \n", strerror(errno));
+        return -1;
+    }
+    start = getTimeNs();
+    cpu = getCpuNs();
+    while (n < n_frames && ret == 0)
+    {
+        switch (mode)
+        {
+        case MODE_DQBUF:
+            ret = waitPoll(fd, &calls);
+            n = ret == 0 ? takeDqbuf(fd, n, &calls) : n;
+            break;
+        case MODE_RING_POLL:
+            ret = waitPoll(fd, &calls);
+            n = ret == 0 ? takeRing(n, &tail, &freeHead) : n;
+            break;
+        case MODE_RING_SPIN:
+            ret = waitSpin(tail);
+            n = ret == 0 ? takeRing(n, &tail, &freeHead) : n;
+            break;
+        }
+    }
+    cpu = getCpuNs() - cpu;
+    wall = getTimeNs() - start;
+    ioctl(fd, VIDIOC_STREAMOFF, &type);
+    if (n <= BENCH_WARMUP)
+    {
+        return -1;
+    }
+
+    count = n - BENCH_WARMUP;
+    qsort(samples + BENCH_WARMUP, count, sizeof(*samples), compareNs);
+    printf("%-11s %7lu %8.2f %9.1f %9.1f %9.1f %9.1f %8.1f \n", mode_names[mode], n, (double)calls / n,
+           samples[BENCH_WARMUP + count / 2] / 1000.0, samples[BENCH_WARMUP + count * 99 / 100] / 1000.0,
+           samples[BENCH_WARMUP + count - 1] / 1000.0, cpu / 1000.0 / n, n * 1e9 / wall);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"format", required_argument, NULL, 'f'},
+        {"count", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *device = "/dev/video2";
+    struct v4l2_format fmt;
+    unsigned int width = 640, height = 480, i;
+    int status = 1;
+    int fd, c;
+
+    while ((c = getopt_long(argc, argv, "d:f:c:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'f':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            n_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    samples = calloc(n_frames, sizeof(*samples));
+    if (samples == NULL || n_frames <= BENCH_WARMUP)
+    {
+        printf("Need more than %d frames \n", BENCH_WARMUP);
+        return 1;
+    }
+
+    fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", device);
+        return 1;
+    }
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
+    {
+        printf("VIDIOC_S_FMT failed: %s \n", strerror(errno));
+    }
+    if (initBuffers(fd) == 0)
+    {
+        printf("%ux%u YUYV, %u buffers, %lu frames per mode, latency from the buffer time stamp \n",
+               fmt.fmt.pix.width, fmt.fmt.pix.height, n_buffers, n_frames);
+        printf("%-11s %7s %8s %9s %9s %9s %9s %8s \n", "mode", "frames", "calls/f", "p50 us", "p99 us", "max us",
+               "cpu us/f", "fps");
+        // DQBUF fails once the ring is on, it runs first
+        status = runMode(fd, MODE_DQBUF) < 0 || initRing(fd) < 0 || runMode(fd, MODE_RING_POLL) < 0 ||
+                 runMode(fd, MODE_RING_SPIN) < 0;
+    }
+    if (ring != NULL)
+    {
+        munmap(ring, ring_size);
+    }
+    for (i = 0; i < n_buffers; i++)
+    {
+        munmap(buffers[i].start, buffers[i].length);
+    }
+    close(fd);
+    free(samples);
+    return status;
+}
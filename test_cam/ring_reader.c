@@ -0,0 +1,173 @@
+/*
+* @file     ring_reader.c
+* @author   Trong Phuoc
+* @brief    Read the frames cam_test -P publishes in its shared ring, in place,
+*           and report the latency from capture to reader and the frames the
+*           reader lost by being slower than the camera
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "frame_ring.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define READER_TIMEOUT_MS   5000    /* a publisher which sends nothing for 5 s is stuck */
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] RING \n"
+           "RING is the path cam_test -P prints, /proc/PID/fd/N \n"
+           "-c | --count N       Number of frames to read (default 300) \n"
+           "-s | --slow US       Spend US microseconds on every frame, to see overruns \n"
+           "-v | --verbose       Print every frame \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* read the whole frame as a consumer would, one byte per cache line is enough */
+static unsigned int touchFrame(const uint8_t *data, uint32_t size)
+{
+    unsigned int sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < size; i += 64)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"count", required_argument, NULL, 'c'},
+        {"slow", required_argument, NULL, 's'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const ringHeader *header;
+    frameRingReader *rd;
+    ringFrame frame;
+    unsigned long long now, latency, latencySum = 0, latencyMax = 0, start = 0, slowNs = 0;
+    unsigned long count = 300, frames = 0, overruns = 0;
+    unsigned int sum = 0;
+    int verbose = 0;
+    int status = 0;
+    int fd, c, ret;
+
+    while ((c = getopt_long(argc, argv, "c:s:vh", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            slowNs = strtoull(optarg, NULL, 0) * 1000ULL;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // read-write for the waiter count, the frames are mapped read-only
+    fd = open(argv[optind], O_RDWR);
+    if (fd < 0)
+    {
+        printf("Can not open %s \n", argv[optind]);
+        return 1;
+    }
+    rd = frameRingAttach(fd);
+    close(fd);
+    if (rd == NULL)
+    {
+        printf("%s is not a frame ring \n", argv[optind]);
+        return 1;
+    }
+    header = frameRingHeader(rd);
+    printf("%ux%u %.4s, %u slots of %u bytes \n", header->width, header->height,
+           (const char *)&header->pixelformat, header->slots, header->slotSize);
+
+    while (frames < count)
+    {
+        ret = frameRingNext(rd, &frame, READER_TIMEOUT_MS);
+        if (ret == 0)
+        {
+            printf("No frame within %d ms \n", READER_TIMEOUT_MS);
+            status = 1;
+            break;
+        }
+        if (ret < 0)
+        {
+            printf("The publisher closed the ring \n");
+            break;
+        }
+        now = getTimeNs();
+        start = start ? start : now;
+        sum += touchFrame(frame.data, frame.size);
+        while (slowNs && getTimeNs() - now < slowNs)
+        {
+        }
+        // the data is only known good once the slot still holds the frame
+        if (frameRingDone(rd, &frame) < 0)
+        {
+            overruns++;
+            continue;
+        }
+        latency = now > frame.timestampNs ? now - frame.timestampNs : 0;
+        latencySum += latency;
+        latencyMax = latency > latencyMax ? latency : latencyMax;
+        frames++;
+        if (verbose)
+        {
+            printf("seq %8u  ring %8llu  %8u bytes  latency %.3f ms \n", frame.frameSequence,
+                   (unsigned long long)frame.sequence, frame.size, latency / 1e6);
+        }
+    }
+
+    printf("------------------> Ring reader statistics <-------------------- \n");
+    printf("Frames: %lu, lost: %llu (%lu overrun while read), checksum %08x \n", frames,
+           (unsigned long long)frameRingLost(rd), overruns, sum);
+    if (frames > 0)
+    {
+        printf("Latency from capture: avg %.3f ms, max %.3f ms \n", latencySum / 1e6 / frames, latencyMax / 1e6);
+    }
+    if (frames > 1)
+    {
+        printf("Frame rate: %.2f fps \n", (frames - 1) * 1e9 / (getTimeNs() - start));
+    }
+    frameRingDetach(rd);
+    return status;
+}
@@ -0,0 +1,422 @@
+/*
+* @file     tlb_bench.c
+* @author   Trong Phuoc
+* @brief    Cost of the page size backing 1080p frames: runs the YUYV to I420
+*           kernel and a column pass over frames in 4K pages, transparent huge
+*           pages, hugetlbfs pages and the buffers of the driver, and prints the
+*           throughput and the dTLB misses per frame
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/videodev2.h>
+#include "yuyv_convert.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_WIDTH     1920
+#define BENCH_HEIGHT    1080
+#define BENCH_FRAMES    4           /* frames cycled through, more than the TLB covers */
+#define BENCH_MIN_NS    500000000ULL /* run every case for at least 0.5 s */
+#define BENCH_HUGE_SIZE (2UL << 20) /* PMD size, alignment of the huge mappings */
+#define BENCH_COLUMN    16          /* bytes between the columns of the column pass */
+
+#define BENCH_SRC_SIZE  ((size_t)BENCH_WIDTH * BENCH_HEIGHT * 2)
+#define BENCH_DST_SIZE  ((size_t)BENCH_WIDTH * BENCH_HEIGHT * 3 / 2)
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef struct benchMap
+{
+    void *start;
+    size_t length;
+} benchMap;
+
+typedef struct benchFrames
+{
+    const char *name;
+    unsigned char *src[BENCH_FRAMES];
+    unsigned char *dst[BENCH_FRAMES];
+    unsigned int count;
+    benchMap maps[BENCH_FRAMES * 2];
+    unsigned int nmaps;
+} benchFrames;
+
+typedef struct benchResult
+{
+    double gbps;
+    double missesPerFrame;  /**< negative when the counter is not available */
+} benchResult;
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-d | --device NODE   Also run on the buffers of the driver (1920x1080 YUYV) \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* dTLB load misses of this thread in user space, -1 without PMU access */
+static int openTlbCounter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* map length bytes at a PMD aligned address, the kernel only uses huge pages there */
+static void *mapAligned(size_t length, int prot, int flags, int fd, off_t offset)
+{
+    unsigned char *area, *start;
+    size_t areaLength = length + BENCH_HUGE_SIZE;
+
+    area = mmap(NULL, areaLength, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+    {
+        return MAP_FAILED;
+    }
+    start = (unsigned char *)(((uintptr_t)area + BENCH_HUGE_SIZE - 1) & ~(BENCH_HUGE_SIZE - 1));
+    if (mmap(start, length, prot, flags | MAP_FIXED, fd, offset) == MAP_FAILED)
+    {
+        munmap(area, areaLength);
+        return MAP_FAILED;
+    }
+    // give back the unused head and tail of the reservation
+    if (start > area)
+    {
+        munmap(area, start - area);
+    }
+    munmap(start + length, area + areaLength - (start + length));
+    return start;
+}
+
+/* one anonymous region split into frames, advice selects the page size */
+static int initAnonymous(benchFrames *frames, const char *name, int advice, int hugetlb)
+{
+    size_t length = (BENCH_SRC_SIZE + BENCH_DST_SIZE) * BENCH_FRAMES;
+    unsigned char *area;
+    unsigned int i;
+
+    memset(frames, 0, sizeof(*frames));
+    frames->name = name;
+    length = (length + BENCH_HUGE_SIZE - 1) & ~(BENCH_HUGE_SIZE - 1);
+    if (hugetlb)
+    {
+#ifdef MAP_HUGETLB
+        area = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#else
+        area = MAP_FAILED;
+#endif
+    }
+    else
+    {
+        area = mapAligned(length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (area == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (advice >= 0 && madvise(area, length, advice) < 0)
+    {
+        munmap(area, length);
+        return -1;
+    }
+    frames->maps[0].start = area;
+    frames->maps[0].length = length;
+    frames->nmaps = 1;
+    for (i = 0; i < BENCH_FRAMES; i++)
+    {
+        frames->src[i] = area + i * BENCH_SRC_SIZE;
+        frames->dst[i] = area + BENCH_FRAMES * BENCH_SRC_SIZE + i * BENCH_DST_SIZE;
+    }
+    frames->count = BENCH_FRAMES;
+    return 0;
+}
+
+/* the sources and destinations are buffers of the driver, as a capture client sees them */
+static int initDevice(benchFrames *frames, int fd)
+{
+    struct v4l2_format format;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    unsigned char *start;
+    unsigned int i;
+
+    memset(frames, 0, sizeof(*frames));
+    frames->name = "device";
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.fmt.pix.width = BENCH_WIDTH;
+    format.fmt.pix.height = BENCH_HEIGHT;
+    format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    format.fmt.pix.field = V4L2_FIELD_NONE;
+    if (ioctl(fd, VIDIOC_S_FMT, &format) < 0 || format.fmt.pix.width != BENCH_WIDTH ||
+        format.fmt.pix.height != BENCH_HEIGHT)
+    {
+        printf("The device has no %ux%u YUYV format \n", BENCH_WIDTH, BENCH_HEIGHT);
+        return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    req.count = BENCH_FRAMES * 2;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2)
+    {
+        printf("VIDIOC_REQBUFS failed: %s \n", strerror(errno));
+        return -1;
+    }
+    if (req.count > BENCH_FRAMES * 2)
+    {
+        req.count = BENCH_FRAMES * 2;
+    }
+    for (i = 0; i < req.count / 2 * 2; i++)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0 || buf.length < BENCH_SRC_SIZE)
+        {
+            printf("VIDIOC_QUERYBUF failed \n");
+            return -1;
+        }
+        start = mapAligned(buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        if (start == MAP_FAILED)
+        {
+            printf("Can not map buffer %u: %s \n", i, strerror(errno));
+            return -1;
+        }
+        frames->maps[frames->nmaps].start = start;
+        frames->maps[frames->nmaps].length = buf.length;
+        frames->nmaps++;
+        if (i % 2 == 0)
+        {
+            frames->src[i / 2] = start;
+        }
+        else
+        {
+            frames->dst[i / 2] = start;
+        }
+    }
+    frames->count = req.count / 2;
+    return 0;
+}
+
+static void uninitFrames(benchFrames *frames)
+{
+    unsigned int i;
+
+    for (i = 0; i < frames->nmaps; i++)
+    {
+        munmap(frames->maps[i].start, frames->maps[i].length);
+    }
+    frames->nmaps = 0;
+}
+
+/* vertical pass over the Y samples, a 4K page only holds one row of a 1080p frame */
+static unsigned int columnPass(const unsigned char *src)
+{
+    unsigned int x, y, sum = 0;
+
+    for (x = 0; x < BENCH_WIDTH * 2; x += BENCH_COLUMN)
+    {
+        for (y = 0; y < BENCH_HEIGHT; y++)
+        {
+            sum += src[(size_t)y * BENCH_WIDTH * 2 + x];
+        }
+    }
+    return sum;
+}
+
+static benchResult runCase(const benchFrames *frames, int counter, int column)
+{
+    const yuyvConverter *conv = yuyvGetConverter();
+    unsigned long long start, ns, misses = 0;
+    unsigned int runs = 0;
+    volatile unsigned int sink = 0;
+    benchResult result;
+    unsigned int f;
+
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = getTimeNs();
+    do
+    {
+        f = runs % frames->count;
+        if (column)
+        {
+            sink += columnPass(frames->src[f]);
+        }
+        else
+        {
+            conv->toI420(frames->src[f], frames->dst[f], BENCH_WIDTH, BENCH_HEIGHT);
+        }
+        runs++;
+        ns = getTimeNs() - start;
+    } while (ns < BENCH_MIN_NS);
+    result.missesPerFrame = -1;
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) == sizeof(misses))
+        {
+            result.missesPerFrame = (double)misses / runs;
+        }
+    }
+    (void)sink;
+    // GB/s of YUYV input, what a capture client has to keep up with
+    result.gbps = (double)BENCH_SRC_SIZE * runs / ns;
+    return result;
+}
+
+static void runFrames(benchFrames *frames, int counter)
+{
+    static const char *passes[] = {"i420", "column"};
+    benchResult result;
+    unsigned int i, p;
+
+    // fault everything in first, the page faults are not what is measured
+    for (i = 0; i < frames->count; i++)
+    {
+        memset(frames->src[i], 0x80, BENCH_SRC_SIZE);
+        memset(frames->dst[i], 0, BENCH_DST_SIZE);
+    }
+    for (p = 0; p < 2; p++)
+    {
+        result = runCase(frames, counter, p);
+        if (result.missesPerFrame < 0)
+        {
+            printf("  %-8s %-7s %8.2f GB/s %14s \n", frames->name, passes[p], result.gbps, "n/a");
+        }
+        else
+        {
+            printf("  %-8s %-7s %8.2f GB/s %14.0f dTLB misses/frame \n", frames->name, passes[p],
+                   result.gbps, result.missesPerFrame);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    const char *device = NULL;
+    benchFrames frames;
+    struct v4l2_requestbuffers req;
+    int counter, fd, c;
+
+    while ((c = getopt_long(argc, argv, "d:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    counter = openTlbCounter();
+    if (counter < 0)
+    {
+        printf("No dTLB counter: %s \n", strerror(errno));
+    }
+    printf("%ux%u YUYV, %u frames, %s kernels \n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_FRAMES,
+           yuyvGetConverter()->name);
+
+    if (initAnonymous(&frames, "4k", MADV_NOHUGEPAGE, 0) == 0)
+    {
+        runFrames(&frames, counter);
+        uninitFrames(&frames);
+    }
+    if (initAnonymous(&frames, "thp", MADV_HUGEPAGE, 0) == 0)
+    {
+        runFrames(&frames, counter);
+        uninitFrames(&frames);
+    }
+    else
+    {
+        printf("  thp      no transparent huge pages \n");
+    }
+    if (initAnonymous(&frames, "hugetlb", -1, 1) == 0)
+    {
+        runFrames(&frames, counter);
+        uninitFrames(&frames);
+    }
+    else
+    {
+        printf("  hugetlb  no huge pages reserved (vm.nr_hugepages) \n");
+    }
+
+    if (device != NULL)
+    {
+        fd = open(device, O_RDWR);
+        if (fd < 0)
+        {
+            printf("Can not open %s \n", device);
+        }
+        else
+        {
+            if (initDevice(&frames, fd) == 0)
+            {
+                runFrames(&frames, counter);
+            }
+            uninitFrames(&frames);
+            memset(&req, 0, sizeof(req));
+            req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            req.memory = V4L2_MEMORY_MMAP;
+            ioctl(fd, VIDIOC_REQBUFS, &req);
+            close(fd);
+        }
+    }
+
+    if (counter >= 0)
+    {
+        close(counter);
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+/*
+* @file     transport_bench.c
+* @author   Trong Phuoc
+* @brief    Hand synthetic frames from a producer process to a consumer process
+*           through .raw files, the shared memfd ring and the Unix socket frame
+*           server, and compare the cost per frame for the producer, the
+*           throughput, the latency and the frames the consumer lost
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "frame_ring.h"
+#include "frame_server.h"
+
+/*******************************************************************************
+ *  DEFINE
+ ******************************************************************************/
+#define BENCH_SOURCES       4       /* distinct source frames, the producer cycles them */
+#define BENCH_RING_SLOTS    8
+#define BENCH_BUFFERS       8       /* buffers of the frame server, like cam_test -U */
+#define BENCH_DEPTH         4
+#define BENCH_TIMEOUT_MS    5000
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+enum benchTransport
+{
+    BENCH_FILE,             /**< one .raw file per frame, its name sent over a pipe */
+    BENCH_RING,             /**< frame_ring.h */
+    BENCH_SERVER,           /**< frame_server.h */
+    BENCH_TRANSPORTS,
+};
+
+typedef struct fileNote
+{
+    uint32_t sequence;
+    uint64_t timestampNs;
+} fileNote;
+
+typedef struct consumerResult
+{
+    unsigned long frames;           /**< frames the consumer got intact */
+    unsigned long long latencySum;  /**< from the producer time stamp to the consumer */
+    unsigned long long latencyMax;
+    unsigned long long firstNs;
+    unsigned long long lastNs;
+    unsigned int checksum;
+} consumerResult;
+
+/*******************************************************************************
+ *  VARIABLES
+ ******************************************************************************/
+static const char *const transportNames[BENCH_TRANSPORTS] = {"file", "ring", "server"};
+static struct v4l2_pix_format pix;
+static uint8_t *sources[BENCH_SOURCES];
+static unsigned long n_frames = 300;
+static unsigned int frame_rate = 0;
+static const char *file_dir = "/tmp";
+
+/*******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] \n"
+           "-n | --frames N      Frames sent through every transport (default 300) \n"
+           "-f | --fps N         Send at N frames per second, 0 sends as fast as the \n"
+           "                     producer can (default) \n"
+           "-W | --width N       Width of the YUYV frames (default 640) \n"
+           "-H | --height N      Height of the YUYV frames (default 480) \n"
+           "-d | --dir DIR       Directory of the .raw files (default /tmp) \n"
+           "-h | --help          Print this message \n",
+           name);
+}
+
+static unsigned long long getTimeNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* sleep until the time of frame n when the frames are paced */
+static void paceFrame(unsigned long long startNs, unsigned long n)
+{
+    unsigned long long due;
+    struct timespec ts;
+
+    if (frame_rate == 0)
+    {
+        return;
+    }
+    due = startNs + n * 1000000000ULL / frame_rate;
+    ts.tv_sec = due / 1000000000ULL;
+    ts.tv_nsec = due % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/* read the whole frame as a consumer would, one byte per cache line is enough */
+static unsigned int touchFrame(const uint8_t *data, uint32_t size)
+{
+    unsigned int sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < size; i += 64)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+/* count a frame the consumer got and read, its latency ends when it was read */
+static void consumerAccount(consumerResult *res, uint64_t timestampNs)
+{
+    unsigned long long now = getTimeNs();
+    unsigned long long latency = now > timestampNs ? now - timestampNs : 0;
+
+    res->latencySum += latency;
+    res->latencyMax = latency > res->latencyMax ? latency : res->latencyMax;
+    res->firstNs = res->firstNs ? res->firstNs : now;
+    res->lastNs = now;
+    res->frames++;
+}
+
+/*******************************************************************************
+ * @func    static void consume(int transport, int in, int ready, const char *path,
+ *                              int ringFd, pid_t producer, consumerResult *res)
+ *
+ * @brief   consumer process: take frames until the producer is done
+ *******************************************************************************/
+static void consume(int transport, int in, int ready, const char *path, int ringFd, pid_t producer,
+                    consumerResult *res)
+{
+    char name[256];
+    uint8_t *frame;
+    fileNote note;
+    frameRingReader *rd;
+    ringFrame rf;
+    frameClient *cl;
+    clientFrame cf;
+    ssize_t n;
+    int fd;
+
+    memset(res, 0, sizeof(*res));
+    switch (transport)
+    {
+    case BENCH_FILE:
+        frame = malloc(pix.sizeimage);
+        if (frame == NULL || write(ready, "", 1) != 1)
+        {
+            break;
+        }
+        while (read(in, &note, sizeof(note)) == sizeof(note))
+        {
+            snprintf(name, sizeof(name), "%s/transport_bench_%d_%u.raw", file_dir, (int)producer, note.sequence);
+            fd = open(name, O_RDONLY);
+            if (fd < 0)
+            {
+                continue;
+            }
+            n = read(fd, frame, pix.sizeimage);
+            close(fd);
+            unlink(name);
+            if (n == (ssize_t)pix.sizeimage)
+            {
+                res->checksum += touchFrame(frame, n);
+                consumerAccount(res, note.timestampNs);
+            }
+        }
+        free(frame);
+        break;
+    case BENCH_RING:
+        rd = frameRingAttach(ringFd);
+        if (rd == NULL || write(ready, "", 1) != 1)
+        {
+            break;
+        }
+        while (frameRingNext(rd, &rf, BENCH_TIMEOUT_MS) > 0)
+        {
+            // the frame is only counted when it was not overwritten while read
+            res->checksum += touchFrame(rf.data, rf.size);
+            if (frameRingDone(rd, &rf) == 0)
+            {
+                consumerAccount(res, rf.timestampNs);
+            }
+        }
+        frameRingDetach(rd);
+        break;
+    case BENCH_SERVER:
+        cl = frameClientConnect(path);
+        if (cl == NULL || write(ready, "", 1) != 1)
+        {
+            break;
+        }
+        while (frameClientNext(cl, &cf, BENCH_TIMEOUT_MS) > 0)
+        {
+            res->checksum += touchFrame(cf.data, cf.info.size);
+            consumerAccount(res, cf.info.timestampNs);
+            if (frameClientRelease(cl, &cf) < 0)
+            {
+                break;
+            }
+        }
+        frameClientDisconnect(cl);
+        break;
+    }
+}
+
+/*******************************************************************************
+ * @func    static int runTransport(int transport)
+ *
+ * @brief   fork a consumer, send n_frames frames to it and print the results
+ *******************************************************************************/
+static int runTransport(int transport)
+{
+    char path[108], name[256];
+    int data[2], ready[2], result[2];
+    struct pollfd pfd;
+    consumerResult res;
+    frameRing *ring = NULL;
+    frameServer *srv = NULL;
+    fileNote note;
+    unsigned long long start, t, produceNs = 0;
+    unsigned long i;
+    pid_t pid;
+    char c;
+    int fd, status;
+
+    snprintf(path, sizeof(path), "/tmp/transport_bench_%d.sock", (int)getpid());
+    if (pipe(data) < 0 || pipe(ready) < 0 || pipe(result) < 0)
+    {
+        printf("Can not create the pipes \n");
+        return -1;
+    }
+    if (transport == BENCH_RING)
+    {
+        ring = frameRingCreate("transport_bench", &pix, BENCH_RING_SLOTS);
+    }
+    if (transport == BENCH_SERVER)
+    {
+        srv = frameServerCreate(path, &pix, BENCH_BUFFERS, BENCH_DEPTH);
+    }
+    if ((transport == BENCH_RING && ring == NULL) || (transport == BENCH_SERVER && srv == NULL))
+    {
+        printf("Can not create the %s transport \n", transportNames[transport]);
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0)
+    {
+        printf("Can not fork the consumer \n");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(data[1]);
+        close(ready[0]);
+        close(result[0]);
+        consume(transport, data[0], ready[1], path, ring != NULL ? frameRingFd(ring) : -1, getppid(), &res);
+        _exit(write(result[1], &res, sizeof(res)) == sizeof(res) ? 0 : 1);
+    }
+    close(data[0]);
+    close(ready[1]);
+    close(result[1]);
+
+    // the server accepts the consumer while it waits for it to be ready
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 1) == 0)
+    {
+        if (srv != NULL)
+        {
+            frameServerPoll(srv);
+        }
+    }
+    if (read(ready[0], &c, 1) != 1)
+    {
+        printf("The %s consumer did not start \n", transportNames[transport]);
+    }
+
+    start = getTimeNs();
+    for (i = 0; i < n_frames; i++)
+    {
+        paceFrame(start, i);
+        t = getTimeNs();
+        switch (transport)
+        {
+        case BENCH_FILE:
+            snprintf(name, sizeof(name), "%s/transport_bench_%d_%lu.raw", file_dir, (int)getpid(), i);
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || write(fd, sources[i % BENCH_SOURCES], pix.sizeimage) != (ssize_t)pix.sizeimage)
+            {
+                printf("Can not write %s \n", name);
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            note.sequence = i;
+            note.timestampNs = t;
+            if (write(data[1], &note, sizeof(note)) != sizeof(note))
+            {
+                printf("The file consumer went away \n");
+            }
+            break;
+        case BENCH_RING:
+            frameRingPublish(ring, sources[i % BENCH_SOURCES], pix.sizeimage, t, i);
+            break;
+        case BENCH_SERVER:
+            frameServerPublish(srv, sources[i % BENCH_SOURCES], pix.sizeimage, t, i);
+            break;
+        }
+        produceNs += getTimeNs() - t;
+    }
+    // the consumer sees the end once it took what is queued
+    close(data[1]);
+    frameRingDestroy(ring);
+    frameServerDestroy(srv);
+
+    if (read(result[0], &res, sizeof(res)) != sizeof(res))
+    {
+        memset(&res, 0, sizeof(res));
+    }
+    waitpid(pid, &status, 0);
+    close(ready[0]);
+    close(result[0]);
+
+    printf("%-8s %10.1f %10lu %10lu %10.1f %12.3f %12.3f \n", transportNames[transport],
+           produceNs / 1000.0 / n_frames, res.frames, n_frames - res.frames,
+           res.lastNs > res.firstNs ? (double)res.frames * pix.sizeimage / (res.lastNs - res.firstNs) * 1e3 : 0.0,
+           res.frames ? res.latencySum / 1e6 / res.frames : 0.0, res.latencyMax / 1e6);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"frames", required_argument, NULL, 'n'},
+        {"fps", required_argument, NULL, 'f'},
+        {"width", required_argument, NULL, 'W'},
+        {"height", required_argument, NULL, 'H'},
+        {"dir", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0}};
+    unsigned int i;
+    int c;
+
+    pix.width = 640;
+    pix.height = 480;
+    while ((c = getopt_long(argc, argv, "n:f:W:H:d:h", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            n_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            frame_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'W':
+            pix.width = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            pix.height = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            file_dir = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (n_frames == 0 || pix.width == 0 || pix.height == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    pix.bytesperline = pix.width * 2;
+    pix.sizeimage = pix.bytesperline * pix.height;
+    for (i = 0; i < BENCH_SOURCES; i++)
+    {
+        sources[i] = malloc(pix.sizeimage);
+        if (sources[i] == NULL)
+        {
+            printf("Out of memory \n");
+            return 1;
+        }
+        memset(sources[i], 0x40 * i + 0x10, pix.sizeimage);
+    }
+
+    printf("%lu frames of %ux%u YUYV (%u bytes), ", n_frames, pix.width, pix.height, pix.sizeimage);
+    if (frame_rate)
+    {
+        printf("paced at %u fps \n", frame_rate);
+    }
+    else
+    {
+        printf("as fast as the producer can \n");
+    }
+    printf("%-8s %10s %10s %10s %10s %12s %12s \n", "path", "send us", "frames", "lost", "MB/s", "avg lat ms",
+           "max lat ms");
+    for (i = 0; i < BENCH_TRANSPORTS; i++)
+    {
+        runTransport(i);
+    }
+    return 0;
+}
@@ -0,0 +1,693 @@
+/*
+* @file     yuyv_convert.c
+* @author   Trong Phuoc
+* @brief    Scalar, SSE2, AVX2 and NEON kernels converting YUYV frames
+*/
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <string.h>
+#include "yuyv_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON 1
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/*
+ * RGB is computed in 16 bit fixed point with 6 fractional bits so that every
+ * kernel produces exactly the same bytes:
+ *   c = (Y - 16) * 74,  d = U - 128,  e = V - 128
+ *   R = (c + 102 * e + 32) >> 6
+ *   G = (c - 25 * d - 52 * e + 32) >> 6
+ *   B = (c + 129 * d + 32) >> 6
+ * Only B can leave the 16 bit range, and only when it saturates to 255 anyway.
+ * Chroma of the planar outputs is the rounded average of two lines.
+ */
+
+/*******************************************************************************
+ *  SCALAR KERNELS
+ ******************************************************************************/
+static inline uint8_t clamp8(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline void yuvToRgb(int y, int u, int v, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+    int c = (y - 16) * 74;
+    int d = u - 128;
+    int e = v - 128;
+
+    *r = clamp8((c + 102 * e + 32) >> 6);
+    *g = clamp8((c - 25 * d - 52 * e + 32) >> 6);
+    *b = clamp8((c + 129 * d + 32) >> 6);
+}
+
+/* the row helpers convert the pixels [x, width) of one line, SIMD kernels use
+   them for the pixels left over at the end of a line */
+static void rowRgb24Scalar(const uint8_t *src, uint8_t *dst, unsigned int x, unsigned int width)
+{
+    for (; x < width; x += 2)
+    {
+        const uint8_t *p = src + x * 2;
+        uint8_t *q = dst + x * 3;
+        yuvToRgb(p[0], p[1], p[3], &q[0], &q[1], &q[2]);
+        yuvToRgb(p[2], p[1], p[3], &q[3], &q[4], &q[5]);
+    }
+}
+
+static void rowBgraScalar(const uint8_t *src, uint8_t *dst, unsigned int x, unsigned int width)
+{
+    for (; x < width; x += 2)
+    {
+        const uint8_t *p = src + x * 2;
+        uint8_t *q = dst + x * 4;
+        yuvToRgb(p[0], p[1], p[3], &q[2], &q[1], &q[0]);
+        yuvToRgb(p[2], p[1], p[3], &q[6], &q[5], &q[4]);
+        q[3] = 255;
+        q[7] = 255;
+    }
+}
+
+static void rowY8Scalar(const uint8_t *src, uint8_t *dst, unsigned int x, unsigned int width)
+{
+    for (; x < width; x++)
+    {
+        dst[x] = src[x * 2];
+    }
+}
+
+static void rowI420Scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *dstU, uint8_t *dstV,
+                          unsigned int x, unsigned int width)
+{
+    for (; x < width; x += 2)
+    {
+        dstU[x / 2] = (src0[x * 2 + 1] + src1[x * 2 + 1] + 1) >> 1;
+        dstV[x / 2] = (src0[x * 2 + 3] + src1[x * 2 + 3] + 1) >> 1;
+    }
+}
+
+static void rowNv12Scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *dstUV,
+                          unsigned int x, unsigned int width)
+{
+    for (; x < width; x += 2)
+    {
+        dstUV[x] = (src0[x * 2 + 1] + src1[x * 2 + 1] + 1) >> 1;
+        dstUV[x + 1] = (src0[x * 2 + 3] + src1[x * 2 + 3] + 1) >> 1;
+    }
+}
+
+static void lineRgb24Scalar(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    rowRgb24Scalar(src, dst, 0, width);
+}
+
+static void lineBgraScalar(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    rowBgraScalar(src, dst, 0, width);
+}
+
+static void lineY8Scalar(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    rowY8Scalar(src, dst, 0, width);
+}
+
+static void lineI420Scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *dstU, uint8_t *dstV,
+                           unsigned int width)
+{
+    rowI420Scalar(src0, src1, dstU, dstV, 0, width);
+}
+
+static void lineNv12Scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *dstUV, unsigned int width)
+{
+    rowNv12Scalar(src0, src1, dstUV, 0, width);
+}
+
+/*******************************************************************************
+ *  SSE2 KERNELS (16 pixels per step)
+ ******************************************************************************/
+#ifdef CONVERT_X86
+/* 8 pixels of YUYV to 8 signed 16 bit R, G and B values */
+static inline SSE2_TARGET void sse2Rgb8(__m128i yuyv, __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i round = _mm_set1_epi16(32);
+    __m128i y = _mm_and_si128(yuyv, _mm_set1_epi16(0x00ff));
+    __m128i uv = _mm_srli_epi16(yuyv, 8);
+    __m128i u = _mm_and_si128(uv, _mm_set1_epi32(0x0000ffff));
+    __m128i v = _mm_srli_epi32(uv, 16);
+    __m128i c, d, e;
+
+    u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+    v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+    c = _mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(74));
+    d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+    *r = _mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(102)));
+    *g = _mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(25)));
+    *g = _mm_subs_epi16(*g, _mm_mullo_epi16(e, _mm_set1_epi16(52)));
+    *b = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(129)));
+    *r = _mm_srai_epi16(_mm_adds_epi16(*r, round), 6);
+    *g = _mm_srai_epi16(_mm_adds_epi16(*g, round), 6);
+    *b = _mm_srai_epi16(_mm_adds_epi16(*b, round), 6);
+}
+
+/* 16 pixels of YUYV to 16 bytes of R, G and B */
+static inline SSE2_TARGET void sse2Rgb16(const uint8_t *src, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i r0, g0, b0, r1, g1, b1;
+
+    sse2Rgb8(_mm_loadu_si128((const __m128i *)src), &r0, &g0, &b0);
+    sse2Rgb8(_mm_loadu_si128((const __m128i *)(src + 16)), &r1, &g1, &b1);
+    *r = _mm_packus_epi16(r0, r1);
+    *g = _mm_packus_epi16(g0, g1);
+    *b = _mm_packus_epi16(b0, b1);
+}
+
+static SSE2_TARGET void lineRgb24Sse2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t pixel[16];
+    __m128i r, g, b, rg, bz;
+    unsigned int x, i;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        sse2Rgb16(src + x * 2, &r, &g, &b);
+        rg = _mm_unpacklo_epi8(r, g);
+        bz = _mm_unpacklo_epi8(b, zero);
+        _mm_storeu_si128((__m128i *)&pixel[0], _mm_unpacklo_epi16(rg, bz));
+        _mm_storeu_si128((__m128i *)&pixel[4], _mm_unpackhi_epi16(rg, bz));
+        rg = _mm_unpackhi_epi8(r, g);
+        bz = _mm_unpackhi_epi8(b, zero);
+        _mm_storeu_si128((__m128i *)&pixel[8], _mm_unpacklo_epi16(rg, bz));
+        _mm_storeu_si128((__m128i *)&pixel[12], _mm_unpackhi_epi16(rg, bz));
+        // SSE2 has no byte shuffle, drop the fourth byte of each pixel here
+        for (i = 0; i < 16; i++)
+        {
+            memcpy(dst + (x + i) * 3, &pixel[i], 3);
+        }
+    }
+    rowRgb24Scalar(src, dst, x, width);
+}
+
+static SSE2_TARGET void lineBgraSse2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    __m128i r, g, b, bg, ra;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        uint8_t *q = dst + x * 4;
+        sse2Rgb16(src + x * 2, &r, &g, &b);
+        bg = _mm_unpacklo_epi8(b, g);
+        ra = _mm_unpacklo_epi8(r, alpha);
+        _mm_storeu_si128((__m128i *)q, _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(q + 16), _mm_unpackhi_epi16(bg, ra));
+        bg = _mm_unpackhi_epi8(b, g);
+        ra = _mm_unpackhi_epi8(r, alpha);
+        _mm_storeu_si128((__m128i *)(q + 32), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(q + 48), _mm_unpackhi_epi16(bg, ra));
+    }
+    rowBgraScalar(src, dst, x, width);
+}
+
+static SSE2_TARGET void lineY8Sse2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i a, b;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + x * 2)), mask);
+        b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + x * 2 + 16)), mask);
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+    }
+    rowY8Scalar(src, dst, x, width);
+}
+
+/* average the chroma of 16 pixels of two lines, result is U0 V0 U1 V1 ... as 16 bit */
+static inline SSE2_TARGET void sse2Chroma16(const uint8_t *src0, const uint8_t *src1, __m128i *c0, __m128i *c1)
+{
+    __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)src0), _mm_loadu_si128((const __m128i *)src1));
+    __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(src0 + 16)),
+                             _mm_loadu_si128((const __m128i *)(src1 + 16)));
+    *c0 = _mm_srli_epi16(a, 8);
+    *c1 = _mm_srli_epi16(b, 8);
+}
+
+static SSE2_TARGET void lineI420Sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dstU, uint8_t *dstV,
+                                     unsigned int width)
+{
+    const __m128i mask = _mm_set1_epi32(0x0000ffff);
+    __m128i c0, c1, u, v;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        sse2Chroma16(src0 + x * 2, src1 + x * 2, &c0, &c1);
+        u = _mm_packs_epi32(_mm_and_si128(c0, mask), _mm_and_si128(c1, mask));
+        v = _mm_packs_epi32(_mm_srli_epi32(c0, 16), _mm_srli_epi32(c1, 16));
+        _mm_storel_epi64((__m128i *)(dstU + x / 2), _mm_packus_epi16(u, u));
+        _mm_storel_epi64((__m128i *)(dstV + x / 2), _mm_packus_epi16(v, v));
+    }
+    rowI420Scalar(src0, src1, dstU, dstV, x, width);
+}
+
+static SSE2_TARGET void lineNv12Sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dstUV,
+                                     unsigned int width)
+{
+    __m128i c0, c1;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        sse2Chroma16(src0 + x * 2, src1 + x * 2, &c0, &c1);
+        _mm_storeu_si128((__m128i *)(dstUV + x), _mm_packus_epi16(c0, c1));
+    }
+    rowNv12Scalar(src0, src1, dstUV, x, width);
+}
+
+/*******************************************************************************
+ *  AVX2 KERNELS (32 pixels per step)
+ ******************************************************************************/
+/* 16 pixels of YUYV to 16 signed 16 bit R, G and B values */
+static inline AVX2_TARGET void avx2Rgb16(__m256i yuyv, __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i round = _mm256_set1_epi16(32);
+    __m256i y = _mm256_and_si256(yuyv, _mm256_set1_epi16(0x00ff));
+    __m256i uv = _mm256_srli_epi16(yuyv, 8);
+    __m256i u = _mm256_and_si256(uv, _mm256_set1_epi32(0x0000ffff));
+    __m256i v = _mm256_srli_epi32(uv, 16);
+    __m256i c, d, e;
+
+    u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+    v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+    c = _mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(16)), _mm256_set1_epi16(74));
+    d = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+    e = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+
+    *r = _mm256_adds_epi16(c, _mm256_mullo_epi16(e, _mm256_set1_epi16(102)));
+    *g = _mm256_subs_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(25)));
+    *g = _mm256_subs_epi16(*g, _mm256_mullo_epi16(e, _mm256_set1_epi16(52)));
+    *b = _mm256_adds_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(129)));
+    *r = _mm256_srai_epi16(_mm256_adds_epi16(*r, round), 6);
+    *g = _mm256_srai_epi16(_mm256_adds_epi16(*g, round), 6);
+    *b = _mm256_srai_epi16(_mm256_adds_epi16(*b, round), 6);
+}
+
+/*
+ * 32 pixels of YUYV to 32 bytes of R, G and B. The bytes are left in the lane
+ * order of packus: pixels 0-7, 16-23 | 8-15, 24-31.
+ */
+static inline AVX2_TARGET void avx2Rgb32(const uint8_t *src, __m256i *r, __m256i *g, __m256i *b)
+{
+    __m256i r0, g0, b0, r1, g1, b1;
+
+    avx2Rgb16(_mm256_loadu_si256((const __m256i *)src), &r0, &g0, &b0);
+    avx2Rgb16(_mm256_loadu_si256((const __m256i *)(src + 32)), &r1, &g1, &b1);
+    *r = _mm256_packus_epi16(r0, r1);
+    *g = _mm256_packus_epi16(g0, g1);
+    *b = _mm256_packus_epi16(b0, b1);
+}
+
+/*
+ * interleave the channels of avx2Rgb32 as 4 byte pixels, out[] holds pixels
+ * 0-7, 8-15, 16-23 and 24-31 in order
+ */
+static inline AVX2_TARGET void avx2Interleave32(__m256i c0, __m256i c1, __m256i c2, __m256i c3, __m256i out[4])
+{
+    __m256i lo01 = _mm256_unpacklo_epi8(c0, c1);    // pixels 0-7 | 8-15
+    __m256i hi01 = _mm256_unpackhi_epi8(c0, c1);    // pixels 16-23 | 24-31
+    __m256i lo23 = _mm256_unpacklo_epi8(c2, c3);
+    __m256i hi23 = _mm256_unpackhi_epi8(c2, c3);
+    __m256i p0 = _mm256_unpacklo_epi16(lo01, lo23); // pixels 0-3 | 8-11
+    __m256i p1 = _mm256_unpackhi_epi16(lo01, lo23); // pixels 4-7 | 12-15
+    __m256i p2 = _mm256_unpacklo_epi16(hi01, hi23); // pixels 16-19 | 24-27
+    __m256i p3 = _mm256_unpackhi_epi16(hi01, hi23); // pixels 20-23 | 28-31
+
+    out[0] = _mm256_permute2x128_si256(p0, p1, 0x20);
+    out[1] = _mm256_permute2x128_si256(p0, p1, 0x31);
+    out[2] = _mm256_permute2x128_si256(p2, p3, 0x20);
+    out[3] = _mm256_permute2x128_si256(p2, p3, 0x31);
+}
+
+static AVX2_TARGET void lineRgb24Avx2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint8_t last[16];
+    __m256i r, g, b, pixel[4], packed;
+    unsigned int x, i;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        uint8_t *q = dst + x * 3;
+        avx2Rgb32(src + x * 2, &r, &g, &b);
+        avx2Interleave32(r, g, b, _mm256_setzero_si256(), pixel);
+        // each lane keeps 12 bytes, the 4 extra bytes are overwritten by the next store
+        for (i = 0; i < 4; i++)
+        {
+            packed = _mm256_shuffle_epi8(pixel[i], shuffle);
+            _mm_storeu_si128((__m128i *)(q + i * 24), _mm256_castsi256_si128(packed));
+            if (i < 3)
+            {
+                _mm_storeu_si128((__m128i *)(q + i * 24 + 12), _mm256_extracti128_si256(packed, 1));
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i *)last, _mm256_extracti128_si256(packed, 1));
+                memcpy(q + i * 24 + 12, last, 12);
+            }
+        }
+    }
+    rowRgb24Scalar(src, dst, x, width);
+}
+
+static AVX2_TARGET void lineBgraAvx2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    __m256i r, g, b, pixel[4];
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        uint8_t *q = dst + x * 4;
+        avx2Rgb32(src + x * 2, &r, &g, &b);
+        avx2Interleave32(b, g, r, _mm256_set1_epi8((char)0xff), pixel);
+        _mm256_storeu_si256((__m256i *)q, pixel[0]);
+        _mm256_storeu_si256((__m256i *)(q + 32), pixel[1]);
+        _mm256_storeu_si256((__m256i *)(q + 64), pixel[2]);
+        _mm256_storeu_si256((__m256i *)(q + 96), pixel[3]);
+    }
+    rowBgraScalar(src, dst, x, width);
+}
+
+static AVX2_TARGET void lineY8Avx2(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    __m256i a, b;
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + x * 2)), mask);
+        b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + x * 2 + 32)), mask);
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    rowY8Scalar(src, dst, x, width);
+}
+
+/* average the chroma of 32 pixels of two lines, result is U0 V0 U1 V1 ... as 16 bit */
+static inline AVX2_TARGET void avx2Chroma32(const uint8_t *src0, const uint8_t *src1, __m256i *c0, __m256i *c1)
+{
+    __m256i a = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)src0),
+                                _mm256_loadu_si256((const __m256i *)src1));
+    __m256i b = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(src0 + 32)),
+                                _mm256_loadu_si256((const __m256i *)(src1 + 32)));
+    *c0 = _mm256_srli_epi16(a, 8);
+    *c1 = _mm256_srli_epi16(b, 8);
+}
+
+static AVX2_TARGET void lineI420Avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dstU, uint8_t *dstV,
+                                     unsigned int width)
+{
+    const __m256i mask = _mm256_set1_epi32(0x0000ffff);
+    // after packs and packus the dwords hold U 0-3, 8-11, x, x | 4-7, 12-15, x, x
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i c0, c1, u, v;
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        avx2Chroma32(src0 + x * 2, src1 + x * 2, &c0, &c1);
+        u = _mm256_packs_epi32(_mm256_and_si256(c0, mask), _mm256_and_si256(c1, mask));
+        v = _mm256_packs_epi32(_mm256_srli_epi32(c0, 16), _mm256_srli_epi32(c1, 16));
+        u = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(u, u), order);
+        v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(v, v), order);
+        _mm_storeu_si128((__m128i *)(dstU + x / 2), _mm256_castsi256_si128(u));
+        _mm_storeu_si128((__m128i *)(dstV + x / 2), _mm256_castsi256_si128(v));
+    }
+    rowI420Scalar(src0, src1, dstU, dstV, x, width);
+}
+
+static AVX2_TARGET void lineNv12Avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dstUV,
+                                     unsigned int width)
+{
+    __m256i c0, c1;
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32)
+    {
+        avx2Chroma32(src0 + x * 2, src1 + x * 2, &c0, &c1);
+        _mm256_storeu_si256((__m256i *)(dstUV + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(c0, c1), 0xd8));
+    }
+    rowNv12Scalar(src0, src1, dstUV, x, width);
+}
+#endif /* CONVERT_X86 */
+
+/*******************************************************************************
+ *  NEON KERNELS (16 pixels per step)
+ ******************************************************************************/
+#ifdef CONVERT_NEON
+/* 16 pixels of YUYV to 16 bytes of R, G and B */
+static inline void neonRgb16(const uint8_t *src, uint8x16_t *r, uint8x16_t *g, uint8x16_t *b)
+{
+    uint8x8x4_t p = vld4_u8(src);   // even Y, U, odd Y, V
+    int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[1])), vdupq_n_s16(128));
+    int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[3])), vdupq_n_s16(128));
+    int16x8_t c0 = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[0])), vdupq_n_s16(16)), 74);
+    int16x8_t c1 = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(p.val[2])), vdupq_n_s16(16)), 74);
+    int16x8_t cr = vmulq_n_s16(e, 102);
+    int16x8_t cg = vaddq_s16(vmulq_n_s16(d, 25), vmulq_n_s16(e, 52));
+    int16x8_t cb = vmulq_n_s16(d, 129);
+    uint8x8x2_t z;
+
+    // vqrshrun rounds with +32 before the shift and saturates to 0..255
+    z = vzip_u8(vqrshrun_n_s16(vqaddq_s16(c0, cr), 6), vqrshrun_n_s16(vqaddq_s16(c1, cr), 6));
+    *r = vcombine_u8(z.val[0], z.val[1]);
+    z = vzip_u8(vqrshrun_n_s16(vqsubq_s16(c0, cg), 6), vqrshrun_n_s16(vqsubq_s16(c1, cg), 6));
+    *g = vcombine_u8(z.val[0], z.val[1]);
+    z = vzip_u8(vqrshrun_n_s16(vqaddq_s16(c0, cb), 6), vqrshrun_n_s16(vqaddq_s16(c1, cb), 6));
+    *b = vcombine_u8(z.val[0], z.val[1]);
+}
+
+static void lineRgb24Neon(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    uint8x16x3_t out;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        neonRgb16(src + x * 2, &out.val[0], &out.val[1], &out.val[2]);
+        vst3q_u8(dst + x * 3, out);
+    }
+    rowRgb24Scalar(src, dst, x, width);
+}
+
+static void lineBgraNeon(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    uint8x16x4_t out;
+    unsigned int x;
+
+    out.val[3] = vdupq_n_u8(255);
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        neonRgb16(src + x * 2, &out.val[2], &out.val[1], &out.val[0]);
+        vst4q_u8(dst + x * 4, out);
+    }
+    rowBgraScalar(src, dst, x, width);
+}
+
+static void lineY8Neon(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        vst1q_u8(dst + x, vld2q_u8(src + x * 2).val[0]);
+    }
+    rowY8Scalar(src, dst, x, width);
+}
+
+static void lineI420Neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dstU, uint8_t *dstV,
+                         unsigned int width)
+{
+    uint8x8x4_t a, b;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        a = vld4_u8(src0 + x * 2);
+        b = vld4_u8(src1 + x * 2);
+        vst1_u8(dstU + x / 2, vrhadd_u8(a.val[1], b.val[1]));
+        vst1_u8(dstV + x / 2, vrhadd_u8(a.val[3], b.val[3]));
+    }
+    rowI420Scalar(src0, src1, dstU, dstV, x, width);
+}
+
+static void lineNv12Neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dstUV, unsigned int width)
+{
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        vst1q_u8(dstUV + x, vrhaddq_u8(vld2q_u8(src0 + x * 2).val[1], vld2q_u8(src1 + x * 2).val[1]));
+    }
+    rowNv12Scalar(src0, src1, dstUV, x, width);
+}
+#endif /* CONVERT_NEON */
+
+/*******************************************************************************
+ *  FRAME KERNELS
+ ******************************************************************************/
+/*
+ * The frame kernels walk the lines and call the line kernels of one instruction
+ * set. Planar outputs handle two lines at a time so that the chroma pass reads
+ * lines which are still in the cache.
+ */
+#define CONVERT_FRAME_KERNELS(isa)                                                              \
+static void isa##Rgb24(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height) \
+{                                                                                               \
+    unsigned int y;                                                                             \
+    for (y = 0; y < height; y++)                                                                \
+        lineRgb24##isa(src + (size_t)y * width * 2, dst + (size_t)y * width * 3, width);        \
+}                                                                                               \
+static void isa##Bgra(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height) \
+{                                                                                               \
+    unsigned int y;                                                                             \
+    for (y = 0; y < height; y++)                                                                \
+        lineBgra##isa(src + (size_t)y * width * 2, dst + (size_t)y * width * 4, width);         \
+}                                                                                               \
+static void isa##Y8(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height)  \
+{                                                                                               \
+    unsigned int y;                                                                             \
+    for (y = 0; y < height; y++)                                                                \
+        lineY8##isa(src + (size_t)y * width * 2, dst + (size_t)y * width, width);               \
+}                                                                                               \
+static void isa##I420(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height) \
+{                                                                                               \
+    uint8_t *u = dst + (size_t)width * height;                                                  \
+    uint8_t *v = u + (size_t)(width / 2) * (height / 2);                                        \
+    const uint8_t *line;                                                                        \
+    unsigned int y;                                                                             \
+    for (y = 0; y + 1 < height; y += 2)                                                         \
+    {                                                                                           \
+        line = src + (size_t)y * width * 2;                                                     \
+        lineY8##isa(line, dst + (size_t)y * width, width);                                      \
+        lineY8##isa(line + width * 2, dst + (size_t)(y + 1) * width, width);                    \
+        lineI420##isa(line, line + width * 2, u + (size_t)(y / 2) * (width / 2),                \
+                      v + (size_t)(y / 2) * (width / 2), width);                                \
+    }                                                                                           \
+}                                                                                               \
+static void isa##Nv12(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height) \
+{                                                                                               \
+    uint8_t *uv = dst + (size_t)width * height;                                                 \
+    const uint8_t *line;                                                                        \
+    unsigned int y;                                                                             \
+    for (y = 0; y + 1 < height; y += 2)                                                         \
+    {                                                                                           \
+        line = src + (size_t)y * width * 2;                                                     \
+        lineY8##isa(line, dst + (size_t)y * width, width);                                      \
+        lineY8##isa(line + width * 2, dst + (size_t)(y + 1) * width, width);                    \
+        lineNv12##isa(line, line + width * 2, uv + (size_t)(y / 2) * width, width);             \
+    }                                                                                           \
+}
+
+CONVERT_FRAME_KERNELS(Scalar)
+#ifdef CONVERT_X86
+CONVERT_FRAME_KERNELS(Sse2)
+CONVERT_FRAME_KERNELS(Avx2)
+#endif
+#ifdef CONVERT_NEON
+CONVERT_FRAME_KERNELS(Neon)
+#endif
+
+static const yuyvConverter converters[CONVERT_ISA_COUNT] =
+{
+    [CONVERT_ISA_SCALAR] = {"scalar", CONVERT_ISA_SCALAR, ScalarRgb24, ScalarBgra, ScalarI420, ScalarNv12, ScalarY8},
+#ifdef CONVERT_X86
+    [CONVERT_ISA_SSE2] = {"sse2", CONVERT_ISA_SSE2, Sse2Rgb24, Sse2Bgra, Sse2I420, Sse2Nv12, Sse2Y8},
+    [CONVERT_ISA_AVX2] = {"avx2", CONVERT_ISA_AVX2, Avx2Rgb24, Avx2Bgra, Avx2I420, Avx2Nv12, Avx2Y8},
+#endif
+#ifdef CONVERT_NEON
+    [CONVERT_ISA_NEON] = {"neon", CONVERT_ISA_NEON, NeonRgb24, NeonBgra, NeonI420, NeonNv12, NeonY8},
+#endif
+};
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+/*******************************************************************************
+ * @func    static int cpuSupports(convertIsa isa)
+ *
+ * @brief   check at run time that the CPU implements the instruction set
+ *******************************************************************************/
+static int cpuSupports(convertIsa isa)
+{
+    switch (isa)
+    {
+    case CONVERT_ISA_SCALAR:
+        return 1;
+#ifdef CONVERT_X86
+    case CONVERT_ISA_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case CONVERT_ISA_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CONVERT_NEON
+    case CONVERT_ISA_NEON:
+#if defined(__aarch64__)
+        return 1;
+#else
+        return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+#endif
+    default:
+        return 0;
+    }
+}
+
+const yuyvConverter *yuyvGetConverterIsa(convertIsa isa)
+{
+    if (isa >= CONVERT_ISA_COUNT || converters[isa].name == NULL || !cpuSupports(isa))
+    {
+        return NULL;
+    }
+    return &converters[isa];
+}
+
+const yuyvConverter *yuyvGetConverter(void)
+{
+    static const yuyvConverter *best = NULL;
+    int isa;
+
+    if (best == NULL)
+    {
+        best = &converters[CONVERT_ISA_SCALAR];
+        for (isa = CONVERT_ISA_COUNT - 1; isa > CONVERT_ISA_SCALAR; isa--)
+        {
+            if (yuyvGetConverterIsa((convertIsa)isa) != NULL)
+            {
+                best = &converters[isa];
+                break;
+            }
+        }
+    }
+    return best;
+}
@@ -0,0 +1,70 @@
+/*
+* @file     yuyv_convert.h
+* @author   Trong Phuoc
+* @brief    Conversion of YUYV frames captured from the camera driver to RGB, planar
+*           YUV and grey images, with SIMD kernels selected at run time
+*/
+#ifndef YUYV_CONVERT_H
+#define YUYV_CONVERT_H
+/*******************************************************************************
+ *  INCLUDES
+ ******************************************************************************/
+#include <stdint.h>
+
+/*********************************************************************************
+ * TYPEDEF
+**********************************************************************************/
+typedef enum convertIsa
+{
+    CONVERT_ISA_SCALAR, /**<  portable C code */
+    CONVERT_ISA_SSE2,   /**<  x86 SSE2 */
+    CONVERT_ISA_AVX2,   /**<  x86 AVX2 */
+    CONVERT_ISA_NEON,   /**<  ARM NEON */
+    CONVERT_ISA_COUNT,
+} convertIsa;
+
+/*
+ * Every kernel reads a packed YUYV frame of width x height pixels (width * 2 bytes
+ * per line) and writes a tightly packed destination:
+ *   toRgb24  R,G,B bytes per pixel
+ *   toBgra   B,G,R,A bytes per pixel, alpha is 255
+ *   toI420   Y plane, then U and V planes of (width / 2) x (height / 2)
+ *   toNv12   Y plane, then one interleaved U,V plane of width x (height / 2)
+ *   toY8     Y plane only
+ * width must be even, height must be even for toI420 and toNv12. RGB uses the
+ * BT.601 limited range matrix.
+ */
+typedef void (*convertFunc)(const uint8_t *src, uint8_t *dst, unsigned int width, unsigned int height);
+
+typedef struct yuyvConverter
+{
+    const char *name;   /**< name of the instruction set */
+    convertIsa isa;
+    convertFunc toRgb24;
+    convertFunc toBgra;
+    convertFunc toI420;
+    convertFunc toNv12;
+    convertFunc toY8;
+} yuyvConverter;
+
+/*******************************************************************************
+ * FUNCTIONS - API
+ ******************************************************************************/
+
+/**********************************************************************************
+ * @func    const yuyvConverter *yuyvGetConverter(void)
+ *
+ * @brief   get the fastest kernels supported by the CPU running the application
+ * @return  the kernels, never NULL (the scalar kernels always work)
+***********************************************************************************/
+const yuyvConverter *yuyvGetConverter(void);
+
+/**********************************************************************************
+ * @func    const yuyvConverter *yuyvGetConverterIsa(convertIsa isa)
+ *
+ * @brief   get the kernels of one instruction set, used to compare them
+ * @return  NULL when the instruction set is not built in or not supported by the CPU
+***********************************************************************************/
+const yuyvConverter *yuyvGetConverterIsa(convertIsa isa);
+
+#endif /* YUYV_CONVERT_H */